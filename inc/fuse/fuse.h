@@ -121,6 +121,32 @@ struct fuse_operations
         struct fuse_file_info *fi);
 };
 
+/*
+ * WinFsp extension: inode operations.
+ *
+ * A file system may register these in addition to its struct fuse_operations by calling
+ * fuse_set_ino_operations before fuse_loop. WinFsp-FUSE then resolves every opened file to a
+ * node ID once, by calling lookup on the path components it does not already know, and uses
+ * the node ID for getattr, read and write on the open file. The node ID of the root is
+ * FUSE_ROOT_ID. Every successful lookup increments the lookup count of the returned node;
+ * forget is called with the accumulated count when WinFsp-FUSE no longer uses a node.
+ *
+ * Namespace operations (create, mkdir, unlink, rename, ...) continue to use fuse_operations.
+ */
+#define FUSE_ROOT_ID                    1
+
+struct fuse_ino_operations
+{
+    /* S */ int (*lookup)(fuse_ino_t parent, const char *name, struct fuse_stat *stbuf,
+        uint64_t *generation);
+    /* S */ void (*forget)(fuse_ino_t ino, uint64_t nlookup);
+    /* S */ int (*getattr)(fuse_ino_t ino, struct fuse_stat *stbuf, struct fuse_file_info *fi);
+    /* S */ int (*read)(fuse_ino_t ino, char *buf, size_t size, fuse_off_t off,
+        struct fuse_file_info *fi);
+    /* S */ int (*write)(fuse_ino_t ino, const char *buf, size_t size, fuse_off_t off,
+        struct fuse_file_info *fi);
+};
+
 struct fuse_context
 {
     struct fuse *fuse;
@@ -155,6 +181,8 @@ FSP_FUSE_API int FSP_FUSE_API_NAME(fsp_fuse_exited)(struct fsp_fuse_env *env,
 FSP_FUSE_API int FSP_FUSE_API_NAME(fsp_fuse_notify)(struct fsp_fuse_env *env,
     struct fuse *f, const char *path, uint32_t action);
 FSP_FUSE_API struct fuse_context *FSP_FUSE_API_NAME(fsp_fuse_get_context)(struct fsp_fuse_env *env);
+FSP_FUSE_API int FSP_FUSE_API_NAME(fsp_fuse_set_ino_operations)(struct fsp_fuse_env *env,
+    struct fuse *f, const struct fuse_ino_operations *ops, size_t opsize);
 
 FSP_FUSE_SYM(
 int fuse_main_real(int argc, char *argv[],
@@ -228,6 +256,14 @@ struct fuse_context *fuse_get_context(void),
         (fsp_fuse_env());
 })
 
+FSP_FUSE_SYM(
+int fuse_set_ino_operations(struct fuse *f,
+    const struct fuse_ino_operations *ops, size_t opsize),
+{
+    return FSP_FUSE_API_CALL(fsp_fuse_set_ino_operations)
+        (fsp_fuse_env(), f, ops, opsize);
+})
+
 FSP_FUSE_SYM(
 int fuse_getgroups(int size, fuse_gid_t list[]),
 {
@@ -198,18 +198,49 @@ void fuse3_pollhandle_destroy(struct fuse3_pollhandle *ph),
 FSP_FUSE_SYM(
 size_t fuse3_buf_size(const struct fuse3_bufvec *bufv),
 {
-    (void)bufv;
-    return 0;
+    size_t size = 0;
+    for (size_t i = 0; bufv->count > i; i++)
+        size += bufv->buf[i].size;
+    return size;
 })
 
+/*
+ * Only memory buffers can be copied. A WinFsp-FUSE file system has no file descriptors
+ * that WinFsp could read or write on its behalf, so FUSE_BUF_IS_FD buffers fail with ENOSYS.
+ */
 FSP_FUSE_SYM(
 ssize_t fuse3_buf_copy(struct fuse3_bufvec *dst, struct fuse3_bufvec *src,
     enum fuse3_buf_copy_flags flags),
 {
-    (void)dst;
-    (void)src;
+    struct fuse3_buf *d, *s;
+    size_t copied = 0, size;
     (void)flags;
-    return 0;
+    while (dst->count > dst->idx && src->count > src->idx)
+    {
+        d = &dst->buf[dst->idx];
+        s = &src->buf[src->idx];
+        if (dst->off >= d->size)
+        {
+            dst->idx++;
+            dst->off = 0;
+            continue;
+        }
+        if (src->off >= s->size)
+        {
+            src->idx++;
+            src->off = 0;
+            continue;
+        }
+        if ((d->flags | s->flags) & FUSE_BUF_IS_FD)
+            return 0 != copied ? (ssize_t)copied : -ENOSYS;
+        size = d->size - dst->off < s->size - src->off ?
+            d->size - dst->off : s->size - src->off;
+        memcpy((char *)d->mem + dst->off, (char *)s->mem + src->off, size);
+        dst->off += size;
+        src->off += size;
+        copied += size;
+    }
+    return (ssize_t)copied;
 })
 
 FSP_FUSE_SYM(
@@ -89,6 +89,10 @@ extern const __declspec(selectany) GUID FspFsvrtDeviceClassGuid =
     CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 0x800 + 's', METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define FSP_FSCTL_NOTIFY                \
     CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 0x800 + 'n', METHOD_NEITHER, FILE_ANY_ACCESS)
+#define FSP_FSCTL_TRANSFER_BUFFERS      \
+    CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 0x800 + 'X', METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define FSP_FSCTL_QUEUE_INFO            \
+    CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 0x800 + 'q', METHOD_BUFFERED, FILE_ANY_ACCESS)
 
 /* fsctl internal device codes (usable only in-kernel) */
 #define FSP_FSCTL_TRANSACT_INTERNAL     \
@@ -121,6 +125,11 @@ FSP_FSCTL_STATIC_ASSERT(FSP_FSCTL_VOLUME_NAME_SIZEMAX <= 260 * sizeof(WCHAR),
 
 #define FSP_FSCTL_DEVICECONTROL_SIZEMAX (4 * 1024)  /* must be < FSP_FSCTL_TRANSACT_{REQ,RSP}_SIZEMAX */
 
+#define FSP_FSCTL_TRANSFER_BUFFER_ALIGNMENT (64 * 1024)
+#define FSP_FSCTL_TRANSFER_BUFFER_SIZEMAX   (16 * 1024 * 1024)
+#define FSP_FSCTL_TRANSFER_BUFFER_COUNTMAX  64
+#define FSP_FSCTL_TRANSFER_BUFFERS_SIZEMAX  (256 * 1024 * 1024)
+
 /* marshalling */
 #pragma warning(push)
 #pragma warning(disable:4200 4201)      /* zero-sized array in struct/union; nameless struct/union */
@@ -300,6 +309,44 @@ typedef struct
 FSP_FSCTL_STATIC_ASSERT(12 == sizeof(FSP_FSCTL_NOTIFY_INFO),
     "sizeof(FSP_FSCTL_NOTIFY_INFO) must be exactly 12.");
 typedef struct
+{
+    UINT16 Version;                     /* set to sizeof(FSP_FSCTL_TRANSFER_BUFFERS) */
+    UINT16 Reserved16;
+    UINT32 BufferSize;                  /* multiple of FSP_FSCTL_TRANSFER_BUFFER_ALIGNMENT */
+    UINT32 BufferCount;
+    UINT32 Reserved32;
+    UINT64 Address;                     /* BufferCount contiguous buffers of BufferSize */
+} FSP_FSCTL_TRANSFER_BUFFERS;
+FSP_FSCTL_STATIC_ASSERT(24 == sizeof(FSP_FSCTL_TRANSFER_BUFFERS),
+    "sizeof(FSP_FSCTL_TRANSFER_BUFFERS) must be exactly 24.");
+enum
+{
+    FspFsctlQueueInfoWakeDispatcher     = 0x00000001,   /* wake one idle dispatcher thread */
+};
+enum
+{
+    /* request priority classes; lower value means higher priority */
+    FspFsctlTransactMetadataClass       = 0,    /* create, cleanup, query/set info, etc. */
+    FspFsctlTransactSmallIoClass,               /* read/write/query directory up to SMALL_IO_SIZEMAX */
+    FspFsctlTransactBulkIoClass,                /* read/write/query directory above SMALL_IO_SIZEMAX */
+    FspFsctlTransactBackgroundClass,            /* flush buffers */
+    FspFsctlTransactClassCount,
+};
+#define FSP_FSCTL_TRANSACT_SMALL_IO_SIZEMAX (64 * 1024)
+typedef struct
+{
+    UINT32 Flags;                       /* in: FspFsctlQueueInfo* flags */
+    UINT32 PendingIrpCount;             /* out: IRP's waiting to be delivered to the file system */
+    UINT32 ProcessIrpCount;             /* out: IRP's delivered and awaiting a response */
+    UINT32 PendingIrpCapacity;          /* out */
+    UINT32 PendingIrpClassCount[FspFsctlTransactClassCount];
+                                        /* out: PendingIrpCount broken down by request class */
+    UINT32 DeliveredIrpClassCount[FspFsctlTransactClassCount];
+                                        /* out: IRP's delivered by request class since volume creation */
+} FSP_FSCTL_QUEUE_INFO;
+FSP_FSCTL_STATIC_ASSERT(48 == sizeof(FSP_FSCTL_QUEUE_INFO),
+    "sizeof(FSP_FSCTL_QUEUE_INFO) must be exactly 48.");
+typedef struct
 {
     UINT64 UserContext;
     UINT64 UserContext2;
@@ -373,6 +420,7 @@ typedef struct
             UINT64 Offset;
             UINT32 Length;
             UINT32 Key;
+            UINT32 TransferBuffer;      /* 1-based registered transfer buffer index; 0 if none */
         } Read;
         struct
         {
@@ -383,6 +431,7 @@ typedef struct
             UINT32 Length;
             UINT32 Key;
             UINT32 ConstrainedIo:1;
+            UINT32 TransferBuffer;      /* 1-based registered transfer buffer index; 0 if none */
         } Write;
         struct
         {
@@ -627,6 +676,29 @@ static inline FSP_FSCTL_TRANSACT_RSP *FspFsctlTransactProduceResponse(
     PVOID NextResponse = (PUINT8)Response + FSP_FSCTL_DEFAULT_ALIGN_UP(ResponseSize);
     return (FSP_FSCTL_TRANSACT_RSP *)NextResponse;
 }
+static inline UINT32 FspFsctlTransactRequestClass(
+    const FSP_FSCTL_TRANSACT_REQ *Request)
+{
+    UINT32 Length;
+    switch (Request->Kind)
+    {
+    case FspFsctlTransactReadKind:
+        Length = Request->Req.Read.Length;
+        break;
+    case FspFsctlTransactWriteKind:
+        Length = Request->Req.Write.Length;
+        break;
+    case FspFsctlTransactQueryDirectoryKind:
+        Length = Request->Req.QueryDirectory.Length;
+        break;
+    case FspFsctlTransactFlushBuffersKind:
+        return FspFsctlTransactBackgroundClass;
+    default:
+        return FspFsctlTransactMetadataClass;
+    }
+    return FSP_FSCTL_TRANSACT_SMALL_IO_SIZEMAX >= Length ?
+        FspFsctlTransactSmallIoClass : FspFsctlTransactBulkIoClass;
+}
 static inline FSP_FSCTL_TRANSACT_RSP *FspFsctlTransactConsumeResponse(
     FSP_FSCTL_TRANSACT_RSP *Response, PVOID ResponseBufEnd)
 {
@@ -652,6 +724,10 @@ FSP_API NTSTATUS FspFsctlStop(HANDLE VolumeHandle);
 FSP_API NTSTATUS FspFsctlStop0(HANDLE VolumeHandle);
 FSP_API NTSTATUS FspFsctlNotify(HANDLE VolumeHandle,
     FSP_FSCTL_NOTIFY_INFO *NotifyInfo, SIZE_T Size);
+FSP_API NTSTATUS FspFsctlRegisterTransferBuffers(HANDLE VolumeHandle,
+    PVOID Address, ULONG BufferSize, ULONG BufferCount);
+FSP_API NTSTATUS FspFsctlQueueInfo(HANDLE VolumeHandle, UINT32 Flags,
+    FSP_FSCTL_QUEUE_INFO *QueueInfo);
 FSP_API NTSTATUS FspFsctlGetVolumeList(PWSTR DevicePath,
     PWCHAR VolumeListBuf, PSIZE_T PVolumeListSize);
 FSP_API NTSTATUS FspFsctlPreflight(PWSTR DevicePath);
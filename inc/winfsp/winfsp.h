@@ -139,13 +139,67 @@ typedef NTSTATUS FSP_FILE_SYSTEM_OPERATION(FSP_FILE_SYSTEM *,
  * 2. A coarse-grained concurrency model where all file system accesses are
  * guarded by a mutually exclusive lock.
  *
+ * 3. A path-sharded concurrency model that applies the same exclusive-shared
+ * rules as the fine-grained model, but uses one of a fixed number of lock
+ * shards selected by hashing the (case-insensitive) path of the parent directory
+ * of the file being accessed. Namespace operations in unrelated directories
+ * can therefore proceed in parallel. A rename locks the shards of its source
+ * and target directories in shard order. ReadDirectory locks the shard of the
+ * directory being listed, which is the shard of the operations on its entries.
+ * Operations whose directory is not known from the request (Overwrite, Flush(Volume)
+ * and any operation when the FSD does not send file names) lock all shards;
+ * GetVolumeInfo and SetVolumeLabel use a separate volume lock. [Note that the
+ * FSD already serializes renames against opens, so that a rename of a directory
+ * cannot race with the lookup of a path under it.]
+ *
  * @see FspFileSystemSetOperationGuardStrategy
  */
 typedef enum
 {
     FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_FINE = 0,
     FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_COARSE,
+    FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_PATH_SHARDED,
 } FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY;
+/**
+ * User mode file system dispatcher strategy.
+ *
+ * Two dispatcher strategies are provided:
+ *
+ * 1. A serial strategy where every dispatcher thread receives a request from the FSD,
+ * processes it and sends the response back with the next request it receives. A slow
+ * operation blocks its dispatcher thread until it completes (or returns STATUS_PENDING).
+ *
+ * 2. A work-stealing strategy where the dispatcher threads only receive requests from the
+ * FSD and hand them off to a pool of worker threads. Every worker owns a queue of requests
+ * and steals requests from the other workers when its queue is empty. Workers send their
+ * responses using FspFileSystemSendResponse. A few slow operations therefore do not hold up
+ * unrelated fast operations, at the cost of an additional hand-off and transaction per
+ * request.
+ *
+ * @see FSP_FILE_SYSTEM_DISPATCHER_PARAMS
+ */
+typedef enum
+{
+    FSP_FILE_SYSTEM_DISPATCHER_STRATEGY_SERIAL = 0,
+    FSP_FILE_SYSTEM_DISPATCHER_STRATEGY_WORK_STEALING,
+} FSP_FILE_SYSTEM_DISPATCHER_STRATEGY;
+/**
+ * User mode file system dispatcher thread affinity.
+ *
+ * With the default affinity dispatcher threads may run on any processor of the process
+ * and allocate their request and response buffers from the process heap.
+ *
+ * With NUMA affinity dispatcher threads are assigned round-robin to the NUMA nodes that
+ * the process can run on; every thread is pinned to the processors of its node and
+ * allocates its request and response buffers from memory that is local to its node.
+ *
+ * @see FSP_FILE_SYSTEM_DISPATCHER_PARAMS
+ */
+typedef enum
+{
+    FSP_FILE_SYSTEM_DISPATCHER_AFFINITY_DEFAULT = 0,
+    FSP_FILE_SYSTEM_DISPATCHER_AFFINITY_NUMA,
+} FSP_FILE_SYSTEM_DISPATCHER_AFFINITY;
 enum
 {
     FspCleanupDelete                    = 0x01,
@@ -1067,6 +1121,17 @@ typedef struct _FSP_FILE_SYSTEM
     FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY OpGuardStrategy;
     SRWLOCK OpGuardLock;
     BOOLEAN UmFileContextIsUserContext2, UmFileContextIsFullContext;
+    ULONG DispatcherTransactBatchSize;
+    volatile LONG64 DispatcherTransactCount, DispatcherRequestCount;
+    FSP_FILE_SYSTEM_DISPATCHER_STRATEGY DispatcherStrategy;
+    PVOID DispatcherWorkQueue;
+    PVOID Statistics;
+    PVOID Trace;
+    PVOID TransferBuffers;
+    PVOID DispatcherAdaptive;
+    PVOID DispatcherNuma;
+    PVOID Async;
+    PVOID OpGuardShards;
 } FSP_FILE_SYSTEM;
 typedef struct _FSP_FILE_SYSTEM_OPERATION_CONTEXT
 {
@@ -1092,7 +1157,9 @@ FSP_API NTSTATUS FspFileSystemPreflight(PWSTR DevicePath,
  *
  * @param DevicePath
  *     The name of the control device for this file system. This must be either
- *     FSP_FSCTL_DISK_DEVICE_NAME or FSP_FSCTL_NET_DEVICE_NAME.
+ *     FSP_FSCTL_DISK_DEVICE_NAME or FSP_FSCTL_NET_DEVICE_NAME. It may also be NULL to create
+ *     a detached file system object that is not connected to the FSD. A detached file system
+ *     cannot be mounted or dispatched; it can only be driven with FspFileSystemReplayTrace.
  * @param VolumeParams
  *     Volume parameters for the newly created file system.
  * @param Interface
@@ -1159,6 +1226,75 @@ FSP_API VOID FspFileSystemRemoveMountPoint(FSP_FILE_SYSTEM *FileSystem);
  *     STATUS_SUCCESS or error code.
  */
 FSP_API NTSTATUS FspFileSystemStartDispatcher(FSP_FILE_SYSTEM *FileSystem, ULONG ThreadCount);
+/**
+ * @class FSP_FILE_SYSTEM_DISPATCHER_PARAMS
+ * File system dispatcher parameters.
+ *
+ * These parameters are passed to FspFileSystemStartDispatcherEx. The Version field must be
+ * set to sizeof(FSP_FILE_SYSTEM_DISPATCHER_PARAMS); fields that are not known to the caller
+ * are assumed to be 0.
+ *
+ * When TransactBatchSize is non-zero the dispatcher threads use batched transactions:
+ * every transaction with the FSD receives as many pending requests as fit in a request
+ * buffer of TransactBatchSize bytes (at least FSP_FSCTL_TRANSACT_BATCH_BUFFER_SIZEMIN) and
+ * returns the responses to all requests of the previous batch. This reduces the number of
+ * kernel round trips when many small requests are queued (e.g. metadata intensive loads).
+ * However requests within the same batch are processed serially by the same dispatcher
+ * thread, so a slow request will delay the other requests in its batch.
+ *
+ * When Strategy is FSP_FILE_SYSTEM_DISPATCHER_STRATEGY_WORK_STEALING, ThreadCount is the
+ * number of threads that receive requests from the FSD (0 means the minimum number of
+ * dispatcher threads) and WorkerThreadCount is the number of threads that process them
+ * (0 means a default number of threads based on the number of processors).
+ *
+ * When ThreadCountMax is greater than ThreadCount the dispatcher is adaptive: it starts
+ * with ThreadCount threads (0 means the minimum number of dispatcher threads) and grows or
+ * shrinks the thread set within [ThreadCount, ThreadCountMax] as the load changes. Every
+ * AdaptiveInterval millis the dispatcher samples the number of requests pending in the FSD
+ * and the average handler latency. It adds threads when more requests are pending than
+ * there are idle threads, provided that there are fewer threads than processors or that the
+ * average latency is at least LatencyThreshold microseconds (i.e. handlers block rather than
+ * compute). It retires one thread for every IdleTimeout millis that the pending queue stays
+ * empty with at least two idle threads. The adaptive dispatcher cannot be combined with the
+ * WORK_STEALING strategy.
+ *
+ * When Affinity is FSP_FILE_SYSTEM_DISPATCHER_AFFINITY_NUMA the dispatcher threads (but not
+ * the WORK_STEALING workers) are spread across NUMA nodes and use node-local buffers.
+ *
+ * When AsyncThreadCount is non-zero the dispatcher also starts a pool of AsyncThreadCount
+ * threads that run the routines posted with FspFileSystemAsyncPost; this enables the
+ * FspFileSystemAsync* API.
+ */
+typedef struct
+{
+    UINT16 Version;                     /* set to sizeof(FSP_FILE_SYSTEM_DISPATCHER_PARAMS) */
+    UINT16 Reserved16;
+    ULONG ThreadCount;                  /* 0: default number of threads */
+    ULONG TransactBatchSize;            /* 0: single request transactions; else batch size */
+    FSP_FILE_SYSTEM_DISPATCHER_STRATEGY Strategy;
+    ULONG WorkerThreadCount;            /* WORK_STEALING: 0: default number of workers */
+    ULONG ThreadCountMax;               /* > ThreadCount: adaptive dispatcher thread count */
+    ULONG AdaptiveInterval;             /* adaptive: sampling interval (millis); 0: 100ms */
+    ULONG IdleTimeout;                  /* adaptive: idle time before retiring a thread (millis); 0: 5s */
+    ULONG LatencyThreshold;             /* adaptive: latency that justifies threads beyond processor count (micros); 0: 1ms */
+    FSP_FILE_SYSTEM_DISPATCHER_AFFINITY Affinity;
+    ULONG AsyncThreadCount;             /* 0: no async API; else threads that run async routines */
+} FSP_FILE_SYSTEM_DISPATCHER_PARAMS;
+/**
+ * Start the file system dispatcher using extended parameters.
+ *
+ * @param FileSystem
+ *     The file system object.
+ * @param DispatcherParams
+ *     Dispatcher parameters.
+ * @return
+ *     STATUS_SUCCESS or error code.
+ * @see
+ *     FSP_FILE_SYSTEM_DISPATCHER_PARAMS
+ *     FspFileSystemStartDispatcher
+ */
+FSP_API NTSTATUS FspFileSystemStartDispatcherEx(FSP_FILE_SYSTEM *FileSystem,
+    const FSP_FILE_SYSTEM_DISPATCHER_PARAMS *DispatcherParams);
 /**
  * Stop the file system dispatcher.
  *
@@ -1166,6 +1302,34 @@ FSP_API NTSTATUS FspFileSystemStartDispatcher(FSP_FILE_SYSTEM *FileSystem, ULONG
  *     The file system object.
  */
 FSP_API VOID FspFileSystemStopDispatcher(FSP_FILE_SYSTEM *FileSystem);
+/**
+ * Register transfer buffers for large non-cached reads and writes.
+ *
+ * The file system allocates BufferCount transfer buffers of BufferSize bytes and registers
+ * them with the FSD, which locks them in memory for the lifetime of the volume. Non-cached
+ * Read and Write requests larger than 64KB and no larger than BufferSize, whose originating I/O
+ * buffer is not page aligned, then receive a free transfer buffer in their Address field (and
+ * its 1-based index in their TransferBuffer field) instead of a per-request copy of the I/O
+ * buffer into newly allocated pages that are then mapped. Page aligned I/O buffers are still
+ * mapped directly, which involves no copy. Requests that do not fit or that arrive when all
+ * transfer buffers are in use are handled as before.
+ *
+ * Transfer buffers must be registered once, prior to starting the file system dispatcher.
+ * On systems with multiple NUMA nodes the transfer buffers are interleaved across the nodes
+ * that the process can run on, so that large transfers are not all served from the memory of
+ * a single node.
+ *
+ * @param FileSystem
+ *     The file system object.
+ * @param BufferSize
+ *     The size of each transfer buffer. Must be a multiple of 64KB and no larger than 16MB.
+ * @param BufferCount
+ *     The number of transfer buffers (at most 64). The total size may not exceed 256MB.
+ * @return
+ *     STATUS_SUCCESS or error code.
+ */
+FSP_API NTSTATUS FspFileSystemRegisterTransferBuffers(FSP_FILE_SYSTEM *FileSystem,
+    ULONG BufferSize, ULONG BufferCount);
 /**
  * Send a response to the FSD.
  *
@@ -1180,6 +1344,8 @@ FSP_API VOID FspFileSystemStopDispatcher(FSP_FILE_SYSTEM *FileSystem);
  *
  * These operations are allowed to return STATUS_PENDING to postpone sending a response to the FSD.
  * At a later time the file system can use FspFileSystemSendResponse to send the response.
+ * Alternatively the file system can use the FspFileSystemAsync* API (see below), which keeps
+ * track of pending requests and fills in the response.
  *
  * @param FileSystem
  *     The file system object.
@@ -1188,6 +1354,126 @@ FSP_API VOID FspFileSystemStopDispatcher(FSP_FILE_SYSTEM *FileSystem);
  */
 FSP_API VOID FspFileSystemSendResponse(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_TRANSACT_RSP *Response);
+/*
+ * Asynchronous request completion.
+ *
+ * The FspFileSystemAsync* API is an alternative to FspFileSystemSendResponse for Read, Write
+ * and ReadDirectory operations that return STATUS_PENDING. It requires the dispatcher to
+ * have been started with a non-zero AsyncThreadCount (see FSP_FILE_SYSTEM_DISPATCHER_PARAMS).
+ *
+ * While servicing the operation the file system calls FspFileSystemAsyncBegin, which captures
+ * the request being serviced in an async context, and then returns STATUS_PENDING. The async
+ * context is later completed using one of the FspFileSystemAsyncComplete* functions, which
+ * fill in the response appropriate for the operation and send it to the FSD.
+ *
+ * Async contexts may be cancelled (FspFileSystemAsyncCancel) or time out; in either case a
+ * response (STATUS_CANCELLED or STATUS_IO_TIMEOUT) is sent immediately and the I/O buffers
+ * of the request may no longer be accessed. A file system that completes requests from its
+ * own threads must therefore call FspFileSystemAsyncClaim before accessing the I/O buffers;
+ * once claimed an async context can no longer be cancelled or time out. Routines posted
+ * using FspFileSystemAsyncPost are claimed automatically and receive Cancelled == TRUE
+ * if their context could not be claimed.
+ *
+ * Regardless of cancellation every async context must be completed exactly once; this
+ * frees the async context. Completion returns STATUS_CANCELLED if a response has already
+ * been sent. When the dispatcher is stopped all pending async contexts are cancelled and
+ * all posted routines are run; async contexts that have been claimed by file system
+ * threads must be completed before FspFileSystemStopDispatcher is called.
+ */
+typedef struct _FSP_FILE_SYSTEM_ASYNC_CONTEXT FSP_FILE_SYSTEM_ASYNC_CONTEXT;
+typedef VOID FSP_FILE_SYSTEM_ASYNC_ROUTINE(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_ASYNC_CONTEXT *AsyncContext, PVOID Context, BOOLEAN Cancelled);
+/**
+ * Begin asynchronous processing of the current request.
+ *
+ * This function may be used only when servicing the Read, Write or ReadDirectory
+ * FSP_FILE_SYSTEM_INTERFACE operations. If it succeeds the operation must return
+ * STATUS_PENDING.
+ *
+ * @param FileSystem
+ *     The file system object.
+ * @param Timeout
+ *     Time in millis after which the request is completed with STATUS_IO_TIMEOUT unless it has
+ *     been claimed or completed. A value of 0 or INFINITE means no timeout.
+ * @param PAsyncContext [out]
+ *     Pointer that will receive the async context.
+ * @return
+ *     STATUS_SUCCESS or error code.
+ */
+FSP_API NTSTATUS FspFileSystemAsyncBegin(FSP_FILE_SYSTEM *FileSystem, ULONG Timeout,
+    FSP_FILE_SYSTEM_ASYNC_CONTEXT **PAsyncContext);
+/**
+ * Post a routine that will complete an async context.
+ *
+ * The routine runs on the async thread pool after Delay millis. It is passed Cancelled == TRUE
+ * if the async context was cancelled or timed out in the meantime; in all cases the routine
+ * must complete the async context. An async context may be posted only once.
+ *
+ * @param AsyncContext
+ *     The async context.
+ * @param Delay
+ *     Delay in millis before the routine runs; 0 means as soon as possible.
+ * @param Routine
+ *     The routine to run.
+ * @param Context
+ *     Context passed to the routine.
+ * @return
+ *     STATUS_SUCCESS or error code.
+ */
+FSP_API NTSTATUS FspFileSystemAsyncPost(FSP_FILE_SYSTEM_ASYNC_CONTEXT *AsyncContext,
+    ULONG Delay, FSP_FILE_SYSTEM_ASYNC_ROUTINE *Routine, PVOID Context);
+/**
+ * Claim an async context prior to accessing the I/O buffers of its request.
+ *
+ * @param AsyncContext
+ *     The async context.
+ * @return
+ *     TRUE if the async context has been claimed; FALSE if it has been cancelled or has timed out.
+ */
+FSP_API BOOLEAN FspFileSystemAsyncClaim(FSP_FILE_SYSTEM_ASYNC_CONTEXT *AsyncContext);
+/**
+ * Cancel an async context.
+ *
+ * The request is completed with STATUS_CANCELLED unless the async context has already been
+ * claimed or completed. The async context must still be completed by its owner.
+ *
+ * @param AsyncContext
+ *     The async context.
+ * @return
+ *     TRUE if the request was cancelled.
+ */
+FSP_API BOOLEAN FspFileSystemAsyncCancel(FSP_FILE_SYSTEM_ASYNC_CONTEXT *AsyncContext);
+/**
+ * Get the number of async contexts that have not been completed, cancelled or timed out.
+ *
+ * @param FileSystem
+ *     The file system object.
+ * @return
+ *     The number of outstanding async contexts.
+ */
+FSP_API ULONG FspFileSystemAsyncOutstandingCount(FSP_FILE_SYSTEM *FileSystem);
+/**
+ * Complete an async context using a response prepared by the file system.
+ *
+ * The Kind and Hint of the response are filled in from the async context. The async context
+ * is freed.
+ *
+ * @param AsyncContext
+ *     The async context.
+ * @param Response
+ *     The response buffer. A Size of 0 means sizeof(FSP_FSCTL_TRANSACT_RSP).
+ * @return
+ *     STATUS_SUCCESS if the response was sent; STATUS_CANCELLED if the request had already
+ *     been cancelled or had timed out.
+ */
+FSP_API NTSTATUS FspFileSystemAsyncComplete(FSP_FILE_SYSTEM_ASYNC_CONTEXT *AsyncContext,
+    FSP_FSCTL_TRANSACT_RSP *Response);
+FSP_API NTSTATUS FspFileSystemAsyncCompleteRead(FSP_FILE_SYSTEM_ASYNC_CONTEXT *AsyncContext,
+    NTSTATUS Status, ULONG BytesTransferred);
+FSP_API NTSTATUS FspFileSystemAsyncCompleteWrite(FSP_FILE_SYSTEM_ASYNC_CONTEXT *AsyncContext,
+    NTSTATUS Status, ULONG BytesTransferred, const FSP_FSCTL_FILE_INFO *FileInfo);
+FSP_API NTSTATUS FspFileSystemAsyncCompleteReadDirectory(FSP_FILE_SYSTEM_ASYNC_CONTEXT *AsyncContext,
+    NTSTATUS Status, ULONG BytesTransferred);
 /**
  * Begin notifying Windows that the file system has file changes.
  *
@@ -1265,6 +1551,227 @@ FSP_API NTSTATUS FspFileSystemNotify(FSP_FILE_SYSTEM *FileSystem,
  *     The current operation context.
  */
 FSP_API FSP_FILE_SYSTEM_OPERATION_CONTEXT *FspFileSystemGetOperationContext(VOID);
+/*
+ * File system statistics.
+ *
+ * The dispatcher measures the time that every operation spends in its FSP_FILE_SYSTEM_INTERFACE
+ * handler (including the operation guard) and records it in a latency histogram. Histograms are
+ * kept per transaction kind, per Create disposition and per SetInformation information class.
+ * Recording is lock-free: every processor updates its own copy of the histograms and copies are
+ * only combined when the statistics are retrieved.
+ *
+ * Histogram buckets are log-linear (similar to HDR histograms): values below 4 have their own
+ * bucket; every following power of 2 is split into 4 equal buckets. Values are in units of the
+ * performance counter (see QueryPerformanceFrequency) and the last bucket also counts all values
+ * that exceed its range.
+ *
+ * Operations that return STATUS_PENDING are measured until they return STATUS_PENDING.
+ *
+ * The statistics also list the running dispatcher threads together with the NUMA node that
+ * each thread is pinned to (FSP_FILE_SYSTEM_DISPATCHER_AFFINITY_NUMA); threads with default
+ * affinity report FSP_FILE_SYSTEM_STATISTICS_NUMA_NODE_ANY. DispatcherLiveThreadCount is the
+ * number of dispatcher threads currently running; with the adaptive dispatcher it moves within
+ * [DispatcherThreadCountMin, DispatcherThreadCountMax] as threads are added and retired.
+ */
+#define FSP_FILE_SYSTEM_HISTOGRAM_BUCKET_COUNT  112
+#define FSP_FILE_SYSTEM_STATISTICS_CREATE_DISPOSITION_COUNT 6      /* FILE_SUPERSEDE - FILE_OVERWRITE_IF */
+#define FSP_FILE_SYSTEM_STATISTICS_INFORMATION_CLASS_COUNT 72
+#define FSP_FILE_SYSTEM_STATISTICS_DISPATCHER_THREAD_COUNT 64
+#define FSP_FILE_SYSTEM_STATISTICS_NUMA_NODE_ANY 0xffff
+typedef struct
+{
+    UINT64 Count;
+    UINT64 TotalTime;
+    UINT64 MaxTime;
+    UINT64 Buckets[FSP_FILE_SYSTEM_HISTOGRAM_BUCKET_COUNT];
+} FSP_FILE_SYSTEM_HISTOGRAM;
+typedef struct
+{
+    UINT32 ThreadId;
+    UINT16 NumaNode;                    /* FSP_FILE_SYSTEM_STATISTICS_NUMA_NODE_ANY: not pinned */
+    UINT16 Reserved16;
+} FSP_FILE_SYSTEM_DISPATCHER_THREAD_INFO;
+typedef struct
+{
+    UINT32 Version;                     /* set to sizeof(FSP_FILE_SYSTEM_STATISTICS) */
+    UINT32 Reserved32;
+    UINT64 Frequency;                   /* performance counter frequency */
+    UINT64 TransactCount;
+    UINT64 RequestCount;
+    FSP_FILE_SYSTEM_HISTOGRAM Kind[FspFsctlTransactKindCount];
+    FSP_FILE_SYSTEM_HISTOGRAM CreateDisposition[FSP_FILE_SYSTEM_STATISTICS_CREATE_DISPOSITION_COUNT];
+    FSP_FILE_SYSTEM_HISTOGRAM SetInformationClass[FSP_FILE_SYSTEM_STATISTICS_INFORMATION_CLASS_COUNT];
+    UINT32 DispatcherThreadCount;       /* number of valid DispatcherThreads entries */
+    UINT32 Reserved32b;
+    FSP_FILE_SYSTEM_DISPATCHER_THREAD_INFO DispatcherThreads[FSP_FILE_SYSTEM_STATISTICS_DISPATCHER_THREAD_COUNT];
+    UINT32 DispatcherLiveThreadCount;   /* dispatcher threads running, whether listed or not */
+    UINT32 DispatcherThreadCountMin;    /* adaptive dispatcher: thread count range; else 0 */
+    UINT32 DispatcherThreadCountMax;
+    UINT32 Reserved32c;
+} FSP_FILE_SYSTEM_STATISTICS;
+/**
+ * Get a snapshot of the file system statistics.
+ *
+ * The snapshot is assembled from counters that may be concurrently updated; it is therefore
+ * possible for the Count of a histogram to differ slightly from the sum of its Buckets.
+ *
+ * @param FileSystem
+ *     The file system object.
+ * @param Statistics [out]
+ *     Receives the statistics. The caller must set the Version field to
+ *     sizeof(FSP_FILE_SYSTEM_STATISTICS) prior to this call.
+ * @param Reset
+ *     If TRUE the statistics are reset to zero as they are retrieved. No measurement
+ *     is lost between consecutive snapshots taken with Reset.
+ * @return
+ *     STATUS_SUCCESS or error code.
+ */
+FSP_API NTSTATUS FspFileSystemGetStatistics(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_STATISTICS *Statistics, BOOLEAN Reset);
+/**
+ * Reset the file system statistics to zero.
+ *
+ * @param FileSystem
+ *     The file system object.
+ */
+FSP_API VOID FspFileSystemResetStatistics(FSP_FILE_SYSTEM *FileSystem);
+/**
+ * Get a latency percentile from a histogram.
+ *
+ * @param Histogram
+ *     The histogram (usually part of an FSP_FILE_SYSTEM_STATISTICS snapshot).
+ * @param Permille
+ *     The requested percentile in permille (e.g. 990 for p99, 999 for p99.9).
+ * @return
+ *     The upper bound of the histogram bucket that contains the requested percentile,
+ *     in units of the performance counter; 0 if the histogram is empty.
+ */
+FSP_API UINT64 FspFileSystemHistogramPercentile(const FSP_FILE_SYSTEM_HISTOGRAM *Histogram,
+    ULONG Permille);
+/*
+ * File system request tracing.
+ *
+ * The trace recorder copies every request that the dispatcher receives and every response
+ * that it sends (in their raw binary form) into a trace file. Records are written into
+ * per-thread buffers without taking any locks; full buffers are written to the trace file
+ * asynchronously by a background thread. If the background thread cannot keep up, records
+ * are dropped rather than slowing down the file system.
+ *
+ * A trace file consists of an FSP_FILE_SYSTEM_TRACE_HEADER followed by a sequence of
+ * FSP_FILE_SYSTEM_TRACE_RECORD's. Every record is immediately followed by the request
+ * (FSP_FSCTL_TRANSACT_REQ) or response (FSP_FSCTL_TRANSACT_RSP) that it describes. Records
+ * from the same thread appear in the order that they were recorded; records from different
+ * threads may appear out of order and should be ordered by their Time field.
+ *
+ * The fsptool utility can convert trace files into text using the same formatting as
+ * the debug log (see FspDebugLogRequest and FspDebugLogResponse).
+ */
+#define FSP_FILE_SYSTEM_TRACE_SIGNATURE ('W' | ('F' << 8) | ('T' << 16) | ('R' << 24))
+enum
+{
+    FspFileSystemTraceRequest           = 1,
+    FspFileSystemTraceResponse          = 2,
+};
+typedef struct
+{
+    UINT32 Signature;                   /* FSP_FILE_SYSTEM_TRACE_SIGNATURE */
+    UINT32 Version;                     /* sizeof(FSP_FILE_SYSTEM_TRACE_HEADER) */
+    UINT64 Frequency;                   /* performance counter frequency */
+    UINT64 StartTime;                   /* performance counter at trace start */
+    UINT64 StartSystemTime;             /* system time (FILETIME) at trace start */
+} FSP_FILE_SYSTEM_TRACE_HEADER;
+typedef struct
+{
+    UINT32 Size;                        /* record size including the request/response */
+    UINT16 Type;                        /* FspFileSystemTraceRequest or Response */
+    UINT16 Reserved16;
+    UINT32 ThreadId;
+    UINT32 Reserved32;
+    UINT64 Time;                        /* performance counter */
+} FSP_FILE_SYSTEM_TRACE_RECORD;
+/**
+ * Start recording file system requests and responses into a trace file.
+ *
+ * Tracing may be started and stopped while the file system dispatcher is running.
+ * FspFileSystemStartTrace and FspFileSystemStopTrace must not be called concurrently.
+ *
+ * @param FileSystem
+ *     The file system object.
+ * @param FileName
+ *     The trace file name. Any existing file is overwritten.
+ * @return
+ *     STATUS_SUCCESS or error code.
+ */
+FSP_API NTSTATUS FspFileSystemStartTrace(FSP_FILE_SYSTEM *FileSystem, PWSTR FileName);
+/**
+ * Stop recording file system requests and responses.
+ *
+ * All recorded requests and responses are written to the trace file before this call returns.
+ *
+ * @param FileSystem
+ *     The file system object.
+ * @param PDropCount [out]
+ *     Optional. Receives the number of records that were dropped because the trace file
+ *     could not be written fast enough.
+ */
+FSP_API VOID FspFileSystemStopTrace(FSP_FILE_SYSTEM *FileSystem, PUINT64 PDropCount);
+/**
+ * Trace replay parameters.
+ *
+ * ThreadCount is the number of threads that replay requests concurrently (0 means 1 thread).
+ * Requests are issued in the order that they were recorded; however a request that uses a
+ * file opened by an earlier Create is never issued before that Create completes and a Close
+ * is never issued before the other requests on its file complete.
+ *
+ * Speed selects the timing model. When 0 requests are issued as fast as possible. Otherwise
+ * requests are issued no earlier than their recorded time (relative to the first recorded
+ * request) scaled by Speed percent; for example 100 replays at the recorded rate and 200
+ * replays twice as fast.
+ */
+typedef struct
+{
+    UINT16 Version;                     /* set to sizeof(FSP_FILE_SYSTEM_REPLAY_PARAMS) */
+    UINT16 Reserved16;
+    ULONG ThreadCount;
+    ULONG Speed;
+} FSP_FILE_SYSTEM_REPLAY_PARAMS;
+typedef struct
+{
+    UINT64 RequestCount;                /* requests replayed */
+    UINT64 SkipCount;                   /* requests skipped (unknown or failed file context) */
+    UINT64 MismatchCount;               /* requests with a status other than the recorded one */
+    UINT64 ElapsedTime;                 /* performance counter */
+} FSP_FILE_SYSTEM_REPLAY_RESULT;
+/**
+ * Replay a request trace against a file system.
+ *
+ * The requests in a trace file recorded with FspFileSystemStartTrace are fed directly into
+ * the file system operations (FSP_FILE_SYSTEM_INTERFACE) without going through the FSD.
+ * This allows benchmarking and regression testing of a file system implementation against
+ * a captured workload without mounting it. Usually the file system is a detached file system
+ * (see FspFileSystemCreate); the dispatcher of a mounted file system must not be running.
+ *
+ * File contexts are translated from the recorded ones to the ones that the file system
+ * returns during replay. Read, Write and ReadDirectory use replay buffers: the data written
+ * by Write is not part of the trace and is replaced by zeroes. Access checks are performed
+ * against the access token of the replaying process. Operations must complete synchronously.
+ *
+ * Replayed operations are measured in the file system statistics, which can be used to
+ * report throughput and latency per operation (see FspFileSystemGetStatistics).
+ *
+ * @param FileSystem
+ *     The file system object.
+ * @param FileName
+ *     The trace file name.
+ * @param ReplayParams
+ *     Replay parameters.
+ * @param ReplayResult [out]
+ *     Optional. Receives the replay counters and elapsed time.
+ * @return
+ *     STATUS_SUCCESS or error code.
+ */
+FSP_API NTSTATUS FspFileSystemReplayTrace(FSP_FILE_SYSTEM *FileSystem, PWSTR FileName,
+    const FSP_FILE_SYSTEM_REPLAY_PARAMS *ReplayParams, FSP_FILE_SYSTEM_REPLAY_RESULT *ReplayResult);
 static inline
 PWSTR FspFileSystemMountPoint(FSP_FILE_SYSTEM *FileSystem)
 {
@@ -1743,11 +2250,35 @@ FSP_API BOOLEAN FspFileSystemAcquireDirectoryBuffer(PVOID *PDirBuffer,
     BOOLEAN Reset, PNTSTATUS PResult);
 FSP_API BOOLEAN FspFileSystemFillDirectoryBuffer(PVOID *PDirBuffer,
     FSP_FSCTL_DIR_INFO *DirInfo, PNTSTATUS PResult);
+/*
+ * Add several entries at once. DirInfoBuffer contains FSP_FSCTL_DIR_INFO entries packed as
+ * by FspFileSystemAddDirInfo (an end-of-directory marker is optional). The directory buffer
+ * grows at most once per call; SizeHint is an estimate of the total size of the enumeration
+ * and is used to size the directory buffer on its first fill.
+ */
+FSP_API BOOLEAN FspFileSystemFillDirectoryBufferBulk(PVOID *PDirBuffer,
+    PVOID DirInfoBuffer, ULONG Length, ULONG SizeHint, PNTSTATUS PResult);
 FSP_API VOID FspFileSystemReleaseDirectoryBuffer(PVOID *PDirBuffer);
 FSP_API VOID FspFileSystemReadDirectoryBuffer(PVOID *PDirBuffer,
     PWSTR Marker,
     PVOID Buffer, ULONG Length, PULONG PBytesTransferred);
 FSP_API VOID FspFileSystemDeleteDirectoryBuffer(PVOID *PDirBuffer);
+/*
+ * Directory snapshots are directory buffers shared by all handles that enumerate the same
+ * directory. They are keyed by DirectoryId and a Generation that the file system changes
+ * whenever the directory changes. AcquireDirectorySnapshot returns TRUE if the caller must
+ * build the snapshot using FillDirectoryBuffer/ReleaseDirectoryBuffer; it returns FALSE if
+ * *PDirBuffer already references a matching snapshot. If Streaming is TRUE the caller promises
+ * to fill entries in directory order; concurrent readers may then return pages before the
+ * snapshot is complete. Snapshots are read with ReadDirectoryBuffer and released with
+ * DeleteDirectoryBuffer.
+ */
+FSP_API BOOLEAN FspFileSystemAcquireDirectorySnapshot(PVOID *PSnapshotCache,
+    UINT64 DirectoryId, UINT64 Generation, BOOLEAN Streaming,
+    PVOID *PDirBuffer, PNTSTATUS PResult);
+FSP_API VOID FspFileSystemInvalidateDirectorySnapshot(PVOID *PSnapshotCache,
+    UINT64 DirectoryId);
+FSP_API VOID FspFileSystemDeleteDirectorySnapshotCache(PVOID *PSnapshotCache);
 
 /*
  * Security
@@ -1874,6 +2405,31 @@ VOID FspPosixUnixTimeToFileTime(const __int3264 UnixTime[2], PUINT64 PFileTime)
 FSP_API VOID FspPathPrefix(PWSTR Path, PWSTR *PPrefix, PWSTR *PRemain, PWSTR Root);
 FSP_API VOID FspPathSuffix(PWSTR Path, PWSTR *PRemain, PWSTR *PSuffix, PWSTR Root);
 FSP_API VOID FspPathCombine(PWSTR Prefix, PWSTR Suffix);
+/*
+ * Non-mutating path views. These take a path and its length in characters (no NUL
+ * terminator is required) and never write to the path.
+ *
+ * FspPathScan returns the index of the first Char0 or Char1 in the path or Length.
+ * FspPathNextComponent returns the next backslash separated component starting
+ * at *PIndex and advances *PIndex past it; it returns FALSE when there are no more.
+ * FspPathSplit splits a path into parent and leaf like FspPathSuffix (the root parent
+ * is returned as the single leading backslash).
+ * FspPathHash returns a (optionally case-insensitive) hash of the path; case-insensitive
+ * hashes of names that FspNameCompare considers equal are equal.
+ */
+FSP_API ULONG FspPathScan(PWSTR Path, ULONG Length, WCHAR Char0, WCHAR Char1);
+FSP_API BOOLEAN FspPathNextComponent(PWSTR Path, ULONG Length, PULONG PIndex,
+    PWSTR *PComponent, PULONG PComponentLength);
+FSP_API VOID FspPathSplit(PWSTR Path, ULONG Length,
+    PULONG PParentLength, PWSTR *PLeaf, PULONG PLeafLength);
+FSP_API UINT32 FspPathHash(PWSTR Path, ULONG Length, BOOLEAN CaseInsensitive);
+/*
+ * FspNameCompare compares two names of the given lengths by UTF-16 code unit and then by
+ * length. If CaseInsensitive is TRUE names are compared after upper casing them in the
+ * same manner as the FSD (and NTFS); this is an ordinal comparison and not a linguistic one.
+ */
+FSP_API int FspNameCompare(PWSTR Name0, ULONG Length0, PWSTR Name1, ULONG Length1,
+    BOOLEAN CaseInsensitive);
 
 /**
  * @group Service Framework
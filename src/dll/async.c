@@ -0,0 +1,507 @@
+/**
+ * @file dll/async.c
+ *
+ * @copyright 2015-2021 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#include <dll/library.h>
+
+/*
+ * Asynchronous request completion.
+ *
+ * An async context captures the Kind and Hint of the request being serviced, so that the
+ * file system can return STATUS_PENDING and complete the request later. Every async context
+ * is in one of three states:
+ *
+ * - Pending: the request is outstanding. It may be cancelled or time out; either way a
+ *   response is sent to the FSD and the context becomes Done.
+ * - Running: the owner has claimed the context (explicitly or by having a posted routine
+ *   run) and is going to complete it. It cannot be cancelled or time out any more.
+ * - Done: a response has been sent.
+ *
+ * All state transitions except for the last step of completion happen under the engine
+ * lock. The owner always completes the context exactly once; this frees it. Since Done is
+ * a final state, completing a context that has already been cancelled does not touch the
+ * engine (which may be gone by then).
+ *
+ * A single service thread expires timed out contexts and moves delayed posts to the work
+ * queue when they become due. Posted routines run on the bounded work queue.
+ */
+
+enum
+{
+    FspFileSystemAsyncPending           = 0,
+    FspFileSystemAsyncRunning           = 1,
+    FspFileSystemAsyncDone              = 2,
+};
+
+typedef struct
+{
+    FSP_FILE_SYSTEM *FileSystem;
+    SRWLOCK Lock;
+    LIST_ENTRY OutstandingList, TimerList;
+    ULONG OutstandingCount;
+    UINT64 NextDueTime;                 /* earliest expiration or timer; 0: none */
+    HANDLE Event;
+    volatile LONG Stopped;
+    HANDLE Thread;
+    FSP_WORK_QUEUE *WorkQueue;
+} FSP_FILE_SYSTEM_ASYNC;
+
+struct _FSP_FILE_SYSTEM_ASYNC_CONTEXT
+{
+    FSP_WORK_ITEM WorkItem;
+    LIST_ENTRY ListEntry, TimerEntry;
+    FSP_FILE_SYSTEM_ASYNC *Async;
+    FSP_FILE_SYSTEM *FileSystem;
+    UINT64 Hint;
+    UINT32 Kind;
+    volatile LONG State;
+    UINT64 ExpirationTime;              /* tick count; 0: no timeout */
+    UINT64 DueTime;                     /* tick count of delayed post */
+    FSP_FILE_SYSTEM_ASYNC_ROUTINE *Routine;
+    PVOID Context;
+};
+
+static VOID FspFileSystemAsyncSendStatus(FSP_FILE_SYSTEM_ASYNC_CONTEXT *AsyncContext,
+    NTSTATUS Status)
+{
+    FSP_FSCTL_TRANSACT_RSP Response;
+
+    memset(&Response, 0, sizeof Response);
+    Response.Size = sizeof Response;
+    Response.Kind = AsyncContext->Kind;
+    Response.Hint = AsyncContext->Hint;
+    Response.IoStatus.Status = Status;
+    FspFileSystemSendResponse(AsyncContext->FileSystem, &Response);
+}
+
+static inline VOID FspFileSystemAsyncScheduleNoLock(FSP_FILE_SYSTEM_ASYNC *Async,
+    UINT64 DueTime)
+{
+    /* wake the service thread if DueTime is earlier than anything it is waiting for */
+    if (0 == Async->NextDueTime || DueTime < Async->NextDueTime)
+    {
+        Async->NextDueTime = DueTime;
+        SetEvent(Async->Event);
+    }
+}
+
+static VOID FspFileSystemAsyncWorkRoutine(FSP_WORK_ITEM *WorkItem, PVOID WorkerBuffer)
+{
+    FSP_FILE_SYSTEM_ASYNC_CONTEXT *AsyncContext =
+        CONTAINING_RECORD(WorkItem, FSP_FILE_SYSTEM_ASYNC_CONTEXT, WorkItem);
+    BOOLEAN Cancelled;
+
+    /* WorkerBuffer is unused; a cancelled work item always finds its context Done */
+    Cancelled = !FspFileSystemAsyncClaim(AsyncContext);
+    AsyncContext->Routine(AsyncContext->FileSystem, AsyncContext, AsyncContext->Context,
+        Cancelled);
+}
+
+static DWORD WINAPI FspFileSystemAsyncThread(PVOID Async0)
+{
+    FSP_FILE_SYSTEM_ASYNC *Async = Async0;
+    FSP_FILE_SYSTEM_ASYNC_CONTEXT *AsyncContext;
+    PLIST_ENTRY ListEntry, NextEntry;
+    LIST_ENTRY ExpiredList;
+    UINT64 Now, NextDueTime;
+    DWORD Timeout = INFINITE;
+
+    for (;;)
+    {
+        WaitForSingleObject(Async->Event, Timeout);
+        if (Async->Stopped)
+            break;
+
+        Now = GetTickCount64();
+        NextDueTime = 0;
+        InitializeListHead(&ExpiredList);
+
+        AcquireSRWLockExclusive(&Async->Lock);
+
+        for (ListEntry = Async->OutstandingList.Flink;
+            &Async->OutstandingList != ListEntry;
+            ListEntry = NextEntry)
+        {
+            NextEntry = ListEntry->Flink;
+            AsyncContext = CONTAINING_RECORD(ListEntry, FSP_FILE_SYSTEM_ASYNC_CONTEXT, ListEntry);
+            if (FspFileSystemAsyncPending != AsyncContext->State ||
+                0 == AsyncContext->ExpirationTime)
+                continue;
+            if (AsyncContext->ExpirationTime <= Now)
+            {
+                AsyncContext->State = FspFileSystemAsyncDone;
+                RemoveEntryList(ListEntry);
+                Async->OutstandingCount--;
+                InsertTailList(&ExpiredList, ListEntry);
+            }
+            else if (0 == NextDueTime || AsyncContext->ExpirationTime < NextDueTime)
+                NextDueTime = AsyncContext->ExpirationTime;
+        }
+
+        /* the timer list is sorted by due time */
+        while (&Async->TimerList != (ListEntry = Async->TimerList.Flink))
+        {
+            AsyncContext = CONTAINING_RECORD(ListEntry, FSP_FILE_SYSTEM_ASYNC_CONTEXT, TimerEntry);
+            if (AsyncContext->DueTime > Now)
+            {
+                if (0 == NextDueTime || AsyncContext->DueTime < NextDueTime)
+                    NextDueTime = AsyncContext->DueTime;
+                break;
+            }
+            RemoveEntryList(ListEntry);
+            FspWorkQueuePost(Async->WorkQueue, &AsyncContext->WorkItem, FALSE);
+        }
+
+        Async->NextDueTime = NextDueTime;
+
+        ReleaseSRWLockExclusive(&Async->Lock);
+
+        /* the expired contexts are Done; only their owners may touch them from now on */
+        for (ListEntry = ExpiredList.Flink; &ExpiredList != ListEntry; ListEntry = NextEntry)
+        {
+            NextEntry = ListEntry->Flink;
+            AsyncContext = CONTAINING_RECORD(ListEntry, FSP_FILE_SYSTEM_ASYNC_CONTEXT, ListEntry);
+            FspFileSystemAsyncSendStatus(AsyncContext, STATUS_IO_TIMEOUT);
+        }
+
+        Timeout = 0 != NextDueTime ? (DWORD)(NextDueTime - Now) : INFINITE;
+    }
+
+    return 0;
+}
+
+NTSTATUS FspFileSystemAsyncCreate(FSP_FILE_SYSTEM *FileSystem, ULONG ThreadCount,
+    PVOID *PAsync)
+{
+    FSP_FILE_SYSTEM_ASYNC *Async = 0;
+    NTSTATUS Result;
+
+    *PAsync = 0;
+
+    Async = MemAlloc(sizeof *Async);
+    if (0 == Async)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto fail;
+    }
+    memset(Async, 0, sizeof *Async);
+
+    Async->FileSystem = FileSystem;
+    InitializeSRWLock(&Async->Lock);
+    InitializeListHead(&Async->OutstandingList);
+    InitializeListHead(&Async->TimerList);
+
+    Async->Event = CreateEventW(0, FALSE, FALSE, 0);
+    if (0 == Async->Event)
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto fail;
+    }
+
+    Result = FspWorkQueueCreate(ThreadCount, 0, &Async->WorkQueue);
+    if (!NT_SUCCESS(Result))
+        goto fail;
+
+    Async->Thread = CreateThread(0, 0, FspFileSystemAsyncThread, Async, 0, 0);
+    if (0 == Async->Thread)
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto fail;
+    }
+
+    *PAsync = Async;
+
+    return STATUS_SUCCESS;
+
+fail:
+    if (0 != Async)
+    {
+        if (0 != Async->WorkQueue)
+            FspWorkQueueDelete(Async->WorkQueue);
+        if (0 != Async->Event)
+            CloseHandle(Async->Event);
+        MemFree(Async);
+    }
+
+    return Result;
+}
+
+VOID FspFileSystemAsyncDelete(PVOID Async0)
+{
+    FSP_FILE_SYSTEM_ASYNC *Async = Async0;
+    FSP_FILE_SYSTEM_ASYNC_CONTEXT *AsyncContext;
+    PLIST_ENTRY ListEntry, NextEntry;
+
+    InterlockedExchange(&Async->Stopped, 1);
+    SetEvent(Async->Event);
+    WaitForSingleObject(Async->Thread, INFINITE);
+    CloseHandle(Async->Thread);
+
+    /*
+     * The dispatcher has been stopped, so there is nobody to send responses to.
+     * Mark all pending contexts Done and run their delayed routines as cancelled.
+     */
+    AcquireSRWLockExclusive(&Async->Lock);
+    for (ListEntry = Async->OutstandingList.Flink;
+        &Async->OutstandingList != ListEntry;
+        ListEntry = NextEntry)
+    {
+        NextEntry = ListEntry->Flink;
+        AsyncContext = CONTAINING_RECORD(ListEntry, FSP_FILE_SYSTEM_ASYNC_CONTEXT, ListEntry);
+        if (FspFileSystemAsyncPending != AsyncContext->State)
+            continue;
+        AsyncContext->State = FspFileSystemAsyncDone;
+        RemoveEntryList(ListEntry);
+        Async->OutstandingCount--;
+    }
+    while (&Async->TimerList != (ListEntry = Async->TimerList.Flink))
+    {
+        RemoveEntryList(ListEntry);
+        AsyncContext = CONTAINING_RECORD(ListEntry, FSP_FILE_SYSTEM_ASYNC_CONTEXT, TimerEntry);
+        FspWorkQueuePost(Async->WorkQueue, &AsyncContext->WorkItem, FALSE);
+    }
+    ReleaseSRWLockExclusive(&Async->Lock);
+
+    /* runs or cancels all posted routines; they may still complete Running contexts */
+    FspWorkQueueDelete(Async->WorkQueue);
+
+    CloseHandle(Async->Event);
+    MemFree(Async);
+}
+
+FSP_API NTSTATUS FspFileSystemAsyncBegin(FSP_FILE_SYSTEM *FileSystem, ULONG Timeout,
+    FSP_FILE_SYSTEM_ASYNC_CONTEXT **PAsyncContext)
+{
+    FSP_FILE_SYSTEM_ASYNC *Async = FileSystem->Async;
+    FSP_FILE_SYSTEM_OPERATION_CONTEXT *OperationContext;
+    FSP_FILE_SYSTEM_ASYNC_CONTEXT *AsyncContext;
+
+    *PAsyncContext = 0;
+
+    if (0 == Async)
+        return STATUS_INVALID_DEVICE_STATE;
+
+    OperationContext = FspFileSystemGetOperationContext();
+    if (0 == OperationContext || 0 == OperationContext->Request)
+        return STATUS_INVALID_DEVICE_STATE;
+
+    switch (OperationContext->Request->Kind)
+    {
+    case FspFsctlTransactReadKind:
+    case FspFsctlTransactWriteKind:
+    case FspFsctlTransactQueryDirectoryKind:
+        break;
+    default:
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    AsyncContext = MemAlloc(sizeof *AsyncContext);
+    if (0 == AsyncContext)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    memset(AsyncContext, 0, sizeof *AsyncContext);
+
+    AsyncContext->WorkItem.Routine = FspFileSystemAsyncWorkRoutine;
+    AsyncContext->Async = Async;
+    AsyncContext->FileSystem = FileSystem;
+    AsyncContext->Hint = OperationContext->Request->Hint;
+    AsyncContext->Kind = OperationContext->Request->Kind;
+    AsyncContext->State = FspFileSystemAsyncPending;
+    if (0 != Timeout && INFINITE != Timeout)
+        AsyncContext->ExpirationTime = GetTickCount64() + Timeout;
+
+    AcquireSRWLockExclusive(&Async->Lock);
+    InsertTailList(&Async->OutstandingList, &AsyncContext->ListEntry);
+    Async->OutstandingCount++;
+    if (0 != AsyncContext->ExpirationTime)
+        FspFileSystemAsyncScheduleNoLock(Async, AsyncContext->ExpirationTime);
+    ReleaseSRWLockExclusive(&Async->Lock);
+
+    *PAsyncContext = AsyncContext;
+
+    return STATUS_SUCCESS;
+}
+
+FSP_API NTSTATUS FspFileSystemAsyncPost(FSP_FILE_SYSTEM_ASYNC_CONTEXT *AsyncContext,
+    ULONG Delay, FSP_FILE_SYSTEM_ASYNC_ROUTINE *Routine, PVOID Context)
+{
+    FSP_FILE_SYSTEM_ASYNC *Async = AsyncContext->Async;
+    PLIST_ENTRY ListEntry;
+
+    if (FspFileSystemAsyncPending != AsyncContext->State || 0 != AsyncContext->Routine)
+        return STATUS_INVALID_PARAMETER;
+
+    AsyncContext->Routine = Routine;
+    AsyncContext->Context = Context;
+
+    if (0 == Delay)
+    {
+        FspWorkQueuePost(Async->WorkQueue, &AsyncContext->WorkItem, FALSE);
+        return STATUS_SUCCESS;
+    }
+
+    AsyncContext->DueTime = GetTickCount64() + Delay;
+
+    AcquireSRWLockExclusive(&Async->Lock);
+    /* most delays are similar, so search for the insertion point from the tail */
+    for (ListEntry = Async->TimerList.Blink;
+        &Async->TimerList != ListEntry &&
+            CONTAINING_RECORD(ListEntry, FSP_FILE_SYSTEM_ASYNC_CONTEXT, TimerEntry)->DueTime >
+                AsyncContext->DueTime;
+        ListEntry = ListEntry->Blink)
+        ;
+    InsertHeadList(ListEntry, &AsyncContext->TimerEntry);
+    FspFileSystemAsyncScheduleNoLock(Async, AsyncContext->DueTime);
+    ReleaseSRWLockExclusive(&Async->Lock);
+
+    return STATUS_SUCCESS;
+}
+
+FSP_API BOOLEAN FspFileSystemAsyncClaim(FSP_FILE_SYSTEM_ASYNC_CONTEXT *AsyncContext)
+{
+    FSP_FILE_SYSTEM_ASYNC *Async = AsyncContext->Async;
+    BOOLEAN Result;
+
+    if (FspFileSystemAsyncDone == AsyncContext->State)
+        return FALSE;
+
+    AcquireSRWLockExclusive(&Async->Lock);
+    Result = FspFileSystemAsyncDone != AsyncContext->State;
+    if (Result)
+        AsyncContext->State = FspFileSystemAsyncRunning;
+    ReleaseSRWLockExclusive(&Async->Lock);
+
+    return Result;
+}
+
+FSP_API BOOLEAN FspFileSystemAsyncCancel(FSP_FILE_SYSTEM_ASYNC_CONTEXT *AsyncContext)
+{
+    FSP_FILE_SYSTEM_ASYNC *Async = AsyncContext->Async;
+    BOOLEAN Result;
+
+    if (FspFileSystemAsyncPending != AsyncContext->State)
+        return FALSE;
+
+    AcquireSRWLockExclusive(&Async->Lock);
+    Result = FspFileSystemAsyncPending == AsyncContext->State;
+    if (Result)
+    {
+        AsyncContext->State = FspFileSystemAsyncDone;
+        RemoveEntryList(&AsyncContext->ListEntry);
+        Async->OutstandingCount--;
+    }
+    ReleaseSRWLockExclusive(&Async->Lock);
+
+    if (Result)
+        FspFileSystemAsyncSendStatus(AsyncContext, STATUS_CANCELLED);
+
+    return Result;
+}
+
+FSP_API ULONG FspFileSystemAsyncOutstandingCount(FSP_FILE_SYSTEM *FileSystem)
+{
+    FSP_FILE_SYSTEM_ASYNC *Async = FileSystem->Async;
+    ULONG Result;
+
+    if (0 == Async)
+        return 0;
+
+    AcquireSRWLockShared(&Async->Lock);
+    Result = Async->OutstandingCount;
+    ReleaseSRWLockShared(&Async->Lock);
+
+    return Result;
+}
+
+FSP_API NTSTATUS FspFileSystemAsyncComplete(FSP_FILE_SYSTEM_ASYNC_CONTEXT *AsyncContext,
+    FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    FSP_FILE_SYSTEM_ASYNC *Async = AsyncContext->Async;
+    BOOLEAN Done;
+
+    Done = FspFileSystemAsyncDone == AsyncContext->State;
+    if (!Done)
+    {
+        AcquireSRWLockExclusive(&Async->Lock);
+        Done = FspFileSystemAsyncDone == AsyncContext->State;
+        if (!Done)
+        {
+            AsyncContext->State = FspFileSystemAsyncDone;
+            RemoveEntryList(&AsyncContext->ListEntry);
+            Async->OutstandingCount--;
+        }
+        ReleaseSRWLockExclusive(&Async->Lock);
+    }
+
+    if (!Done)
+    {
+        Response->Kind = AsyncContext->Kind;
+        Response->Hint = AsyncContext->Hint;
+        if (0 == Response->Size)
+            Response->Size = sizeof *Response;
+        FspFileSystemSendResponse(AsyncContext->FileSystem, Response);
+    }
+
+    MemFree(AsyncContext);
+
+    return Done ? STATUS_CANCELLED : STATUS_SUCCESS;
+}
+
+FSP_API NTSTATUS FspFileSystemAsyncCompleteRead(FSP_FILE_SYSTEM_ASYNC_CONTEXT *AsyncContext,
+    NTSTATUS Status, ULONG BytesTransferred)
+{
+    FSP_FSCTL_TRANSACT_RSP Response;
+
+    memset(&Response, 0, sizeof Response);
+    Response.Size = sizeof Response;
+    Response.IoStatus.Status = Status;
+    if (NT_SUCCESS(Status))
+        Response.IoStatus.Information = BytesTransferred;
+    return FspFileSystemAsyncComplete(AsyncContext, &Response);
+}
+
+FSP_API NTSTATUS FspFileSystemAsyncCompleteWrite(FSP_FILE_SYSTEM_ASYNC_CONTEXT *AsyncContext,
+    NTSTATUS Status, ULONG BytesTransferred, const FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    FSP_FSCTL_TRANSACT_RSP Response;
+
+    memset(&Response, 0, sizeof Response);
+    Response.Size = sizeof Response;
+    Response.IoStatus.Status = Status;
+    if (NT_SUCCESS(Status))
+    {
+        Response.IoStatus.Information = BytesTransferred;
+        if (0 != FileInfo)
+            memcpy(&Response.Rsp.Write.FileInfo, FileInfo, sizeof *FileInfo);
+    }
+    return FspFileSystemAsyncComplete(AsyncContext, &Response);
+}
+
+FSP_API NTSTATUS FspFileSystemAsyncCompleteReadDirectory(FSP_FILE_SYSTEM_ASYNC_CONTEXT *AsyncContext,
+    NTSTATUS Status, ULONG BytesTransferred)
+{
+    FSP_FSCTL_TRANSACT_RSP Response;
+
+    memset(&Response, 0, sizeof Response);
+    Response.Size = sizeof Response;
+    Response.IoStatus.Status = Status;
+    if (NT_SUCCESS(Status))
+        Response.IoStatus.Information = BytesTransferred;
+    return FspFileSystemAsyncComplete(AsyncContext, &Response);
+}
@@ -29,24 +29,65 @@
         return B;                       \
     } while (0,0)
 
+typedef struct _FSP_FILE_SYSTEM_DIRECTORY_SNAPSHOT FSP_FILE_SYSTEM_DIRECTORY_SNAPSHOT;
+
 typedef struct
 {
     SRWLOCK Lock;
     ULONG Capacity, LoMark, HiMark;
     PUINT8 Buffer;
+    FSP_FILE_SYSTEM_DIRECTORY_SNAPSHOT *Snapshot;   /* non-0 if part of a snapshot */
 } FSP_FILE_SYSTEM_DIRECTORY_BUFFER;
 
-static int FspFileSystemDirectoryBufferFileNameCmp(PWSTR a, int alen, PWSTR b, int blen)
+/*
+ * Directory snapshots.
+ *
+ * A snapshot is a directory buffer that is shared (read-only once built) by all handles
+ * that enumerate the same directory. Snapshots are kept in a small cache keyed by the
+ * directory identity and a change generation supplied by the file system; a snapshot
+ * with a different generation replaces any cached snapshot of the same directory. The
+ * cache holds one reference to each of its snapshots and every handle holds another.
+ *
+ * The handle that creates a snapshot builds it using FspFileSystemFillDirectoryBuffer and
+ * FspFileSystemReleaseDirectoryBuffer. Other handles block in ReadDirectoryBuffer until it
+ * is complete, unless the snapshot is streaming: the file system promises to fill entries
+ * in sorted order, so every filled entry is immediately published and readers can return
+ * pages while the enumeration is still in progress. If an entry arrives out of order the
+ * snapshot stops publishing and is sorted normally when released.
+ */
+struct _FSP_FILE_SYSTEM_DIRECTORY_SNAPSHOT
+{
+    FSP_FILE_SYSTEM_DIRECTORY_BUFFER DirBuffer;
+    FSP_FILE_SYSTEM_DIRECTORY_SNAPSHOT *HashNext;
+    LIST_ENTRY LruEntry;
+    UINT64 DirectoryId, Generation;
+    volatile LONG RefCount;
+    CONDITION_VARIABLE CompleteCond;
+    BOOLEAN Streaming, Complete, Cached;
+    ULONG PublishedCount;               /* streaming: entries filled so far in sorted order */
+};
+
+enum
+{
+    FspFileSystemDirectorySnapshotBucketCount = 61,
+    FspFileSystemDirectorySnapshotCountMax = 64,
+};
+
+typedef struct
 {
-    int len, res;
+    SRWLOCK Lock;
+    ULONG Count;
+    LIST_ENTRY LruList;                 /* least recently acquired first */
+    FSP_FILE_SYSTEM_DIRECTORY_SNAPSHOT *Buckets[FspFileSystemDirectorySnapshotBucketCount];
+} FSP_FILE_SYSTEM_DIRECTORY_SNAPSHOT_CACHE;
 
+static int FspFileSystemDirectoryBufferFileNameCmp(PWSTR a, int alen, PWSTR b, int blen)
+{
     if (-1 == alen)
         alen = (int)lstrlenW(a);
     if (-1 == blen)
         blen = (int)lstrlenW(b);
 
-    len = alen < blen ? alen : blen;
-
     /* order "." and ".." first */
     switch (alen)
     {
@@ -73,12 +114,7 @@ static int FspFileSystemDirectoryBufferFileNameCmp(PWSTR a, int alen, PWSTR b, i
         break;
     }
 
-    res = invariant_wcsncmp(a, b, len);
-
-    if (0 == res)
-        res = alen - blen;
-
-    return res;
+    return FspNameCompare(a, alen, b, blen, FALSE);
 }
 
 /*
@@ -215,13 +251,161 @@ static VOID FspFileSystemQSortDirectoryBuffer(PUINT8 Buffer, PULONG Index, int l
 #undef compexch
 #undef exch
 
+/*
+ * Merge sort on cached name prefixes
+ *
+ * The quick sort above follows an Index offset into the buffer and performs a full name
+ * comparison for every comparison, which is cache-hostile for large directories. For those
+ * we copy the first few characters of every name into a side array of fixed-width keys that
+ * compare as integers in the same order as FspFileSystemDirectoryBufferFileNameCmp. Most
+ * comparisons are then resolved within the side array; only prefix ties compare full names,
+ * which goes through FspNameCompare and its SSE2 block comparison on x86 and x64.
+ *
+ * The side array is sorted using a bottom-up (stable, non-recursive) merge sort over runs
+ * produced by insertion sort. Runs that are already in order are copied without merging,
+ * so presorted input (the common case for many file systems) sorts in linear time.
+ */
+
+enum
+{
+    FspFileSystemDirectoryBufferKeyLength = 8,
+    FspFileSystemDirectoryBufferMergeSortThreshold = 64,
+    FspFileSystemDirectoryBufferMergeSortRunLength = 16,
+};
+
+typedef struct
+{
+    UINT64 Key[2];
+    ULONG Offset;
+} FSP_FILE_SYSTEM_DIRECTORY_BUFFER_SORT_ENTRY;
+
+static inline VOID FspFileSystemDirectoryBufferSortKey(PUINT8 Buffer, ULONG Offset,
+    FSP_FILE_SYSTEM_DIRECTORY_BUFFER_SORT_ENTRY *Entry)
+{
+    FSP_FSCTL_DIR_INFO *DirInfo = (FSP_FSCTL_DIR_INFO *)(Buffer + Offset);
+    PWSTR FileName = DirInfo->FileNameBuf;
+    ULONG FileNameLen = (DirInfo->Size - sizeof *DirInfo) / sizeof(WCHAR);
+    UINT64 Key;
+    ULONG I, J;
+
+    /* order "." and ".." first */
+    switch (FileNameLen)
+    {
+    case 1:
+        if (L'.' == FileName[0])
+            FileName = L"\1";
+        break;
+    case 2:
+        if (L'.' == FileName[0] && L'.' == FileName[1])
+            FileName = L"\1\1";
+        break;
+    }
+
+    /* pack characters high to low; missing characters are 0 and order shorter names first */
+    for (I = 0; 2 > I; I++)
+    {
+        Key = 0;
+        for (J = I * 4; (I + 1) * 4 > J; J++)
+            Key = (Key << 16) | (J < FileNameLen ? (UINT16)FileName[J] : 0);
+        Entry->Key[I] = Key;
+    }
+    Entry->Offset = Offset;
+}
+
+static __forceinline
+int FspFileSystemDirectoryBufferSortLess(PUINT8 Buffer,
+    FSP_FILE_SYSTEM_DIRECTORY_BUFFER_SORT_ENTRY *a, FSP_FILE_SYSTEM_DIRECTORY_BUFFER_SORT_ENTRY *b)
+{
+    if (a->Key[0] != b->Key[0])
+        return a->Key[0] < b->Key[0];
+    if (a->Key[1] != b->Key[1])
+        return a->Key[1] < b->Key[1];
+    return FspFileSystemDirectoryBufferLess(Buffer, a->Offset, b->Offset);
+}
+
+static FSP_FILE_SYSTEM_DIRECTORY_BUFFER_SORT_ENTRY *FspFileSystemMergeSortDirectoryBuffer(
+    PUINT8 Buffer,
+    FSP_FILE_SYSTEM_DIRECTORY_BUFFER_SORT_ENTRY *Entries,
+    FSP_FILE_SYSTEM_DIRECTORY_BUFFER_SORT_ENTRY *Scratch,
+    ULONG Count)
+{
+    FSP_FILE_SYSTEM_DIRECTORY_BUFFER_SORT_ENTRY *Src, *Dst, *Tmp, Entry;
+    ULONG Width, L, M, R, I, J, K;
+
+    for (L = 0; Count > L; L = R)
+    {
+        R = Count - L > FspFileSystemDirectoryBufferMergeSortRunLength ?
+            L + FspFileSystemDirectoryBufferMergeSortRunLength : Count;
+        for (I = L + 1; R > I; I++)
+        {
+            Entry = Entries[I];
+            for (J = I; L < J && FspFileSystemDirectoryBufferSortLess(Buffer, &Entry, &Entries[J - 1]); J--)
+                Entries[J] = Entries[J - 1];
+            Entries[J] = Entry;
+        }
+    }
+
+    Src = Entries;
+    Dst = Scratch;
+    for (Width = FspFileSystemDirectoryBufferMergeSortRunLength; Count > Width; Width *= 2)
+    {
+        for (L = 0; Count > L; L = R)
+        {
+            M = Count - L > Width ? L + Width : Count;
+            R = Count - M > Width ? M + Width : Count;
+
+            if (M == R || !FspFileSystemDirectoryBufferSortLess(Buffer, &Src[M], &Src[M - 1]))
+            {
+                /* runs already in order */
+                memcpy(Dst + L, Src + L, (R - L) * sizeof *Src);
+                continue;
+            }
+
+            for (I = L, J = M, K = L; M > I && R > J; K++)
+                if (FspFileSystemDirectoryBufferSortLess(Buffer, &Src[J], &Src[I]))
+                    Dst[K] = Src[J++];
+                else
+                    Dst[K] = Src[I++];
+            if (M > I)
+                memcpy(Dst + K, Src + I, (M - I) * sizeof *Src);
+            else if (R > J)
+                memcpy(Dst + K, Src + J, (R - J) * sizeof *Src);
+        }
+
+        Tmp = Src;
+        Src = Dst;
+        Dst = Tmp;
+    }
+
+    return Src;
+}
+
 static inline VOID FspFileSystemSortDirectoryBuffer(FSP_FILE_SYSTEM_DIRECTORY_BUFFER *DirBuffer)
 {
     PUINT8 Buffer = DirBuffer->Buffer;
     PULONG Index = (PULONG)(DirBuffer->Buffer + DirBuffer->HiMark);
     ULONG Count = (DirBuffer->Capacity - DirBuffer->HiMark) / sizeof(ULONG);
+    FSP_FILE_SYSTEM_DIRECTORY_BUFFER_SORT_ENTRY *Entries, *Sorted;
+    ULONG I;
+
+    Entries = FspFileSystemDirectoryBufferMergeSortThreshold <= Count ?
+        MemAlloc(2 * Count * sizeof *Entries) : 0;
+    if (0 == Entries)
+    {
+        /* small directory or out of memory: sort in place */
+        FspFileSystemQSortDirectoryBuffer(Buffer, Index, 0, Count - 1);
+        return;
+    }
+
+    for (I = 0; Count > I; I++)
+        FspFileSystemDirectoryBufferSortKey(Buffer, Index[I], &Entries[I]);
+
+    Sorted = FspFileSystemMergeSortDirectoryBuffer(Buffer, Entries, Entries + Count, Count);
+
+    for (I = 0; Count > I; I++)
+        Index[I] = Sorted[I].Offset;
 
-    FspFileSystemQSortDirectoryBuffer(Buffer, Index, 0, Count - 1);
+    MemFree(Entries);
 }
 
 FSP_API BOOLEAN FspFileSystemAcquireDirectoryBuffer(PVOID *PDirBuffer,
@@ -256,6 +440,10 @@ FSP_API BOOLEAN FspFileSystemAcquireDirectoryBuffer(PVOID *PDirBuffer,
         MemFree(NewDirBuffer);
     }
 
+    if (0 != DirBuffer->Snapshot)
+        /* snapshots are acquired using FspFileSystemAcquireDirectorySnapshot */
+        RETURN(STATUS_INVALID_PARAMETER, FALSE);
+
     if (Reset)
     {
         AcquireSRWLockExclusive(&DirBuffer->Lock);
@@ -269,18 +457,12 @@ FSP_API BOOLEAN FspFileSystemAcquireDirectoryBuffer(PVOID *PDirBuffer,
     RETURN(STATUS_SUCCESS, FALSE);
 }
 
-FSP_API BOOLEAN FspFileSystemFillDirectoryBuffer(PVOID *PDirBuffer,
+static BOOLEAN FspFileSystemFillDirectoryBufferNoLock(FSP_FILE_SYSTEM_DIRECTORY_BUFFER *DirBuffer,
     FSP_FSCTL_DIR_INFO *DirInfo, PNTSTATUS PResult)
 {
-    /* assume that FspFileSystemAcquireDirectoryBuffer has been called */
-
-    FSP_FILE_SYSTEM_DIRECTORY_BUFFER *DirBuffer = *PDirBuffer;
     ULONG Capacity, LoMark, HiMark;
     PUINT8 Buffer;
 
-    if (0 == DirInfo)
-        RETURN(STATUS_INVALID_PARAMETER, FALSE);
-
     for (;;)
     {
         LoMark = DirBuffer->LoMark;
@@ -329,16 +511,187 @@ FSP_API BOOLEAN FspFileSystemFillDirectoryBuffer(PVOID *PDirBuffer,
     }
 }
 
+static inline FSP_FSCTL_DIR_INFO *FspFileSystemDirectorySnapshotEntry(
+    FSP_FILE_SYSTEM_DIRECTORY_BUFFER *DirBuffer, ULONG I)
+{
+    /* I-th filled entry; the index grows downwards, so it is stored in reverse fill order */
+    PULONG IndexEnd = (PULONG)(DirBuffer->Buffer + DirBuffer->Capacity);
+    return (PVOID)(DirBuffer->Buffer + IndexEnd[-1 - (LONG)I]);
+}
+
+static VOID FspFileSystemPublishDirectorySnapshotEntry(FSP_FILE_SYSTEM_DIRECTORY_SNAPSHOT *Snapshot)
+{
+    FSP_FILE_SYSTEM_DIRECTORY_BUFFER *DirBuffer = &Snapshot->DirBuffer;
+    ULONG Count = (DirBuffer->Capacity - DirBuffer->HiMark) / sizeof(ULONG);
+    FSP_FSCTL_DIR_INFO *PrevDirInfo, *DirInfo;
+
+    if (Snapshot->PublishedCount + 1 != Count)
+        return; /* an earlier entry was out of order */
+
+    if (1 < Count)
+    {
+        PrevDirInfo = FspFileSystemDirectorySnapshotEntry(DirBuffer, Count - 2);
+        DirInfo = FspFileSystemDirectorySnapshotEntry(DirBuffer, Count - 1);
+        if (0 <= FspFileSystemDirectoryBufferFileNameCmp(
+            PrevDirInfo->FileNameBuf, (PrevDirInfo->Size - sizeof *PrevDirInfo) / sizeof(WCHAR),
+            DirInfo->FileNameBuf, (DirInfo->Size - sizeof *DirInfo) / sizeof(WCHAR)))
+            return;
+    }
+
+    Snapshot->PublishedCount = Count;
+}
+
+FSP_API BOOLEAN FspFileSystemFillDirectoryBuffer(PVOID *PDirBuffer,
+    FSP_FSCTL_DIR_INFO *DirInfo, PNTSTATUS PResult)
+{
+    /* assume that FspFileSystemAcquireDirectoryBuffer has been called */
+
+    FSP_FILE_SYSTEM_DIRECTORY_BUFFER *DirBuffer = *PDirBuffer;
+    FSP_FILE_SYSTEM_DIRECTORY_SNAPSHOT *Snapshot = DirBuffer->Snapshot;
+    NTSTATUS Result;
+    BOOLEAN Success;
+
+    if (0 == DirInfo)
+        RETURN(STATUS_INVALID_PARAMETER, FALSE);
+
+    if (0 == Snapshot || !Snapshot->Streaming)
+        return FspFileSystemFillDirectoryBufferNoLock(DirBuffer, DirInfo, PResult);
+
+    /* streaming snapshot: readers may be reading concurrently */
+    AcquireSRWLockExclusive(&DirBuffer->Lock);
+    Success = FspFileSystemFillDirectoryBufferNoLock(DirBuffer, DirInfo, &Result);
+    if (Success)
+        FspFileSystemPublishDirectorySnapshotEntry(Snapshot);
+    ReleaseSRWLockExclusive(&DirBuffer->Lock);
+    if (Success)
+        WakeAllConditionVariable(&Snapshot->CompleteCond);
+
+    RETURN(Result, Success);
+}
+
+static BOOLEAN FspFileSystemReserveDirectoryBufferNoLock(FSP_FILE_SYSTEM_DIRECTORY_BUFFER *DirBuffer,
+    ULONG Size, PNTSTATUS PResult)
+{
+    ULONG Capacity, IndexSize, NewHiMark;
+    PUINT8 Buffer;
+
+    if (DirBuffer->HiMark - DirBuffer->LoMark >= Size)
+        RETURN(STATUS_SUCCESS, TRUE);
+
+    IndexSize = DirBuffer->Capacity - DirBuffer->HiMark;
+    if (Size > MAXULONG / 2 - DirBuffer->LoMark - IndexSize)
+        RETURN(STATUS_INSUFFICIENT_RESOURCES, FALSE);
+
+    /* grow once to the next capacity (same progression as FillDirectoryBuffer) that fits */
+    Capacity = 0 != DirBuffer->Capacity ? DirBuffer->Capacity : 512;
+    while (Capacity - DirBuffer->LoMark - IndexSize < Size)
+        Capacity *= 2;
+
+    Buffer = MemRealloc(DirBuffer->Buffer, Capacity);
+    if (0 == Buffer)
+        RETURN(STATUS_INSUFFICIENT_RESOURCES, FALSE);
+
+    NewHiMark = Capacity - IndexSize;
+    memmove(Buffer + NewHiMark, Buffer + DirBuffer->HiMark, IndexSize);
+
+    DirBuffer->Capacity = Capacity;
+    DirBuffer->HiMark = NewHiMark;
+    DirBuffer->Buffer = Buffer;
+
+    RETURN(STATUS_SUCCESS, TRUE);
+}
+
+FSP_API BOOLEAN FspFileSystemFillDirectoryBufferBulk(PVOID *PDirBuffer,
+    PVOID DirInfoBuffer, ULONG Length, ULONG SizeHint, PNTSTATUS PResult)
+{
+    /* assume that FspFileSystemAcquireDirectoryBuffer has been called */
+
+    FSP_FILE_SYSTEM_DIRECTORY_BUFFER *DirBuffer = *PDirBuffer;
+    FSP_FILE_SYSTEM_DIRECTORY_SNAPSHOT *Snapshot = DirBuffer->Snapshot;
+    BOOLEAN Streaming = 0 != Snapshot && Snapshot->Streaming;
+    PUINT8 P, EndP, Buffer;
+    ULONG DirInfoSize, Size, Count, LoMark, HiMark;
+    NTSTATUS Result;
+
+    /* validate the entries and compute the space they need in a single pass */
+    Size = 0;
+    Count = 0;
+    for (P = DirInfoBuffer, EndP = P + Length;
+        sizeof(UINT16) <= (ULONG)(EndP - P);
+        P += FSP_FSCTL_DEFAULT_ALIGN_UP(DirInfoSize))
+    {
+        DirInfoSize = ((FSP_FSCTL_DIR_INFO *)P)->Size;
+        if (0 == DirInfoSize)
+            break;
+        if (sizeof(FSP_FSCTL_DIR_INFO) > DirInfoSize || (ULONG)(EndP - P) < DirInfoSize)
+            RETURN(STATUS_INVALID_PARAMETER, FALSE);
+        Size += FSP_FSCTL_DEFAULT_ALIGN_UP(DirInfoSize) + sizeof(ULONG);
+        Count++;
+    }
+    EndP = P;
+
+    if (0 == Count)
+        RETURN(STATUS_SUCCESS, TRUE);
+
+    if (Streaming)
+        AcquireSRWLockExclusive(&DirBuffer->Lock);
+
+    /* on first fill honor the caller's estimate for the whole enumeration */
+    if (!FspFileSystemReserveDirectoryBufferNoLock(DirBuffer,
+        0 == DirBuffer->Capacity && SizeHint > Size ? SizeHint : Size, &Result))
+    {
+        if (Streaming)
+            ReleaseSRWLockExclusive(&DirBuffer->Lock);
+        RETURN(Result, FALSE);
+    }
+
+    Buffer = DirBuffer->Buffer;
+    LoMark = DirBuffer->LoMark;
+    HiMark = DirBuffer->HiMark;
+    for (P = DirInfoBuffer; EndP > P; P += FSP_FSCTL_DEFAULT_ALIGN_UP(DirInfoSize))
+    {
+        DirInfoSize = ((FSP_FSCTL_DIR_INFO *)P)->Size;
+        memcpy(Buffer + LoMark, P, DirInfoSize);
+        HiMark -= sizeof(ULONG);
+        *(PULONG)(Buffer + HiMark) = LoMark;
+        LoMark += FSP_FSCTL_DEFAULT_ALIGN_UP(DirInfoSize);
+
+        if (Streaming)
+        {
+            DirBuffer->LoMark = LoMark;
+            DirBuffer->HiMark = HiMark;
+            FspFileSystemPublishDirectorySnapshotEntry(Snapshot);
+        }
+    }
+    DirBuffer->LoMark = LoMark;
+    DirBuffer->HiMark = HiMark;
+
+    if (Streaming)
+    {
+        ReleaseSRWLockExclusive(&DirBuffer->Lock);
+        WakeAllConditionVariable(&Snapshot->CompleteCond);
+    }
+
+    RETURN(STATUS_SUCCESS, TRUE);
+}
+
 FSP_API VOID FspFileSystemReleaseDirectoryBuffer(PVOID *PDirBuffer)
 {
     /* assume that FspFileSystemAcquireDirectoryBuffer has been called */
 
     FSP_FILE_SYSTEM_DIRECTORY_BUFFER *DirBuffer = *PDirBuffer;
+    FSP_FILE_SYSTEM_DIRECTORY_SNAPSHOT *Snapshot = DirBuffer->Snapshot;
+    BOOLEAN Sorted = FALSE;
+
+    if (0 != Snapshot && Snapshot->Streaming)
+        AcquireSRWLockExclusive(&DirBuffer->Lock);
 
     /* eliminate invalidated entries from the index */
     PULONG Index = (PULONG)(DirBuffer->Buffer + DirBuffer->HiMark);
     ULONG Count = (DirBuffer->Capacity - DirBuffer->HiMark) / sizeof(ULONG);
     ULONG I, J;
+    if (0 != Snapshot && Snapshot->Streaming && Snapshot->PublishedCount == Count)
+        Sorted = TRUE;
     for (I = Count - 1, J = Count; I < Count; I--)
     {
         if (FspFileSystemDirectoryBufferEntryInvalid == Index[I])
@@ -347,9 +700,90 @@ FSP_API VOID FspFileSystemReleaseDirectoryBuffer(PVOID *PDirBuffer)
     }
     DirBuffer->HiMark = (ULONG)((PUINT8)&Index[J] - DirBuffer->Buffer);
 
-    FspFileSystemSortDirectoryBuffer(DirBuffer);
+    if (Sorted)
+    {
+        /* entries were filled in order; the index is in reverse order */
+        Index = (PULONG)(DirBuffer->Buffer + DirBuffer->HiMark);
+        Count = (DirBuffer->Capacity - DirBuffer->HiMark) / sizeof(ULONG);
+        for (I = 0, J = Count - 1; Count > 0 && I < J; I++, J--)
+        {
+            ULONG T = Index[I];
+            Index[I] = Index[J];
+            Index[J] = T;
+        }
+    }
+    else
+        FspFileSystemSortDirectoryBuffer(DirBuffer);
+
+    if (0 != Snapshot)
+        Snapshot->Complete = TRUE;
 
     ReleaseSRWLockExclusive(&DirBuffer->Lock);
+
+    if (0 != Snapshot)
+        WakeAllConditionVariable(&Snapshot->CompleteCond);
+}
+
+static BOOLEAN FspFileSystemReadDirectorySnapshotStreaming(
+    FSP_FILE_SYSTEM_DIRECTORY_SNAPSHOT *Snapshot,
+    PWSTR Marker,
+    PVOID Buffer, ULONG Length, PULONG PBytesTransferred)
+{
+    /*
+     * Assume that the snapshot lock is held shared. Return the published entries past
+     * Marker without an end-of-directory marker (the FSD will ask for more). Wait for
+     * the snapshot to publish more entries or to complete, in which case return FALSE.
+     */
+    FSP_FILE_SYSTEM_DIRECTORY_BUFFER *DirBuffer = &Snapshot->DirBuffer;
+    FSP_FSCTL_DIR_INFO *DirInfo;
+    int MarkerLen = 0 != Marker ? lstrlenW(Marker) : 0;
+    int Lo, Hi, Mi, CmpResult;
+    ULONG IndexNum, PublishedCount;
+
+    for (;;)
+    {
+        if (Snapshot->Complete)
+            return FALSE;
+
+        PublishedCount = Snapshot->PublishedCount;
+        IndexNum = 0;
+        if (0 != Marker)
+        {
+            Lo = 0, Hi = (int)PublishedCount - 1;
+            while (Lo <= Hi)
+            {
+                Mi = (unsigned)(Lo + Hi) >> 1;
+                DirInfo = FspFileSystemDirectorySnapshotEntry(DirBuffer, Mi);
+                CmpResult = FspFileSystemDirectoryBufferFileNameCmp(
+                    DirInfo->FileNameBuf, (DirInfo->Size - sizeof *DirInfo) / sizeof(WCHAR),
+                    Marker, MarkerLen);
+                if (0 > CmpResult)
+                    Lo = Mi + 1;
+                else if (0 < CmpResult)
+                    Hi = Mi - 1;
+                else
+                {
+                    Lo = Mi + 1;
+                    break;
+                }
+            }
+            IndexNum = Lo;
+        }
+
+        if (IndexNum < PublishedCount)
+        {
+            for (; IndexNum < PublishedCount; IndexNum++)
+            {
+                DirInfo = FspFileSystemDirectorySnapshotEntry(DirBuffer, IndexNum);
+                if (!FspFileSystemAddDirInfo(DirInfo, Buffer, Length, PBytesTransferred))
+                    break;
+            }
+            return TRUE;
+        }
+
+        SleepConditionVariableSRW(&Snapshot->CompleteCond, &DirBuffer->Lock,
+            INFINITE, CONDITION_VARIABLE_LOCKMODE_SHARED);
+    }
 }
 
 FSP_API VOID FspFileSystemReadDirectoryBuffer(PVOID *PDirBuffer,
@@ -363,6 +797,14 @@ FSP_API VOID FspFileSystemReadDirectoryBuffer(PVOID *PDirBuffer,
     {
         AcquireSRWLockShared(&DirBuffer->Lock);
 
+        if (0 != DirBuffer->Snapshot && !DirBuffer->Snapshot->Complete &&
+            FspFileSystemReadDirectorySnapshotStreaming(DirBuffer->Snapshot,
+                Marker, Buffer, Length, PBytesTransferred))
+        {
+            ReleaseSRWLockShared(&DirBuffer->Lock);
+            return;
+        }
+
         PULONG Index = (PULONG)(DirBuffer->Buffer + DirBuffer->HiMark);
         ULONG Count = (DirBuffer->Capacity - DirBuffer->HiMark) / sizeof(ULONG);
         ULONG IndexNum;
@@ -394,6 +836,184 @@ FSP_API VOID FspFileSystemReadDirectoryBuffer(PVOID *PDirBuffer,
     FspFileSystemAddDirInfo(0, Buffer, Length, PBytesTransferred);
 }
 
+static VOID FspFileSystemDereferenceDirectorySnapshot(FSP_FILE_SYSTEM_DIRECTORY_SNAPSHOT *Snapshot)
+{
+    if (0 == InterlockedDecrement(&Snapshot->RefCount))
+    {
+        MemFree(Snapshot->DirBuffer.Buffer);
+        MemFree(Snapshot);
+    }
+}
+
+static VOID FspFileSystemRemoveDirectorySnapshotNoLock(
+    FSP_FILE_SYSTEM_DIRECTORY_SNAPSHOT_CACHE *Cache,
+    FSP_FILE_SYSTEM_DIRECTORY_SNAPSHOT *Snapshot)
+{
+    FSP_FILE_SYSTEM_DIRECTORY_SNAPSHOT **P;
+
+    for (P = &Cache->Buckets[
+            (ULONG)(Snapshot->DirectoryId ^ (Snapshot->DirectoryId >> 32)) %
+                FspFileSystemDirectorySnapshotBucketCount];
+        *P != Snapshot;
+        P = &(*P)->HashNext)
+        ;
+    *P = Snapshot->HashNext;
+    RemoveEntryList(&Snapshot->LruEntry);
+    Cache->Count--;
+    Snapshot->Cached = FALSE;
+
+    /* drop the cache reference; handles may still be using the snapshot */
+    FspFileSystemDereferenceDirectorySnapshot(Snapshot);
+}
+
+FSP_API BOOLEAN FspFileSystemAcquireDirectorySnapshot(PVOID *PSnapshotCache,
+    UINT64 DirectoryId, UINT64 Generation, BOOLEAN Streaming,
+    PVOID *PDirBuffer, PNTSTATUS PResult)
+{
+    FSP_FILE_SYSTEM_DIRECTORY_SNAPSHOT_CACHE *Cache = *PSnapshotCache;
+    FSP_FILE_SYSTEM_DIRECTORY_BUFFER *DirBuffer = *PDirBuffer;
+    FSP_FILE_SYSTEM_DIRECTORY_SNAPSHOT *Snapshot, *NextSnapshot, **Bucket;
+    BOOLEAN Build = FALSE;
+    MemoryBarrier();
+
+    if (0 != DirBuffer)
+    {
+        if (0 == DirBuffer->Snapshot)
+            RETURN(STATUS_INVALID_PARAMETER, FALSE);
+
+        /* the handle keeps using its snapshot as long as the generation is the same */
+        if (DirectoryId == DirBuffer->Snapshot->DirectoryId &&
+            Generation == DirBuffer->Snapshot->Generation)
+            RETURN(STATUS_SUCCESS, FALSE);
+    }
+
+    if (0 == Cache)
+    {
+        static SRWLOCK CreateLock = SRWLOCK_INIT;
+        FSP_FILE_SYSTEM_DIRECTORY_SNAPSHOT_CACHE *NewCache;
+
+        NewCache = MemAlloc(sizeof *NewCache);
+        if (0 == NewCache)
+            RETURN(STATUS_INSUFFICIENT_RESOURCES, FALSE);
+        memset(NewCache, 0, sizeof *NewCache);
+        InitializeSRWLock(&NewCache->Lock);
+        InitializeListHead(&NewCache->LruList);
+
+        AcquireSRWLockExclusive(&CreateLock);
+        Cache = *PSnapshotCache;
+        MemoryBarrier();
+        if (0 == Cache)
+            *PSnapshotCache = Cache = NewCache;
+        ReleaseSRWLockExclusive(&CreateLock);
+
+        if (Cache != NewCache)
+            MemFree(NewCache);
+    }
+
+    Bucket = &Cache->Buckets[
+        (ULONG)(DirectoryId ^ (DirectoryId >> 32)) % FspFileSystemDirectorySnapshotBucketCount];
+
+    AcquireSRWLockExclusive(&Cache->Lock);
+
+    for (Snapshot = *Bucket; 0 != Snapshot; Snapshot = NextSnapshot)
+    {
+        NextSnapshot = Snapshot->HashNext;
+        if (DirectoryId != Snapshot->DirectoryId)
+            continue;
+        if (Generation == Snapshot->Generation)
+            break;
+
+        /* the directory has changed since this snapshot was taken */
+        FspFileSystemRemoveDirectorySnapshotNoLock(Cache, Snapshot);
+    }
+
+    if (0 != Snapshot)
+    {
+        InterlockedIncrement(&Snapshot->RefCount);
+        RemoveEntryList(&Snapshot->LruEntry);
+        InsertTailList(&Cache->LruList, &Snapshot->LruEntry);
+    }
+    else
+    {
+        Snapshot = MemAlloc(sizeof *Snapshot);
+        if (0 == Snapshot)
+        {
+            ReleaseSRWLockExclusive(&Cache->Lock);
+            RETURN(STATUS_INSUFFICIENT_RESOURCES, FALSE);
+        }
+        memset(Snapshot, 0, sizeof *Snapshot);
+        InitializeSRWLock(&Snapshot->DirBuffer.Lock);
+        Snapshot->DirBuffer.Snapshot = Snapshot;
+        Snapshot->DirectoryId = DirectoryId;
+        Snapshot->Generation = Generation;
+        Snapshot->RefCount = 2;         /* cache and handle */
+        InitializeConditionVariable(&Snapshot->CompleteCond);
+        Snapshot->Streaming = Streaming;
+        Snapshot->Cached = TRUE;
+
+        /* non-streaming snapshots are locked until built (see FspFileSystemReleaseDirectoryBuffer) */
+        if (!Streaming)
+            AcquireSRWLockExclusive(&Snapshot->DirBuffer.Lock);
+
+        Snapshot->HashNext = *Bucket;
+        *Bucket = Snapshot;
+        InsertTailList(&Cache->LruList, &Snapshot->LruEntry);
+        Cache->Count++;
+
+        while (FspFileSystemDirectorySnapshotCountMax < Cache->Count)
+            FspFileSystemRemoveDirectorySnapshotNoLock(Cache,
+                CONTAINING_RECORD(Cache->LruList.Flink, FSP_FILE_SYSTEM_DIRECTORY_SNAPSHOT, LruEntry));
+
+        Build = TRUE;
+    }
+
+    ReleaseSRWLockExclusive(&Cache->Lock);
+
+    if (0 != DirBuffer)
+        FspFileSystemDereferenceDirectorySnapshot(DirBuffer->Snapshot);
+    *PDirBuffer = &Snapshot->DirBuffer;
+
+    RETURN(STATUS_SUCCESS, Build);
+}
+
+FSP_API VOID FspFileSystemInvalidateDirectorySnapshot(PVOID *PSnapshotCache,
+    UINT64 DirectoryId)
+{
+    FSP_FILE_SYSTEM_DIRECTORY_SNAPSHOT_CACHE *Cache = *PSnapshotCache;
+    FSP_FILE_SYSTEM_DIRECTORY_SNAPSHOT *Snapshot, *NextSnapshot;
+    MemoryBarrier();
+
+    if (0 == Cache)
+        return;
+
+    AcquireSRWLockExclusive(&Cache->Lock);
+    for (Snapshot = Cache->Buckets[
+            (ULONG)(DirectoryId ^ (DirectoryId >> 32)) % FspFileSystemDirectorySnapshotBucketCount];
+        0 != Snapshot;
+        Snapshot = NextSnapshot)
+    {
+        NextSnapshot = Snapshot->HashNext;
+        if (DirectoryId == Snapshot->DirectoryId)
+            FspFileSystemRemoveDirectorySnapshotNoLock(Cache, Snapshot);
+    }
+    ReleaseSRWLockExclusive(&Cache->Lock);
+}
+
+FSP_API VOID FspFileSystemDeleteDirectorySnapshotCache(PVOID *PSnapshotCache)
+{
+    FSP_FILE_SYSTEM_DIRECTORY_SNAPSHOT_CACHE *Cache = *PSnapshotCache;
+    MemoryBarrier();
+
+    if (0 != Cache)
+    {
+        while (!IsListEmpty(&Cache->LruList))
+            FspFileSystemRemoveDirectorySnapshotNoLock(Cache,
+                CONTAINING_RECORD(Cache->LruList.Flink, FSP_FILE_SYSTEM_DIRECTORY_SNAPSHOT, LruEntry));
+        MemFree(Cache);
+        *PSnapshotCache = 0;
+    }
+}
+
 FSP_API VOID FspFileSystemDeleteDirectoryBuffer(PVOID *PDirBuffer)
 {
     FSP_FILE_SYSTEM_DIRECTORY_BUFFER *DirBuffer = *PDirBuffer;
@@ -401,8 +1021,13 @@ FSP_API VOID FspFileSystemDeleteDirectoryBuffer(PVOID *PDirBuffer)
 
     if (0 != DirBuffer)
     {
-        MemFree(DirBuffer->Buffer);
-        MemFree(DirBuffer);
+        if (0 != DirBuffer->Snapshot)
+            FspFileSystemDereferenceDirectorySnapshot(DirBuffer->Snapshot);
+        else
+        {
+            MemFree(DirBuffer->Buffer);
+            MemFree(DirBuffer);
+        }
         *PDirBuffer = 0;
     }
 }
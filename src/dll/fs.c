@@ -26,8 +26,34 @@ enum
     FspFileSystemDispatcherThreadCountMin = 2,
     FspFileSystemDispatcherDefaultThreadCountMin = 4,
     FspFileSystemDispatcherDefaultThreadCountMax = 16,
+    FspFileSystemDispatcherAdaptiveThreadCountMax = 64,
+    FspFileSystemDispatcherAdaptiveDefaultInterval = 100,
+    FspFileSystemDispatcherAdaptiveDefaultIdleTimeout = 5000,
+    FspFileSystemDispatcherAdaptiveDefaultLatencyThreshold = 1000,
+    FspFileSystemDispatcherNumaNodeCountMax = 64,
 };
 
+typedef struct
+{
+    HANDLE StopEvent;
+    ULONG ThreadCountMin, ThreadCountMax, ProcessorCount;
+    ULONG Interval;                     /* millis */
+    LONG64 IdleTimeout;                 /* performance counter units */
+    LONG64 LatencyThreshold;            /* performance counter units */
+    volatile LONG ThreadCount, IdleThreadCount, ExitRequestCount;
+    volatile LONG64 BusyTime, BusyCount;
+    ULONG ThreadHandleCount;
+    HANDLE ThreadHandles[FspFileSystemDispatcherAdaptiveThreadCountMax];
+} FSP_FILE_SYSTEM_DISPATCHER_ADAPTIVE;
+
+typedef struct
+{
+    ULONG NodeCount;
+    volatile LONG NextThreadIndex;
+    USHORT Nodes[FspFileSystemDispatcherNumaNodeCountMax];
+    GROUP_AFFINITY Affinities[FspFileSystemDispatcherNumaNodeCountMax];
+} FSP_FILE_SYSTEM_DISPATCHER_NUMA;
+
 static FSP_FILE_SYSTEM_INTERFACE FspFileSystemNullInterface;
 
 static INIT_ONCE FspFileSystemInitOnce = INIT_ONCE_STATIC_INIT;
@@ -54,6 +80,42 @@ VOID FspFileSystemFinalize(BOOLEAN Dynamic)
         TlsFree(FspFileSystemTlsKey);
 }
 
+static NTSTATUS FspFileSystemNumaTopology(PUSHORT Nodes, GROUP_AFFINITY *Affinities,
+    PULONG PNodeCount)
+{
+    DWORD_PTR ProcessMask, SystemMask;
+    ULONG HighestNode, NodeCount;
+    GROUP_AFFINITY Affinity;
+
+    *PNodeCount = 0;
+
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &ProcessMask, &SystemMask) ||
+        !GetNumaHighestNodeNumber(&HighestNode))
+        return FspNtStatusFromWin32(GetLastError());
+
+    /* list the nodes that have processors the process can run on */
+    NodeCount = 0;
+    for (ULONG Node = 0; HighestNode >= Node && FspFileSystemDispatcherNumaNodeCountMax > NodeCount;
+        Node++)
+    {
+        if (!GetNumaNodeProcessorMaskEx((USHORT)Node, &Affinity))
+            continue;
+        if (0 == Affinity.Group)
+            Affinity.Mask &= ProcessMask;
+        if (0 == Affinity.Mask)
+            continue;
+
+        Nodes[NodeCount] = (USHORT)Node;
+        if (0 != Affinities)
+            Affinities[NodeCount] = Affinity;
+        NodeCount++;
+    }
+
+    *PNodeCount = NodeCount;
+
+    return STATUS_SUCCESS;
+}
+
 FSP_API NTSTATUS FspFileSystemPreflight(PWSTR DevicePath,
     PWSTR MountPoint)
 {
@@ -124,11 +186,35 @@ FSP_API NTSTATUS FspFileSystemCreate(PWSTR DevicePath,
         return STATUS_INSUFFICIENT_RESOURCES;
     memset(FileSystem, 0, sizeof *FileSystem);
 
-    Result = FspFsctlCreateVolume(DevicePath, VolumeParams,
-        FileSystem->VolumeName, sizeof FileSystem->VolumeName,
-        &FileSystem->VolumeHandle);
+    Result = FspFileSystemStatisticsCreate(&FileSystem->Statistics);
+    if (!NT_SUCCESS(Result))
+    {
+        MemFree(FileSystem);
+        return Result;
+    }
+
+    Result = FspFileSystemOpGuardShardsCreate(&FileSystem->OpGuardShards);
+    if (!NT_SUCCESS(Result))
+    {
+        FspFileSystemStatisticsDelete(FileSystem->Statistics);
+        MemFree(FileSystem);
+        return Result;
+    }
+
+    if (0 != DevicePath)
+        Result = FspFsctlCreateVolume(DevicePath, VolumeParams,
+            FileSystem->VolumeName, sizeof FileSystem->VolumeName,
+            &FileSystem->VolumeHandle);
+    else
+    {
+        /* detached file system: not connected to the FSD */
+        FileSystem->VolumeHandle = INVALID_HANDLE_VALUE;
+        Result = STATUS_SUCCESS;
+    }
     if (!NT_SUCCESS(Result))
     {
+        FspFileSystemOpGuardShardsDelete(FileSystem->OpGuardShards);
+        FspFileSystemStatisticsDelete(FileSystem->Statistics);
         MemFree(FileSystem);
         return Result;
     }
@@ -170,10 +256,79 @@ FSP_API NTSTATUS FspFileSystemCreate(PWSTR DevicePath,
 FSP_API VOID FspFileSystemDelete(FSP_FILE_SYSTEM *FileSystem)
 {
     FspFileSystemRemoveMountPoint(FileSystem);
-    CloseHandle(FileSystem->VolumeHandle);
+    if (INVALID_HANDLE_VALUE != FileSystem->VolumeHandle)
+        CloseHandle(FileSystem->VolumeHandle);
+    /* the FSD has unlocked the transfer buffers when the volume handle was closed */
+    if (0 != FileSystem->TransferBuffers)
+        VirtualFree(FileSystem->TransferBuffers, 0, MEM_RELEASE);
+    if (0 != FileSystem->Trace)
+    {
+        FspFileSystemStopTrace(FileSystem, 0);
+        FspFileSystemTraceDelete(FileSystem->Trace);
+    }
+    FspFileSystemOpGuardShardsDelete(FileSystem->OpGuardShards);
+    FspFileSystemStatisticsDelete(FileSystem->Statistics);
     MemFree(FileSystem);
 }
 
+FSP_API NTSTATUS FspFileSystemRegisterTransferBuffers(FSP_FILE_SYSTEM *FileSystem,
+    ULONG BufferSize, ULONG BufferCount)
+{
+    PVOID TransferBuffers;
+    USHORT Nodes[FspFileSystemDispatcherNumaNodeCountMax];
+    ULONG NodeCount;
+    NTSTATUS Result;
+
+    if (0 != FileSystem->TransferBuffers ||
+        0 != FileSystem->DispatcherThread ||
+        INVALID_HANDLE_VALUE == FileSystem->VolumeHandle ||
+        0 == BufferSize || 0 != BufferSize % FSP_FSCTL_TRANSFER_BUFFER_ALIGNMENT ||
+        FSP_FSCTL_TRANSFER_BUFFER_SIZEMAX < BufferSize ||
+        0 == BufferCount || FSP_FSCTL_TRANSFER_BUFFER_COUNTMAX < BufferCount ||
+        FSP_FSCTL_TRANSFER_BUFFERS_SIZEMAX / BufferSize < BufferCount)
+        return STATUS_INVALID_PARAMETER;
+
+    Result = FspFileSystemNumaTopology(Nodes, 0, &NodeCount);
+    if (!NT_SUCCESS(Result))
+        NodeCount = 0;
+
+    if (1 >= NodeCount)
+    {
+        TransferBuffers = VirtualAlloc(0, (SIZE_T)BufferSize * BufferCount,
+            MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (0 == TransferBuffers)
+            return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    else
+    {
+        /* interleave the buffers across the NUMA nodes: buffer I prefers node I % NodeCount */
+        TransferBuffers = VirtualAlloc(0, (SIZE_T)BufferSize * BufferCount,
+            MEM_RESERVE, PAGE_READWRITE);
+        if (0 == TransferBuffers)
+            return STATUS_INSUFFICIENT_RESOURCES;
+        for (ULONG I = 0; BufferCount > I; I++)
+            if (0 == VirtualAllocExNuma(GetCurrentProcess(),
+                (PUINT8)TransferBuffers + (SIZE_T)BufferSize * I, BufferSize,
+                MEM_COMMIT, PAGE_READWRITE, Nodes[I % NodeCount]))
+            {
+                VirtualFree(TransferBuffers, 0, MEM_RELEASE);
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+    }
+
+    Result = FspFsctlRegisterTransferBuffers(FileSystem->VolumeHandle,
+        TransferBuffers, BufferSize, BufferCount);
+    if (!NT_SUCCESS(Result))
+    {
+        VirtualFree(TransferBuffers, 0, MEM_RELEASE);
+        return Result;
+    }
+
+    FileSystem->TransferBuffers = TransferBuffers;
+
+    return STATUS_SUCCESS;
+}
+
 FSP_API NTSTATUS FspFileSystemSetMountPoint(FSP_FILE_SYSTEM *FileSystem, PWSTR MountPoint)
 {
     return FspFileSystemSetMountPointEx(FileSystem, MountPoint, 0);
@@ -182,7 +337,7 @@ FSP_API NTSTATUS FspFileSystemSetMountPoint(FSP_FILE_SYSTEM *FileSystem, PWSTR M
 FSP_API NTSTATUS FspFileSystemSetMountPointEx(FSP_FILE_SYSTEM *FileSystem, PWSTR MountPoint,
     PSECURITY_DESCRIPTOR SecurityDescriptor)
 {
-    if (0 != FileSystem->MountPoint)
+    if (0 != FileSystem->MountPoint || INVALID_HANDLE_VALUE == FileSystem->VolumeHandle)
         return STATUS_INVALID_PARAMETER;
 
     FSP_MOUNT_DESC Desc;
@@ -240,19 +395,439 @@ FSP_API VOID FspFileSystemRemoveMountPoint(FSP_FILE_SYSTEM *FileSystem)
     FileSystem->MountHandle = 0;
 }
 
+static inline BOOLEAN FspFileSystemDispatchRequest(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    SIZE_T ResponseSize;
+    LARGE_INTEGER StartTime, EndTime;
+
+    if (FileSystem->DebugLog)
+    {
+        if (FspFsctlTransactKindCount <= Request->Kind ||
+            (FileSystem->DebugLog & (1 << Request->Kind)))
+            FspDebugLogRequest(Request);
+    }
+
+    QueryPerformanceCounter(&StartTime);
+    EndTime = StartTime;
+
+    if (0 != FileSystem->Trace)
+        FspFileSystemTraceRecord(FileSystem->Trace, FspFileSystemTraceRequest,
+            Request, Request->Size, StartTime.QuadPart);
+
+    memset(Response, 0, sizeof *Response);
+    Response->Size = sizeof *Response;
+    Response->Kind = Request->Kind;
+    Response->Hint = Request->Hint;
+    if (FspFsctlTransactKindCount > Request->Kind && 0 != FileSystem->Operations[Request->Kind])
+    {
+        Response->IoStatus.Status =
+            FspFileSystemEnterOperation(FileSystem, Request, Response);
+        if (NT_SUCCESS(Response->IoStatus.Status))
+        {
+            Response->IoStatus.Status =
+                FileSystem->Operations[Request->Kind](FileSystem, Request, Response);
+            FspFileSystemLeaveOperation(FileSystem, Request, Response);
+        }
+        QueryPerformanceCounter(&EndTime);
+        FspFileSystemStatisticsRecord(FileSystem->Statistics, Request,
+            EndTime.QuadPart - StartTime.QuadPart);
+        if (0 != FileSystem->DispatcherAdaptive)
+        {
+            FSP_FILE_SYSTEM_DISPATCHER_ADAPTIVE *Adaptive = FileSystem->DispatcherAdaptive;
+            InterlockedAdd64(&Adaptive->BusyTime, EndTime.QuadPart - StartTime.QuadPart);
+            InterlockedIncrement64(&Adaptive->BusyCount);
+        }
+    }
+    else
+        Response->IoStatus.Status = STATUS_INVALID_DEVICE_REQUEST;
+
+    if (FileSystem->DebugLog)
+    {
+        if (FspFsctlTransactKindCount <= Response->Kind ||
+            (FileSystem->DebugLog & (1 << Response->Kind)))
+            FspDebugLogResponse(Response);
+    }
+
+    ResponseSize = FSP_FSCTL_DEFAULT_ALIGN_UP(Response->Size);
+    if (FSP_FSCTL_TRANSACT_RSP_SIZEMAX < ResponseSize/* should NOT happen */)
+    {
+        memset(Response, 0, sizeof *Response);
+        Response->Size = sizeof *Response;
+        Response->Kind = Request->Kind;
+        Response->Hint = Request->Hint;
+        Response->IoStatus.Status = STATUS_INVALID_DEVICE_REQUEST;
+    }
+    else if (STATUS_PENDING == Response->IoStatus.Status)
+    {
+        memset(Response, 0, sizeof *Response);
+        return FALSE;
+    }
+    else
+    {
+        memset((PUINT8)Response + Response->Size, 0, ResponseSize - Response->Size);
+        Response->Size = (UINT16)ResponseSize;
+    }
+
+    if (0 != FileSystem->Trace)
+        FspFileSystemTraceRecord(FileSystem->Trace, FspFileSystemTraceResponse,
+            Response, Response->Size, EndTime.QuadPart);
+
+    return TRUE;
+}
+
+static inline NTSTATUS FspFileSystemDispatcherTransact(FSP_FILE_SYSTEM *FileSystem,
+    PVOID ResponseBuf, SIZE_T ResponseBufSize,
+    PVOID RequestBuf, SIZE_T *PRequestBufSize,
+    BOOLEAN Batch)
+{
+    FSP_FILE_SYSTEM_DISPATCHER_ADAPTIVE *Adaptive = FileSystem->DispatcherAdaptive;
+    NTSTATUS Result;
+
+    if (0 == Adaptive)
+        return FspFsctlTransact(FileSystem->VolumeHandle,
+            ResponseBuf, ResponseBufSize, RequestBuf, PRequestBufSize, Batch);
+
+    InterlockedIncrement(&Adaptive->IdleThreadCount);
+    Result = FspFsctlTransact(FileSystem->VolumeHandle,
+        ResponseBuf, ResponseBufSize, RequestBuf, PRequestBufSize, Batch);
+    InterlockedDecrement(&Adaptive->IdleThreadCount);
+
+    return Result;
+}
+
+static inline BOOLEAN FspFileSystemDispatcherShouldExit(FSP_FILE_SYSTEM *FileSystem)
+{
+    /*
+     * Called by a dispatcher thread that has no outstanding responses after a transaction
+     * that returned no requests. In adaptive mode the thread claims a pending exit request
+     * (if any) and exits.
+     */
+    FSP_FILE_SYSTEM_DISPATCHER_ADAPTIVE *Adaptive = FileSystem->DispatcherAdaptive;
+    LONG ExitRequestCount, PrevExitRequestCount;
+
+    if (0 == Adaptive)
+        return FALSE;
+
+    for (ExitRequestCount = Adaptive->ExitRequestCount; 0 < ExitRequestCount;
+        ExitRequestCount = PrevExitRequestCount)
+    {
+        PrevExitRequestCount = InterlockedCompareExchange(&Adaptive->ExitRequestCount,
+            ExitRequestCount - 1, ExitRequestCount);
+        if (PrevExitRequestCount == ExitRequestCount)
+        {
+            InterlockedDecrement(&Adaptive->ThreadCount);
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static NTSTATUS FspFileSystemDispatcherLoop(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_OPERATION_CONTEXT *OperationContext)
+{
+    NTSTATUS Result;
+    SIZE_T RequestSize;
+    FSP_FSCTL_TRANSACT_REQ *Request = OperationContext->Request;
+    FSP_FSCTL_TRANSACT_RSP *Response = OperationContext->Response;
+
+    memset(Response, 0, sizeof *Response);
+    for (;;)
+    {
+        RequestSize = FSP_FSCTL_TRANSACT_BUFFER_SIZEMIN;
+        Result = FspFileSystemDispatcherTransact(FileSystem,
+            Response, Response->Size, Request, &RequestSize, FALSE);
+        if (!NT_SUCCESS(Result))
+            return Result;
+
+        InterlockedIncrement64(&FileSystem->DispatcherTransactCount);
+
+        memset(Response, 0, sizeof *Response);
+        if (0 == RequestSize)
+        {
+            if (FspFileSystemDispatcherShouldExit(FileSystem))
+                return STATUS_SUCCESS;
+            continue;
+        }
+
+        InterlockedIncrement64(&FileSystem->DispatcherRequestCount);
+
+        FspFileSystemDispatchRequest(FileSystem, Request, Response);
+    }
+}
+
+static NTSTATUS FspFileSystemDispatcherBatchLoop(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_OPERATION_CONTEXT *OperationContext,
+    PVOID RequestBuf, SIZE_T RequestBufSize, PVOID ResponseBuf, SIZE_T ResponseBufSize)
+{
+    NTSTATUS Result;
+    SIZE_T RequestSize, ResponseSize;
+    PVOID RequestBufEnd, ResponseBufEnd;
+    FSP_FSCTL_TRANSACT_REQ *Request, *NextRequest;
+    FSP_FSCTL_TRANSACT_RSP *Response;
+    LONG64 RequestCount;
+
+    /*
+     * In batch mode a single transaction returns the responses for all the requests
+     * of the previous batch and receives a new batch of requests. Responses are laid
+     * out back-to-back in the response buffer; if the response buffer cannot hold the
+     * largest possible response we send the responses accumulated so far and continue.
+     */
+
+    ResponseBufEnd = (PUINT8)ResponseBuf + ResponseBufSize;
+    ResponseSize = 0;
+    for (;;)
+    {
+        RequestSize = RequestBufSize;
+        Result = FspFileSystemDispatcherTransact(FileSystem,
+            ResponseBuf, ResponseSize, RequestBuf, &RequestSize, TRUE);
+        if (!NT_SUCCESS(Result))
+            return Result;
+
+        InterlockedIncrement64(&FileSystem->DispatcherTransactCount);
+
+        ResponseSize = 0;
+        if (0 == RequestSize)
+        {
+            if (FspFileSystemDispatcherShouldExit(FileSystem))
+                return STATUS_SUCCESS;
+            continue;
+        }
+
+        /*
+         * Process the batch in request class order: metadata requests first, flushes
+         * last. The kernel has already applied its fairness policy when it assembled
+         * the batch, so within a batch we only need to avoid making an interactive
+         * request wait behind a bulk transfer.
+         */
+        RequestCount = 0;
+        Response = ResponseBuf;
+        RequestBufEnd = (PUINT8)RequestBuf + RequestSize;
+        for (ULONG Class = 0; FspFsctlTransactClassCount > Class; Class++)
+        for (Request = RequestBuf;
+            0 != (NextRequest = FspFsctlTransactConsumeRequest(Request, RequestBufEnd));
+            Request = NextRequest)
+        {
+            if (Class != FspFsctlTransactRequestClass(Request))
+                continue;
+
+            if (!FspFsctlTransactCanProduceResponse(Response, ResponseBufEnd))
+            {
+                Result = FspFsctlTransact(FileSystem->VolumeHandle,
+                    ResponseBuf, (PUINT8)Response - (PUINT8)ResponseBuf, 0, 0, FALSE);
+                if (!NT_SUCCESS(Result))
+                    return Result;
+
+                InterlockedIncrement64(&FileSystem->DispatcherTransactCount);
+
+                Response = ResponseBuf;
+            }
+
+            OperationContext->Request = Request;
+            OperationContext->Response = Response;
+            if (FspFileSystemDispatchRequest(FileSystem, Request, Response))
+                Response = FspFsctlTransactProduceResponse(Response, Response->Size);
+
+            RequestCount++;
+        }
+
+        InterlockedAdd64(&FileSystem->DispatcherRequestCount, RequestCount);
+
+        ResponseSize = (PUINT8)Response - (PUINT8)ResponseBuf;
+    }
+}
+
+BOOLEAN FspFileSystemDispatchDetached(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    FSP_FILE_SYSTEM_OPERATION_CONTEXT OperationContext;
+    BOOLEAN Result;
+
+    OperationContext.Request = Request;
+    OperationContext.Response = Response;
+    TlsSetValue(FspFileSystemTlsKey, &OperationContext);
+
+    InterlockedIncrement64(&FileSystem->DispatcherRequestCount);
+    Result = FspFileSystemDispatchRequest(FileSystem, Request, Response);
+
+    TlsSetValue(FspFileSystemTlsKey, 0);
+
+    return Result;
+}
+
+static inline VOID FspFileSystemTransactResponse(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    NTSTATUS Result;
+
+    if (INVALID_HANDLE_VALUE == FileSystem->VolumeHandle)
+        return;
+
+    Result = FspFsctlTransact(FileSystem->VolumeHandle,
+        Response, Response->Size, 0, 0, FALSE);
+    InterlockedIncrement64(&FileSystem->DispatcherTransactCount);
+    if (!NT_SUCCESS(Result))
+    {
+        FspFileSystemSetDispatcherResult(FileSystem, Result);
+
+        FspFsctlStop0(FileSystem->VolumeHandle);
+    }
+}
+
+typedef struct
+{
+    FSP_WORK_ITEM WorkItem;
+    FSP_FILE_SYSTEM *FileSystem;
+    FSP_FSCTL_DECLSPEC_ALIGN UINT8 RequestBuf[];
+} FSP_FILE_SYSTEM_DISPATCHER_WORK_ITEM;
+
+static VOID FspFileSystemDispatcherWorkRoutine(FSP_WORK_ITEM *WorkItem0, PVOID WorkerBuffer)
+{
+    FSP_FILE_SYSTEM_DISPATCHER_WORK_ITEM *WorkItem =
+        CONTAINING_RECORD(WorkItem0, FSP_FILE_SYSTEM_DISPATCHER_WORK_ITEM, WorkItem);
+    FSP_FILE_SYSTEM *FileSystem = WorkItem->FileSystem;
+    FSP_FSCTL_TRANSACT_REQ *Request = (PVOID)WorkItem->RequestBuf;
+    FSP_FSCTL_TRANSACT_RSP *Response = WorkerBuffer;
+    FSP_FILE_SYSTEM_OPERATION_CONTEXT OperationContext;
+
+    if (0 != Response)
+    {
+        OperationContext.Request = Request;
+        OperationContext.Response = Response;
+        TlsSetValue(FspFileSystemTlsKey, &OperationContext);
+
+        if (FspFileSystemDispatchRequest(FileSystem, Request, Response))
+            FspFileSystemTransactResponse(FileSystem, Response);
+
+        TlsSetValue(FspFileSystemTlsKey, 0);
+    }
+
+    MemFree(WorkItem);
+}
+
+static NTSTATUS FspFileSystemDispatcherHandOffLoop(FSP_FILE_SYSTEM *FileSystem,
+    PVOID RequestBuf, SIZE_T RequestBufSize)
+{
+    NTSTATUS Result;
+    SIZE_T RequestSize;
+    PVOID RequestBufEnd;
+    FSP_FSCTL_TRANSACT_REQ *Request, *NextRequest;
+    FSP_FSCTL_TRANSACT_RSP Response;
+    FSP_FILE_SYSTEM_DISPATCHER_WORK_ITEM *WorkItem;
+    BOOLEAN Batch = 0 != FileSystem->DispatcherTransactBatchSize;
+    LONG64 RequestCount;
+
+    /*
+     * In work-stealing mode the dispatcher threads only receive requests. Every request
+     * is copied into a work item and posted to the work queue; the workers process the
+     * requests and send their responses back using separate transactions.
+     */
+
+    for (;;)
+    {
+        RequestSize = RequestBufSize;
+        Result = FspFsctlTransact(FileSystem->VolumeHandle,
+            0, 0, RequestBuf, &RequestSize, Batch);
+        if (!NT_SUCCESS(Result))
+            return Result;
+
+        InterlockedIncrement64(&FileSystem->DispatcherTransactCount);
+
+        if (0 == RequestSize)
+            continue;
+
+        RequestCount = 0;
+        RequestBufEnd = (PUINT8)RequestBuf + RequestSize;
+        for (Request = RequestBuf;
+            0 != (NextRequest = FspFsctlTransactConsumeRequest(Request, RequestBufEnd));
+            Request = NextRequest)
+        {
+            WorkItem = MemAlloc(sizeof *WorkItem + Request->Size);
+            if (0 != WorkItem)
+            {
+                WorkItem->WorkItem.Routine = FspFileSystemDispatcherWorkRoutine;
+                WorkItem->FileSystem = FileSystem;
+                memcpy(WorkItem->RequestBuf, Request, Request->Size);
+                FspWorkQueuePost(FileSystem->DispatcherWorkQueue, &WorkItem->WorkItem,
+                    FspFsctlTransactMetadataClass == FspFsctlTransactRequestClass(Request));
+            }
+            else
+            {
+                memset(&Response, 0, sizeof Response);
+                Response.Size = sizeof Response;
+                Response.Kind = Request->Kind;
+                Response.Hint = Request->Hint;
+                Response.IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+                FspFileSystemTransactResponse(FileSystem, &Response);
+            }
+
+            RequestCount++;
+        }
+
+        InterlockedAdd64(&FileSystem->DispatcherRequestCount, RequestCount);
+    }
+}
+
+static PVOID FspFileSystemDispatcherBufferAlloc(FSP_FILE_SYSTEM_DISPATCHER_NUMA *Numa,
+    USHORT NumaNode, SIZE_T Size)
+{
+    if (0 == Numa)
+        return MemAlloc(Size);
+
+    return VirtualAllocExNuma(GetCurrentProcess(), 0, Size,
+        MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE, NumaNode);
+}
+
+static VOID FspFileSystemDispatcherBufferFree(FSP_FILE_SYSTEM_DISPATCHER_NUMA *Numa,
+    PVOID Buffer)
+{
+    if (0 == Numa)
+        MemFree(Buffer);
+    else if (0 != Buffer)
+        VirtualFree(Buffer, 0, MEM_RELEASE);
+}
+
 static DWORD WINAPI FspFileSystemDispatcherThread(PVOID FileSystem0)
 {
     FSP_FILE_SYSTEM *FileSystem = FileSystem0;
+    FSP_FILE_SYSTEM_DISPATCHER_NUMA *Numa = FileSystem->DispatcherNuma;
     NTSTATUS Result;
-    SIZE_T RequestSize, ResponseSize;
+    SIZE_T RequestBufSize, ResponseBufSize;
     FSP_FSCTL_TRANSACT_REQ *Request = 0;
     FSP_FSCTL_TRANSACT_RSP *Response = 0;
     FSP_FILE_SYSTEM_OPERATION_CONTEXT OperationContext;
     HANDLE DispatcherThread = 0;
+    USHORT NumaNode = FSP_FILE_SYSTEM_STATISTICS_NUMA_NODE_ANY;
+    ULONG NodeIndex;
+
+    if (0 != Numa)
+    {
+        /* pin the thread to its node before allocating its buffers */
+        NodeIndex = (ULONG)(InterlockedIncrement(&Numa->NextThreadIndex) - 1) % Numa->NodeCount;
+        NumaNode = Numa->Nodes[NodeIndex];
+        SetThreadGroupAffinity(GetCurrentThread(), &Numa->Affinities[NodeIndex], 0);
+    }
+
+    FspFileSystemStatisticsRegisterThread(FileSystem->Statistics, NumaNode);
 
-    Request = MemAlloc(FSP_FSCTL_TRANSACT_BUFFER_SIZEMIN);
-    Response = MemAlloc(FSP_FSCTL_TRANSACT_RSP_SIZEMAX);
-    if (0 == Request || 0 == Response)
+    if (0 != FileSystem->DispatcherTransactBatchSize)
+    {
+        RequestBufSize = FileSystem->DispatcherTransactBatchSize;
+        ResponseBufSize = RequestBufSize + FSP_FSCTL_TRANSACT_RSP_SIZEMAX;
+    }
+    else
+    {
+        RequestBufSize = FSP_FSCTL_TRANSACT_BUFFER_SIZEMIN;
+        ResponseBufSize = FSP_FSCTL_TRANSACT_RSP_SIZEMAX;
+    }
+    if (FSP_FILE_SYSTEM_DISPATCHER_STRATEGY_WORK_STEALING == FileSystem->DispatcherStrategy)
+        ResponseBufSize = 0;        /* responses are produced by the workers */
+
+    Request = FspFileSystemDispatcherBufferAlloc(Numa, NumaNode, RequestBufSize);
+    Response = 0 != ResponseBufSize ?
+        FspFileSystemDispatcherBufferAlloc(Numa, NumaNode, ResponseBufSize) : 0;
+    if (0 == Request || (0 != ResponseBufSize && 0 == Response))
     {
         Result = STATUS_INSUFFICIENT_RESOURCES;
         goto exit;
@@ -280,117 +855,406 @@ static DWORD WINAPI FspFileSystemDispatcherThread(PVOID FileSystem0)
         goto exit;
 #endif
 
-    memset(Response, 0, sizeof *Response);
-    for (;;)
+    if (FSP_FILE_SYSTEM_DISPATCHER_STRATEGY_WORK_STEALING == FileSystem->DispatcherStrategy)
+        Result = FspFileSystemDispatcherHandOffLoop(FileSystem, Request, RequestBufSize);
+    else if (0 != FileSystem->DispatcherTransactBatchSize)
+        Result = FspFileSystemDispatcherBatchLoop(FileSystem, &OperationContext,
+            Request, RequestBufSize, Response, ResponseBufSize);
+    else
+        Result = FspFileSystemDispatcherLoop(FileSystem, &OperationContext);
+
+exit:
+    TlsSetValue(FspFileSystemTlsKey, 0);
+    FspFileSystemDispatcherBufferFree(Numa, Response);
+    FspFileSystemDispatcherBufferFree(Numa, Request);
+
+    FspFileSystemStatisticsUnregisterThread(FileSystem->Statistics);
+
+    /* STATUS_SUCCESS: an idle thread retired by the adaptive dispatcher */
+    if (STATUS_SUCCESS != Result)
     {
-        RequestSize = FSP_FSCTL_TRANSACT_BUFFER_SIZEMIN;
-        Result = FspFsctlTransact(FileSystem->VolumeHandle,
-            Response, Response->Size, Request, &RequestSize, FALSE);
-        if (!NT_SUCCESS(Result))
-            goto exit;
+        FspFileSystemSetDispatcherResult(FileSystem, Result);
 
-        memset(Response, 0, sizeof *Response);
-        if (0 == RequestSize)
+        FspFsctlStop0(FileSystem->VolumeHandle);
+    }
+
+    if (0 != DispatcherThread)
+    {
+        WaitForSingleObject(DispatcherThread, INFINITE);
+        CloseHandle(DispatcherThread);
+    }
+
+    return Result;
+}
+
+static NTSTATUS FspFileSystemProcessorCount(PULONG PProcessorCount)
+{
+    DWORD_PTR ProcessMask, SystemMask;
+    ULONG ProcessorCount;
+
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &ProcessMask, &SystemMask))
+        return FspNtStatusFromWin32(GetLastError());
+
+    for (ProcessorCount = 0; 0 != ProcessMask; ProcessMask >>= 1)
+        ProcessorCount += ProcessMask & 1;
+
+    *PProcessorCount = ProcessorCount;
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS FspFileSystemDefaultThreadCount(PULONG PThreadCount)
+{
+    ULONG ThreadCount;
+    NTSTATUS Result;
+
+    Result = FspFileSystemProcessorCount(&ThreadCount);
+    if (!NT_SUCCESS(Result))
+        return Result;
+
+    if (ThreadCount < FspFileSystemDispatcherDefaultThreadCountMin)
+        ThreadCount = FspFileSystemDispatcherDefaultThreadCountMin;
+    else if (ThreadCount > FspFileSystemDispatcherDefaultThreadCountMax)
+        ThreadCount = FspFileSystemDispatcherDefaultThreadCountMax;
+
+    *PThreadCount = ThreadCount;
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS FspFileSystemDispatcherAdaptiveGrow(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_DISPATCHER_ADAPTIVE *Adaptive, ULONG GrowCount)
+{
+    HANDLE Thread;
+
+    for (; 0 < GrowCount; GrowCount--)
+    {
+        if (FspFileSystemDispatcherAdaptiveThreadCountMax <= Adaptive->ThreadHandleCount)
+            break;
+
+        Thread = CreateThread(0, 0, FspFileSystemDispatcherThread, FileSystem, 0, 0);
+        if (0 == Thread)
+            return FspNtStatusFromWin32(GetLastError());
+
+        Adaptive->ThreadHandles[Adaptive->ThreadHandleCount++] = Thread;
+        InterlockedIncrement(&Adaptive->ThreadCount);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static VOID FspFileSystemDispatcherAdaptiveReap(FSP_FILE_SYSTEM_DISPATCHER_ADAPTIVE *Adaptive,
+    BOOLEAN Wait)
+{
+    ULONG I, J;
+
+    for (I = 0, J = 0; Adaptive->ThreadHandleCount > I; I++)
+    {
+        if (WAIT_OBJECT_0 == WaitForSingleObject(Adaptive->ThreadHandles[I], Wait ? INFINITE : 0))
+            CloseHandle(Adaptive->ThreadHandles[I]);
+        else
+            Adaptive->ThreadHandles[J++] = Adaptive->ThreadHandles[I];
+    }
+    Adaptive->ThreadHandleCount = J;
+}
+
+static DWORD WINAPI FspFileSystemDispatcherAdaptiveThread(PVOID FileSystem0)
+{
+    FSP_FILE_SYSTEM *FileSystem = FileSystem0;
+    FSP_FILE_SYSTEM_DISPATCHER_ADAPTIVE *Adaptive = FileSystem->DispatcherAdaptive;
+    FSP_FSCTL_QUEUE_INFO QueueInfo;
+    LARGE_INTEGER Time;
+    LONG64 IdleTime = 0, BusyTime, BusyCount, Latency;
+    ULONG ThreadCount, IdleThreadCount, GrowCount;
+    NTSTATUS Result, DispatcherResult;
+
+    /*
+     * The adaptive dispatcher controller samples the depth of the FSD pending queue and
+     * the average handler latency every Interval millis:
+     *
+     * - If there are more pending requests than idle dispatcher threads, it grows the
+     * thread set. It does so freely while there are fewer threads than processors;
+     * beyond that only when handlers are slow (blocked on I/O, etc.), because then more
+     * threads can make progress concurrently.
+     *
+     * - If the pending queue remains empty while at least two threads are idle for
+     * IdleTimeout millis, it retires a single thread and restarts the idle timer.
+     * It does so by posting an exit request and waking an idle thread.
+     */
+
+    Result = FspFileSystemDispatcherAdaptiveGrow(FileSystem, Adaptive, Adaptive->ThreadCountMin);
+    if (!NT_SUCCESS(Result))
+        goto exit;
+
+    while (WAIT_TIMEOUT == WaitForSingleObject(Adaptive->StopEvent, Adaptive->Interval))
+    {
+        FspFileSystemDispatcherAdaptiveReap(Adaptive, FALSE);
+
+        FspFileSystemGetDispatcherResult(FileSystem, &DispatcherResult);
+        if (!NT_SUCCESS(DispatcherResult))
             continue;
 
-        if (FileSystem->DebugLog)
-        {
-            if (FspFsctlTransactKindCount <= Request->Kind ||
-                (FileSystem->DebugLog & (1 << Request->Kind)))
-                FspDebugLogRequest(Request);
-        }
+        /* if there are unclaimed exit requests wake an idle thread to claim one */
+        Result = FspFsctlQueueInfo(FileSystem->VolumeHandle,
+            0 < Adaptive->ExitRequestCount ? FspFsctlQueueInfoWakeDispatcher : 0,
+            &QueueInfo);
+        if (!NT_SUCCESS(Result))
+            continue;
 
-        Response->Size = sizeof *Response;
-        Response->Kind = Request->Kind;
-        Response->Hint = Request->Hint;
-        if (FspFsctlTransactKindCount > Request->Kind && 0 != FileSystem->Operations[Request->Kind])
+        BusyTime = InterlockedExchange64(&Adaptive->BusyTime, 0);
+        BusyCount = InterlockedExchange64(&Adaptive->BusyCount, 0);
+        Latency = 0 != BusyCount ? BusyTime / BusyCount : 0;
+
+        ThreadCount = Adaptive->ThreadCount - Adaptive->ExitRequestCount;
+        IdleThreadCount = Adaptive->IdleThreadCount;
+        QueryPerformanceCounter(&Time);
+
+        if (QueueInfo.PendingIrpCount > IdleThreadCount)
         {
-            Response->IoStatus.Status =
-                FspFileSystemEnterOperation(FileSystem, Request, Response);
-            if (NT_SUCCESS(Response->IoStatus.Status))
+            IdleTime = 0;
+
+            /* withdraw unclaimed exit requests before growing */
+            if (0 < InterlockedExchange(&Adaptive->ExitRequestCount, 0))
+                ThreadCount = Adaptive->ThreadCount;
+
+            if (ThreadCount < Adaptive->ThreadCountMax &&
+                (ThreadCount < Adaptive->ProcessorCount || Latency >= Adaptive->LatencyThreshold))
             {
-                Response->IoStatus.Status =
-                    FileSystem->Operations[Request->Kind](FileSystem, Request, Response);
-                FspFileSystemLeaveOperation(FileSystem, Request, Response);
-            }
-        }
-        else
-            Response->IoStatus.Status = STATUS_INVALID_DEVICE_REQUEST;
+                GrowCount = QueueInfo.PendingIrpCount - IdleThreadCount;
+                if (GrowCount > Adaptive->ThreadCountMax - ThreadCount)
+                    GrowCount = Adaptive->ThreadCountMax - ThreadCount;
 
-        if (FileSystem->DebugLog)
-        {
-            if (FspFsctlTransactKindCount <= Response->Kind ||
-                (FileSystem->DebugLog & (1 << Response->Kind)))
-                FspDebugLogResponse(Response);
+                /* failure to grow is not fatal; the existing threads continue to serve */
+                FspFileSystemDispatcherAdaptiveGrow(FileSystem, Adaptive, GrowCount);
+            }
         }
-
-        ResponseSize = FSP_FSCTL_DEFAULT_ALIGN_UP(Response->Size);
-        if (FSP_FSCTL_TRANSACT_RSP_SIZEMAX < ResponseSize/* should NOT happen */)
+        else if (0 == QueueInfo.PendingIrpCount && 2 <= IdleThreadCount &&
+            ThreadCount > Adaptive->ThreadCountMin)
         {
-            memset(Response, 0, sizeof *Response);
-            Response->Size = sizeof *Response;
-            Response->Kind = Request->Kind;
-            Response->Hint = Request->Hint;
-            Response->IoStatus.Status = STATUS_INVALID_DEVICE_REQUEST;
+            if (0 == IdleTime)
+                IdleTime = Time.QuadPart;
+            else if (Time.QuadPart - IdleTime >= Adaptive->IdleTimeout)
+            {
+                IdleTime = Time.QuadPart;
+                InterlockedIncrement(&Adaptive->ExitRequestCount);
+                FspFsctlQueueInfo(FileSystem->VolumeHandle,
+                    FspFsctlQueueInfoWakeDispatcher, &QueueInfo);
+            }
         }
-        else if (STATUS_PENDING == Response->IoStatus.Status)
-            memset(Response, 0, sizeof *Response);
         else
-        {
-            memset((PUINT8)Response + Response->Size, 0, ResponseSize - Response->Size);
-            Response->Size = (UINT16)ResponseSize;
-        }
+            IdleTime = 0;
     }
 
-exit:
-    TlsSetValue(FspFileSystemTlsKey, 0);
-    MemFree(Response);
-    MemFree(Request);
-
-    FspFileSystemSetDispatcherResult(FileSystem, Result);
-
-    FspFsctlStop0(FileSystem->VolumeHandle);
+    Result = STATUS_SUCCESS;
 
-    if (0 != DispatcherThread)
+exit:
+    if (!NT_SUCCESS(Result))
     {
-        WaitForSingleObject(DispatcherThread, INFINITE);
-        CloseHandle(DispatcherThread);
+        FspFileSystemSetDispatcherResult(FileSystem, Result);
+
+        FspFsctlStop0(FileSystem->VolumeHandle);
     }
 
+    FspFileSystemDispatcherAdaptiveReap(Adaptive, TRUE);
+
     return Result;
 }
 
+VOID FspFileSystemDispatcherThreadCountRange(FSP_FILE_SYSTEM *FileSystem,
+    PULONG PThreadCountMin, PULONG PThreadCountMax)
+{
+    FSP_FILE_SYSTEM_DISPATCHER_ADAPTIVE *Adaptive = FileSystem->DispatcherAdaptive;
+
+    /* the range is fixed when the dispatcher starts; only the adaptive dispatcher has one */
+    *PThreadCountMin = 0 != Adaptive ? Adaptive->ThreadCountMin : 0;
+    *PThreadCountMax = 0 != Adaptive ? Adaptive->ThreadCountMax : 0;
+}
+
 FSP_API NTSTATUS FspFileSystemStartDispatcher(FSP_FILE_SYSTEM *FileSystem, ULONG ThreadCount)
 {
-    if (0 != FileSystem->DispatcherThread)
+    FSP_FILE_SYSTEM_DISPATCHER_PARAMS DispatcherParams;
+
+    memset(&DispatcherParams, 0, sizeof DispatcherParams);
+    DispatcherParams.Version = sizeof DispatcherParams;
+    DispatcherParams.ThreadCount = ThreadCount;
+
+    return FspFileSystemStartDispatcherEx(FileSystem, &DispatcherParams);
+}
+
+FSP_API NTSTATUS FspFileSystemStartDispatcherEx(FSP_FILE_SYSTEM *FileSystem,
+    const FSP_FILE_SYSTEM_DISPATCHER_PARAMS *DispatcherParams0)
+{
+    FSP_FILE_SYSTEM_DISPATCHER_PARAMS DispatcherParams;
+    FSP_WORK_QUEUE *WorkQueue = 0;
+    FSP_FILE_SYSTEM_DISPATCHER_ADAPTIVE *Adaptive = 0;
+    FSP_FILE_SYSTEM_DISPATCHER_NUMA *Numa = 0;
+    PVOID Async = 0;
+    ULONG ThreadCount, WorkerThreadCount;
+    LARGE_INTEGER Frequency;
+    NTSTATUS Result;
+
+    if (0 != FileSystem->DispatcherThread || INVALID_HANDLE_VALUE == FileSystem->VolumeHandle)
         return STATUS_INVALID_PARAMETER;
 
-    if (0 == ThreadCount)
-    {
-        DWORD_PTR ProcessMask, SystemMask;
+    if (sizeof(UINT16) > DispatcherParams0->Version ||
+        sizeof DispatcherParams < DispatcherParams0->Version)
+        return STATUS_INVALID_PARAMETER;
 
-        if (!GetProcessAffinityMask(GetCurrentProcess(), &ProcessMask, &SystemMask))
-            return FspNtStatusFromWin32(GetLastError());
+    memset(&DispatcherParams, 0, sizeof DispatcherParams);
+    memcpy(&DispatcherParams, DispatcherParams0, DispatcherParams0->Version);
+
+    if (FSP_FILE_SYSTEM_DISPATCHER_STRATEGY_SERIAL != DispatcherParams.Strategy &&
+        FSP_FILE_SYSTEM_DISPATCHER_STRATEGY_WORK_STEALING != DispatcherParams.Strategy)
+        return STATUS_INVALID_PARAMETER;
 
-        for (ThreadCount = 0; 0 != ProcessMask; ProcessMask >>= 1)
-            ThreadCount += ProcessMask & 1;
+    if (0 != DispatcherParams.ThreadCountMax &&
+        FSP_FILE_SYSTEM_DISPATCHER_STRATEGY_SERIAL != DispatcherParams.Strategy)
+        return STATUS_INVALID_PARAMETER;
+
+    if (FSP_FILE_SYSTEM_DISPATCHER_AFFINITY_DEFAULT != DispatcherParams.Affinity &&
+        FSP_FILE_SYSTEM_DISPATCHER_AFFINITY_NUMA != DispatcherParams.Affinity)
+        return STATUS_INVALID_PARAMETER;
 
-        if (ThreadCount < FspFileSystemDispatcherDefaultThreadCountMin)
-            ThreadCount = FspFileSystemDispatcherDefaultThreadCountMin;
-        else if (ThreadCount > FspFileSystemDispatcherDefaultThreadCountMax)
-            ThreadCount = FspFileSystemDispatcherDefaultThreadCountMax;
+    ThreadCount = DispatcherParams.ThreadCount;
+    if (0 == ThreadCount && 0 == DispatcherParams.ThreadCountMax &&
+        FSP_FILE_SYSTEM_DISPATCHER_STRATEGY_SERIAL == DispatcherParams.Strategy)
+    {
+        Result = FspFileSystemDefaultThreadCount(&ThreadCount);
+        if (!NT_SUCCESS(Result))
+            return Result;
     }
 
     if (ThreadCount < FspFileSystemDispatcherThreadCountMin)
         ThreadCount = FspFileSystemDispatcherThreadCountMin;
 
+    if (FSP_FILE_SYSTEM_DISPATCHER_AFFINITY_NUMA == DispatcherParams.Affinity)
+    {
+        Numa = MemAlloc(sizeof *Numa);
+        if (0 == Numa)
+        {
+            Result = STATUS_INSUFFICIENT_RESOURCES;
+            goto fail;
+        }
+        memset(Numa, 0, sizeof *Numa);
+
+        Result = FspFileSystemNumaTopology(Numa->Nodes, Numa->Affinities, &Numa->NodeCount);
+        if (!NT_SUCCESS(Result))
+            goto fail;
+        if (0 == Numa->NodeCount)
+        {
+            Result = STATUS_INVALID_PARAMETER;
+            goto fail;
+        }
+    }
+
+    if (ThreadCount < DispatcherParams.ThreadCountMax)
+    {
+        Adaptive = MemAlloc(sizeof *Adaptive);
+        if (0 == Adaptive)
+        {
+            Result = STATUS_INSUFFICIENT_RESOURCES;
+            goto fail;
+        }
+        memset(Adaptive, 0, sizeof *Adaptive);
+
+        Result = FspFileSystemProcessorCount(&Adaptive->ProcessorCount);
+        if (!NT_SUCCESS(Result))
+            goto fail;
+
+        Adaptive->StopEvent = CreateEventW(0, TRUE, FALSE, 0);
+        if (0 == Adaptive->StopEvent)
+        {
+            Result = FspNtStatusFromWin32(GetLastError());
+            goto fail;
+        }
+
+        QueryPerformanceFrequency(&Frequency);
+        Adaptive->ThreadCountMin = ThreadCount;
+        Adaptive->ThreadCountMax = DispatcherParams.ThreadCountMax;
+        if (Adaptive->ThreadCountMax > FspFileSystemDispatcherAdaptiveThreadCountMax)
+            Adaptive->ThreadCountMax = FspFileSystemDispatcherAdaptiveThreadCountMax;
+        if (Adaptive->ThreadCountMin > Adaptive->ThreadCountMax)
+            Adaptive->ThreadCountMin = Adaptive->ThreadCountMax;
+        Adaptive->Interval = 0 != DispatcherParams.AdaptiveInterval ?
+            DispatcherParams.AdaptiveInterval : FspFileSystemDispatcherAdaptiveDefaultInterval;
+        Adaptive->IdleTimeout = Frequency.QuadPart *
+            (0 != DispatcherParams.IdleTimeout ?
+                DispatcherParams.IdleTimeout : FspFileSystemDispatcherAdaptiveDefaultIdleTimeout) /
+            1000;
+        Adaptive->LatencyThreshold = Frequency.QuadPart *
+            (0 != DispatcherParams.LatencyThreshold ?
+                DispatcherParams.LatencyThreshold : FspFileSystemDispatcherAdaptiveDefaultLatencyThreshold) /
+            1000000;
+
+        /* the adaptive controller creates (and joins) the dispatcher threads; no chaining */
+        ThreadCount = 1;
+    }
+
+    if (FSP_FILE_SYSTEM_DISPATCHER_STRATEGY_WORK_STEALING == DispatcherParams.Strategy)
+    {
+        WorkerThreadCount = DispatcherParams.WorkerThreadCount;
+        if (0 == WorkerThreadCount)
+        {
+            Result = FspFileSystemDefaultThreadCount(&WorkerThreadCount);
+            if (!NT_SUCCESS(Result))
+                goto fail;
+        }
+
+        Result = FspWorkQueueCreate(WorkerThreadCount, FSP_FSCTL_TRANSACT_RSP_SIZEMAX,
+            &WorkQueue);
+        if (!NT_SUCCESS(Result))
+            goto fail;
+    }
+
+    if (0 != DispatcherParams.AsyncThreadCount)
+    {
+        Result = FspFileSystemAsyncCreate(FileSystem, DispatcherParams.AsyncThreadCount, &Async);
+        if (!NT_SUCCESS(Result))
+            goto fail;
+    }
+
+    if (0 != DispatcherParams.TransactBatchSize)
+    {
+        FileSystem->DispatcherTransactBatchSize = (ULONG)FSP_FSCTL_DEFAULT_ALIGN_UP(
+            FSP_FSCTL_TRANSACT_BATCH_BUFFER_SIZEMIN < DispatcherParams.TransactBatchSize ?
+                DispatcherParams.TransactBatchSize : FSP_FSCTL_TRANSACT_BATCH_BUFFER_SIZEMIN);
+    }
+    else
+        FileSystem->DispatcherTransactBatchSize = 0;
+
+    FileSystem->DispatcherStrategy = DispatcherParams.Strategy;
+    FileSystem->DispatcherWorkQueue = WorkQueue;
+    FileSystem->DispatcherAdaptive = Adaptive;
+    FileSystem->DispatcherNuma = Numa;
+    FileSystem->Async = Async;
     FileSystem->DispatcherThreadCount = ThreadCount;
     FileSystem->DispatcherThread = CreateThread(0, 0,
-        FspFileSystemDispatcherThread, FileSystem, 0, 0);
+        0 != Adaptive ? FspFileSystemDispatcherAdaptiveThread : FspFileSystemDispatcherThread,
+        FileSystem, 0, 0);
     if (0 == FileSystem->DispatcherThread)
-        return FspNtStatusFromWin32(GetLastError());
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        FileSystem->DispatcherWorkQueue = 0;
+        FileSystem->DispatcherAdaptive = 0;
+        FileSystem->DispatcherNuma = 0;
+        FileSystem->Async = 0;
+        goto fail;
+    }
 
     return STATUS_SUCCESS;
+
+fail:
+    if (0 != Async)
+        FspFileSystemAsyncDelete(Async);
+    if (0 != WorkQueue)
+        FspWorkQueueDelete(WorkQueue);
+    if (0 != Adaptive)
+    {
+        if (0 != Adaptive->StopEvent)
+            CloseHandle(Adaptive->StopEvent);
+        MemFree(Adaptive);
+    }
+    MemFree(Numa);
+
+    return Result;
 }
 
 FSP_API VOID FspFileSystemStopDispatcher(FSP_FILE_SYSTEM *FileSystem)
@@ -400,10 +1264,36 @@ FSP_API VOID FspFileSystemStopDispatcher(FSP_FILE_SYSTEM *FileSystem)
 
     FspFsctlStop0(FileSystem->VolumeHandle);
 
+    if (0 != FileSystem->DispatcherAdaptive)
+        SetEvent(((FSP_FILE_SYSTEM_DISPATCHER_ADAPTIVE *)FileSystem->DispatcherAdaptive)->StopEvent);
+
     WaitForSingleObject(FileSystem->DispatcherThread, INFINITE);
     CloseHandle(FileSystem->DispatcherThread);
     FileSystem->DispatcherThread = 0;
 
+    if (0 != FileSystem->DispatcherAdaptive)
+    {
+        FSP_FILE_SYSTEM_DISPATCHER_ADAPTIVE *Adaptive = FileSystem->DispatcherAdaptive;
+        FileSystem->DispatcherAdaptive = 0;
+        CloseHandle(Adaptive->StopEvent);
+        MemFree(Adaptive);
+    }
+
+    MemFree(FileSystem->DispatcherNuma);
+    FileSystem->DispatcherNuma = 0;
+
+    if (0 != FileSystem->DispatcherWorkQueue)
+    {
+        FspWorkQueueDelete(FileSystem->DispatcherWorkQueue);
+        FileSystem->DispatcherWorkQueue = 0;
+    }
+
+    if (0 != FileSystem->Async)
+    {
+        FspFileSystemAsyncDelete(FileSystem->Async);
+        FileSystem->Async = 0;
+    }
+
     FspFsctlStop(FileSystem->VolumeHandle);
 }
 
@@ -419,14 +1309,16 @@ FSP_API VOID FspFileSystemSendResponse(FSP_FILE_SYSTEM *FileSystem,
             FspDebugLogResponse(Response);
     }
 
-    Result = FspFsctlTransact(FileSystem->VolumeHandle,
-        Response, Response->Size, 0, 0, FALSE);
-    if (!NT_SUCCESS(Result))
+    if (0 != FileSystem->Trace)
     {
-        FspFileSystemSetDispatcherResult(FileSystem, Result);
+        LARGE_INTEGER Time;
 
-        FspFsctlStop0(FileSystem->VolumeHandle);
+        QueryPerformanceCounter(&Time);
+        FspFileSystemTraceRecord(FileSystem->Trace, FspFileSystemTraceResponse,
+            Response, Response->Size, Time.QuadPart);
     }
+
+    FspFileSystemTransactResponse(FileSystem, Response);
 }
 
 FSP_API FSP_FILE_SYSTEM_OPERATION_CONTEXT *FspFileSystemGetOperationContext(VOID)
@@ -190,6 +190,43 @@ exit:
     return Result;
 }
 
+FSP_API NTSTATUS FspFsctlRegisterTransferBuffers(HANDLE VolumeHandle,
+    PVOID Address, ULONG BufferSize, ULONG BufferCount)
+{
+    FSP_FSCTL_TRANSFER_BUFFERS TransferBuffers;
+    DWORD Bytes;
+
+    memset(&TransferBuffers, 0, sizeof TransferBuffers);
+    TransferBuffers.Version = sizeof TransferBuffers;
+    TransferBuffers.BufferSize = BufferSize;
+    TransferBuffers.BufferCount = BufferCount;
+    TransferBuffers.Address = (UINT64)(UINT_PTR)Address;
+
+    if (!DeviceIoControl(VolumeHandle,
+        FSP_FSCTL_TRANSFER_BUFFERS,
+        &TransferBuffers, sizeof TransferBuffers, 0, 0,
+        &Bytes, 0))
+        return FspNtStatusFromWin32(GetLastError());
+
+    return STATUS_SUCCESS;
+}
+
+FSP_API NTSTATUS FspFsctlQueueInfo(HANDLE VolumeHandle, UINT32 Flags,
+    FSP_FSCTL_QUEUE_INFO *QueueInfo)
+{
+    DWORD Bytes;
+
+    memset(QueueInfo, 0, sizeof *QueueInfo);
+    QueueInfo->Flags = Flags;
+    if (!DeviceIoControl(VolumeHandle,
+        FSP_FSCTL_QUEUE_INFO,
+        QueueInfo, sizeof *QueueInfo, QueueInfo, sizeof *QueueInfo,
+        &Bytes, 0))
+        return FspNtStatusFromWin32(GetLastError());
+
+    return STATUS_SUCCESS;
+}
+
 FSP_API NTSTATUS FspFsctlGetVolumeList(PWSTR DevicePath,
     PWCHAR VolumeListBuf, PSIZE_T PVolumeListSize)
 {
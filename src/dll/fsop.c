@@ -44,40 +44,258 @@
             )                           \
     )
 
-FSP_API NTSTATUS FspFileSystemOpEnter(FSP_FILE_SYSTEM *FileSystem,
-    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
+/*
+ * Path-sharded operation guard
+ *
+ * The shard of a request is selected by hashing the path of the parent directory of the
+ * file being accessed; the hash ignores case. Hash collisions only cause unnecessary
+ * serialization. Requests that do not carry a path lock all shards.
+ *
+ * A directory listing (QueryDirectory) accesses the entries of the directory itself, so it
+ * selects the shard of the directory's own path: this is the shard that creates, deletes and
+ * renames of its entries select.
+ */
+#define FspFileSystemOpGuardShardCount  64
+#define FspFileSystemOpGuardShardAll    ((ULONG)-1)
+
+typedef struct
 {
-    switch (FileSystem->OpGuardStrategy)
+    SRWLOCK Lock;
+    UINT8 Padding[64 - sizeof(SRWLOCK)];
+} FSP_FILE_SYSTEM_OP_GUARD_SHARD;
+
+NTSTATUS FspFileSystemOpGuardShardsCreate(PVOID *PShards)
+{
+    FSP_FILE_SYSTEM_OP_GUARD_SHARD *Shards;
+
+    *PShards = 0;
+
+    Shards = MemAlloc(FspFileSystemOpGuardShardCount * sizeof Shards[0]);
+    if (0 == Shards)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    memset(Shards, 0, FspFileSystemOpGuardShardCount * sizeof Shards[0]);
+    for (ULONG I = 0; FspFileSystemOpGuardShardCount > I; I++)
+        InitializeSRWLock(&Shards[I].Lock);
+
+    *PShards = Shards;
+
+    return STATUS_SUCCESS;
+}
+
+VOID FspFileSystemOpGuardShardsDelete(PVOID Shards)
+{
+    MemFree(Shards);
+}
+
+ULONG FspFileSystemOpGuardShardOfParentW(PWSTR FileName, ULONG Length)
+{
+    PWSTR Leaf;
+    ULONG ParentLength, LeafLength;
+    UINT32 Hash;
+
+    FspPathSplit(FileName, Length, &ParentLength, &Leaf, &LeafLength);
+    Hash = FspPathHash(FileName, ParentLength, TRUE);
+
+    return (Hash ^ (Hash >> 16)) % FspFileSystemOpGuardShardCount;
+}
+
+ULONG FspFileSystemOpGuardShardOfDirectoryW(PWSTR FileName, ULONG Length)
+{
+    UINT32 Hash;
+
+    /* view the directory the way FspPathSplit views the parent of its entries */
+    while (1 < Length && L'\\' == FileName[Length - 1])
+        Length--;
+    Hash = FspPathHash(FileName, Length, TRUE);
+
+    return (Hash ^ (Hash >> 16)) % FspFileSystemOpGuardShardCount;
+}
+
+static inline
+VOID FspFileSystemOpGuardRequestShards(FSP_FSCTL_TRANSACT_REQ *Request,
+    PULONG PShard0, PULONG PShard1)
+{
+    ULONG Shard0, Shard1, Temp;
+
+    if (0 == Request->FileName.Size)
     {
-    case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_FINE:
-        if ((FspFsctlTransactCreateKind == Request->Kind &&
-                FILE_OPEN != ((Request->Req.Create.CreateOptions >> 24) & 0xff)) ||
-            FspFsctlTransactOverwriteKind == Request->Kind ||
-            (FspFsctlTransactCleanupKind == Request->Kind &&
-                Request->Req.Cleanup.Delete) ||
-            (FspFsctlTransactSetInformationKind == Request->Kind &&
-                10/*FileRenameInformation*/ == Request->Req.SetInformation.FileInformationClass) ||
-            FspFsctlTransactSetVolumeInformationKind == Request->Kind ||
-            (FspFsctlTransactFlushBuffersKind == Request->Kind &&
-                0 == Request->Req.FlushBuffers.UserContext &&
-                0 == Request->Req.FlushBuffers.UserContext2))
+        *PShard0 = *PShard1 = FspFileSystemOpGuardShardAll;
+        return;
+    }
+
+    /* FileName.Size includes the terminating NUL */
+    if (FspFsctlTransactQueryDirectoryKind == Request->Kind)
+        Shard0 = Shard1 = FspFileSystemOpGuardShardOfDirectoryW(
+            (PWSTR)(Request->Buffer + Request->FileName.Offset),
+            Request->FileName.Size / sizeof(WCHAR) - 1);
+    else
+        Shard0 = Shard1 = FspFileSystemOpGuardShardOfParentW(
+            (PWSTR)(Request->Buffer + Request->FileName.Offset),
+            Request->FileName.Size / sizeof(WCHAR) - 1);
+    if (FspFsctlTransactSetInformationKind == Request->Kind &&
+        10/*FileRenameInformation*/ == Request->Req.SetInformation.FileInformationClass)
+    {
+        Shard1 = FspFileSystemOpGuardShardOfParentW(
+            (PWSTR)(Request->Buffer + Request->Req.SetInformation.Info.Rename.NewFileName.Offset),
+            Request->Req.SetInformation.Info.Rename.NewFileName.Size / sizeof(WCHAR) - 1);
+        if (Shard0 > Shard1)
         {
+            Temp = Shard0;
+            Shard0 = Shard1;
+            Shard1 = Temp;
+        }
+    }
+
+    *PShard0 = Shard0;
+    *PShard1 = Shard1;
+}
+
+VOID FspFileSystemOpGuardShardsAcquire(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, BOOLEAN Exclusive)
+{
+    FSP_FILE_SYSTEM_OP_GUARD_SHARD *Shards = FileSystem->OpGuardShards;
+    ULONG Shard0, Shard1;
+
+    if (FspFsctlTransactQueryVolumeInformationKind == Request->Kind ||
+        FspFsctlTransactSetVolumeInformationKind == Request->Kind)
+    {
+        if (Exclusive)
             AcquireSRWLockExclusive(&FileSystem->OpGuardLock);
+        else
+            AcquireSRWLockShared(&FileSystem->OpGuardLock);
+        return;
+    }
+
+    FspFileSystemOpGuardRequestShards(Request, &Shard0, &Shard1);
+    if (FspFileSystemOpGuardShardAll == Shard0)
+    {
+        Shard0 = 0;
+        Shard1 = FspFileSystemOpGuardShardCount - 1;
+    }
+    else if (Shard0 != Shard1)
+    {
+        /* shard pair: lock both shards in order */
+        if (Exclusive)
+        {
+            AcquireSRWLockExclusive(&Shards[Shard0].Lock);
+            AcquireSRWLockExclusive(&Shards[Shard1].Lock);
         }
         else
-        if (FspFsctlTransactCreateKind == Request->Kind ||
-            (FspFsctlTransactSetInformationKind == Request->Kind &&
-                13/*FileDispositionInformation*/ == Request->Req.SetInformation.FileInformationClass) ||
-            FspFsctlTransactQueryDirectoryKind == Request->Kind ||
-            FspFsctlTransactQueryVolumeInformationKind == Request->Kind)
         {
-            AcquireSRWLockShared(&FileSystem->OpGuardLock);
+            AcquireSRWLockShared(&Shards[Shard0].Lock);
+            AcquireSRWLockShared(&Shards[Shard1].Lock);
         }
+        return;
+    }
+
+    for (ULONG I = Shard0; Shard1 >= I; I++)
+        if (Exclusive)
+            AcquireSRWLockExclusive(&Shards[I].Lock);
+        else
+            AcquireSRWLockShared(&Shards[I].Lock);
+}
+
+VOID FspFileSystemOpGuardShardsRelease(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, BOOLEAN Exclusive)
+{
+    FSP_FILE_SYSTEM_OP_GUARD_SHARD *Shards = FileSystem->OpGuardShards;
+    ULONG Shard0, Shard1;
+
+    if (FspFsctlTransactQueryVolumeInformationKind == Request->Kind ||
+        FspFsctlTransactSetVolumeInformationKind == Request->Kind)
+    {
+        if (Exclusive)
+            ReleaseSRWLockExclusive(&FileSystem->OpGuardLock);
+        else
+            ReleaseSRWLockShared(&FileSystem->OpGuardLock);
+        return;
+    }
+
+    FspFileSystemOpGuardRequestShards(Request, &Shard0, &Shard1);
+    if (FspFileSystemOpGuardShardAll == Shard0)
+    {
+        Shard0 = 0;
+        Shard1 = FspFileSystemOpGuardShardCount - 1;
+    }
+    else if (Shard0 != Shard1)
+    {
+        if (Exclusive)
+        {
+            ReleaseSRWLockExclusive(&Shards[Shard1].Lock);
+            ReleaseSRWLockExclusive(&Shards[Shard0].Lock);
+        }
+        else
+        {
+            ReleaseSRWLockShared(&Shards[Shard1].Lock);
+            ReleaseSRWLockShared(&Shards[Shard0].Lock);
+        }
+        return;
+    }
+
+    for (ULONG I = Shard1 + 1; Shard0 < I; I--)
+        if (Exclusive)
+            ReleaseSRWLockExclusive(&Shards[I - 1].Lock);
+        else
+            ReleaseSRWLockShared(&Shards[I - 1].Lock);
+}
+
+/*
+ * Operation guard
+ *
+ * Returns the lock mode that the fine-grained and path-sharded strategies apply
+ * to a request: 0 for none, 1 for shared, 2 for exclusive.
+ */
+static inline
+ULONG FspFileSystemOpGuardMode(FSP_FSCTL_TRANSACT_REQ *Request)
+{
+    if ((FspFsctlTransactCreateKind == Request->Kind &&
+            FILE_OPEN != ((Request->Req.Create.CreateOptions >> 24) & 0xff)) ||
+        FspFsctlTransactOverwriteKind == Request->Kind ||
+        (FspFsctlTransactCleanupKind == Request->Kind &&
+            Request->Req.Cleanup.Delete) ||
+        (FspFsctlTransactSetInformationKind == Request->Kind &&
+            10/*FileRenameInformation*/ == Request->Req.SetInformation.FileInformationClass) ||
+        FspFsctlTransactSetVolumeInformationKind == Request->Kind ||
+        (FspFsctlTransactFlushBuffersKind == Request->Kind &&
+            0 == Request->Req.FlushBuffers.UserContext &&
+            0 == Request->Req.FlushBuffers.UserContext2))
+        return 2;
+    else
+    if (FspFsctlTransactCreateKind == Request->Kind ||
+        (FspFsctlTransactSetInformationKind == Request->Kind &&
+            13/*FileDispositionInformation*/ == Request->Req.SetInformation.FileInformationClass) ||
+        FspFsctlTransactQueryDirectoryKind == Request->Kind ||
+        FspFsctlTransactQueryVolumeInformationKind == Request->Kind)
+        return 1;
+    else
+        return 0;
+}
+
+FSP_API NTSTATUS FspFileSystemOpEnter(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    ULONG Mode;
+
+    switch (FileSystem->OpGuardStrategy)
+    {
+    case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_FINE:
+        Mode = FspFileSystemOpGuardMode(Request);
+        if (2 == Mode)
+            AcquireSRWLockExclusive(&FileSystem->OpGuardLock);
+        else if (1 == Mode)
+            AcquireSRWLockShared(&FileSystem->OpGuardLock);
         break;
 
     case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_COARSE:
         AcquireSRWLockExclusive(&FileSystem->OpGuardLock);
         break;
+
+    case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_PATH_SHARDED:
+        Mode = FspFileSystemOpGuardMode(Request);
+        if (0 != Mode)
+            FspFileSystemOpGuardShardsAcquire(FileSystem, Request, 2 == Mode);
+        break;
     }
 
     return STATUS_SUCCESS;
@@ -86,37 +304,27 @@ FSP_API NTSTATUS FspFileSystemOpEnter(FSP_FILE_SYSTEM *FileSystem,
 FSP_API NTSTATUS FspFileSystemOpLeave(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
 {
+    ULONG Mode;
+
     switch (FileSystem->OpGuardStrategy)
     {
     case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_FINE:
-        if ((FspFsctlTransactCreateKind == Request->Kind &&
-                FILE_OPEN != ((Request->Req.Create.CreateOptions >> 24) & 0xff)) ||
-            FspFsctlTransactOverwriteKind == Request->Kind ||
-            (FspFsctlTransactCleanupKind == Request->Kind &&
-                Request->Req.Cleanup.Delete) ||
-            (FspFsctlTransactSetInformationKind == Request->Kind &&
-                10/*FileRenameInformation*/ == Request->Req.SetInformation.FileInformationClass) ||
-            FspFsctlTransactSetVolumeInformationKind == Request->Kind ||
-            (FspFsctlTransactFlushBuffersKind == Request->Kind &&
-                0 == Request->Req.FlushBuffers.UserContext &&
-                0 == Request->Req.FlushBuffers.UserContext2))
-        {
+        Mode = FspFileSystemOpGuardMode(Request);
+        if (2 == Mode)
             ReleaseSRWLockExclusive(&FileSystem->OpGuardLock);
-        }
-        else
-        if (FspFsctlTransactCreateKind == Request->Kind ||
-            (FspFsctlTransactSetInformationKind == Request->Kind &&
-                13/*FileDispositionInformation*/ == Request->Req.SetInformation.FileInformationClass) ||
-            FspFsctlTransactQueryDirectoryKind == Request->Kind ||
-            FspFsctlTransactQueryVolumeInformationKind == Request->Kind)
-        {
+        else if (1 == Mode)
             ReleaseSRWLockShared(&FileSystem->OpGuardLock);
-        }
         break;
 
     case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_COARSE:
         ReleaseSRWLockExclusive(&FileSystem->OpGuardLock);
         break;
+
+    case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_PATH_SHARDED:
+        Mode = FspFileSystemOpGuardMode(Request);
+        if (0 != Mode)
+            FspFileSystemOpGuardShardsRelease(FileSystem, Request, 2 == Mode);
+        break;
     }
 
     return STATUS_SUCCESS;
@@ -1580,7 +1788,8 @@ static NTSTATUS FspFileSystemResolveReparsePointsInternal(FSP_FILE_SYSTEM *FileS
     PIO_STATUS_BLOCK PIoStatus, PVOID Buffer, PSIZE_T PSize)
 {
     PREPARSE_DATA_BUFFER OutputReparseData;
-    PWSTR TargetPath, RemainderPath, LastPathComponent, NewRemainderPath, ReparseTargetPath;
+    PWSTR TargetPath, TargetPathEnd, RemainderPath, LastPathComponent, NewRemainderPath;
+    PWSTR ReparseTargetPath;
     WCHAR RemainderChar;
     SIZE_T ReparseDataSize, RemainderPathSize, ReparseTargetPathLength;
     BOOLEAN ResolveLastPathComponent;
@@ -1599,6 +1808,7 @@ static NTSTATUS FspFileSystemResolveReparsePointsInternal(FSP_FILE_SYSTEM *FileS
     OutputReparseData->SymbolicLinkReparseBuffer.Flags = SYMLINK_FLAG_RELATIVE;
     TargetPath = OutputReparseData->SymbolicLinkReparseBuffer.PathBuffer;
     memcpy(TargetPath, FileName, RemainderPathSize);
+    TargetPathEnd = TargetPath + RemainderPathSize / sizeof(WCHAR) - 1;
 
     ResolveLastPathComponent = ResolveLastPathComponent0;
     RemainderPath = TargetPath + ReparsePointIndex;
@@ -1608,16 +1818,14 @@ static NTSTATUS FspFileSystemResolveReparsePointsInternal(FSP_FILE_SYSTEM *FileS
         while (L'\\' == *RemainderPath)
             RemainderPath++;
         LastPathComponent = RemainderPath;
-        while (L'\\' != *RemainderPath)
+        RemainderPath += FspPathScan(RemainderPath, (ULONG)(TargetPathEnd - RemainderPath),
+            L'\\', L':');
+        if (L'\\' != *RemainderPath)
         {
-            if (L'\0' == *RemainderPath || L':' == *RemainderPath)
-            {
-                if (!ResolveLastPathComponent)
-                    goto symlink_exit;
-                ResolveLastPathComponent = FALSE;
-                break;
-            }
-            RemainderPath++;
+            /* last path component: end of path or stream */
+            if (!ResolveLastPathComponent)
+                goto symlink_exit;
+            ResolveLastPathComponent = FALSE;
         }
 
         /* handle dot and dotdot! */
@@ -1702,7 +1910,7 @@ static NTSTATUS FspFileSystemResolveReparsePointsInternal(FSP_FILE_SYSTEM *FileS
             TargetPath : LastPathComponent;
 
     reparse:
-        RemainderPathSize = (lstrlenW(RemainderPath) + 1) * sizeof(WCHAR);
+        RemainderPathSize = (TargetPathEnd - RemainderPath + 1) * sizeof(WCHAR);
         if ((PUINT8)NewRemainderPath + ReparseTargetPathLength + RemainderPathSize >
             (PUINT8)Buffer + *PSize)
             return STATUS_REPARSE_POINT_NOT_RESOLVED;
@@ -1713,6 +1921,8 @@ static NTSTATUS FspFileSystemResolveReparsePointsInternal(FSP_FILE_SYSTEM *FileS
 
         /* copy symlink target */
         memcpy(NewRemainderPath, ReparseTargetPath, ReparseTargetPathLength);
+        TargetPathEnd = (PWSTR)((PUINT8)NewRemainderPath + ReparseTargetPathLength +
+            RemainderPathSize) - 1;
 
         /* if an absolute (in the NT namespace) symlink exit now */
         if (0 != ReparseTargetPath /* ensure we are not doing dot handling */ &&
@@ -1730,7 +1940,7 @@ static NTSTATUS FspFileSystemResolveReparsePointsInternal(FSP_FILE_SYSTEM *FileS
 symlink_exit:
     OutputReparseData->SymbolicLinkReparseBuffer.SubstituteNameLength =
         OutputReparseData->SymbolicLinkReparseBuffer.PrintNameLength =
-        (USHORT)lstrlenW(OutputReparseData->SymbolicLinkReparseBuffer.PathBuffer) * sizeof(WCHAR);
+        (USHORT)((TargetPathEnd - TargetPath) * sizeof(WCHAR));
     OutputReparseData->ReparseDataLength =
         FIELD_OFFSET(REPARSE_DATA_BUFFER, SymbolicLinkReparseBuffer.PathBuffer) -
         FIELD_OFFSET(REPARSE_DATA_BUFFER, SymbolicLinkReparseBuffer) +
@@ -1749,7 +1959,7 @@ reparse_data_exit:
             STATUS_IO_REPARSE_DATA_INVALID : STATUS_REPARSE_POINT_NOT_RESOLVED;
 
     if (IO_REPARSE_TAG_MOUNT_POINT == ReparseData->ReparseTag)
-        RemainderPathSize = lstrlenW(RemainderPath) * sizeof(WCHAR);
+        RemainderPathSize = (TargetPathEnd - RemainderPath) * sizeof(WCHAR);
 
     *PSize = ReparseDataSize;
     memcpy(Buffer, ReparseData, ReparseDataSize);
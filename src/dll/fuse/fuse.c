@@ -67,7 +67,8 @@ static struct fuse_opt fsp_fuse_core_opts[] =
     FSP_FUSE_CORE_OPT("attr_timeout=", set_attr_timeout, 1),
     FSP_FUSE_CORE_OPT("attr_timeout=%d", attr_timeout, 0),
     FUSE_OPT_KEY("ac_attr_timeout", FUSE_OPT_KEY_DISCARD),
-    FUSE_OPT_KEY("negative_timeout", FUSE_OPT_KEY_DISCARD),
+    FSP_FUSE_CORE_OPT("negative_timeout=", set_negative_timeout, 1),
+    FSP_FUSE_CORE_OPT("negative_timeout=%d", negative_timeout, 0),
     FUSE_OPT_KEY("noforget", FUSE_OPT_KEY_DISCARD),
     FUSE_OPT_KEY("intr", FUSE_OPT_KEY_DISCARD),
     FUSE_OPT_KEY("intr_signal=", FUSE_OPT_KEY_DISCARD),
@@ -97,6 +98,11 @@ static struct fuse_opt fsp_fuse_core_opts[] =
     FSP_FUSE_CORE_OPT("VolumeInfoTimeout=%d", VolumeParams.VolumeInfoTimeout, 0),
     FSP_FUSE_CORE_OPT("KeepFileCache=", set_KeepFileCache, 1),
     FSP_FUSE_CORE_OPT("ThreadCount=%u", ThreadCount, 0),
+    FSP_FUSE_CORE_OPT("PathShardedGuard", PathShardedGuard, 1),
+    FSP_FUSE_CORE_OPT("AttrCache", AttrCache, 1),
+    FSP_FUSE_CORE_OPT("DirInfoThreadCount=%u", DirInfoThreadCount, 0),
+    FSP_FUSE_CORE_OPT("ReadAheadSize=%u", ReadAheadSize, 0),
+    FSP_FUSE_CORE_OPT("WriteBackSize=%u", WriteBackSize, 0),
     FUSE_OPT_KEY("UNC=", 'U'),
     FUSE_OPT_KEY("--UNC=", 'U'),
     FUSE_OPT_KEY("VolumePrefix=", 'U'),
@@ -422,6 +428,12 @@ static int fsp_fuse_core_opt_proc(void *opt_data0, const char *arg, int key,
             "    -o VolumeInfoTimeout=N     volume info timeout (millis)\n"
             "    -o KeepFileCache           do not discard cache when files are closed\n"
             "    -o ThreadCount             number of file system dispatcher threads\n"
+            "    -o PathShardedGuard        lock namespace operations per directory\n"
+            "    -o AttrCache               cache getattr results for attr_timeout secs\n"
+            "    -o DirInfoThreadCount=N    threads that getattr directory entries in parallel\n"
+            "                               (ignored with -s)\n"
+            "    -o ReadAheadSize=N         max read-ahead window of sequential reads (bytes)\n"
+            "    -o WriteBackSize=N         coalesce small sequential writes up to N bytes\n"
             );
         opt_data->help = 1;
         return 1;
@@ -654,6 +666,33 @@ FSP_FUSE_API struct fuse *fsp_fuse_new(struct fsp_fuse_env *env,
     f->rellinks = opt_data.rellinks;
     f->dothidden = opt_data.dothidden;
     f->ThreadCount = opt_data.ThreadCount;
+    f->PathShardedGuard = opt_data.PathShardedGuard;
+    if (opt_data.AttrCache ||
+        (opt_data.set_negative_timeout && 0 < opt_data.negative_timeout))
+    {
+        /* libfuse attr_timeout semantics; the default attr_timeout is 1 second */
+        Result = fsp_fuse_attr_cache_create(
+            !opt_data.AttrCache ? 0 :
+            !opt_data.set_attr_timeout ? 1000 :
+            0 < opt_data.attr_timeout ? opt_data.attr_timeout * 1000 : 0,
+            opt_data.set_negative_timeout && 0 < opt_data.negative_timeout ?
+                opt_data.negative_timeout * 1000 : 0,
+            &f->AttrCache);
+        if (!NT_SUCCESS(Result))
+            goto fail;
+    }
+    f->DirInfoThreadCount = opt_data.DirInfoThreadCount;
+    if (0 != f->DirInfoThreadCount)
+    {
+        Result = FspWorkQueueCreate(f->DirInfoThreadCount,
+            FSP_FUSE_DIRINFO_PATH_SIZEMAX, &f->DirInfoWorkQueue);
+        if (!NT_SUCCESS(Result))
+            goto fail;
+    }
+    f->ReadAheadSize = FSP_FUSE_FILE_IO_SIZEMAX < opt_data.ReadAheadSize ?
+        FSP_FUSE_FILE_IO_SIZEMAX : opt_data.ReadAheadSize;
+    f->WriteBackSize = FSP_FUSE_FILE_IO_SIZEMAX < opt_data.WriteBackSize ?
+        FSP_FUSE_FILE_IO_SIZEMAX : opt_data.WriteBackSize;
     memcpy(&f->ops, ops, opsize);
     f->data = data;
     f->DebugLog = opt_data.debug ? -1 : 0;
@@ -719,6 +758,13 @@ fail:
 FSP_FUSE_API void fsp_fuse_destroy(struct fsp_fuse_env *env,
     struct fuse *f)
 {
+    if (0 != f->DirInfoWorkQueue)
+        FspWorkQueueDelete(f->DirInfoWorkQueue);
+
+    fsp_fuse_node_table_delete(f->NodeTable);
+
+    fsp_fuse_attr_cache_delete(f->AttrCache);
+
     fsp_fuse_obj_free(f->MountPoint);
 
     fsp_fuse_obj_free(f);
@@ -751,6 +797,10 @@ FSP_FUSE_API int fsp_fuse_notify(struct fsp_fuse_env *env,
     NTSTATUS Result;
     int result;
 
+    /* the file system tells us that path changed: drop any attributes we have cached */
+    fsp_fuse_attr_cache_invalidate(f->AttrCache, path, TRUE);
+    fsp_fuse_node_invalidate(f->NodeTable, path);
+
     Result = FspPosixMapPosixToWindowsPath(path, &Path);
     if (!NT_SUCCESS(Result))
     {
@@ -847,6 +897,29 @@ exit:
     return result;
 }
 
+FSP_FUSE_API int FSP_FUSE_API_NAME(fsp_fuse_set_ino_operations)(struct fsp_fuse_env *env,
+    struct fuse *f, const struct fuse_ino_operations *ops, size_t opsize)
+{
+    NTSTATUS Result;
+
+    /* the node table is consulted without synchronization once the dispatcher runs */
+    if (0 != f->FileSystem || 0 != f->NodeTable)
+        return -EBUSY;
+
+    if (opsize > sizeof f->ino_ops)
+        opsize = sizeof f->ino_ops;
+    memset(&f->ino_ops, 0, sizeof f->ino_ops);
+    memcpy(&f->ino_ops, ops, opsize);
+    if (0 == f->ino_ops.lookup)
+        return -EINVAL;
+
+    Result = fsp_fuse_node_table_create(&f->ino_ops, &f->NodeTable);
+    if (!NT_SUCCESS(Result))
+        return -ENOMEM;
+
+    return 0;
+}
+
 FSP_FUSE_API struct fuse_context *fsp_fuse_get_context(struct fsp_fuse_env *env)
 {
     struct fuse_context *context;
@@ -0,0 +1,320 @@
+/**
+ * @file dll/fuse/fuse_attr.c
+ *
+ * @copyright 2015-2021 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#include <dll/fuse/library.h>
+
+/*
+ * Attribute cache
+ *
+ * Most FSP_FILE_SYSTEM_INTERFACE operations (Open, Write, SetBasicInfo, GetSecurity, ...)
+ * need the attributes of a file and the FUSE layer gets them by calling getattr/fgetattr.
+ * For file systems whose getattr is a network round trip this doubles the cost of many
+ * operations. When enabled (-o AttrCache) getattr results are cached by POSIX path for
+ * attr_timeout seconds.
+ *
+ * Entries are invalidated by the mutating operations of the FUSE layer and by fuse_notify.
+ * Writes that extend a file instead extend the cached size to what the file system has
+ * been sent, so that a sequence of appending writes does not getattr every time.
+ * Changes that the file system makes behind our back become visible after at most
+ * attr_timeout seconds, which is the libfuse attr_timeout contract.
+ *
+ * Failed lookups (ENOENT) may also be cached for negative_timeout seconds. This helps
+ * applications that probe for many files that do not exist and FixDirInfo, which may
+ * getattr the same names repeatedly. A negative entry is removed when the name is created,
+ * because creation invalidates the path like any other mutating operation.
+ *
+ * The cache is a fixed size hash table protected by a single SRW lock. It is bounded: when
+ * full, expired entries are purged and if that is not enough the bucket being inserted into
+ * is emptied.
+ */
+
+enum
+{
+    fsp_fuse_attr_cache_bucket_count = 1024,
+    fsp_fuse_attr_cache_max_count = 16 * fsp_fuse_attr_cache_bucket_count,
+};
+
+struct fsp_fuse_attr_cache_entry
+{
+    struct fsp_fuse_attr_cache_entry *HashNext;
+    UINT64 ExpirationTime;
+    UINT32 Hash;
+    ULONG PosixPathLength;
+    int Err;                            /* 0: positive entry; -errno: negative entry */
+    struct fuse_stat_ex stbuf;
+    char PosixPath[];
+};
+
+struct fsp_fuse_attr_cache
+{
+    SRWLOCK Lock;
+    UINT64 Timeout, NegativeTimeout;
+    ULONG Count;
+    struct fsp_fuse_attr_cache_entry *Buckets[fsp_fuse_attr_cache_bucket_count];
+};
+
+static inline UINT32 fsp_fuse_attr_cache_hash(const char *PosixPath, ULONG Length)
+{
+    UINT32 Hash = 2166136261;
+
+    for (ULONG I = 0; Length > I; I++)
+        Hash = (Hash ^ (UINT8)PosixPath[I]) * 16777619;
+
+    return Hash;
+}
+
+static inline struct fsp_fuse_attr_cache_entry **fsp_fuse_attr_cache_lookup(
+    struct fsp_fuse_attr_cache *Cache, const char *PosixPath, ULONG Length, UINT32 Hash)
+{
+    struct fsp_fuse_attr_cache_entry **PEntry;
+
+    for (PEntry = &Cache->Buckets[Hash % fsp_fuse_attr_cache_bucket_count];
+        0 != *PEntry; PEntry = &(*PEntry)->HashNext)
+        if (Hash == (*PEntry)->Hash && Length == (*PEntry)->PosixPathLength &&
+            0 == memcmp(PosixPath, (*PEntry)->PosixPath, Length))
+            break;
+
+    return PEntry;
+}
+
+static VOID fsp_fuse_attr_cache_purge(struct fsp_fuse_attr_cache *Cache,
+    UINT64 CurrentTime)
+{
+    struct fsp_fuse_attr_cache_entry **PEntry, *Entry;
+
+    for (ULONG I = 0; fsp_fuse_attr_cache_bucket_count > I; I++)
+        for (PEntry = &Cache->Buckets[I]; 0 != (Entry = *PEntry);)
+            if (CurrentTime >= Entry->ExpirationTime)
+            {
+                *PEntry = Entry->HashNext;
+                MemFree(Entry);
+                Cache->Count--;
+            }
+            else
+                PEntry = &Entry->HashNext;
+}
+
+NTSTATUS fsp_fuse_attr_cache_create(unsigned Timeout, unsigned NegativeTimeout,
+    struct fsp_fuse_attr_cache **PCache)
+{
+    struct fsp_fuse_attr_cache *Cache;
+
+    *PCache = 0;
+
+    Cache = MemAlloc(sizeof *Cache);
+    if (0 == Cache)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    memset(Cache, 0, sizeof *Cache);
+    InitializeSRWLock(&Cache->Lock);
+    Cache->Timeout = Timeout;
+    Cache->NegativeTimeout = NegativeTimeout;
+
+    *PCache = Cache;
+
+    return STATUS_SUCCESS;
+}
+
+VOID fsp_fuse_attr_cache_delete(struct fsp_fuse_attr_cache *Cache)
+{
+    if (0 == Cache)
+        return;
+
+    fsp_fuse_attr_cache_invalidate_all(Cache);
+    MemFree(Cache);
+}
+
+BOOLEAN fsp_fuse_attr_cache_get(struct fsp_fuse_attr_cache *Cache,
+    const char *PosixPath, struct fuse_stat_ex *stbuf, int *PErr)
+{
+    struct fsp_fuse_attr_cache_entry *Entry;
+    ULONG Length;
+    UINT32 Hash;
+    BOOLEAN Result = FALSE;
+
+    if (0 == Cache)
+        return FALSE;
+
+    Length = lstrlenA(PosixPath);
+    Hash = fsp_fuse_attr_cache_hash(PosixPath, Length);
+
+    AcquireSRWLockShared(&Cache->Lock);
+    Entry = *fsp_fuse_attr_cache_lookup(Cache, PosixPath, Length, Hash);
+    if (0 != Entry && GetTickCount64() < Entry->ExpirationTime)
+    {
+        if (0 == Entry->Err)
+            memcpy(stbuf, &Entry->stbuf, sizeof Entry->stbuf);
+        *PErr = Entry->Err;
+        Result = TRUE;
+    }
+    ReleaseSRWLockShared(&Cache->Lock);
+
+    return Result;
+}
+
+VOID fsp_fuse_attr_cache_set(struct fsp_fuse_attr_cache *Cache,
+    const char *PosixPath, const struct fuse_stat_ex *stbuf, int Err)
+{
+    struct fsp_fuse_attr_cache_entry **PEntry, *Entry, *NewEntry;
+    ULONG Length;
+    UINT32 Hash;
+    UINT64 CurrentTime;
+
+    if (0 == Cache)
+        return;
+
+    if (0 == (0 == Err ? Cache->Timeout : Cache->NegativeTimeout))
+    {
+        /* this kind of result is not cached; do not leave a stale entry behind either */
+        fsp_fuse_attr_cache_invalidate(Cache, PosixPath, FALSE);
+        return;
+    }
+
+    Length = lstrlenA(PosixPath);
+    Hash = fsp_fuse_attr_cache_hash(PosixPath, Length);
+
+    /* allocate outside the lock; getattr results arrive in parallel from all dispatchers */
+    NewEntry = MemAlloc(sizeof *NewEntry + Length + 1);
+    if (0 == NewEntry)
+        return;
+    NewEntry->Hash = Hash;
+    NewEntry->PosixPathLength = Length;
+    NewEntry->Err = Err;
+    if (0 == Err)
+        memcpy(&NewEntry->stbuf, stbuf, sizeof *stbuf);
+    else
+        memset(&NewEntry->stbuf, 0, sizeof NewEntry->stbuf);
+    memcpy(NewEntry->PosixPath, PosixPath, Length + 1);
+
+    AcquireSRWLockExclusive(&Cache->Lock);
+    CurrentTime = GetTickCount64();
+    NewEntry->ExpirationTime = CurrentTime + (0 == Err ? Cache->Timeout : Cache->NegativeTimeout);
+
+    PEntry = fsp_fuse_attr_cache_lookup(Cache, PosixPath, Length, Hash);
+    if (0 != (Entry = *PEntry))
+    {
+        NewEntry->HashNext = Entry->HashNext;
+        *PEntry = NewEntry;
+    }
+    else
+    {
+        if (fsp_fuse_attr_cache_max_count <= Cache->Count)
+        {
+            fsp_fuse_attr_cache_purge(Cache, CurrentTime);
+            if (fsp_fuse_attr_cache_max_count <= Cache->Count)
+            {
+                PEntry = &Cache->Buckets[Hash % fsp_fuse_attr_cache_bucket_count];
+                while (0 != (Entry = *PEntry))
+                {
+                    *PEntry = Entry->HashNext;
+                    MemFree(Entry);
+                    Cache->Count--;
+                }
+            }
+            PEntry = &Cache->Buckets[Hash % fsp_fuse_attr_cache_bucket_count];
+        }
+        NewEntry->HashNext = *PEntry;
+        *PEntry = NewEntry;
+        Cache->Count++;
+    }
+    ReleaseSRWLockExclusive(&Cache->Lock);
+
+    MemFree(Entry);
+}
+
+VOID fsp_fuse_attr_cache_set_size(struct fsp_fuse_attr_cache *Cache,
+    const char *PosixPath, UINT64 FileSize)
+{
+    struct fsp_fuse_attr_cache_entry *Entry;
+    ULONG Length;
+    UINT32 Hash;
+
+    if (0 == Cache)
+        return;
+
+    Length = lstrlenA(PosixPath);
+    Hash = fsp_fuse_attr_cache_hash(PosixPath, Length);
+
+    AcquireSRWLockExclusive(&Cache->Lock);
+    Entry = *fsp_fuse_attr_cache_lookup(Cache, PosixPath, Length, Hash);
+    if (0 != Entry && 0 == Entry->Err && FileSize > (UINT64)Entry->stbuf.st_size)
+        Entry->stbuf.st_size = FileSize;
+    ReleaseSRWLockExclusive(&Cache->Lock);
+}
+
+static VOID fsp_fuse_attr_cache_remove(struct fsp_fuse_attr_cache *Cache,
+    const char *PosixPath, ULONG Length)
+{
+    struct fsp_fuse_attr_cache_entry **PEntry, *Entry;
+
+    PEntry = fsp_fuse_attr_cache_lookup(Cache,
+        PosixPath, Length, fsp_fuse_attr_cache_hash(PosixPath, Length));
+    if (0 != (Entry = *PEntry))
+    {
+        *PEntry = Entry->HashNext;
+        MemFree(Entry);
+        Cache->Count--;
+    }
+}
+
+VOID fsp_fuse_attr_cache_invalidate(struct fsp_fuse_attr_cache *Cache,
+    const char *PosixPath, BOOLEAN Parent)
+{
+    ULONG Length, ParentLength;
+
+    if (0 == Cache)
+        return;
+
+    Length = lstrlenA(PosixPath);
+
+    AcquireSRWLockExclusive(&Cache->Lock);
+    fsp_fuse_attr_cache_remove(Cache, PosixPath, Length);
+    if (Parent)
+    {
+        /* the parent's times (and link count) change when a name is added or removed */
+        for (ParentLength = Length; 0 < ParentLength && '/' != PosixPath[ParentLength - 1];
+            ParentLength--)
+            ;
+        if (1 < ParentLength)
+            ParentLength--;
+        if (0 < ParentLength)
+            fsp_fuse_attr_cache_remove(Cache, PosixPath, ParentLength);
+    }
+    ReleaseSRWLockExclusive(&Cache->Lock);
+}
+
+VOID fsp_fuse_attr_cache_invalidate_all(struct fsp_fuse_attr_cache *Cache)
+{
+    struct fsp_fuse_attr_cache_entry *Entry;
+
+    if (0 == Cache)
+        return;
+
+    AcquireSRWLockExclusive(&Cache->Lock);
+    for (ULONG I = 0; fsp_fuse_attr_cache_bucket_count > I; I++)
+        while (0 != (Entry = Cache->Buckets[I]))
+        {
+            Cache->Buckets[I] = Entry->HashNext;
+            MemFree(Entry);
+        }
+    Cache->Count = 0;
+    ReleaseSRWLockExclusive(&Cache->Lock);
+}
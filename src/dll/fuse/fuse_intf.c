@@ -21,47 +21,64 @@
 
 #include <dll/fuse/library.h>
 
+static inline
+ULONG fsp_fuse_op_guard_mode(FSP_FSCTL_TRANSACT_REQ *Request)
+{
+    /* 0: none, 1: shared, 2: exclusive */
+    if ((FspFsctlTransactCreateKind == Request->Kind &&
+            FILE_OPEN != ((Request->Req.Create.CreateOptions >> 24) & 0xff)) ||
+        FspFsctlTransactOverwriteKind == Request->Kind ||
+        (FspFsctlTransactCleanupKind == Request->Kind &&
+            Request->Req.Cleanup.Delete) ||
+        (FspFsctlTransactSetInformationKind == Request->Kind &&
+            10/*FileRenameInformation*/ == Request->Req.SetInformation.FileInformationClass) ||
+        FspFsctlTransactSetVolumeInformationKind == Request->Kind ||
+        (FspFsctlTransactFlushBuffersKind == Request->Kind &&
+            0 == Request->Req.FlushBuffers.UserContext &&
+            0 == Request->Req.FlushBuffers.UserContext2) ||
+        /* FSCTL_SET_REPARSE_POINT manipulates namespace */
+        (FspFsctlTransactFileSystemControlKind == Request->Kind &&
+            FSCTL_SET_REPARSE_POINT == Request->Req.FileSystemControl.FsControlCode))
+        return 2;
+    else
+    if (FspFsctlTransactCreateKind == Request->Kind ||
+        (FspFsctlTransactSetInformationKind == Request->Kind &&
+            13/*FileDispositionInformation*/ == Request->Req.SetInformation.FileInformationClass) ||
+        FspFsctlTransactQueryDirectoryKind == Request->Kind ||
+        FspFsctlTransactQueryVolumeInformationKind == Request->Kind ||
+        /* FSCTL_GET_REPARSE_POINT may access namespace */
+        (FspFsctlTransactFileSystemControlKind == Request->Kind &&
+            FSCTL_GET_REPARSE_POINT == Request->Req.FileSystemControl.FsControlCode))
+        return 1;
+    else
+        return 0;
+}
+
 static inline
 VOID fsp_fuse_op_enter_lock(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
 {
+    ULONG Mode;
+
     switch (FileSystem->OpGuardStrategy)
     {
     case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_FINE:
-        if ((FspFsctlTransactCreateKind == Request->Kind &&
-                FILE_OPEN != ((Request->Req.Create.CreateOptions >> 24) & 0xff)) ||
-            FspFsctlTransactOverwriteKind == Request->Kind ||
-            (FspFsctlTransactCleanupKind == Request->Kind &&
-                Request->Req.Cleanup.Delete) ||
-            (FspFsctlTransactSetInformationKind == Request->Kind &&
-                10/*FileRenameInformation*/ == Request->Req.SetInformation.FileInformationClass) ||
-            FspFsctlTransactSetVolumeInformationKind == Request->Kind ||
-            (FspFsctlTransactFlushBuffersKind == Request->Kind &&
-                0 == Request->Req.FlushBuffers.UserContext &&
-                0 == Request->Req.FlushBuffers.UserContext2) ||
-            /* FSCTL_SET_REPARSE_POINT manipulates namespace */
-            (FspFsctlTransactFileSystemControlKind == Request->Kind &&
-                FSCTL_SET_REPARSE_POINT == Request->Req.FileSystemControl.FsControlCode))
-        {
+        Mode = fsp_fuse_op_guard_mode(Request);
+        if (2 == Mode)
             AcquireSRWLockExclusive(&FileSystem->OpGuardLock);
-        }
-        else
-        if (FspFsctlTransactCreateKind == Request->Kind ||
-            (FspFsctlTransactSetInformationKind == Request->Kind &&
-                13/*FileDispositionInformation*/ == Request->Req.SetInformation.FileInformationClass) ||
-            FspFsctlTransactQueryDirectoryKind == Request->Kind ||
-            FspFsctlTransactQueryVolumeInformationKind == Request->Kind ||
-            /* FSCTL_GET_REPARSE_POINT may access namespace */
-            (FspFsctlTransactFileSystemControlKind == Request->Kind &&
-                FSCTL_GET_REPARSE_POINT == Request->Req.FileSystemControl.FsControlCode))
-        {
+        else if (1 == Mode)
             AcquireSRWLockShared(&FileSystem->OpGuardLock);
-        }
         break;
 
     case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_COARSE:
         AcquireSRWLockExclusive(&FileSystem->OpGuardLock);
         break;
+
+    case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_PATH_SHARDED:
+        Mode = fsp_fuse_op_guard_mode(Request);
+        if (0 != Mode)
+            FspFileSystemOpGuardShardsAcquire(FileSystem, Request, 2 == Mode);
+        break;
     }
 }
 
@@ -69,43 +86,27 @@ static inline
 VOID fsp_fuse_op_leave_unlock(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
 {
+    ULONG Mode;
+
     switch (FileSystem->OpGuardStrategy)
     {
     case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_FINE:
-        if ((FspFsctlTransactCreateKind == Request->Kind &&
-                FILE_OPEN != ((Request->Req.Create.CreateOptions >> 24) & 0xff)) ||
-            FspFsctlTransactOverwriteKind == Request->Kind ||
-            (FspFsctlTransactCleanupKind == Request->Kind &&
-                Request->Req.Cleanup.Delete) ||
-            (FspFsctlTransactSetInformationKind == Request->Kind &&
-                10/*FileRenameInformation*/ == Request->Req.SetInformation.FileInformationClass) ||
-            FspFsctlTransactSetVolumeInformationKind == Request->Kind ||
-            (FspFsctlTransactFlushBuffersKind == Request->Kind &&
-                0 == Request->Req.FlushBuffers.UserContext &&
-                0 == Request->Req.FlushBuffers.UserContext2) ||
-            /* FSCTL_SET_REPARSE_POINT manipulates namespace */
-            (FspFsctlTransactFileSystemControlKind == Request->Kind &&
-                FSCTL_SET_REPARSE_POINT == Request->Req.FileSystemControl.FsControlCode))
-        {
+        Mode = fsp_fuse_op_guard_mode(Request);
+        if (2 == Mode)
             ReleaseSRWLockExclusive(&FileSystem->OpGuardLock);
-        }
-        else
-        if (FspFsctlTransactCreateKind == Request->Kind ||
-            (FspFsctlTransactSetInformationKind == Request->Kind &&
-                13/*FileDispositionInformation*/ == Request->Req.SetInformation.FileInformationClass) ||
-            FspFsctlTransactQueryDirectoryKind == Request->Kind ||
-            FspFsctlTransactQueryVolumeInformationKind == Request->Kind ||
-            /* FSCTL_GET_REPARSE_POINT may access namespace */
-            (FspFsctlTransactFileSystemControlKind == Request->Kind &&
-                FSCTL_GET_REPARSE_POINT == Request->Req.FileSystemControl.FsControlCode))
-        {
+        else if (1 == Mode)
             ReleaseSRWLockShared(&FileSystem->OpGuardLock);
-        }
         break;
 
     case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_COARSE:
         ReleaseSRWLockExclusive(&FileSystem->OpGuardLock);
         break;
+
+    case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_PATH_SHARDED:
+        Mode = fsp_fuse_op_guard_mode(Request);
+        if (0 != Mode)
+            FspFileSystemOpGuardShardsRelease(FileSystem, Request, 2 == Mode);
+        break;
     }
 }
 
@@ -118,14 +119,22 @@ NTSTATUS fsp_fuse_op_enter(FSP_FILE_SYSTEM *FileSystem,
     char *PosixPath = 0;
     UINT32 Uid = -1, Gid = -1, Pid = -1;
     PWSTR FileName = 0, Suffix;
-    WCHAR Root[2] = L"\\";
+    ULONG ParentLength, SuffixLength;
+    WCHAR ParentName[FSP_FSCTL_TRANSACT_PATH_SIZEMAX / sizeof(WCHAR)];
     UINT64 AccessToken = 0;
     NTSTATUS Result;
 
     if (FspFsctlTransactCreateKind == Request->Kind)
     {
         if (Request->Req.Create.OpenTargetDirectory)
-            FspPathSuffix((PWSTR)Request->Buffer, &FileName, &Suffix, Root);
+        {
+            /* map the parent directory without splitting the request's file name in place */
+            FspPathSplit((PWSTR)Request->Buffer, Request->FileName.Size / sizeof(WCHAR) - 1,
+                &ParentLength, &Suffix, &SuffixLength);
+            memcpy(ParentName, Request->Buffer, ParentLength * sizeof(WCHAR));
+            ParentName[ParentLength] = L'\0';
+            FileName = ParentName;
+        }
         else
             FileName = (PWSTR)Request->Buffer;
         AccessToken = Request->Req.Create.AccessToken;
@@ -140,8 +149,6 @@ NTSTATUS fsp_fuse_op_enter(FSP_FILE_SYSTEM *FileSystem,
     if (0 != FileName)
     {
         Result = FspPosixMapWindowsToPosixPath(FileName, &PosixPath);
-        if (FspFsctlTransactCreateKind == Request->Kind && Request->Req.Create.OpenTargetDirectory)
-            FspPathCombine((PWSTR)Request->Buffer, Suffix);
         if (!NT_SUCCESS(Result))
             goto exit;
     }
@@ -356,9 +363,9 @@ static inline UINT32 fsp_fuse_intf_MapFlagsToFileAttributes(uint32_t flags)
 
 #define FUSE_FILE_INFO(IsDirectory, fi) ((IsDirectory) ? 0 : (fi))
 #define fsp_fuse_intf_GetFileInfoEx(FileSystem, PosixPath, fi, PUid, PGid, PMode, FileInfo)\
-    fsp_fuse_intf_GetFileInfoFunnel(FileSystem, PosixPath, fi, 0, PUid, PGid, PMode, 0, FileInfo)
+    fsp_fuse_intf_GetFileInfoFunnel(FileSystem, PosixPath, fi, 0, 0, PUid, PGid, PMode, 0, FileInfo)
 static NTSTATUS fsp_fuse_intf_GetFileInfoFunnel(FSP_FILE_SYSTEM *FileSystem,
-    const char *PosixPath, struct fuse_file_info *fi, const void *stbufp,
+    const char *PosixPath, struct fuse_file_info *fi, fuse_ino_t ino, const void *stbufp,
     PUINT32 PUid, PUINT32 PGid, PUINT32 PMode, PUINT32 PDev,
     FSP_FSCTL_FILE_INFO *FileInfo)
 {
@@ -366,21 +373,33 @@ static NTSTATUS fsp_fuse_intf_GetFileInfoFunnel(FSP_FILE_SYSTEM *FileSystem,
     UINT64 AllocationUnit;
     struct fuse_stat_ex stbuf;
     BOOLEAN StatEx = 0 != (f->conn_want & FSP_FUSE_CAP_STAT_EX);
+    int err;
 
     memset(&stbuf, 0, sizeof stbuf);
     if (0 != stbufp)
         memcpy(&stbuf, stbufp, StatEx ? sizeof(struct fuse_stat_ex) : sizeof(struct fuse_stat));
+    else if (fsp_fuse_attr_cache_get(f->AttrCache, PosixPath, &stbuf, &err))
+    {
+        if (0 != err)
+            return fsp_fuse_ntstatus_from_errno(f->env, err);
+    }
     else
     {
-        int err;
-
-        if (0 != f->ops.fgetattr && 0 != fi && -1 != fi->fh)
+        if (0 != ino && 0 != f->ino_ops.getattr)
+            err = f->ino_ops.getattr(ino, (void *)&stbuf, fi);
+        else if (0 != f->ops.fgetattr && 0 != fi && -1 != fi->fh)
             err = f->ops.fgetattr(PosixPath, (void *)&stbuf, fi);
         else if (0 != f->ops.getattr)
             err = f->ops.getattr(PosixPath, (void *)&stbuf);
         else
             return STATUS_INVALID_DEVICE_REQUEST;
 
+        /* only "no such file" is cached negatively; other errors may well be transient */
+        if (0 == err || -ENOENT == err)
+            fsp_fuse_attr_cache_set(f->AttrCache, PosixPath, &stbuf, err);
+        else
+            fsp_fuse_attr_cache_invalidate(f->AttrCache, PosixPath, FALSE);
+
         if (0 != err)
             return fsp_fuse_ntstatus_from_errno(f->env, err);
     }
@@ -454,6 +473,37 @@ static NTSTATUS fsp_fuse_intf_GetFileInfoFunnel(FSP_FILE_SYSTEM *FileSystem,
     return STATUS_SUCCESS;
 }
 
+static NTSTATUS fsp_fuse_intf_GetFileInfoFd(FSP_FILE_SYSTEM *FileSystem,
+    struct fsp_fuse_file_desc *filedesc, struct fuse_file_info *fi,
+    PUINT32 PUid, PUINT32 PGid, PUINT32 PMode,
+    FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    struct fuse *f = FileSystem->UserContext;
+    struct fsp_fuse_file_io *Io = filedesc->Io;
+    UINT64 EndOffset, AllocationUnit;
+    NTSTATUS Result;
+
+    Result = fsp_fuse_intf_GetFileInfoFunnel(FileSystem, filedesc->PosixPath, fi,
+        fsp_fuse_node_ino(filedesc->Node), 0, PUid, PGid, PMode, 0, FileInfo);
+    if (!NT_SUCCESS(Result) || 0 == Io)
+        return Result;
+
+    /* the file system has not seen the writes buffered on this handle yet */
+    AcquireSRWLockShared(&Io->Lock);
+    EndOffset = 0 != Io->WriteLength ? Io->WriteOffset + Io->WriteLength : 0;
+    ReleaseSRWLockShared(&Io->Lock);
+    if (EndOffset > FileInfo->FileSize)
+    {
+        AllocationUnit = (UINT64)f->VolumeParams.SectorSize *
+            (UINT64)f->VolumeParams.SectorsPerAllocationUnit;
+        FileInfo->FileSize = EndOffset;
+        FileInfo->AllocationSize =
+            (FileInfo->FileSize + AllocationUnit - 1) / AllocationUnit * AllocationUnit;
+    }
+
+    return Result;
+}
+
 static NTSTATUS fsp_fuse_intf_GetSecurityEx(FSP_FILE_SYSTEM *FileSystem,
     const char *PosixPath, struct fuse_file_info *fi,
     PUINT32 PFileAttributes,
@@ -571,7 +621,7 @@ static NTSTATUS fsp_fuse_intf_GetReparsePointEx(FSP_FILE_SYSTEM *FileSystem,
     SIZE_T Size;
     NTSTATUS Result;
 
-    Result = fsp_fuse_intf_GetFileInfoFunnel(FileSystem, PosixPath, fi, 0,
+    Result = fsp_fuse_intf_GetFileInfoFunnel(FileSystem, PosixPath, fi, 0, 0,
         &Uid, &Gid, &Mode, &Dev, &FileInfo);
     if (!NT_SUCCESS(Result))
         return Result;
@@ -683,6 +733,10 @@ static NTSTATUS fsp_fuse_intf_GetReparsePointByName(
 static NTSTATUS fsp_fuse_intf_SetEaEntry(
     FSP_FILE_SYSTEM *FileSystem, PVOID Context,
     PFILE_FULL_EA_INFORMATION SingleEa);
+static struct fsp_fuse_file_io *fsp_fuse_intf_NewFileIo(struct fuse *f);
+static VOID fsp_fuse_intf_DeleteFileIo(struct fsp_fuse_file_io *Io);
+static NTSTATUS fsp_fuse_intf_FlushIo(struct fuse *f, struct fsp_fuse_file_desc *filedesc);
+static VOID fsp_fuse_intf_FlushIoHoldError(struct fuse *f, struct fsp_fuse_file_desc *filedesc);
 
 static NTSTATUS fsp_fuse_intf_GetVolumeInfo(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_VOLUME_INFO *VolumeInfo)
@@ -875,6 +929,8 @@ static NTSTATUS fsp_fuse_intf_Create(FSP_FILE_SYSTEM *FileSystem,
         else
             Result = STATUS_INVALID_DEVICE_REQUEST;
     }
+    fsp_fuse_attr_cache_invalidate(f->AttrCache, contexthdr->PosixPath, TRUE);
+    fsp_fuse_node_invalidate(f->NodeTable, contexthdr->PosixPath);
     if (!NT_SUCCESS(Result))
         goto exit;
 
@@ -939,6 +995,8 @@ static NTSTATUS fsp_fuse_intf_Create(FSP_FILE_SYSTEM *FileSystem,
     filedesc->OpenFlags = fi.flags;
     filedesc->FileHandle = fi.fh;
     filedesc->DirBuffer = 0;
+    filedesc->Node = fsp_fuse_node_resolve(f->NodeTable, filedesc->PosixPath);
+    filedesc->Io = filedesc->IsDirectory ? 0 : fsp_fuse_intf_NewFileIo(f);
     contexthdr->PosixPath = 0;
 
     Result = STATUS_SUCCESS;
@@ -1068,6 +1126,10 @@ static NTSTATUS fsp_fuse_intf_Open(FSP_FILE_SYSTEM *FileSystem,
     filedesc->OpenFlags = fi.flags;
     filedesc->FileHandle = fi.fh;
     filedesc->DirBuffer = 0;
+    filedesc->Node = filedesc->IsReparsePoint ? 0 :
+        fsp_fuse_node_resolve(f->NodeTable, filedesc->PosixPath);
+    filedesc->Io = filedesc->IsDirectory || filedesc->IsReparsePoint ? 0 :
+        fsp_fuse_intf_NewFileIo(f);
     contexthdr->PosixPath = 0;
 
     Result = STATUS_SUCCESS;
@@ -1117,6 +1179,10 @@ static NTSTATUS fsp_fuse_intf_Overwrite(FSP_FILE_SYSTEM *FileSystem,
             return Result;
     }
 
+    Result = fsp_fuse_intf_FlushIo(f, filedesc);
+    if (!NT_SUCCESS(Result))
+        return Result;
+
     if (0 != f->ops.ftruncate)
     {
         memset(&fi, 0, sizeof fi);
@@ -1133,6 +1199,7 @@ static NTSTATUS fsp_fuse_intf_Overwrite(FSP_FILE_SYSTEM *FileSystem,
     }
     else
         Result = STATUS_INVALID_DEVICE_REQUEST;
+    fsp_fuse_attr_cache_invalidate(f->AttrCache, filedesc->PosixPath, FALSE);
     if (!NT_SUCCESS(Result))
         return Result;
 
@@ -1152,7 +1219,7 @@ static NTSTATUS fsp_fuse_intf_Overwrite(FSP_FILE_SYSTEM *FileSystem,
             return Result;
     }
 
-    return fsp_fuse_intf_GetFileInfoEx(FileSystem, filedesc->PosixPath,
+    return fsp_fuse_intf_GetFileInfoFd(FileSystem, filedesc,
         FUSE_FILE_INFO(filedesc->IsDirectory, &fi),
         &Uid, &Gid, &Mode, FileInfo);
 }
@@ -1180,7 +1247,11 @@ static VOID fsp_fuse_intf_Cleanup(FSP_FILE_SYSTEM *FileSystem,
      * FUSE option and can safely remove the file at this time.
      */
 
+    /* Cleanup cannot fail; a write-back error is reported by a later Flush or logged by Close */
+    fsp_fuse_intf_FlushIoHoldError(f, filedesc);
+
     if (Flags & FspCleanupDelete)
+    {
         if (filedesc->IsDirectory && !filedesc->IsReparsePoint)
         {
             if (0 != f->ops.rmdir)
@@ -1191,6 +1262,9 @@ static VOID fsp_fuse_intf_Cleanup(FSP_FILE_SYSTEM *FileSystem,
             if (0 != f->ops.unlink)
                 f->ops.unlink(filedesc->PosixPath);
         }
+        fsp_fuse_attr_cache_invalidate(f->AttrCache, filedesc->PosixPath, TRUE);
+        fsp_fuse_node_invalidate(f->NodeTable, filedesc->PosixPath);
+    }
 }
 
 static VOID fsp_fuse_intf_Close(FSP_FILE_SYSTEM *FileSystem,
@@ -1215,17 +1289,350 @@ static VOID fsp_fuse_intf_Close(FSP_FILE_SYSTEM *FileSystem,
     }
     else
     {
+        NTSTATUS Result = fsp_fuse_intf_FlushIo(f, filedesc);
+        if (!NT_SUCCESS(Result))
+            /* Close cannot fail either; do not let the loss of written data go unnoticed */
+            FspServiceLog(EVENTLOG_ERROR_TYPE,
+                L"Cannot write buffered data to file %S (Status=%lx).",
+                filedesc->PosixPath, Result);
         if (0 != f->ops.flush)
             f->ops.flush(filedesc->PosixPath, &fi);
         if (0 != f->ops.release)
             f->ops.release(filedesc->PosixPath, &fi);
     }
 
+    fsp_fuse_intf_DeleteFileIo(filedesc->Io);
+    fsp_fuse_node_release(f->NodeTable, filedesc->Node);
     FspFileSystemDeleteDirectoryBuffer(&filedesc->DirBuffer);
     MemFree(filedesc->PosixPath);
     MemFree(filedesc);
 }
 
+static int fsp_fuse_intf_ReadBuf(struct fuse *f, struct fsp_fuse_file_desc *filedesc,
+    PVOID Buffer, UINT64 Offset, ULONG Length, struct fuse_file_info *fi)
+{
+    struct fsp_fuse_bufvec *bufv = 0;
+    struct fsp_fuse_buf *buf;
+    size_t idx, off, size;
+    ULONG bytes = 0;
+    int err;
+
+    err = f->ops.read_buf(filedesc->PosixPath, (struct fuse_bufvec **)&bufv, Length, Offset, fi);
+    if (0 != err)
+        return err;
+    if (0 == bufv)
+        return 0;
+
+    /* copy the returned buffers once, directly into the transfer buffer */
+    for (idx = bufv->idx, off = bufv->off; bufv->count > idx && Length > bytes; idx++, off = 0)
+    {
+        buf = &bufv->buf[idx];
+        if (off >= buf->size)
+            continue;
+        if (buf->flags & FSP_FUSE_BUF_IS_FD)
+        {
+            /* we have no way to read the file system's file descriptors */
+            err = -ENOSYS_(f->env);
+            break;
+        }
+        size = buf->size - off;
+        if (size > Length - bytes)
+            size = Length - bytes;
+        memcpy((PUINT8)Buffer + bytes, (PUINT8)buf->mem + off, size);
+        bytes += (ULONG)size;
+    }
+
+    /* the bufvec and its memory buffers belong to us now (libfuse fuse_free_buf) */
+    for (idx = 0; bufv->count > idx; idx++)
+        if (!(bufv->buf[idx].flags & FSP_FUSE_BUF_IS_FD))
+            f->env->memfree(bufv->buf[idx].mem);
+    f->env->memfree(bufv);
+
+    return 0 == err ? (int)bytes : err;
+}
+
+static int fsp_fuse_intf_WriteBuf(struct fuse *f, struct fsp_fuse_file_desc *filedesc,
+    PVOID Buffer, UINT64 Offset, size_t Length, struct fuse_file_info *fi)
+{
+    struct fsp_fuse_bufvec bufv;
+
+    /* hand the transfer buffer to the file system as is */
+    memset(&bufv, 0, sizeof bufv);
+    bufv.count = 1;
+    bufv.buf[0].size = Length;
+    bufv.buf[0].mem = Buffer;
+    bufv.buf[0].fd = -1;
+
+    return f->ops.write_buf(filedesc->PosixPath, (struct fuse_bufvec *)&bufv, Offset, fi);
+}
+
+static int fsp_fuse_intf_ReadFd(struct fuse *f, struct fsp_fuse_file_desc *filedesc,
+    PVOID Buffer, UINT64 Offset, ULONG Length, struct fuse_file_info *fi)
+{
+    if (0 != filedesc->Node && 0 != f->ino_ops.read)
+        return f->ino_ops.read(fsp_fuse_node_ino(filedesc->Node), Buffer, Length, Offset, fi);
+    else if (0 != f->ops.read_buf)
+        return fsp_fuse_intf_ReadBuf(f, filedesc, Buffer, Offset, Length, fi);
+    else
+        return f->ops.read(filedesc->PosixPath, Buffer, Length, Offset, fi);
+}
+
+static int fsp_fuse_intf_WriteFd(struct fuse *f, struct fsp_fuse_file_desc *filedesc,
+    PVOID Buffer, UINT64 Offset, size_t Length, struct fuse_file_info *fi)
+{
+    int bytes;
+
+    if (0 != filedesc->Node && 0 != f->ino_ops.write)
+        bytes = f->ino_ops.write(fsp_fuse_node_ino(filedesc->Node), Buffer, Length, Offset, fi);
+    else if (0 != f->ops.write_buf)
+        bytes = fsp_fuse_intf_WriteBuf(f, filedesc, Buffer, Offset, Length, fi);
+    else
+        bytes = f->ops.write(filedesc->PosixPath, Buffer, Length, Offset, fi);
+
+    /*
+     * Keep a cached size current so that the next write on this file can trust it. Only
+     * writes that reach the file system extend it: the cache is shared by all handles and
+     * must not include bytes that are still buffered on one of them.
+     */
+    if (0 < bytes)
+        fsp_fuse_attr_cache_set_size(f->AttrCache, filedesc->PosixPath, Offset + bytes);
+
+    return bytes;
+}
+
+/*
+ * Read-ahead and write-back
+ *
+ * Every Read and Write is a round trip to the file system. For file systems backed by a
+ * network service the latency of the round trip rather than the amount of data moved decides
+ * the throughput, and applications (or the FSD when the cache manager is not used) often do
+ * their I/O in small pieces.
+ *
+ * With -o ReadAheadSize=N a handle that is read sequentially reads ahead of the application.
+ * The window starts at twice the size of the read and doubles with every read that continues
+ * the previous one, up to N bytes. A read elsewhere collapses it.
+ *
+ * With -o WriteBackSize=N writes smaller than N bytes that continue each other are collected
+ * in a buffer of N bytes. The buffer is written out when it fills up, when a write does not
+ * continue it and before any operation that must observe the file data or size on the file
+ * system: Read, Flush, Cleanup, Close, SetBasicInfo, SetFileSize, Overwrite, Rename and
+ * SetReparsePoint. File sizes reported on the handle include the buffered writes.
+ *
+ * The state belongs to the open handle and is protected by its own lock. Other handles see the
+ * buffered writes of a handle only after they are written out and a handle may read stale data
+ * from its read-ahead buffer until its next write or flush. An error writing out buffered data
+ * is returned by the operation that wrote it out; when that is a Read or Cleanup, the error is
+ * held and returned by the next Write or Flush on the handle. An error that is still held when
+ * the handle is closed is logged, because Close cannot fail.
+ */
+
+static struct fsp_fuse_file_io *fsp_fuse_intf_NewFileIo(struct fuse *f)
+{
+    struct fsp_fuse_file_io *Io;
+
+    if (0 == f->ReadAheadSize && 0 == f->WriteBackSize)
+        return 0;
+
+    /* not fatal; the handle does unbuffered I/O instead */
+    Io = MemAlloc(sizeof *Io);
+    if (0 == Io)
+        return 0;
+
+    memset(Io, 0, sizeof *Io);
+    InitializeSRWLock(&Io->Lock);
+
+    return Io;
+}
+
+static VOID fsp_fuse_intf_DeleteFileIo(struct fsp_fuse_file_io *Io)
+{
+    if (0 == Io)
+        return;
+
+    MemFree(Io->ReadBuffer);
+    MemFree(Io->WriteBuffer);
+    MemFree(Io);
+}
+
+static int fsp_fuse_intf_WriteBack(struct fuse *f, struct fsp_fuse_file_desc *filedesc,
+    struct fuse_file_info *fi)
+{
+    struct fsp_fuse_file_io *Io = filedesc->Io;
+    ULONG Bytes;
+    int bytes, err = 0;
+
+    /* we have already reported these bytes as written; finish short writes */
+    for (Bytes = 0; Io->WriteLength > Bytes; Bytes += bytes)
+    {
+        bytes = fsp_fuse_intf_WriteFd(f, filedesc,
+            Io->WriteBuffer + Bytes, Io->WriteOffset + Bytes, Io->WriteLength - Bytes, fi);
+        if (0 >= bytes)
+        {
+            err = 0 > bytes ? bytes : -EIO;
+            break;
+        }
+    }
+
+    Io->WriteLength = 0;
+
+    return err;
+}
+
+static NTSTATUS fsp_fuse_intf_FlushIo(struct fuse *f, struct fsp_fuse_file_desc *filedesc)
+{
+    struct fsp_fuse_file_io *Io = filedesc->Io;
+    struct fuse_file_info fi;
+    int err = 0;
+
+    if (0 == Io)
+        return STATUS_SUCCESS;
+
+    memset(&fi, 0, sizeof fi);
+    fi.flags = filedesc->OpenFlags;
+    fi.fh = filedesc->FileHandle;
+
+    AcquireSRWLockExclusive(&Io->Lock);
+    if (0 != Io->WriteLength)
+        err = fsp_fuse_intf_WriteBack(f, filedesc, &fi);
+    if (0 == err)
+        err = Io->WriteError;
+    Io->WriteError = 0;
+    Io->ReadLength = 0;
+    ReleaseSRWLockExclusive(&Io->Lock);
+
+    return fsp_fuse_ntstatus_from_errno(f->env, err);
+}
+
+static VOID fsp_fuse_intf_FlushIoHoldError(struct fuse *f, struct fsp_fuse_file_desc *filedesc)
+{
+    struct fsp_fuse_file_io *Io = filedesc->Io;
+    struct fuse_file_info fi;
+    int err;
+
+    if (0 == Io)
+        return;
+
+    memset(&fi, 0, sizeof fi);
+    fi.flags = filedesc->OpenFlags;
+    fi.fh = filedesc->FileHandle;
+
+    AcquireSRWLockExclusive(&Io->Lock);
+    if (0 != Io->WriteLength)
+    {
+        err = fsp_fuse_intf_WriteBack(f, filedesc, &fi);
+        if (0 != err && 0 == Io->WriteError)
+            Io->WriteError = err;
+    }
+    Io->ReadLength = 0;
+    ReleaseSRWLockExclusive(&Io->Lock);
+}
+
+static int fsp_fuse_intf_ReadIo(struct fuse *f, struct fsp_fuse_file_desc *filedesc,
+    PVOID Buffer, UINT64 Offset, ULONG Length, struct fuse_file_info *fi)
+{
+    struct fsp_fuse_file_io *Io = filedesc->Io;
+    UINT64 Window, EndOffset;
+    int bytes;
+
+    AcquireSRWLockExclusive(&Io->Lock);
+
+    /* reads must see the writes buffered on this handle */
+    if (0 != Io->WriteLength)
+    {
+        bytes = fsp_fuse_intf_WriteBack(f, filedesc, fi);
+        if (0 != bytes && 0 == Io->WriteError)
+            Io->WriteError = bytes;
+    }
+
+    Window = Offset == Io->ReadNextOffset ?
+        (0 == Io->ReadWindow ? 2 * (UINT64)Length : 2 * (UINT64)Io->ReadWindow) : 0;
+    Io->ReadWindow = (ULONG)(f->ReadAheadSize < Window ? f->ReadAheadSize : Window);
+
+    EndOffset = Io->ReadOffset + Io->ReadLength;
+    if (Io->ReadOffset <= Offset && EndOffset > Offset &&
+        (Offset + Length <= EndOffset || Io->ReadEof))
+    {
+        bytes = (int)(Offset + Length <= EndOffset ? Length : EndOffset - Offset);
+        memcpy(Buffer, Io->ReadBuffer + (Offset - Io->ReadOffset), bytes);
+    }
+    else if (Io->ReadWindow > Length &&
+        (0 != Io->ReadBuffer || 0 != (Io->ReadBuffer = MemAlloc(f->ReadAheadSize))))
+    {
+        Io->ReadLength = 0;
+        bytes = fsp_fuse_intf_ReadFd(f, filedesc, Io->ReadBuffer, Offset, Io->ReadWindow, fi);
+        if (0 < bytes)
+        {
+            /* FUSE reads return fewer bytes than asked only at end of file */
+            Io->ReadOffset = Offset;
+            Io->ReadLength = bytes;
+            Io->ReadEof = (ULONG)bytes < Io->ReadWindow;
+            if ((ULONG)bytes > Length)
+                bytes = Length;
+            memcpy(Buffer, Io->ReadBuffer, bytes);
+        }
+    }
+    else
+        bytes = fsp_fuse_intf_ReadFd(f, filedesc, Buffer, Offset, Length, fi);
+
+    if (0 < bytes)
+        Io->ReadNextOffset = Offset + bytes;
+
+    ReleaseSRWLockExclusive(&Io->Lock);
+
+    return bytes;
+}
+
+static int fsp_fuse_intf_WriteIo(struct fuse *f, struct fsp_fuse_file_desc *filedesc,
+    PVOID Buffer, UINT64 Offset, size_t Length, struct fuse_file_info *fi)
+{
+    struct fsp_fuse_file_io *Io = filedesc->Io;
+    int bytes, err;
+
+    AcquireSRWLockExclusive(&Io->Lock);
+
+    /* the read-ahead data may cover the range being written */
+    Io->ReadLength = 0;
+
+    if (0 != Io->WriteError)
+    {
+        bytes = Io->WriteError;
+        Io->WriteError = 0;
+        goto exit;
+    }
+
+    if (0 != Io->WriteLength &&
+        (Io->WriteOffset + Io->WriteLength != Offset || f->WriteBackSize - Io->WriteLength < Length))
+    {
+        bytes = fsp_fuse_intf_WriteBack(f, filedesc, fi);
+        if (0 != bytes)
+            goto exit;
+    }
+
+    if (f->WriteBackSize > Length &&
+        (0 != Io->WriteBuffer || 0 != (Io->WriteBuffer = MemAlloc(f->WriteBackSize))))
+    {
+        if (0 == Io->WriteLength)
+            Io->WriteOffset = Offset;
+        memcpy(Io->WriteBuffer + Io->WriteLength, Buffer, Length);
+        Io->WriteLength += (ULONG)Length;
+        bytes = (int)Length;
+
+        if (f->WriteBackSize == Io->WriteLength)
+        {
+            err = fsp_fuse_intf_WriteBack(f, filedesc, fi);
+            if (0 != err)
+                bytes = err;
+        }
+    }
+    else
+        bytes = fsp_fuse_intf_WriteFd(f, filedesc, Buffer, Offset, Length, fi);
+
+exit:
+    ReleaseSRWLockExclusive(&Io->Lock);
+
+    return bytes;
+}
+
 static NTSTATUS fsp_fuse_intf_Read(FSP_FILE_SYSTEM *FileSystem,
     PVOID FileDesc, PVOID Buffer, UINT64 Offset, ULONG Length,
     PULONG PBytesTransferred)
@@ -1239,14 +1646,17 @@ static NTSTATUS fsp_fuse_intf_Read(FSP_FILE_SYSTEM *FileSystem,
     if (filedesc->IsDirectory || filedesc->IsReparsePoint)
         return STATUS_ACCESS_DENIED;
 
-    if (0 == f->ops.read)
+    if (0 == f->ops.read && 0 == f->ops.read_buf &&
+        (0 == filedesc->Node || 0 == f->ino_ops.read))
         return STATUS_INVALID_DEVICE_REQUEST;
 
     memset(&fi, 0, sizeof fi);
     fi.flags = filedesc->OpenFlags;
     fi.fh = filedesc->FileHandle;
 
-    bytes = f->ops.read(filedesc->PosixPath, Buffer, Length, Offset, &fi);
+    bytes = 0 != filedesc->Io ?
+        fsp_fuse_intf_ReadIo(f, filedesc, Buffer, Offset, Length, &fi) :
+        fsp_fuse_intf_ReadFd(f, filedesc, Buffer, Offset, Length, &fi);
     if (0 < bytes)
     {
         *PBytesTransferred = bytes;
@@ -1277,14 +1687,15 @@ static NTSTATUS fsp_fuse_intf_Write(FSP_FILE_SYSTEM *FileSystem,
     if (filedesc->IsDirectory || filedesc->IsReparsePoint)
         return STATUS_ACCESS_DENIED;
 
-    if (0 == f->ops.write)
+    if (0 == f->ops.write && 0 == f->ops.write_buf &&
+        (0 == filedesc->Node || 0 == f->ino_ops.write))
         return STATUS_INVALID_DEVICE_REQUEST;
 
     memset(&fi, 0, sizeof fi);
     fi.flags = filedesc->OpenFlags;
     fi.fh = filedesc->FileHandle;
 
-    Result = fsp_fuse_intf_GetFileInfoEx(FileSystem, filedesc->PosixPath,
+    Result = fsp_fuse_intf_GetFileInfoFd(FileSystem, filedesc,
         FUSE_FILE_INFO(filedesc->IsDirectory, &fi),
         &Uid, &Gid, &Mode, &FileInfoBuf);
     if (!NT_SUCCESS(Result))
@@ -1305,7 +1716,9 @@ static NTSTATUS fsp_fuse_intf_Write(FSP_FILE_SYSTEM *FileSystem,
         EndOffset = Offset + Length;
     }
 
-    bytes = f->ops.write(filedesc->PosixPath, Buffer, (size_t)(EndOffset - Offset), Offset, &fi);
+    bytes = 0 != filedesc->Io ?
+        fsp_fuse_intf_WriteIo(f, filedesc, Buffer, Offset, (size_t)(EndOffset - Offset), &fi) :
+        fsp_fuse_intf_WriteFd(f, filedesc, Buffer, Offset, (size_t)(EndOffset - Offset), &fi);
     if (0 > bytes)
         return fsp_fuse_ntstatus_from_errno(f->env, bytes);
 
@@ -1356,7 +1769,8 @@ static NTSTATUS fsp_fuse_intf_Flush(FSP_FILE_SYSTEM *FileSystem,
         Result = STATUS_ACCESS_DENIED;
     else
     {
-        if (0 != f->ops.fsync)
+        Result = fsp_fuse_intf_FlushIo(f, filedesc);
+        if (NT_SUCCESS(Result) && 0 != f->ops.fsync)
         {
             err = f->ops.fsync(filedesc->PosixPath, 0, &fi);
             Result = fsp_fuse_ntstatus_from_errno(f->env, err);
@@ -1365,7 +1779,7 @@ static NTSTATUS fsp_fuse_intf_Flush(FSP_FILE_SYSTEM *FileSystem,
     if (!NT_SUCCESS(Result))
         return Result;
 
-    Result = fsp_fuse_intf_GetFileInfoEx(FileSystem, filedesc->PosixPath,
+    Result = fsp_fuse_intf_GetFileInfoFd(FileSystem, filedesc,
         FUSE_FILE_INFO(filedesc->IsDirectory, &fi),
         &Uid, &Gid, &Mode, &FileInfoBuf);
     if (!NT_SUCCESS(Result))
@@ -1389,7 +1803,7 @@ static NTSTATUS fsp_fuse_intf_GetFileInfo(FSP_FILE_SYSTEM *FileSystem,
     fi.flags = filedesc->OpenFlags;
     fi.fh = filedesc->FileHandle;
 
-    return fsp_fuse_intf_GetFileInfoEx(FileSystem, filedesc->PosixPath,
+    return fsp_fuse_intf_GetFileInfoFd(FileSystem, filedesc,
         FUSE_FILE_INFO(filedesc->IsDirectory, &fi),
         &Uid, &Gid, &Mode, FileInfo);
 }
@@ -1413,6 +1827,11 @@ static NTSTATUS fsp_fuse_intf_SetBasicInfo(FSP_FILE_SYSTEM *FileSystem,
     fi.flags = filedesc->OpenFlags;
     fi.fh = filedesc->FileHandle;
 
+    /* buffered writes must not land after the new times */
+    Result = fsp_fuse_intf_FlushIo(f, filedesc);
+    if (!NT_SUCCESS(Result))
+        return Result;
+
     if (INVALID_FILE_ATTRIBUTES != FileAttributes &&
         0 != (f->conn_want & FSP_FUSE_CAP_STAT_EX) && 0 != f->ops.chflags)
     {
@@ -1428,7 +1847,7 @@ static NTSTATUS fsp_fuse_intf_SetBasicInfo(FSP_FILE_SYSTEM *FileSystem,
     {
         if (0 == LastAccessTime || 0 == LastWriteTime)
         {
-            Result = fsp_fuse_intf_GetFileInfoEx(FileSystem, filedesc->PosixPath,
+            Result = fsp_fuse_intf_GetFileInfoFd(FileSystem, filedesc,
                 FUSE_FILE_INFO(filedesc->IsDirectory, &fi),
                 &Uid, &Gid, &Mode, &FileInfoBuf);
             if (!NT_SUCCESS(Result))
@@ -1476,7 +1895,9 @@ static NTSTATUS fsp_fuse_intf_SetBasicInfo(FSP_FILE_SYSTEM *FileSystem,
             return Result;
     }
 
-    return fsp_fuse_intf_GetFileInfoEx(FileSystem, filedesc->PosixPath,
+    fsp_fuse_attr_cache_invalidate(f->AttrCache, filedesc->PosixPath, FALSE);
+
+    return fsp_fuse_intf_GetFileInfoFd(FileSystem, filedesc,
         FUSE_FILE_INFO(filedesc->IsDirectory, &fi),
         &Uid, &Gid, &Mode, FileInfo);
 }
@@ -1500,11 +1921,15 @@ static NTSTATUS fsp_fuse_intf_SetFileSize(FSP_FILE_SYSTEM *FileSystem,
     if (0 == f->ops.ftruncate && 0 == f->ops.truncate)
         return STATUS_INVALID_DEVICE_REQUEST;
 
+    Result = fsp_fuse_intf_FlushIo(f, filedesc);
+    if (!NT_SUCCESS(Result))
+        return Result;
+
     memset(&fi, 0, sizeof fi);
     fi.flags = filedesc->OpenFlags;
     fi.fh = filedesc->FileHandle;
 
-    Result = fsp_fuse_intf_GetFileInfoEx(FileSystem, filedesc->PosixPath,
+    Result = fsp_fuse_intf_GetFileInfoFd(FileSystem, filedesc,
         FUSE_FILE_INFO(filedesc->IsDirectory, &fi),
         &Uid, &Gid, &Mode, &FileInfoBuf);
     if (!NT_SUCCESS(Result))
@@ -1527,6 +1952,7 @@ static NTSTATUS fsp_fuse_intf_SetFileSize(FSP_FILE_SYSTEM *FileSystem,
             err = f->ops.truncate(filedesc->PosixPath, NewSize);
             Result = fsp_fuse_ntstatus_from_errno(f->env, err);
         }
+        fsp_fuse_attr_cache_invalidate(f->AttrCache, filedesc->PosixPath, FALSE);
         if (!NT_SUCCESS(Result))
             return Result;
 
@@ -1635,7 +2061,19 @@ static NTSTATUS fsp_fuse_intf_Rename(FSP_FILE_SYSTEM *FileSystem,
             return STATUS_ACCESS_DENIED;
     }
 
+    Result = fsp_fuse_intf_FlushIo(f, filedesc);
+    if (!NT_SUCCESS(Result))
+        return Result;
+
     err = f->ops.rename(filedesc->PosixPath, contexthdr->PosixPath);
+
+    /* a directory rename moves every path below it */
+    fsp_fuse_attr_cache_invalidate_all(f->AttrCache);
+
+    /* node links are relative to the parent node; only the two names themselves change */
+    fsp_fuse_node_invalidate(f->NodeTable, filedesc->PosixPath);
+    fsp_fuse_node_invalidate(f->NodeTable, contexthdr->PosixPath);
+
     return fsp_fuse_ntstatus_from_errno(f->env, err);
 }
 
@@ -1677,7 +2115,7 @@ static NTSTATUS fsp_fuse_intf_SetSecurity(FSP_FILE_SYSTEM *FileSystem,
     fi.flags = filedesc->OpenFlags;
     fi.fh = filedesc->FileHandle;
 
-    Result = fsp_fuse_intf_GetFileInfoEx(FileSystem, filedesc->PosixPath,
+    Result = fsp_fuse_intf_GetFileInfoFd(FileSystem, filedesc,
         FUSE_FILE_INFO(filedesc->IsDirectory, &fi),
         &Uid, &Gid, &Mode, &FileInfo);
     if (!NT_SUCCESS(Result))
@@ -1725,6 +2163,8 @@ static NTSTATUS fsp_fuse_intf_SetSecurity(FSP_FILE_SYSTEM *FileSystem,
     Result = STATUS_SUCCESS;
 
 exit:
+    fsp_fuse_attr_cache_invalidate(f->AttrCache, filedesc->PosixPath, FALSE);
+
     if (0 != NewSecurityDescriptor)
         FspDeleteSecurityDescriptor(NewSecurityDescriptor,
             FspSetSecurityDescriptor);
@@ -1751,6 +2191,20 @@ static VOID fsp_fuse_intf_LogBadDirInfo(
             PosixPath, PosixName, Message);
 }
 
+static BOOLEAN fsp_fuse_intf_FlushDirInfo(struct fuse_dirhandle *dh)
+{
+    BOOLEAN Success = TRUE;
+
+    if (0 != dh->FillBytes)
+    {
+        Success = FspFileSystemFillDirectoryBufferBulk(&dh->filedesc->DirBuffer,
+            dh->FillBuffer, dh->FillBytes, 0, &dh->Result);
+        dh->FillBytes = 0;
+    }
+
+    return Success;
+}
+
 /* !static: used by fuse2to3 */
 int fsp_fuse_intf_AddDirInfo(void *buf, const char *name,
     const struct fuse_stat *stbuf, fuse_off_t off)
@@ -1799,13 +2253,21 @@ int fsp_fuse_intf_AddDirInfo(void *buf, const char *name,
         UINT32 Uid, Gid, Mode;
         NTSTATUS Result0;
 
-        Result0 = fsp_fuse_intf_GetFileInfoFunnel(dh->FileSystem, name, 0, stbuf,
+        Result0 = fsp_fuse_intf_GetFileInfoFunnel(dh->FileSystem, name, 0, 0, stbuf,
             &Uid, &Gid, &Mode, 0, &DirInfo->FileInfo);
         if (NT_SUCCESS(Result0))
             DirInfo->Padding[0] = 1; /* HACK: remember that the FileInfo is valid */
     }
 
-    return !FspFileSystemFillDirectoryBuffer(&filedesc->DirBuffer, DirInfo, &dh->Result);
+    if (0 == dh->FillBuffer)
+        return !FspFileSystemFillDirectoryBuffer(&filedesc->DirBuffer, DirInfo, &dh->Result);
+
+    /* stage the entry; hand staged entries to the directory buffer in bulk */
+    if (FspFileSystemAddDirInfo(DirInfo, dh->FillBuffer, dh->FillLength, &dh->FillBytes))
+        return 0;
+    if (!fsp_fuse_intf_FlushDirInfo(dh))
+        return 1;
+    return !FspFileSystemAddDirInfo(DirInfo, dh->FillBuffer, dh->FillLength, &dh->FillBytes);
 }
 
 static int fsp_fuse_intf_AddDirInfoOld(fuse_dirh_t dh, const char *name,
@@ -1814,98 +2276,241 @@ static int fsp_fuse_intf_AddDirInfoOld(fuse_dirh_t dh, const char *name,
     return fsp_fuse_intf_AddDirInfo(dh, name, 0, 0) ? -ENOMEM : 0;
 }
 
-static NTSTATUS fsp_fuse_intf_FixDirInfo(FSP_FILE_SYSTEM *FileSystem,
-    struct fsp_fuse_file_desc *filedesc)
+/*
+ * File systems that do not implement readdirplus only return names from readdir, so
+ * FixDirInfo has to getattr every entry. When getattr is a network round trip this is the
+ * dominant cost of listing a large directory. With -o DirInfoThreadCount=N the entries are
+ * claimed one at a time from a shared counter by the dispatcher thread and by up to N
+ * helpers on the DirInfoWorkQueue, so that up to N+1 getattr calls are in flight. Every
+ * entry is touched by exactly one thread, so no locking is needed on the directory buffer.
+ * File systems mounted single-threaded (-s) rely on serialized callbacks, so they never
+ * fan out and all getattr's stay on the dispatcher thread.
+ */
+struct fsp_fuse_intf_fixdirinfo
 {
-    char *PosixPath = 0, *PosixName, *PosixPathEnd, SavedPathChar;
-    ULONG SizeA, SizeW;
+    FSP_FILE_SYSTEM *FileSystem;
+    struct fsp_fuse_file_desc *filedesc;
+    struct fuse_context *context;       /* dispatcher context; copied into helpers */
     PUINT8 Buffer;
-    PULONG Index, IndexEnd;
+    PULONG Index;
     ULONG Count;
+    volatile LONG Next;
+    volatile LONG Result;
+    volatile LONG PendingCount;
+    HANDLE Event;
+};
+
+struct fsp_fuse_intf_fixdirinfo_helper
+{
+    FSP_WORK_ITEM WorkItem;
+    struct fsp_fuse_intf_fixdirinfo *FixDirInfo;
+};
+
+static NTSTATUS fsp_fuse_intf_FixDirInfoEntry(FSP_FILE_SYSTEM *FileSystem,
+    struct fsp_fuse_file_desc *filedesc,
+    char *PosixPath, char *PosixName,
+    PUINT8 Buffer, PULONG Index)
+{
+    char *PosixPathEnd, SavedPathChar;
+    ULONG SizeA, SizeW;
     FSP_FSCTL_DIR_INFO *DirInfo;
     UINT32 Uid, Gid, Mode;
     NTSTATUS Result;
 
-    SizeA = lstrlenA(filedesc->PosixPath);
-    PosixPath = MemAlloc(SizeA + 1 + 255 + 1);
-    if (0 == PosixPath)
+    DirInfo = (FSP_FSCTL_DIR_INFO *)(Buffer + *Index);
+    SizeW = (DirInfo->Size - sizeof *DirInfo) / sizeof(WCHAR);
+
+    if (DirInfo->Padding[0])
     {
-        Result = STATUS_INSUFFICIENT_RESOURCES;
-        goto exit;
+        /* DirInfo has been filled already! */
+
+        DirInfo->Padding[0] = 0;
+    }
+    else
+    {
+        if (1 == SizeW && L'.' == DirInfo->FileNameBuf[0])
+        {
+            PosixPathEnd = 1 < PosixName - PosixPath ? PosixName - 1 : PosixName;
+            SavedPathChar = *PosixPathEnd;
+            *PosixPathEnd = '\0';
+        }
+        else
+        if (2 == SizeW && L'.' == DirInfo->FileNameBuf[0] && L'.' == DirInfo->FileNameBuf[1])
+        {
+            PosixPathEnd = 1 < PosixName - PosixPath ? PosixName - 2 : PosixName;
+            while (PosixPath < PosixPathEnd && '/' != *PosixPathEnd)
+                PosixPathEnd--;
+            if (PosixPath == PosixPathEnd)
+                PosixPathEnd++;
+            SavedPathChar = *PosixPathEnd;
+            *PosixPathEnd = '\0';
+        }
+        else
+        {
+            PosixPathEnd = 0;
+            SizeA = WideCharToMultiByte(CP_UTF8, 0, DirInfo->FileNameBuf, SizeW, PosixName, 255, 0, 0);
+            if (0 == SizeA)
+                /* this should never happen because we just converted using MultiByteToWideChar */
+                return STATUS_OBJECT_NAME_INVALID;
+            PosixName[SizeA] = '\0';
+        }
+
+        Result = fsp_fuse_intf_GetFileInfoEx(FileSystem, PosixPath, 0,
+            &Uid, &Gid, &Mode, &DirInfo->FileInfo);
+        if (!NT_SUCCESS(Result))
+        {
+            /* mark the directory buffer entry as invalid */
+            *Index = FspFileSystemDirectoryBufferEntryInvalid;
+            fsp_fuse_intf_LogBadDirInfo(filedesc->PosixPath, PosixName,
+                "getattr failed");
+        }
+
+        if (0 != PosixPathEnd)
+            *PosixPathEnd = SavedPathChar;
     }
 
-    memcpy(PosixPath, filedesc->PosixPath, SizeA);
+    FspPosixDecodeWindowsPath(DirInfo->FileNameBuf, SizeW);
+
+    return STATUS_SUCCESS;
+}
+
+static VOID fsp_fuse_intf_FixDirInfoRange(struct fsp_fuse_intf_fixdirinfo *FixDirInfo,
+    char *PosixPath, ULONG PosixPathSize)
+{
+    char *PosixName;
+    ULONG SizeA, I;
+    NTSTATUS Result;
+
+    SizeA = lstrlenA(FixDirInfo->filedesc->PosixPath);
+    if (SizeA + 1 + 255 + 1 > PosixPathSize)
+        /* cannot happen with FSP_FUSE_DIRINFO_PATH_SIZEMAX; leave our share to the others */
+        return;
+
+    memcpy(PosixPath, FixDirInfo->filedesc->PosixPath, SizeA);
     if (1 < SizeA)
         /* if not root */
         PosixPath[SizeA++] = '/';
     PosixPath[SizeA] = '\0';
     PosixName = PosixPath + SizeA;
 
-    FspFileSystemPeekInDirectoryBuffer(&filedesc->DirBuffer, &Buffer, &Index, &Count);
-
-    for (IndexEnd = Index + Count; IndexEnd > Index; Index++)
+    while (FixDirInfo->Count > (I = (ULONG)InterlockedIncrement(&FixDirInfo->Next) - 1))
     {
-        DirInfo = (FSP_FSCTL_DIR_INFO *)(Buffer + *Index);
-        SizeW = (DirInfo->Size - sizeof *DirInfo) / sizeof(WCHAR);
-
-        if (DirInfo->Padding[0])
+        Result = fsp_fuse_intf_FixDirInfoEntry(FixDirInfo->FileSystem, FixDirInfo->filedesc,
+            PosixPath, PosixName, FixDirInfo->Buffer, FixDirInfo->Index + I);
+        if (!NT_SUCCESS(Result))
         {
-            /* DirInfo has been filled already! */
-
-            DirInfo->Padding[0] = 0;
+            InterlockedExchange(&FixDirInfo->Result, Result);
+            InterlockedExchange(&FixDirInfo->Next, FixDirInfo->Count);
+            break;
         }
-        else
+    }
+}
+
+static VOID fsp_fuse_intf_FixDirInfoWork(FSP_WORK_ITEM *WorkItem, PVOID WorkerBuffer)
+{
+    struct fsp_fuse_intf_fixdirinfo *FixDirInfo =
+        CONTAINING_RECORD(WorkItem, struct fsp_fuse_intf_fixdirinfo_helper, WorkItem)->FixDirInfo;
+    struct fuse *f = FixDirInfo->FileSystem->UserContext;
+    struct fuse_context *context;
+
+    /* WorkerBuffer is 0 if the work queue is being deleted; the dispatcher does our share */
+    if (0 != WorkerBuffer)
+    {
+        /* getattr may call fuse_get_context; give it the context of the original request */
+        context = fsp_fuse_get_context(f->env);
+        if (0 != context)
         {
-            if (1 == SizeW && L'.' == DirInfo->FileNameBuf[0])
-            {
-                PosixPathEnd = 1 < PosixName - PosixPath ? PosixName - 1 : PosixName;
-                SavedPathChar = *PosixPathEnd;
-                *PosixPathEnd = '\0';
-            }
-            else
-            if (2 == SizeW && L'.' == DirInfo->FileNameBuf[0] && L'.' == DirInfo->FileNameBuf[1])
-            {
-                PosixPathEnd = 1 < PosixName - PosixPath ? PosixName - 2 : PosixName;
-                while (PosixPath < PosixPathEnd && '/' != *PosixPathEnd)
-                    PosixPathEnd--;
-                if (PosixPath == PosixPathEnd)
-                    PosixPathEnd++;
-                SavedPathChar = *PosixPathEnd;
-                *PosixPathEnd = '\0';
-            }
-            else
-            {
-                PosixPathEnd = 0;
-                SizeA = WideCharToMultiByte(CP_UTF8, 0, DirInfo->FileNameBuf, SizeW, PosixName, 255, 0, 0);
-                if (0 == SizeA)
-                {
-                    /* this should never happen because we just converted using MultiByteToWideChar */
-                    Result = STATUS_OBJECT_NAME_INVALID;
-                    goto exit;
-                }
-                PosixName[SizeA] = '\0';
-            }
+            context->fuse = FixDirInfo->context->fuse;
+            context->private_data = FixDirInfo->context->private_data;
+            context->uid = FixDirInfo->context->uid;
+            context->gid = FixDirInfo->context->gid;
+            context->pid = FixDirInfo->context->pid;
+
+            fsp_fuse_intf_FixDirInfoRange(FixDirInfo, WorkerBuffer, FSP_FUSE_DIRINFO_PATH_SIZEMAX);
+
+            context->fuse = 0;
+            context->private_data = 0;
+            context->uid = -1;
+            context->gid = -1;
+            context->pid = -1;
+        }
+    }
 
-            Result = fsp_fuse_intf_GetFileInfoEx(FileSystem, PosixPath, 0,
-                &Uid, &Gid, &Mode, &DirInfo->FileInfo);
-            if (!NT_SUCCESS(Result))
+    if (0 == InterlockedDecrement(&FixDirInfo->PendingCount))
+        SetEvent(FixDirInfo->Event);
+}
+
+static NTSTATUS fsp_fuse_intf_FixDirInfo(FSP_FILE_SYSTEM *FileSystem,
+    struct fsp_fuse_file_desc *filedesc)
+{
+    struct fuse *f = FileSystem->UserContext;
+    struct fsp_fuse_intf_fixdirinfo FixDirInfo;
+    struct fsp_fuse_intf_fixdirinfo_helper *Helpers = 0;
+    char *PosixPath = 0;
+    ULONG PosixPathSize, HelperCount = 0, GetattrCount = 0;
+    NTSTATUS Result;
+
+    memset(&FixDirInfo, 0, sizeof FixDirInfo);
+    FixDirInfo.FileSystem = FileSystem;
+    FixDirInfo.filedesc = filedesc;
+    FixDirInfo.Result = STATUS_SUCCESS;
+
+    PosixPathSize = lstrlenA(filedesc->PosixPath) + 1 + 255 + 1;
+    PosixPath = MemAlloc(PosixPathSize);
+    if (0 == PosixPath)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+
+    FspFileSystemPeekInDirectoryBuffer(&filedesc->DirBuffer,
+        &FixDirInfo.Buffer, &FixDirInfo.Index, &FixDirInfo.Count);
+
+    if (0 != f->DirInfoWorkQueue &&
+        FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_COARSE != f->OpGuardStrategy)
+    {
+        /* entries filled by readdirplus are cheap; only fan out for the getattr's */
+        for (ULONG I = 0; FixDirInfo.Count > I; I++)
+            if (!((FSP_FSCTL_DIR_INFO *)(FixDirInfo.Buffer + FixDirInfo.Index[I]))->Padding[0])
+                GetattrCount++;
+    }
+
+    if (2 <= GetattrCount && 0 != (FixDirInfo.context = fsp_fuse_get_context(f->env)))
+    {
+        HelperCount = f->DirInfoThreadCount < GetattrCount - 1 ?
+            f->DirInfoThreadCount : GetattrCount - 1;
+
+        /* if we cannot get helpers we still do all the work on this thread */
+        FixDirInfo.Event = CreateEventW(0, TRUE, FALSE, 0);
+        if (0 != FixDirInfo.Event)
+            Helpers = MemAlloc(HelperCount * sizeof *Helpers);
+        if (0 != Helpers)
+        {
+            FixDirInfo.PendingCount = HelperCount;
+            for (ULONG I = 0; HelperCount > I; I++)
             {
-                /* mark the directory buffer entry as invalid */
-                *Index = FspFileSystemDirectoryBufferEntryInvalid;
-                fsp_fuse_intf_LogBadDirInfo(filedesc->PosixPath, PosixName,
-                    "getattr failed");
+                Helpers[I].WorkItem.Routine = fsp_fuse_intf_FixDirInfoWork;
+                Helpers[I].FixDirInfo = &FixDirInfo;
+                FspWorkQueuePost(f->DirInfoWorkQueue, &Helpers[I].WorkItem, FALSE);
             }
-
-            if (0 != PosixPathEnd)
-                *PosixPathEnd = SavedPathChar;
         }
+    }
 
-        FspPosixDecodeWindowsPath(DirInfo->FileNameBuf, SizeW);
+    fsp_fuse_intf_FixDirInfoRange(&FixDirInfo, PosixPath, PosixPathSize);
+
+    if (0 != Helpers)
+    {
+        /* helpers reference FixDirInfo on our stack; wait for all of them */
+        WaitForSingleObject(FixDirInfo.Event, INFINITE);
+        MemFree(Helpers);
     }
 
-    Result = STATUS_SUCCESS;
+    Result = FixDirInfo.Result;
 
 exit:
+    if (0 != FixDirInfo.Event)
+        CloseHandle(FixDirInfo.Event);
+
     MemFree(PosixPath);
 
     return Result;
@@ -1929,6 +2534,8 @@ static NTSTATUS fsp_fuse_intf_ReadDirectory(FSP_FILE_SYSTEM *FileSystem,
         dh.FileSystem = FileSystem;
         dh.ReaddirPlus = 0 != (f->conn_want & FSP_FUSE_CAP_READDIR_PLUS);
         dh.Result = STATUS_SUCCESS;
+        dh.FillLength = 64 * 1024;
+        dh.FillBuffer = MemAlloc(dh.FillLength); /* if this fails fill entries one at a time */
 
         if (0 != f->ops.readdir)
         {
@@ -1947,6 +2554,10 @@ static NTSTATUS fsp_fuse_intf_ReadDirectory(FSP_FILE_SYSTEM *FileSystem,
         else
             Result = STATUS_INVALID_DEVICE_REQUEST;
 
+        if (NT_SUCCESS(Result) && NT_SUCCESS(dh.Result))
+            fsp_fuse_intf_FlushDirInfo(&dh);
+        MemFree(dh.FillBuffer);
+
         if (NT_SUCCESS(Result))
         {
             Result = dh.Result;
@@ -2133,11 +2744,15 @@ static NTSTATUS fsp_fuse_intf_SetReparsePoint(FSP_FILE_SYSTEM *FileSystem,
     if (filedesc->IsDirectory)
         return STATUS_ACCESS_DENIED;
 
+    Result = fsp_fuse_intf_FlushIo(f, filedesc);
+    if (!NT_SUCCESS(Result))
+        return Result;
+
     memset(&fi, 0, sizeof fi);
     fi.flags = filedesc->OpenFlags;
     fi.fh = filedesc->FileHandle;
 
-    Result = fsp_fuse_intf_GetFileInfoEx(FileSystem, filedesc->PosixPath,
+    Result = fsp_fuse_intf_GetFileInfoFd(FileSystem, filedesc,
         FUSE_FILE_INFO(filedesc->IsDirectory, &fi),
         &Uid, &Gid, &Mode, &FileInfo);
     if (!NT_SUCCESS(Result))
@@ -2255,9 +2870,16 @@ static NTSTATUS fsp_fuse_intf_SetReparsePoint(FSP_FILE_SYSTEM *FileSystem,
 
     filedesc->IsReparsePoint = TRUE;
 
+    /* the file we had open has been replaced by the symlink */
+    fsp_fuse_node_release(f->NodeTable, filedesc->Node);
+    filedesc->Node = 0;
+
     Result = STATUS_SUCCESS;
 
 exit:
+    fsp_fuse_attr_cache_invalidate(f->AttrCache, filedesc->PosixPath, TRUE);
+    fsp_fuse_node_invalidate(f->NodeTable, filedesc->PosixPath);
+
     MemFree(PosixHiddenPath);
 
     if (0 != PosixTargetPath)
@@ -2404,6 +3026,7 @@ static NTSTATUS fsp_fuse_intf_SetEa(FSP_FILE_SYSTEM *FileSystem,
 
     Result = FspFileSystemEnumerateEa(FileSystem,
         fsp_fuse_intf_SetEaEntry, filedesc->PosixPath, Ea, EaLength);
+    fsp_fuse_attr_cache_invalidate(f->AttrCache, filedesc->PosixPath, FALSE);
     if (!NT_SUCCESS(Result))
         return Result;
 
@@ -2411,7 +3034,7 @@ static NTSTATUS fsp_fuse_intf_SetEa(FSP_FILE_SYSTEM *FileSystem,
     fi.flags = filedesc->OpenFlags;
     fi.fh = filedesc->FileHandle;
 
-    return fsp_fuse_intf_GetFileInfoEx(FileSystem, filedesc->PosixPath,
+    return fsp_fuse_intf_GetFileInfoFd(FileSystem, filedesc,
         FUSE_FILE_INFO(filedesc->IsDirectory, &fi),
         &Uid, &Gid, &Mode, FileInfo);
 }
@@ -306,7 +306,9 @@ FSP_FUSE_API int fsp_fuse_loop(struct fsp_fuse_env *env,
 FSP_FUSE_API int fsp_fuse_loop_mt(struct fsp_fuse_env *env,
     struct fuse *f)
 {
-    f->OpGuardStrategy = FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_FINE;
+    f->OpGuardStrategy = f->PathShardedGuard ?
+        FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_PATH_SHARDED :
+        FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_FINE;
     return NT_SUCCESS(fsp_fuse_loop_internal(f)) ? 0 : -1;
 }
 
@@ -0,0 +1,419 @@
+/**
+ * @file dll/fuse/fuse_node.c
+ *
+ * @copyright 2015-2021 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#include <dll/fuse/library.h>
+
+/*
+ * Node table
+ *
+ * File systems that register struct fuse_ino_operations have their open files resolved to
+ * node ID's (IndexNumber / st_ino) once, by calling lookup for every path component that is
+ * not already known. The node ID is then used for getattr, read and write on the open file,
+ * so that the file system does not have to walk the path again on every call.
+ *
+ * Nodes are indexed by (ino, generation). A node may also be linked under its name in its
+ * parent directory; links form a tree rooted at FUSE_ROOT_ID that mirrors the parts of the
+ * namespace that have been resolved. A linked node holds a reference on its parent, so that
+ * a link is always relative to a live node (and never to a recycled node ID). Links are
+ * keyed by the parent node rather than by path, so renaming a directory does not affect the
+ * links below it; only the link of the renamed name itself goes stale. The next lookup that
+ * returns the node under its new name links it again; for this reason the name of a node is
+ * kept in its own allocation, which can be exchanged while the node is not linked.
+ *
+ * A node stays alive while it is linked or referenced (by open files, by linked children or
+ * by a resolution in progress). When it dies forget is called with the number of lookups
+ * that returned it. Calls into the file system are never made under the table lock.
+ *
+ * The number of links is bounded; once the bound is reached newly resolved nodes are not
+ * linked and are forgotten when their last open file is closed.
+ */
+
+enum
+{
+    fsp_fuse_node_bucket_count = 4096,
+    fsp_fuse_node_max_link_count = 16 * fsp_fuse_node_bucket_count,
+};
+
+struct fsp_fuse_node
+{
+    struct fsp_fuse_node *InoNext;      /* ino index chain; forget list when dead */
+    struct fsp_fuse_node *NameNext;     /* name index chain */
+    struct fsp_fuse_node *Parent;       /* referenced while linked */
+    fuse_ino_t ino;
+    uint64_t generation;
+    uint64_t nlookup;
+    ULONG RefCount;
+    BOOLEAN Linked;
+    UINT32 NameHash;
+    ULONG NameLength;
+    char *Name;
+};
+
+struct fsp_fuse_node_table
+{
+    SRWLOCK Lock;
+    const struct fuse_ino_operations *ops;
+    struct fsp_fuse_node *Root;
+    ULONG LinkCount;
+    struct fsp_fuse_node *InoBuckets[fsp_fuse_node_bucket_count];
+    struct fsp_fuse_node *NameBuckets[fsp_fuse_node_bucket_count];
+};
+
+static inline UINT32 fsp_fuse_node_name_hash(struct fsp_fuse_node *Parent,
+    const char *Name, ULONG Length)
+{
+    UINT32 Hash = 2166136261;
+    UINT_PTR ParentValue = (UINT_PTR)Parent;
+
+    for (ULONG I = 0; sizeof ParentValue > I; I++, ParentValue >>= 8)
+        Hash = (Hash ^ (UINT8)ParentValue) * 16777619;
+    for (ULONG I = 0; Length > I; I++)
+        Hash = (Hash ^ (UINT8)Name[I]) * 16777619;
+
+    return Hash;
+}
+
+static inline struct fsp_fuse_node **fsp_fuse_node_lookup_ino(
+    struct fsp_fuse_node_table *Table, fuse_ino_t ino, uint64_t generation)
+{
+    struct fsp_fuse_node **PNode;
+
+    for (PNode = &Table->InoBuckets[(UINT32)(ino ^ (ino >> 32)) % fsp_fuse_node_bucket_count];
+        0 != *PNode; PNode = &(*PNode)->InoNext)
+        if (ino == (*PNode)->ino && generation == (*PNode)->generation)
+            break;
+
+    return PNode;
+}
+
+static inline struct fsp_fuse_node **fsp_fuse_node_lookup_name(
+    struct fsp_fuse_node_table *Table, struct fsp_fuse_node *Parent,
+    const char *Name, ULONG Length, UINT32 Hash)
+{
+    struct fsp_fuse_node **PNode;
+
+    for (PNode = &Table->NameBuckets[Hash % fsp_fuse_node_bucket_count];
+        0 != *PNode; PNode = &(*PNode)->NameNext)
+        if (Hash == (*PNode)->NameHash && Parent == (*PNode)->Parent &&
+            Length == (*PNode)->NameLength && 0 == memcmp(Name, (*PNode)->Name, Length))
+            break;
+
+    return PNode;
+}
+
+static VOID fsp_fuse_node_unref(struct fsp_fuse_node_table *Table,
+    struct fsp_fuse_node *Node, struct fsp_fuse_node **PForgetList)
+{
+    struct fsp_fuse_node **PNode;
+
+    if (0 != --Node->RefCount || Node->Linked || Table->Root == Node)
+        return;
+
+    PNode = fsp_fuse_node_lookup_ino(Table, Node->ino, Node->generation);
+    if (Node == *PNode)
+        *PNode = Node->InoNext;
+
+    Node->InoNext = *PForgetList;
+    *PForgetList = Node;
+}
+
+static VOID fsp_fuse_node_unlink(struct fsp_fuse_node_table *Table,
+    struct fsp_fuse_node *Node, struct fsp_fuse_node **PForgetList)
+{
+    struct fsp_fuse_node **PNode, *Parent;
+
+    PNode = fsp_fuse_node_lookup_name(Table,
+        Node->Parent, Node->Name, Node->NameLength, Node->NameHash);
+    if (Node == *PNode)
+        *PNode = Node->NameNext;
+    Node->NameNext = 0;
+    Node->Linked = FALSE;
+    Table->LinkCount--;
+
+    Parent = Node->Parent;
+    Node->Parent = 0;
+
+    /* the unlinked node may die now; it is kept alive by the caller or by open files */
+    Node->RefCount++;
+    fsp_fuse_node_unref(Table, Parent, PForgetList);
+    fsp_fuse_node_unref(Table, Node, PForgetList);
+}
+
+static VOID fsp_fuse_node_free(struct fsp_fuse_node *Node)
+{
+    MemFree(Node->Name);
+    MemFree(Node);
+}
+
+static VOID fsp_fuse_node_forget(struct fsp_fuse_node_table *Table,
+    struct fsp_fuse_node *ForgetList)
+{
+    struct fsp_fuse_node *Node;
+
+    while (0 != (Node = ForgetList))
+    {
+        ForgetList = Node->InoNext;
+        if (0 != Table->ops->forget && 0 != Node->nlookup)
+            Table->ops->forget(Node->ino, Node->nlookup);
+        fsp_fuse_node_free(Node);
+    }
+}
+
+static struct fsp_fuse_node *fsp_fuse_node_alloc(fuse_ino_t ino,
+    const char *Name, ULONG Length)
+{
+    struct fsp_fuse_node *Node;
+
+    Node = MemAlloc(sizeof *Node);
+    if (0 == Node)
+        return 0;
+
+    memset(Node, 0, sizeof *Node);
+    Node->ino = ino;
+    Node->NameLength = Length;
+    Node->Name = MemAlloc(Length + 1);
+    if (0 == Node->Name)
+    {
+        MemFree(Node);
+        return 0;
+    }
+    memcpy(Node->Name, Name, Length);
+    Node->Name[Length] = '\0';
+
+    return Node;
+}
+
+NTSTATUS fsp_fuse_node_table_create(const struct fuse_ino_operations *ops,
+    struct fsp_fuse_node_table **PTable)
+{
+    struct fsp_fuse_node_table *Table;
+    struct fsp_fuse_node *Root;
+
+    *PTable = 0;
+
+    Table = MemAlloc(sizeof *Table);
+    if (0 == Table)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    Root = fsp_fuse_node_alloc(FUSE_ROOT_ID, "", 0);
+    if (0 == Root)
+    {
+        MemFree(Table);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    memset(Table, 0, sizeof *Table);
+    InitializeSRWLock(&Table->Lock);
+    Table->ops = ops;
+    Table->Root = Root;
+    *fsp_fuse_node_lookup_ino(Table, Root->ino, Root->generation) = Root;
+
+    *PTable = Table;
+
+    return STATUS_SUCCESS;
+}
+
+VOID fsp_fuse_node_table_delete(struct fsp_fuse_node_table *Table)
+{
+    struct fsp_fuse_node *Node;
+
+    if (0 == Table)
+        return;
+
+    /* like a libfuse unmount: lookup counts implicitly drop to zero without forget */
+    for (ULONG I = 0; fsp_fuse_node_bucket_count > I; I++)
+        while (0 != (Node = Table->InoBuckets[I]))
+        {
+            Table->InoBuckets[I] = Node->InoNext;
+            fsp_fuse_node_free(Node);
+        }
+
+    MemFree(Table);
+}
+
+struct fsp_fuse_node *fsp_fuse_node_resolve(struct fsp_fuse_node_table *Table,
+    const char *PosixPath)
+{
+    struct fsp_fuse_node *Node, *Child, *NewNode, **PNode, *ForgetList = 0;
+    struct fuse_stat_ex stbuf;
+    uint64_t generation;
+    const char *Name, *NameEnd;
+    ULONG Length;
+    UINT32 Hash;
+    int err;
+
+    if (0 == Table)
+        return 0;
+
+    AcquireSRWLockExclusive(&Table->Lock);
+
+    Node = Table->Root;
+    Node->RefCount++;
+
+    for (Name = PosixPath; 0 != Node; Name = NameEnd)
+    {
+        while ('/' == *Name)
+            Name++;
+        if ('\0' == *Name)
+            break;
+        for (NameEnd = Name; '\0' != *NameEnd && '/' != *NameEnd; NameEnd++)
+            ;
+        Length = (ULONG)(NameEnd - Name);
+        Hash = fsp_fuse_node_name_hash(Node, Name, Length);
+
+        Child = *fsp_fuse_node_lookup_name(Table, Node, Name, Length, Hash);
+        if (0 != Child)
+            Child->RefCount++;
+        else
+        {
+            /* allocate before calling lookup so that we never owe a forget we cannot make */
+            NewNode = fsp_fuse_node_alloc(0, Name, Length);
+            if (0 == NewNode)
+            {
+                fsp_fuse_node_unref(Table, Node, &ForgetList);
+                Node = 0;
+                break;
+            }
+
+            ReleaseSRWLockExclusive(&Table->Lock);
+
+            memset(&stbuf, 0, sizeof stbuf);
+            generation = 0;
+            err = Table->ops->lookup(Node->ino, NewNode->Name, (void *)&stbuf, &generation);
+
+            AcquireSRWLockExclusive(&Table->Lock);
+
+            if (0 != err)
+            {
+                fsp_fuse_node_free(NewNode);
+                fsp_fuse_node_unref(Table, Node, &ForgetList);
+                Node = 0;
+                break;
+            }
+
+            PNode = fsp_fuse_node_lookup_ino(Table, stbuf.st_ino, generation);
+            if (0 == (Child = *PNode))
+            {
+                Child = NewNode;
+                NewNode = 0;
+                Child->ino = stbuf.st_ino;
+                Child->generation = generation;
+                Child->InoNext = *PNode;
+                *PNode = Child;
+            }
+            Child->nlookup++;
+            Child->RefCount++;
+
+            /*
+             * Link the child unless it is linked elsewhere or someone beat us to this name.
+             * A known node that is not linked may have been renamed: it takes the new name.
+             */
+            if (!Child->Linked && Table->Root != Child &&
+                fsp_fuse_node_max_link_count > Table->LinkCount)
+            {
+                PNode = fsp_fuse_node_lookup_name(Table, Node, Name, Length, Hash);
+                if (0 == *PNode)
+                {
+                    if (0 != NewNode)
+                    {
+                        char *ChildName = Child->Name;
+                        Child->Name = NewNode->Name;
+                        Child->NameLength = NewNode->NameLength;
+                        NewNode->Name = ChildName;
+                    }
+                    Child->Parent = Node;
+                    Child->NameHash = Hash;
+                    Child->Linked = TRUE;
+                    *PNode = Child;
+                    Table->LinkCount++;
+                    Node->RefCount++;
+                }
+            }
+
+            if (0 != NewNode)
+                fsp_fuse_node_free(NewNode);
+        }
+
+        fsp_fuse_node_unref(Table, Node, &ForgetList);
+        Node = Child;
+    }
+
+    ReleaseSRWLockExclusive(&Table->Lock);
+
+    fsp_fuse_node_forget(Table, ForgetList);
+
+    return Node;
+}
+
+VOID fsp_fuse_node_release(struct fsp_fuse_node_table *Table,
+    struct fsp_fuse_node *Node)
+{
+    struct fsp_fuse_node *ForgetList = 0;
+
+    if (0 == Table || 0 == Node)
+        return;
+
+    AcquireSRWLockExclusive(&Table->Lock);
+    fsp_fuse_node_unref(Table, Node, &ForgetList);
+    ReleaseSRWLockExclusive(&Table->Lock);
+
+    fsp_fuse_node_forget(Table, ForgetList);
+}
+
+fuse_ino_t fsp_fuse_node_ino(struct fsp_fuse_node *Node)
+{
+    return 0 != Node ? Node->ino : 0;
+}
+
+VOID fsp_fuse_node_invalidate(struct fsp_fuse_node_table *Table,
+    const char *PosixPath)
+{
+    struct fsp_fuse_node *Node, *ForgetList = 0;
+    const char *Name, *NameEnd;
+    ULONG Length;
+
+    if (0 == Table)
+        return;
+
+    AcquireSRWLockExclusive(&Table->Lock);
+
+    /* follow existing links only; nothing needs to be invalidated below an unknown name */
+    for (Node = Table->Root, Name = PosixPath; 0 != Node; Name = NameEnd)
+    {
+        while ('/' == *Name)
+            Name++;
+        if ('\0' == *Name)
+            break;
+        for (NameEnd = Name; '\0' != *NameEnd && '/' != *NameEnd; NameEnd++)
+            ;
+        Length = (ULONG)(NameEnd - Name);
+
+        Node = *fsp_fuse_node_lookup_name(Table,
+            Node, Name, Length, fsp_fuse_node_name_hash(Node, Name, Length));
+    }
+
+    if (0 != Node && Table->Root != Node)
+        fsp_fuse_node_unlink(Table, Node, &ForgetList);
+
+    ReleaseSRWLockExclusive(&Table->Lock);
+
+    fsp_fuse_node_forget(Table, ForgetList);
+}
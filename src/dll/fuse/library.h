@@ -35,6 +35,10 @@
 
 #define FSP_FUSE_HAS_SYMLINKS(f)        ((f)->has_symlinks)
 
+/* UTF-8 directory path (at most 3 bytes per WCHAR) + '/' + 255 byte name + '\0' */
+#define FSP_FUSE_DIRINFO_PATH_SIZEMAX   \
+    (3 * FSP_FSCTL_TRANSACT_PATH_SIZEMAX / sizeof(WCHAR) + 1 + 255 + 1)
+
 #define ENOSYS_(env)                    ('C' == (env)->environment ? 88 : 40)
 
 /* NFS reparse points */
@@ -57,6 +61,13 @@ struct fuse
     int rellinks;
     int dothidden;
     unsigned ThreadCount;
+    int PathShardedGuard;
+    struct fsp_fuse_attr_cache *AttrCache;
+    FSP_WORK_QUEUE *DirInfoWorkQueue;
+    unsigned DirInfoThreadCount;
+    ULONG ReadAheadSize, WriteBackSize;
+    struct fsp_fuse_node_table *NodeTable;
+    struct fuse_ino_operations ino_ops;
     struct fuse_operations ops;
     void *data;
     unsigned conn_want;
@@ -87,6 +98,40 @@ struct fsp_fuse_file_desc
     int OpenFlags;
     UINT64 FileHandle;
     PVOID DirBuffer;
+    struct fsp_fuse_node *Node;
+    struct fsp_fuse_file_io *Io;
+};
+/* per-handle read-ahead and write-back; see fuse_intf.c */
+#define FSP_FUSE_FILE_IO_SIZEMAX        (16 * 1024 * 1024)
+struct fsp_fuse_file_io
+{
+    SRWLOCK Lock;
+    UINT64 ReadNextOffset;              /* where a sequential reader will read next */
+    ULONG ReadWindow;                   /* grows while reads are sequential */
+    UINT64 ReadOffset;
+    ULONG ReadLength;                   /* valid read-ahead bytes at ReadOffset */
+    BOOLEAN ReadEof;                    /* read-ahead stopped short at end of file */
+    UINT64 WriteOffset;
+    ULONG WriteLength;                  /* pending write-back bytes at WriteOffset */
+    int WriteError;                     /* deferred write-back error */
+    PUINT8 ReadBuffer, WriteBuffer;     /* allocated on first use */
+};
+/* struct fuse_bufvec as in FUSE 2.9 and FUSE 3; our FUSE 2 headers only declare it */
+#define FSP_FUSE_BUF_IS_FD              (1 << 1)
+struct fsp_fuse_buf
+{
+    size_t size;
+    int flags;
+    void *mem;
+    int fd;
+    fuse_off_t pos;
+};
+struct fsp_fuse_bufvec
+{
+    size_t count;
+    size_t idx;
+    size_t off;
+    struct fsp_fuse_buf buf[1];
 };
 struct fuse_dirhandle
 {
@@ -95,6 +140,8 @@ struct fuse_dirhandle
     FSP_FILE_SYSTEM *FileSystem;
     BOOLEAN ReaddirPlus;
     NTSTATUS Result;
+    PUINT8 FillBuffer;                  /* entries staged for FspFileSystemFillDirectoryBufferBulk */
+    ULONG FillLength, FillBytes;
     /* CanDelete */
     BOOLEAN DotFiles, HasChild;
 };
@@ -147,6 +194,7 @@ struct fsp_fuse_core_opt_data
         set_uid, uid, username_to_uid_result,
         set_gid, gid,
         set_attr_timeout, attr_timeout,
+        set_negative_timeout, negative_timeout,
         rellinks,
         dothidden;
     int set_FileInfoTimeout,
@@ -155,6 +203,10 @@ struct fsp_fuse_core_opt_data
         set_VolumeInfoTimeout,
         set_KeepFileCache;
     unsigned ThreadCount;
+    int PathShardedGuard;
+    int AttrCache;
+    unsigned DirInfoThreadCount;
+    unsigned ReadAheadSize, WriteBackSize;
     FSP_FSCTL_VOLUME_PARAMS VolumeParams;
     UINT16 VolumeLabelLength;
     WCHAR VolumeLabel[sizeof ((FSP_FSCTL_VOLUME_INFO *)0)->VolumeLabel / sizeof(WCHAR)];
@@ -168,6 +220,35 @@ int fsp_fuse_core_opt_parse(struct fsp_fuse_env *env,
     struct fuse_args *args, struct fsp_fuse_core_opt_data *opt_data,
     int help);
 
+/* attribute cache */
+struct fsp_fuse_attr_cache;
+NTSTATUS fsp_fuse_attr_cache_create(unsigned Timeout, unsigned NegativeTimeout,
+    struct fsp_fuse_attr_cache **PCache);
+VOID fsp_fuse_attr_cache_delete(struct fsp_fuse_attr_cache *Cache);
+BOOLEAN fsp_fuse_attr_cache_get(struct fsp_fuse_attr_cache *Cache,
+    const char *PosixPath, struct fuse_stat_ex *stbuf, int *PErr);
+VOID fsp_fuse_attr_cache_set(struct fsp_fuse_attr_cache *Cache,
+    const char *PosixPath, const struct fuse_stat_ex *stbuf, int Err);
+VOID fsp_fuse_attr_cache_set_size(struct fsp_fuse_attr_cache *Cache,
+    const char *PosixPath, UINT64 FileSize);
+VOID fsp_fuse_attr_cache_invalidate(struct fsp_fuse_attr_cache *Cache,
+    const char *PosixPath, BOOLEAN Parent);
+VOID fsp_fuse_attr_cache_invalidate_all(struct fsp_fuse_attr_cache *Cache);
+
+/* node table */
+struct fsp_fuse_node;
+struct fsp_fuse_node_table;
+NTSTATUS fsp_fuse_node_table_create(const struct fuse_ino_operations *ops,
+    struct fsp_fuse_node_table **PTable);
+VOID fsp_fuse_node_table_delete(struct fsp_fuse_node_table *Table);
+struct fsp_fuse_node *fsp_fuse_node_resolve(struct fsp_fuse_node_table *Table,
+    const char *PosixPath);
+VOID fsp_fuse_node_release(struct fsp_fuse_node_table *Table,
+    struct fsp_fuse_node *Node);
+fuse_ino_t fsp_fuse_node_ino(struct fsp_fuse_node *Node);
+VOID fsp_fuse_node_invalidate(struct fsp_fuse_node_table *Table,
+    const char *PosixPath);
+
 /* misc public symbols */
 NTSTATUS fsp_fuse_op_enter(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response);
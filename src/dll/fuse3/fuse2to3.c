@@ -434,12 +434,16 @@ static int fuse2to3_poll(const char *path, struct fuse_file_info *fi,
 static int fuse2to3_write_buf(const char *path,
     struct fuse_bufvec *buf, fuse_off_t off, struct fuse_file_info *fi)
 {
+    FSP_FSCTL_STATIC_ASSERT(
+        sizeof(struct fsp_fuse_bufvec) == sizeof(struct fuse3_bufvec),
+        "incompatible structs fsp_fuse_bufvec and fuse3_bufvec");
+    FSP_FSCTL_STATIC_ASSERT(FIELD_OFFSET(
+        struct fsp_fuse_bufvec, buf[0].pos) == FIELD_OFFSET(struct fuse3_bufvec, buf[0].pos),
+        "incompatible structs fsp_fuse_bufvec and fuse3_bufvec");
     struct fuse3 *f3 = fuse2to3_getfuse3();
     struct fuse3_file_info fi3;
     fuse2to3_fi3from2(&fi3, fi);
-    int res = f3->ops.write_buf(path,
-        (struct fuse3_bufvec *)buf, /* revisit if we implement bufvec's */
-        off, &fi3);
+    int res = f3->ops.write_buf(path, (struct fuse3_bufvec *)buf, off, &fi3);
     fuse2to3_fi2from3(fi, &fi3);
     return res;
 }
@@ -450,9 +454,7 @@ static int fuse2to3_read_buf(const char *path,
     struct fuse3 *f3 = fuse2to3_getfuse3();
     struct fuse3_file_info fi3;
     fuse2to3_fi3from2(&fi3, fi);
-    int res = f3->ops.read_buf(path,
-        (struct fuse3_bufvec **)bufp, /* revisit if we implement bufvec's */
-        size, off, &fi3);
+    int res = f3->ops.read_buf(path, (struct fuse3_bufvec **)bufp, size, off, &fi3);
     fuse2to3_fi2from3(fi, &fi3);
     return res;
 }
@@ -79,17 +79,56 @@ VOID FspFileSystemPeekInDirectoryBuffer(PVOID *PDirBuffer,
 
 BOOL WINAPI FspServiceConsoleCtrlHandler(DWORD CtrlType);
 
+typedef struct _FSP_WORK_QUEUE FSP_WORK_QUEUE;
+typedef struct _FSP_WORK_ITEM FSP_WORK_ITEM;
+typedef VOID FSP_WORK_ROUTINE(FSP_WORK_ITEM *WorkItem, PVOID WorkerBuffer);
+    /* WorkerBuffer is 0 when the work item is cancelled during FspWorkQueueDelete */
+struct _FSP_WORK_ITEM
+{
+    LIST_ENTRY ListEntry;
+    FSP_WORK_ROUTINE *Routine;
+};
+NTSTATUS FspWorkQueueCreate(ULONG ThreadCount, SIZE_T WorkerBufferSize,
+    FSP_WORK_QUEUE **PWorkQueue);
+VOID FspWorkQueueDelete(FSP_WORK_QUEUE *WorkQueue);
+VOID FspWorkQueuePost(FSP_WORK_QUEUE *WorkQueue, FSP_WORK_ITEM *WorkItem, BOOLEAN Urgent);
+
+NTSTATUS FspFileSystemStatisticsCreate(PVOID *PStatistics);
+VOID FspFileSystemStatisticsDelete(PVOID Statistics);
+VOID FspFileSystemStatisticsRegisterThread(PVOID Statistics, USHORT NumaNode);
+VOID FspFileSystemStatisticsUnregisterThread(PVOID Statistics);
+VOID FspFileSystemStatisticsRecord(PVOID Statistics,
+    FSP_FSCTL_TRANSACT_REQ *Request, UINT64 Time);
+VOID FspFileSystemDispatcherThreadCountRange(FSP_FILE_SYSTEM *FileSystem,
+    PULONG PThreadCountMin, PULONG PThreadCountMax);
+
+NTSTATUS FspFileSystemOpGuardShardsCreate(PVOID *PShards);
+VOID FspFileSystemOpGuardShardsDelete(PVOID Shards);
+ULONG FspFileSystemOpGuardShardOfParentW(PWSTR FileName, ULONG Length);
+ULONG FspFileSystemOpGuardShardOfDirectoryW(PWSTR FileName, ULONG Length);
+VOID FspFileSystemOpGuardShardsAcquire(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, BOOLEAN Exclusive);
+VOID FspFileSystemOpGuardShardsRelease(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, BOOLEAN Exclusive);
+
+BOOLEAN FspFileSystemDispatchDetached(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response);
+
+VOID FspFileSystemTraceDelete(PVOID Trace);
+NTSTATUS FspFileSystemAsyncCreate(FSP_FILE_SYSTEM *FileSystem, ULONG ThreadCount,
+    PVOID *PAsync);
+VOID FspFileSystemAsyncDelete(PVOID Async);
+VOID FspFileSystemTraceRecord(PVOID Trace, ULONG Type, PVOID Message, ULONG Size, UINT64 Time);
+
 static inline ULONG FspPathSuffixIndex(PWSTR FileName)
 {
-    WCHAR Root[2] = L"\\";
-    PWSTR Remain, Suffix;
-    ULONG Result;
+    PWSTR Suffix;
+    ULONG RemainLength, SuffixLength;
 
-    FspPathSuffix(FileName, &Remain, &Suffix, Root);
-    Result = Remain == Root ? 0 : (ULONG)(Suffix - Remain);
-    FspPathCombine(FileName, Suffix);
+    FspPathSplit(FileName, lstrlenW(FileName), &RemainLength, &Suffix, &SuffixLength);
 
-    return Result;
+    /* a root parent has a suffix index of 0 */
+    return 1 == RemainLength && L'\\' == FileName[0] ? 0 : (ULONG)(Suffix - FileName);
 }
 
 static inline BOOLEAN FspPathIsDrive(PWSTR FileName)
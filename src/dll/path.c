@@ -20,6 +20,9 @@
  */
 
 #include <dll/library.h>
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
 
 FSP_API VOID FspPathPrefix(PWSTR Path, PWSTR *PPrefix, PWSTR *PRemain, PWSTR Root)
 {
@@ -73,3 +76,231 @@ FSP_API VOID FspPathCombine(PWSTR Prefix, PWSTR Suffix)
         if (L'\0' == *Prefix)
             *Prefix = L'\\';
 }
+
+/*
+ * Path views
+ *
+ * The following functions operate on a (Path, Length) view of a path and never write
+ * to it; the path need not be NUL-terminated. They are meant for hot paths (lookups,
+ * lock sharding, reparse point resolution) that would otherwise have to copy a path
+ * or temporarily split it with FspPathPrefix/FspPathSuffix/FspPathCombine.
+ */
+
+FSP_API ULONG FspPathScan(PWSTR Path, ULONG Length, WCHAR Char0, WCHAR Char1)
+{
+    ULONG Index = 0;
+
+#if defined(_M_IX86) || defined(_M_X64)
+    __m128i Vector0 = _mm_set1_epi16((SHORT)Char0);
+    __m128i Vector1 = _mm_set1_epi16((SHORT)Char1);
+    __m128i Vector;
+    DWORD Mask, Bit;
+
+    for (; Length - Index >= 8; Index += 8)
+    {
+        Vector = _mm_loadu_si128((const __m128i *)(Path + Index));
+        Mask = (DWORD)_mm_movemask_epi8(_mm_or_si128(
+            _mm_cmpeq_epi16(Vector, Vector0),
+            _mm_cmpeq_epi16(Vector, Vector1)));
+        if (0 != Mask)
+        {
+            _BitScanForward(&Bit, Mask);
+            return Index + Bit / sizeof(WCHAR);
+        }
+    }
+#endif
+
+    for (; Length > Index; Index++)
+        if (Char0 == Path[Index] || Char1 == Path[Index])
+            break;
+
+    return Index;
+}
+
+FSP_API BOOLEAN FspPathNextComponent(PWSTR Path, ULONG Length, PULONG PIndex,
+    PWSTR *PComponent, PULONG PComponentLength)
+{
+    ULONG Index = *PIndex, EndIndex;
+
+    for (; Length > Index && L'\\' == Path[Index]; Index++)
+        ;
+
+    if (Length <= Index)
+    {
+        *PIndex = Length;
+        *PComponent = Path + Length;
+        *PComponentLength = 0;
+        return FALSE;
+    }
+
+    EndIndex = Index + FspPathScan(Path + Index, Length - Index, L'\\', L'\\');
+
+    *PIndex = EndIndex;
+    *PComponent = Path + Index;
+    *PComponentLength = EndIndex - Index;
+    return TRUE;
+}
+
+FSP_API VOID FspPathSplit(PWSTR Path, ULONG Length,
+    PULONG PParentLength, PWSTR *PLeaf, PULONG PLeafLength)
+{
+    ULONG LeafIndex, ParentLength;
+
+    for (LeafIndex = Length; 0 < LeafIndex && L'\\' != Path[LeafIndex - 1]; LeafIndex--)
+        ;
+
+    if (0 == LeafIndex)
+    {
+        /* no separator: like FspPathSuffix the whole path is the parent */
+        *PParentLength = Length;
+        *PLeaf = Path + Length;
+        *PLeafLength = 0;
+        return;
+    }
+
+    for (ParentLength = LeafIndex - 1; 0 < ParentLength && L'\\' == Path[ParentLength - 1];
+        ParentLength--)
+        ;
+
+    /* a parent that is all separators is the root, which is viewed as Path[0..1) */
+    *PParentLength = 0 != ParentLength ? ParentLength : 1;
+    *PLeaf = Path + LeafIndex;
+    *PLeafLength = Length - LeafIndex;
+}
+
+/*
+ * Case-insensitive names
+ *
+ * Names are upper cased one UTF-16 code unit at a time using a 64K entry table, in the
+ * same manner as the NTFS $UpCase file. The table is filled from RtlUpcaseUnicodeChar,
+ * which is what the FSD uses to normalize case-insensitive names. ASCII characters are
+ * folded inline and never touch the table.
+ */
+
+static INIT_ONCE FspUpcaseInitOnce = INIT_ONCE_STATIC_INIT;
+static WCHAR FspUpcaseTable[0x10000];
+
+static BOOL WINAPI FspUpcaseInitialize(
+    PINIT_ONCE InitOnce, PVOID Parameter, PVOID *Context)
+{
+    WCHAR (NTAPI *RtlUpcaseUnicodeChar)(WCHAR C) = 0;
+    HANDLE Handle;
+
+    Handle = GetModuleHandleW(L"ntdll.dll");
+    if (0 != Handle)
+        RtlUpcaseUnicodeChar = (PVOID)GetProcAddress(Handle, "RtlUpcaseUnicodeChar");
+
+    /* ntdll always exports it; if it does not, fold ASCII only rather than pull in user32 */
+    for (ULONG C = 0; 0x10000 > C; C++)
+        FspUpcaseTable[C] = 0 != RtlUpcaseUnicodeChar ?
+            RtlUpcaseUnicodeChar((WCHAR)C) :
+            (L'a' <= C && C <= L'z' ? (WCHAR)(C - (L'a' - L'A')) : (WCHAR)C);
+
+    return TRUE;
+}
+
+static inline WCHAR FspUpcaseAscii(WCHAR C)
+{
+    return L'a' <= C && C <= L'z' ? C - (L'a' - L'A') : C;
+}
+
+FSP_API UINT32 FspPathHash(PWSTR Path, ULONG Length, BOOLEAN CaseInsensitive)
+{
+    UINT32 Hash = 2166136261;
+    BOOLEAN Upcase = FALSE;
+    WCHAR C;
+
+    /* FNV-1a over UTF-16 code units; case-folded the way the FSD upper cases names */
+    for (ULONG Index = 0; Length > Index; Index++)
+    {
+        C = Path[Index];
+        if (CaseInsensitive)
+        {
+            if (0x80 > C)
+                C = FspUpcaseAscii(C);
+            else
+            {
+                if (!Upcase)
+                {
+                    InitOnceExecuteOnce(&FspUpcaseInitOnce, FspUpcaseInitialize, 0, 0);
+                    Upcase = TRUE;
+                }
+                C = FspUpcaseTable[C];
+            }
+        }
+        Hash = (Hash ^ C) * 16777619;
+    }
+
+    return Hash;
+}
+
+FSP_API int FspNameCompare(PWSTR Name0, ULONG Length0, PWSTR Name1, ULONG Length1,
+    BOOLEAN CaseInsensitive)
+{
+    ULONG Length = Length0 < Length1 ? Length0 : Length1, Index = 0;
+    BOOLEAN Upcase = FALSE;
+    WCHAR C0, C1;
+
+#if defined(_M_IX86) || defined(_M_X64)
+    /*
+     * Compare eight code units at a time while they are equal, after folding ASCII case
+     * if required. Stop at the first block that differs or that contains a non-ASCII
+     * character and let the scalar loop below finish the comparison.
+     */
+    __m128i NonAscii = _mm_set1_epi16((SHORT)0xff80);
+    __m128i LowerA = _mm_set1_epi16(L'a' - 1), LowerZ = _mm_set1_epi16(L'z' + 1);
+    __m128i CaseBit = _mm_set1_epi16(0x20);
+    __m128i Vector0, Vector1;
+
+    for (; Length - Index >= 8; Index += 8)
+    {
+        Vector0 = _mm_loadu_si128((const __m128i *)(Name0 + Index));
+        Vector1 = _mm_loadu_si128((const __m128i *)(Name1 + Index));
+        if (CaseInsensitive)
+        {
+            if (0xffff != _mm_movemask_epi8(_mm_cmpeq_epi16(
+                _mm_and_si128(_mm_or_si128(Vector0, Vector1), NonAscii), _mm_setzero_si128())))
+                break;
+            Vector0 = _mm_sub_epi16(Vector0, _mm_and_si128(CaseBit, _mm_and_si128(
+                _mm_cmpgt_epi16(Vector0, LowerA), _mm_cmplt_epi16(Vector0, LowerZ))));
+            Vector1 = _mm_sub_epi16(Vector1, _mm_and_si128(CaseBit, _mm_and_si128(
+                _mm_cmpgt_epi16(Vector1, LowerA), _mm_cmplt_epi16(Vector1, LowerZ))));
+        }
+        if (0xffff != _mm_movemask_epi8(_mm_cmpeq_epi16(Vector0, Vector1)))
+            break;
+    }
+#endif
+
+    for (; Length > Index; Index++)
+    {
+        C0 = Name0[Index];
+        C1 = Name1[Index];
+        if (C0 == C1)
+            continue;
+
+        if (CaseInsensitive)
+        {
+            if (0x80 > C0 && 0x80 > C1)
+            {
+                C0 = FspUpcaseAscii(C0);
+                C1 = FspUpcaseAscii(C1);
+            }
+            else
+            {
+                if (!Upcase)
+                {
+                    InitOnceExecuteOnce(&FspUpcaseInitOnce, FspUpcaseInitialize, 0, 0);
+                    Upcase = TRUE;
+                }
+                C0 = FspUpcaseTable[C0];
+                C1 = FspUpcaseTable[C1];
+            }
+            if (C0 == C1)
+                continue;
+        }
+
+        return (int)C0 - (int)C1;
+    }
+
+    return (int)Length0 - (int)Length1;
+}
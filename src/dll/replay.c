@@ -0,0 +1,645 @@
+/**
+ * @file dll/replay.c
+ *
+ * @copyright 2015-2021 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+
+#include <dll/library.h>
+
+/*
+ * Request trace replay.
+ *
+ * The trace is loaded in memory and its records are ordered by time. Requests are paired
+ * with their recorded responses using the request Hint. Every request that uses a file
+ * context is then linked to the Create that produced that file context (its producer);
+ * during replay the request waits for its producer to complete and uses the file context
+ * that the producer received from the file system.
+ *
+ * All request kinds other than Create and the volume requests carry the file context in
+ * the first two fields of their Req union member (UserContext, UserContext2); the replay
+ * code relies on this layout.
+ */
+
+#define FspReplayFileContext(Request)   ((PUINT64)&(Request)->Req)
+
+enum
+{
+    FspReplayPending                    = 0,
+    FspReplaySucceeded                  = 1,
+    FspReplayFailed                     = 2,
+};
+
+typedef struct
+{
+    FSP_FSCTL_TRANSACT_REQ *Request;
+    FSP_FSCTL_TRANSACT_RSP *RecordedResponse;
+    UINT64 Time;
+    LONG Producer;
+    volatile LONG State;
+    volatile LONG DependentCount;
+    UINT64 FileContext[2];
+} FSP_REPLAY_ENTRY;
+
+typedef struct
+{
+    UINT64 Key[2];
+    LONG Value;
+} FSP_REPLAY_MAP_ENTRY;
+
+typedef struct
+{
+    FSP_FILE_SYSTEM *FileSystem;
+    FSP_REPLAY_ENTRY *Entries;
+    ULONG EntryCount;
+    volatile LONG NextEntry;
+    ULONG Speed;
+    UINT64 RecordedFrequency, RecordedStartTime;
+    UINT64 Frequency, StartTime;
+    UINT64 AccessToken;
+    volatile LONG64 RequestCount, SkipCount, MismatchCount;
+} FSP_REPLAY;
+
+static inline BOOLEAN FspReplayRecordLess(
+    FSP_FILE_SYSTEM_TRACE_RECORD *A, FSP_FILE_SYSTEM_TRACE_RECORD *B)
+{
+    /* order by time; requests before responses; then by position in the trace */
+    if (A->Time != B->Time)
+        return A->Time < B->Time;
+    if (A->Type != B->Type)
+        return A->Type < B->Type;
+    return A < B;
+}
+
+static VOID FspReplaySortRecords(FSP_FILE_SYSTEM_TRACE_RECORD **Records, ULONG Count)
+{
+    FSP_FILE_SYSTEM_TRACE_RECORD *Record;
+    ULONG I, Parent, Child, End;
+
+    /* heap sort: no recursion and no additional memory */
+    for (I = Count / 2; 0 < I;)
+    {
+        I--;
+        for (Parent = I; (Child = 2 * Parent + 1) < Count; Parent = Child)
+        {
+            if (Child + 1 < Count && FspReplayRecordLess(Records[Child], Records[Child + 1]))
+                Child++;
+            if (!FspReplayRecordLess(Records[Parent], Records[Child]))
+                break;
+            Record = Records[Parent]; Records[Parent] = Records[Child]; Records[Child] = Record;
+        }
+    }
+    for (End = Count; 1 < End;)
+    {
+        End--;
+        Record = Records[0]; Records[0] = Records[End]; Records[End] = Record;
+        for (Parent = 0; (Child = 2 * Parent + 1) < End; Parent = Child)
+        {
+            if (Child + 1 < End && FspReplayRecordLess(Records[Child], Records[Child + 1]))
+                Child++;
+            if (!FspReplayRecordLess(Records[Parent], Records[Child]))
+                break;
+            Record = Records[Parent]; Records[Parent] = Records[Child]; Records[Child] = Record;
+        }
+    }
+}
+
+static PLONG FspReplayMapLookup(FSP_REPLAY_MAP_ENTRY *Map, ULONG Mask,
+    UINT64 Key0, UINT64 Key1, BOOLEAN Insert)
+{
+    ULONG Index;
+
+    Index = (ULONG)(((Key0 ^ (Key1 * 0x9e3779b97f4a7c15ULL)) * 0x9e3779b97f4a7c15ULL) >> 40) & Mask;
+    for (;; Index = (Index + 1) & Mask)
+    {
+        if (-1 == Map[Index].Value)
+        {
+            if (!Insert)
+                return 0;
+            Map[Index].Key[0] = Key0;
+            Map[Index].Key[1] = Key1;
+            return &Map[Index].Value;
+        }
+        if (Key0 == Map[Index].Key[0] && Key1 == Map[Index].Key[1])
+            return &Map[Index].Value;
+    }
+}
+
+static FSP_REPLAY_MAP_ENTRY *FspReplayMapCreate(ULONG Count, PULONG PMask)
+{
+    FSP_REPLAY_MAP_ENTRY *Map;
+    ULONG Size;
+
+    for (Size = 16; Size < 2 * Count; Size <<= 1)
+        ;
+
+    Map = MemAlloc(Size * sizeof *Map);
+    if (0 == Map)
+        return 0;
+    for (ULONG I = 0; Size > I; I++)
+        Map[I].Value = -1;
+
+    *PMask = Size - 1;
+    return Map;
+}
+
+static NTSTATUS FspReplayLoad(FSP_FILE_SYSTEM *FileSystem, PWSTR FileName,
+    FSP_REPLAY *Replay, PVOID *PTraceBuf)
+{
+    HANDLE Handle = INVALID_HANDLE_VALUE;
+    LARGE_INTEGER FileSize;
+    PUINT8 TraceBuf = 0, TraceBufEnd, P;
+    FSP_FILE_SYSTEM_TRACE_HEADER *Header;
+    FSP_FILE_SYSTEM_TRACE_RECORD *Record, **Records = 0;
+    FSP_FSCTL_TRANSACT_REQ *Request;
+    FSP_FSCTL_TRANSACT_RSP *Response;
+    FSP_REPLAY_ENTRY *Entries = 0, *Entry;
+    FSP_REPLAY_MAP_ENTRY *Map = 0;
+    ULONG RecordCount, EntryCount, MapMask, Size;
+    DWORD BytesTransferred;
+    PLONG PValue;
+    NTSTATUS Result;
+
+    *PTraceBuf = 0;
+
+    Handle = CreateFileW(FileName,
+        GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+    if (INVALID_HANDLE_VALUE == Handle)
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+
+    if (!GetFileSizeEx(Handle, &FileSize))
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+    if (sizeof *Header > FileSize.QuadPart || MAXLONG < FileSize.QuadPart)
+    {
+        Result = STATUS_INVALID_IMAGE_FORMAT;
+        goto exit;
+    }
+
+    TraceBuf = MemAlloc((SIZE_T)FileSize.QuadPart);
+    if (0 == TraceBuf)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+
+    for (P = TraceBuf, TraceBufEnd = TraceBuf + FileSize.QuadPart; TraceBufEnd > P;
+        P += BytesTransferred)
+    {
+        if (!ReadFile(Handle, P, (DWORD)(TraceBufEnd - P), &BytesTransferred, 0))
+        {
+            Result = FspNtStatusFromWin32(GetLastError());
+            goto exit;
+        }
+        if (0 == BytesTransferred)
+        {
+            Result = STATUS_INVALID_IMAGE_FORMAT;
+            goto exit;
+        }
+    }
+
+    Header = (PVOID)TraceBuf;
+    if (FSP_FILE_SYSTEM_TRACE_SIGNATURE != Header->Signature ||
+        sizeof *Header > Header->Version ||
+        FileSize.QuadPart < Header->Version ||
+        0 == Header->Frequency)
+    {
+        Result = STATUS_INVALID_IMAGE_FORMAT;
+        goto exit;
+    }
+
+    /* validate records and count them */
+    RecordCount = 0;
+    for (P = TraceBuf + Header->Version; TraceBufEnd > P; P += Record->Size)
+    {
+        Record = (PVOID)P;
+        if ((ULONG)(TraceBufEnd - P) < sizeof *Record ||
+            (ULONG)(TraceBufEnd - P) < Record->Size ||
+            sizeof *Record + sizeof(UINT16) * 2 > Record->Size ||
+            0 != Record->Size % FSP_FSCTL_DEFAULT_ALIGNMENT)
+        {
+            Result = STATUS_INVALID_IMAGE_FORMAT;
+            goto exit;
+        }
+        Size = ((PUINT16)(Record + 1))[1]; /* Request->Size or Response->Size */
+        if (Record->Size < sizeof *Record + Size ||
+            (FspFileSystemTraceRequest == Record->Type &&
+                (sizeof(FSP_FSCTL_TRANSACT_REQ) > Size || FSP_FSCTL_TRANSACT_REQ_SIZEMAX < Size)) ||
+            (FspFileSystemTraceResponse == Record->Type &&
+                (sizeof(FSP_FSCTL_TRANSACT_RSP) > Size || FSP_FSCTL_TRANSACT_RSP_SIZEMAX < Size)))
+        {
+            Result = STATUS_INVALID_IMAGE_FORMAT;
+            goto exit;
+        }
+        RecordCount++;
+    }
+
+    Records = MemAlloc((RecordCount + 1) * sizeof *Records);
+    Entries = MemAlloc((RecordCount + 1) * sizeof *Entries);
+    Map = FspReplayMapCreate(RecordCount, &MapMask);
+    if (0 == Records || 0 == Entries || 0 == Map)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+
+    RecordCount = 0;
+    for (P = TraceBuf + Header->Version; TraceBufEnd > P; P += Record->Size)
+        Records[RecordCount++] = Record = (PVOID)P;
+
+    FspReplaySortRecords(Records, RecordCount);
+
+    /* pair requests with responses by Hint */
+    EntryCount = 0;
+    for (ULONG I = 0; RecordCount > I; I++)
+    {
+        Record = Records[I];
+        switch (Record->Type)
+        {
+        case FspFileSystemTraceRequest:
+            Request = (PVOID)(Record + 1);
+            if (FspFsctlTransactReservedKind == Request->Kind ||
+                FspFsctlTransactKindCount <= Request->Kind)
+                break;
+            Entry = Entries + EntryCount;
+            memset(Entry, 0, sizeof *Entry);
+            Entry->Request = Request;
+            Entry->Time = Record->Time;
+            Entry->Producer = -1;
+            PValue = FspReplayMapLookup(Map, MapMask, Request->Hint, 0, TRUE);
+            *PValue = EntryCount++;
+            break;
+        case FspFileSystemTraceResponse:
+            Response = (PVOID)(Record + 1);
+            PValue = FspReplayMapLookup(Map, MapMask, Response->Hint, 0, FALSE);
+            if (0 != PValue && 0 == Entries[*PValue].RecordedResponse)
+                Entries[*PValue].RecordedResponse = Response;
+            break;
+        }
+    }
+
+    /* link requests to the Create that produced their file context */
+    for (ULONG I = 0; MapMask >= I; I++)
+        Map[I].Value = -1;
+    for (ULONG I = 0; EntryCount > I; I++)
+    {
+        Entry = Entries + I;
+        Request = Entry->Request;
+        Response = Entry->RecordedResponse;
+        switch (Request->Kind)
+        {
+        case FspFsctlTransactCreateKind:
+            if (0 != Response &&
+                NT_SUCCESS(Response->IoStatus.Status) &&
+                STATUS_REPARSE != Response->IoStatus.Status &&
+                STATUS_PENDING != Response->IoStatus.Status)
+            {
+                PValue = FspReplayMapLookup(Map, MapMask,
+                    Response->Rsp.Create.Opened.UserContext,
+                    Response->Rsp.Create.Opened.UserContext2, TRUE);
+                *PValue = I;
+            }
+            break;
+        case FspFsctlTransactQueryVolumeInformationKind:
+        case FspFsctlTransactSetVolumeInformationKind:
+        case FspFsctlTransactShutdownKind:
+        case FspFsctlTransactLockControlKind:
+            break;
+        default:
+            if (0 == FspReplayFileContext(Request)[0] && 0 == FspReplayFileContext(Request)[1])
+                break;
+            PValue = FspReplayMapLookup(Map, MapMask,
+                FspReplayFileContext(Request)[0], FspReplayFileContext(Request)[1], FALSE);
+            Entry->Producer = 0 != PValue ? *PValue : -2;
+            if (0 <= Entry->Producer)
+            {
+                if (FspFsctlTransactCloseKind != Request->Kind)
+                    Entries[Entry->Producer].DependentCount++;
+                else
+                    /* requests after Close cannot use the file context; avoids Close deadlock */
+                    *PValue = -2;
+            }
+            break;
+        }
+    }
+
+    Replay->FileSystem = FileSystem;
+    Replay->Entries = Entries;
+    Replay->EntryCount = EntryCount;
+    Replay->RecordedFrequency = Header->Frequency;
+    Replay->RecordedStartTime = 0 < EntryCount ? Entries[0].Time : 0;
+
+    *PTraceBuf = TraceBuf;
+    Result = STATUS_SUCCESS;
+
+exit:
+    MemFree(Map);
+    MemFree(Records);
+    if (!NT_SUCCESS(Result))
+    {
+        MemFree(Entries);
+        MemFree(TraceBuf);
+    }
+    if (INVALID_HANDLE_VALUE != Handle)
+        CloseHandle(Handle);
+
+    return Result;
+}
+
+static inline UINT64 FspReplayConvertTime(UINT64 Time, UINT64 FromFrequency, UINT64 ToFrequency)
+{
+    return Time / FromFrequency * ToFrequency + Time % FromFrequency * ToFrequency / FromFrequency;
+}
+
+static VOID FspReplayWaitTime(FSP_REPLAY *Replay, FSP_REPLAY_ENTRY *Entry)
+{
+    UINT64 DueTime;
+    LARGE_INTEGER Time;
+    ULONG Millis;
+
+    DueTime = (Entry->Time - Replay->RecordedStartTime) * 100 / Replay->Speed;
+    DueTime = Replay->StartTime +
+        FspReplayConvertTime(DueTime, Replay->RecordedFrequency, Replay->Frequency);
+
+    for (;;)
+    {
+        QueryPerformanceCounter(&Time);
+        if ((UINT64)Time.QuadPart >= DueTime)
+            break;
+        Millis = (ULONG)FspReplayConvertTime(DueTime - Time.QuadPart, Replay->Frequency, 1000);
+        if (1 < Millis)
+            Sleep(Millis - 1);
+        else
+            YieldProcessor();
+    }
+}
+
+static VOID FspReplayEntry(FSP_REPLAY *Replay, FSP_REPLAY_ENTRY *Entry,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response,
+    PVOID *PDataBuffer, PULONG PDataBufferSize)
+{
+    FSP_REPLAY_ENTRY *Producer = 0;
+    ULONG Length;
+    PVOID DataBuffer;
+    BOOLEAN Completed;
+
+    if (0 != Replay->Speed)
+        FspReplayWaitTime(Replay, Entry);
+
+    if (-1 != Entry->Producer)
+    {
+        if (0 > Entry->Producer)
+            goto skip;
+
+        Producer = Replay->Entries + Entry->Producer;
+        while (FspReplayPending == Producer->State)
+            SwitchToThread();
+        if (FspReplaySucceeded != Producer->State)
+            goto skip;
+
+        if (FspFsctlTransactCloseKind == Entry->Request->Kind)
+            while (0 != Producer->DependentCount)
+                SwitchToThread();
+    }
+
+    memcpy(Request, Entry->Request, Entry->Request->Size);
+    if (0 != Producer)
+    {
+        FspReplayFileContext(Request)[0] = Producer->FileContext[0];
+        FspReplayFileContext(Request)[1] = Producer->FileContext[1];
+    }
+
+    Length = 0;
+    switch (Request->Kind)
+    {
+    case FspFsctlTransactCreateKind:
+        Request->Req.Create.AccessToken = Replay->AccessToken;
+        break;
+    case FspFsctlTransactSetInformationKind:
+        if (10/*FileRenameInformation*/ == Request->Req.SetInformation.FileInformationClass ||
+            65/*FileRenameInformationEx*/ == Request->Req.SetInformation.FileInformationClass)
+        {
+            if (0 != Request->Req.SetInformation.Info.Rename.AccessToken)
+                Request->Req.SetInformation.Info.Rename.AccessToken = Replay->AccessToken;
+        }
+        break;
+    case FspFsctlTransactReadKind:
+        Length = Request->Req.Read.Length;
+        break;
+    case FspFsctlTransactWriteKind:
+        Length = Request->Req.Write.Length;
+        break;
+    case FspFsctlTransactQueryDirectoryKind:
+        Length = Request->Req.QueryDirectory.Length;
+        break;
+    }
+
+    if (0 != Length)
+    {
+        if (*PDataBufferSize < Length)
+        {
+            DataBuffer = MemRealloc(*PDataBuffer, Length);
+            if (0 == DataBuffer)
+                goto skip;
+            memset(DataBuffer, 0, Length);
+            *PDataBuffer = DataBuffer;
+            *PDataBufferSize = Length;
+        }
+        /* Read, Write and QueryDirectory share the Address field offset */
+        Request->Req.Read.Address = (UINT64)(UINT_PTR)*PDataBuffer;
+    }
+
+    Completed = FspFileSystemDispatchDetached(Replay->FileSystem, Request, Response);
+    InterlockedIncrement64(&Replay->RequestCount);
+
+    /* operations that return STATUS_PENDING cannot be replayed; count them as mismatches */
+    if (!Completed ||
+        (0 != Entry->RecordedResponse &&
+            Entry->RecordedResponse->IoStatus.Status != Response->IoStatus.Status))
+        InterlockedIncrement64(&Replay->MismatchCount);
+
+    if (FspFsctlTransactCreateKind == Request->Kind)
+    {
+        if (Completed &&
+            NT_SUCCESS(Response->IoStatus.Status) &&
+            STATUS_REPARSE != Response->IoStatus.Status)
+        {
+            Entry->FileContext[0] = Response->Rsp.Create.Opened.UserContext;
+            Entry->FileContext[1] = Response->Rsp.Create.Opened.UserContext2;
+            InterlockedExchange(&Entry->State, FspReplaySucceeded);
+        }
+        else
+            InterlockedExchange(&Entry->State, FspReplayFailed);
+    }
+
+    goto exit;
+
+skip:
+    InterlockedIncrement64(&Replay->SkipCount);
+    if (FspFsctlTransactCreateKind == Entry->Request->Kind)
+        InterlockedExchange(&Entry->State, FspReplayFailed);
+
+exit:
+    if (0 != Producer && FspFsctlTransactCloseKind != Entry->Request->Kind)
+        InterlockedDecrement(&Producer->DependentCount);
+}
+
+static DWORD WINAPI FspReplayThread(PVOID Replay0)
+{
+    FSP_REPLAY *Replay = Replay0;
+    FSP_FSCTL_TRANSACT_REQ *Request;
+    FSP_FSCTL_TRANSACT_RSP *Response;
+    PVOID DataBuffer = 0;
+    ULONG DataBufferSize = 0;
+    ULONG Index;
+
+    Request = MemAlloc(FSP_FSCTL_TRANSACT_REQ_SIZEMAX);
+    Response = MemAlloc(FSP_FSCTL_TRANSACT_RSP_SIZEMAX);
+
+    for (;;)
+    {
+        Index = (ULONG)InterlockedIncrement(&Replay->NextEntry) - 1;
+        if (Replay->EntryCount <= Index)
+            break;
+
+        if (0 != Request && 0 != Response)
+            FspReplayEntry(Replay, Replay->Entries + Index,
+                Request, Response, &DataBuffer, &DataBufferSize);
+        else
+        {
+            /* cannot replay; mark the entry as done so that other threads do not wait on it */
+            InterlockedIncrement64(&Replay->SkipCount);
+            InterlockedExchange(&Replay->Entries[Index].State, FspReplayFailed);
+            if (0 <= Replay->Entries[Index].Producer &&
+                FspFsctlTransactCloseKind != Replay->Entries[Index].Request->Kind)
+                InterlockedDecrement(&Replay->Entries[Replay->Entries[Index].Producer].DependentCount);
+        }
+    }
+
+    MemFree(DataBuffer);
+    MemFree(Response);
+    MemFree(Request);
+
+    return 0;
+}
+
+FSP_API NTSTATUS FspFileSystemReplayTrace(FSP_FILE_SYSTEM *FileSystem, PWSTR FileName,
+    const FSP_FILE_SYSTEM_REPLAY_PARAMS *ReplayParams, FSP_FILE_SYSTEM_REPLAY_RESULT *ReplayResult)
+{
+    FSP_FILE_SYSTEM_REPLAY_PARAMS Params;
+    FSP_REPLAY Replay;
+    PVOID TraceBuf = 0;
+    HANDLE ProcessToken = 0, Token = 0;
+    HANDLE *Threads = 0;
+    ULONG ThreadCount = 0;
+    LARGE_INTEGER Frequency, StartTime, EndTime;
+    NTSTATUS Result;
+
+    if (0 != ReplayResult)
+        memset(ReplayResult, 0, sizeof *ReplayResult);
+
+    if (0 != FileSystem->DispatcherThread)
+        return STATUS_INVALID_PARAMETER;
+
+    if (sizeof(UINT16) > ReplayParams->Version ||
+        sizeof Params < ReplayParams->Version)
+        return STATUS_INVALID_PARAMETER;
+
+    memset(&Params, 0, sizeof Params);
+    memcpy(&Params, ReplayParams, ReplayParams->Version);
+    if (0 == Params.ThreadCount)
+        Params.ThreadCount = 1;
+    else if (MAXIMUM_WAIT_OBJECTS < Params.ThreadCount)
+        Params.ThreadCount = MAXIMUM_WAIT_OBJECTS;
+
+    memset(&Replay, 0, sizeof Replay);
+    Result = FspReplayLoad(FileSystem, FileName, &Replay, &TraceBuf);
+    if (!NT_SUCCESS(Result))
+        goto exit;
+
+    /* access checks are performed against an impersonation token of this process */
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_DUPLICATE | TOKEN_QUERY, &ProcessToken) ||
+        !DuplicateToken(ProcessToken, SecurityImpersonation, &Token))
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+    Replay.AccessToken =
+        ((UINT64)GetCurrentProcessId() << 32) | (UINT32)(UINT_PTR)Token;
+
+    Threads = MemAlloc(Params.ThreadCount * sizeof(HANDLE));
+    if (0 == Threads)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&StartTime);
+    Replay.Speed = Params.Speed;
+    Replay.Frequency = Frequency.QuadPart;
+    Replay.StartTime = StartTime.QuadPart;
+
+    for (; Params.ThreadCount > ThreadCount; ThreadCount++)
+    {
+        Threads[ThreadCount] = CreateThread(0, 0, FspReplayThread, &Replay, 0, 0);
+        if (0 == Threads[ThreadCount])
+        {
+            /* the threads already started will replay the whole trace */
+            if (0 == ThreadCount)
+            {
+                Result = FspNtStatusFromWin32(GetLastError());
+                goto exit;
+            }
+            break;
+        }
+    }
+
+    WaitForMultipleObjectsEx(ThreadCount, Threads, TRUE, INFINITE, FALSE);
+    QueryPerformanceCounter(&EndTime);
+
+    if (0 != ReplayResult)
+    {
+        ReplayResult->RequestCount = Replay.RequestCount;
+        ReplayResult->SkipCount = Replay.SkipCount;
+        ReplayResult->MismatchCount = Replay.MismatchCount;
+        ReplayResult->ElapsedTime = EndTime.QuadPart - StartTime.QuadPart;
+    }
+
+    Result = STATUS_SUCCESS;
+
+exit:
+    for (ULONG I = 0; ThreadCount > I; I++)
+        CloseHandle(Threads[I]);
+    MemFree(Threads);
+
+    if (0 != Token)
+        CloseHandle(Token);
+    if (0 != ProcessToken)
+        CloseHandle(ProcessToken);
+
+    MemFree(Replay.Entries);
+    MemFree(TraceBuf);
+
+    return Result;
+}
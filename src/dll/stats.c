@@ -0,0 +1,344 @@
+/**
+ * @file dll/stats.c
+ *
+ * @copyright 2015-2021 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+
+#include <dll/library.h>
+
+/*
+ * Operation statistics.
+ *
+ * Statistics are kept in a small number of slots; every processor records into the
+ * slot selected by its processor number. Recording only uses interlocked operations
+ * on the slot, so processors rarely contend on the same cache lines. The slots are
+ * combined when a snapshot is requested.
+ *
+ * Dispatcher threads register themselves (with the NUMA node they are pinned to) in a
+ * small table; each entry packs the thread id and node in a 64-bit value that is claimed
+ * and released with interlocked operations.
+ */
+
+enum
+{
+    FspFileSystemStatisticsSlotCountMax = 16,
+    FspFileSystemStatisticsVersionMin =
+        FIELD_OFFSET(FSP_FILE_SYSTEM_STATISTICS, SetInformationClass) +
+        sizeof(((FSP_FILE_SYSTEM_STATISTICS *)0)->SetInformationClass),
+};
+
+typedef struct
+{
+    FSP_FILE_SYSTEM_HISTOGRAM Kind[FspFsctlTransactKindCount];
+    FSP_FILE_SYSTEM_HISTOGRAM CreateDisposition[FSP_FILE_SYSTEM_STATISTICS_CREATE_DISPOSITION_COUNT];
+    FSP_FILE_SYSTEM_HISTOGRAM SetInformationClass[FSP_FILE_SYSTEM_STATISTICS_INFORMATION_CLASS_COUNT];
+} FSP_FILE_SYSTEM_STATISTICS_SLOT;
+
+typedef struct
+{
+    volatile LONG64 Threads[FSP_FILE_SYSTEM_STATISTICS_DISPATCHER_THREAD_COUNT];
+    volatile LONG ThreadCount;
+    ULONG SlotCount;
+    FSP_FILE_SYSTEM_STATISTICS_SLOT Slots[];
+} FSP_FILE_SYSTEM_STATISTICS_DATA;
+
+static inline ULONG FspHistogramBucketIndex(UINT64 Value)
+{
+    ULONG Value32, Exponent, Index;
+
+    /* values that do not fit in 32 bits are well past the last bucket */
+    if (0 != (Value >> 32))
+        return FSP_FILE_SYSTEM_HISTOGRAM_BUCKET_COUNT - 1;
+
+    Value32 = (ULONG)Value;
+    if (4 > Value32)
+        return Value32;
+
+    _BitScanReverse(&Exponent, Value32);
+    Index = (Exponent - 1) * 4 + ((Value32 >> (Exponent - 2)) & 3);
+
+    return FSP_FILE_SYSTEM_HISTOGRAM_BUCKET_COUNT > Index ?
+        Index : FSP_FILE_SYSTEM_HISTOGRAM_BUCKET_COUNT - 1;
+}
+
+static inline UINT64 FspHistogramBucketUpperBound(ULONG Index)
+{
+    ULONG Shift;
+
+    if (4 > Index)
+        return Index;
+
+    /* the last bucket is below 2^32 (see FspHistogramBucketIndex) */
+    Shift = Index / 4 - 1;
+    return ((4 + Index % 4 + 1) << Shift) - 1;
+}
+
+static inline VOID FspHistogramRecord(FSP_FILE_SYSTEM_HISTOGRAM *Histogram,
+    UINT64 Time, ULONG Index)
+{
+    LONG64 MaxTime;
+
+    InterlockedIncrement64((PLONG64)&Histogram->Count);
+    InterlockedAdd64((PLONG64)&Histogram->TotalTime, (LONG64)Time);
+    InterlockedIncrement64((PLONG64)&Histogram->Buckets[Index]);
+
+    for (;;)
+    {
+        MaxTime = *(volatile LONG64 *)&Histogram->MaxTime;
+        if ((UINT64)MaxTime >= Time ||
+            MaxTime == InterlockedCompareExchange64(
+                (PLONG64)&Histogram->MaxTime, (LONG64)Time, MaxTime))
+            break;
+    }
+}
+
+static inline UINT64 FspStatisticsFetch(volatile UINT64 *P, BOOLEAN Reset)
+{
+    /* interlocked so that 64-bit values are not torn on 32-bit platforms */
+    return Reset ?
+        (UINT64)InterlockedExchange64((PLONG64)P, 0) :
+        (UINT64)InterlockedCompareExchange64((PLONG64)P, 0, 0);
+}
+
+static VOID FspHistogramFetch(FSP_FILE_SYSTEM_HISTOGRAM *Histogram,
+    FSP_FILE_SYSTEM_HISTOGRAM *Source, BOOLEAN Reset)
+{
+    UINT64 MaxTime;
+
+    Histogram->Count += FspStatisticsFetch(&Source->Count, Reset);
+    Histogram->TotalTime += FspStatisticsFetch(&Source->TotalTime, Reset);
+    MaxTime = FspStatisticsFetch(&Source->MaxTime, Reset);
+    if (Histogram->MaxTime < MaxTime)
+        Histogram->MaxTime = MaxTime;
+    for (ULONG I = 0; FSP_FILE_SYSTEM_HISTOGRAM_BUCKET_COUNT > I; I++)
+        Histogram->Buckets[I] += FspStatisticsFetch(&Source->Buckets[I], Reset);
+}
+
+NTSTATUS FspFileSystemStatisticsCreate(PVOID *PStatistics)
+{
+    FSP_FILE_SYSTEM_STATISTICS_DATA *Statistics;
+    SYSTEM_INFO SystemInfo;
+    ULONG SlotCount;
+    SIZE_T Size;
+
+    *PStatistics = 0;
+
+    GetSystemInfo(&SystemInfo);
+    SlotCount = SystemInfo.dwNumberOfProcessors;
+    if (0 == SlotCount)
+        SlotCount = 1;
+    else if (FspFileSystemStatisticsSlotCountMax < SlotCount)
+        SlotCount = FspFileSystemStatisticsSlotCountMax;
+
+    Size = sizeof *Statistics + SlotCount * sizeof(FSP_FILE_SYSTEM_STATISTICS_SLOT);
+    Statistics = MemAlloc(Size);
+    if (0 == Statistics)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    memset(Statistics, 0, Size);
+    Statistics->SlotCount = SlotCount;
+
+    *PStatistics = Statistics;
+
+    return STATUS_SUCCESS;
+}
+
+VOID FspFileSystemStatisticsDelete(PVOID Statistics)
+{
+    MemFree(Statistics);
+}
+
+VOID FspFileSystemStatisticsRegisterThread(PVOID Statistics0, USHORT NumaNode)
+{
+    FSP_FILE_SYSTEM_STATISTICS_DATA *Statistics = Statistics0;
+    LONG64 Value = ((LONG64)NumaNode << 32) | GetCurrentThreadId();
+
+    InterlockedIncrement(&Statistics->ThreadCount);
+
+    /* if the table is full the thread is simply not listed (but it is counted) */
+    for (ULONG I = 0; FSP_FILE_SYSTEM_STATISTICS_DISPATCHER_THREAD_COUNT > I; I++)
+        if (0 == InterlockedCompareExchange64(&Statistics->Threads[I], Value, 0))
+            break;
+}
+
+VOID FspFileSystemStatisticsUnregisterThread(PVOID Statistics0)
+{
+    FSP_FILE_SYSTEM_STATISTICS_DATA *Statistics = Statistics0;
+    DWORD ThreadId = GetCurrentThreadId();
+    LONG64 Value;
+
+    InterlockedDecrement(&Statistics->ThreadCount);
+
+    for (ULONG I = 0; FSP_FILE_SYSTEM_STATISTICS_DISPATCHER_THREAD_COUNT > I; I++)
+    {
+        Value = Statistics->Threads[I];
+        if (0 != Value && ThreadId == (DWORD)Value)
+        {
+            InterlockedExchange64(&Statistics->Threads[I], 0);
+            break;
+        }
+    }
+}
+
+VOID FspFileSystemStatisticsRecord(PVOID Statistics0,
+    FSP_FSCTL_TRANSACT_REQ *Request, UINT64 Time)
+{
+    FSP_FILE_SYSTEM_STATISTICS_DATA *Statistics = Statistics0;
+    FSP_FILE_SYSTEM_STATISTICS_SLOT *Slot;
+    ULONG Index, Class;
+
+    if (FspFsctlTransactKindCount <= Request->Kind)
+        return;
+
+    Slot = Statistics->Slots + GetCurrentProcessorNumber() % Statistics->SlotCount;
+    Index = FspHistogramBucketIndex(Time);
+
+    FspHistogramRecord(&Slot->Kind[Request->Kind], Time, Index);
+
+    switch (Request->Kind)
+    {
+    case FspFsctlTransactCreateKind:
+        Class = (Request->Req.Create.CreateOptions >> 24) & 0xff;
+        if (FSP_FILE_SYSTEM_STATISTICS_CREATE_DISPOSITION_COUNT > Class)
+            FspHistogramRecord(&Slot->CreateDisposition[Class], Time, Index);
+        break;
+    case FspFsctlTransactSetInformationKind:
+        Class = Request->Req.SetInformation.FileInformationClass;
+        if (FSP_FILE_SYSTEM_STATISTICS_INFORMATION_CLASS_COUNT > Class)
+            FspHistogramRecord(&Slot->SetInformationClass[Class], Time, Index);
+        break;
+    }
+}
+
+FSP_API NTSTATUS FspFileSystemGetStatistics(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_STATISTICS *Statistics, BOOLEAN Reset)
+{
+    FSP_FILE_SYSTEM_STATISTICS_DATA *Data = FileSystem->Statistics;
+    FSP_FILE_SYSTEM_STATISTICS_SLOT *Slot;
+    FSP_FILE_SYSTEM_DISPATCHER_THREAD_INFO *ThreadInfo;
+    LARGE_INTEGER Frequency;
+    UINT32 Version;
+    LONG64 Value;
+
+    Version = Statistics->Version;
+    if (FspFileSystemStatisticsVersionMin > Version || sizeof *Statistics < Version)
+        return STATUS_INVALID_PARAMETER;
+
+    memset(Statistics, 0, Version);
+    Statistics->Version = Version;
+
+    QueryPerformanceFrequency(&Frequency);
+    Statistics->Frequency = Frequency.QuadPart;
+    Statistics->TransactCount = FspStatisticsFetch(
+        (volatile UINT64 *)&FileSystem->DispatcherTransactCount, Reset);
+    Statistics->RequestCount = FspStatisticsFetch(
+        (volatile UINT64 *)&FileSystem->DispatcherRequestCount, Reset);
+
+    for (ULONG I = 0; Data->SlotCount > I; I++)
+    {
+        Slot = Data->Slots + I;
+        for (ULONG J = 0; FspFsctlTransactKindCount > J; J++)
+            FspHistogramFetch(&Statistics->Kind[J], &Slot->Kind[J], Reset);
+        for (ULONG J = 0; FSP_FILE_SYSTEM_STATISTICS_CREATE_DISPOSITION_COUNT > J; J++)
+            FspHistogramFetch(&Statistics->CreateDisposition[J],
+                &Slot->CreateDisposition[J], Reset);
+        for (ULONG J = 0; FSP_FILE_SYSTEM_STATISTICS_INFORMATION_CLASS_COUNT > J; J++)
+            FspHistogramFetch(&Statistics->SetInformationClass[J],
+                &Slot->SetInformationClass[J], Reset);
+    }
+
+    if (FIELD_OFFSET(FSP_FILE_SYSTEM_STATISTICS, DispatcherThreads) +
+        sizeof Statistics->DispatcherThreads <= Version)
+    {
+        for (ULONG I = 0; FSP_FILE_SYSTEM_STATISTICS_DISPATCHER_THREAD_COUNT > I; I++)
+        {
+            Value = InterlockedCompareExchange64(&Data->Threads[I], 0, 0);
+            if (0 == Value)
+                continue;
+            ThreadInfo = Statistics->DispatcherThreads + Statistics->DispatcherThreadCount++;
+            ThreadInfo->ThreadId = (UINT32)Value;
+            ThreadInfo->NumaNode = (UINT16)(Value >> 32);
+        }
+    }
+
+    if (FIELD_OFFSET(FSP_FILE_SYSTEM_STATISTICS, Reserved32c) +
+        sizeof Statistics->Reserved32c <= Version)
+    {
+        ULONG ThreadCountMin, ThreadCountMax;
+
+        Statistics->DispatcherLiveThreadCount = (UINT32)InterlockedCompareExchange(
+            &Data->ThreadCount, 0, 0);
+        FspFileSystemDispatcherThreadCountRange(FileSystem, &ThreadCountMin, &ThreadCountMax);
+        Statistics->DispatcherThreadCountMin = ThreadCountMin;
+        Statistics->DispatcherThreadCountMax = ThreadCountMax;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+FSP_API VOID FspFileSystemResetStatistics(FSP_FILE_SYSTEM *FileSystem)
+{
+    FSP_FILE_SYSTEM_STATISTICS_DATA *Data = FileSystem->Statistics;
+    FSP_FILE_SYSTEM_STATISTICS_SLOT *Slot;
+    FSP_FILE_SYSTEM_HISTOGRAM *Histogram;
+    ULONG HistogramCount = sizeof(FSP_FILE_SYSTEM_STATISTICS_SLOT) / sizeof *Histogram;
+
+    InterlockedExchange64(&FileSystem->DispatcherTransactCount, 0);
+    InterlockedExchange64(&FileSystem->DispatcherRequestCount, 0);
+
+    for (ULONG I = 0; Data->SlotCount > I; I++)
+    {
+        Slot = Data->Slots + I;
+        Histogram = (FSP_FILE_SYSTEM_HISTOGRAM *)Slot;
+        for (ULONG J = 0; HistogramCount > J; J++, Histogram++)
+        {
+            InterlockedExchange64((PLONG64)&Histogram->Count, 0);
+            InterlockedExchange64((PLONG64)&Histogram->TotalTime, 0);
+            InterlockedExchange64((PLONG64)&Histogram->MaxTime, 0);
+            for (ULONG K = 0; FSP_FILE_SYSTEM_HISTOGRAM_BUCKET_COUNT > K; K++)
+                InterlockedExchange64((PLONG64)&Histogram->Buckets[K], 0);
+        }
+    }
+}
+
+FSP_API UINT64 FspFileSystemHistogramPercentile(const FSP_FILE_SYSTEM_HISTOGRAM *Histogram,
+    ULONG Permille)
+{
+    UINT64 Count, Cumulative, Threshold;
+    ULONG I;
+
+    Count = 0;
+    for (I = 0; FSP_FILE_SYSTEM_HISTOGRAM_BUCKET_COUNT > I; I++)
+        Count += Histogram->Buckets[I];
+    if (0 == Count)
+        return 0;
+
+    if (1000 < Permille)
+        Permille = 1000;
+    Threshold = Count * Permille;
+
+    Cumulative = 0;
+    for (I = 0; FSP_FILE_SYSTEM_HISTOGRAM_BUCKET_COUNT - 1 > I; I++)
+    {
+        Cumulative += Histogram->Buckets[I];
+        if (Cumulative * 1000 >= Threshold)
+            break;
+    }
+
+    return FspHistogramBucketUpperBound(I);
+}
@@ -0,0 +1,488 @@
+/**
+ * @file dll/trace.c
+ *
+ * @copyright 2015-2021 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+
+#include <dll/library.h>
+
+/*
+ * Binary request trace recorder.
+ *
+ * Every thread that records a request or response owns a trace thread object (found
+ * through FLS) and a trace buffer. Records are appended to the thread's buffer without
+ * any synchronization. When the buffer fills up it is queued for the flush thread, which
+ * writes it to the trace file and returns it to the free list.
+ *
+ * The number of buffers is bounded. When a thread exits its partial buffer is queued and
+ * its trace thread object is reused by the next new thread. When no buffer is left a thread
+ * takes over the partial buffer of an idle thread (every record carries its thread ID), so
+ * that records are only dropped when every buffer is in use or waiting to be written.
+ *
+ * The trace object is created on the first FspFileSystemStartTrace and lives until the
+ * file system is deleted, so that recording threads can always safely access it. To
+ * stop tracing the Active flag is cleared and the stopping thread waits for every
+ * trace thread that is in the middle of recording (Busy) to finish. Recording threads
+ * set Busy before they check Active, so that no thread can start recording after the
+ * stopping thread has observed that it is not Busy. Other threads (the stopping thread, a
+ * thread taking over a partial buffer) also set Busy before they touch the buffer of a
+ * trace thread, so Busy is acquired with a compare-exchange.
+ */
+
+enum
+{
+    FspTraceBufferSize                  = 256 * 1024,
+    FspTraceBufferCountMax              = 64,
+};
+
+typedef struct _FSP_TRACE_BUFFER
+{
+    struct _FSP_TRACE_BUFFER *Next;
+    ULONG Length, RecordCount;
+    FSP_FSCTL_DECLSPEC_ALIGN UINT8 Data[];
+} FSP_TRACE_BUFFER;
+
+typedef struct _FSP_TRACE_THREAD
+{
+    struct _FSP_TRACE_THREAD *Next;
+    struct _FSP_TRACE *Trace;
+    volatile LONG Busy;
+    BOOLEAN Exited;
+    DWORD ThreadId;
+    FSP_TRACE_BUFFER *Buffer;
+} FSP_TRACE_THREAD;
+
+typedef struct _FSP_TRACE
+{
+    DWORD FlsKey;
+    volatile LONG Active;
+    volatile LONG64 DropCount;
+    HANDLE File;
+    HANDLE FlushEvent;
+    HANDLE FlushThread;
+    volatile LONG FlushStop;
+    SRWLOCK Lock;
+    FSP_TRACE_THREAD *ThreadList;
+    FSP_TRACE_BUFFER *FullList, **FullListTail;
+    FSP_TRACE_BUFFER *FreeList;
+    ULONG BufferCount;
+} FSP_TRACE;
+
+static inline VOID FspTraceThreadAcquire(FSP_TRACE_THREAD *Thread)
+{
+    while (0 != InterlockedCompareExchange(&Thread->Busy, 1, 0))
+        YieldProcessor();
+}
+
+static inline VOID FspTraceThreadRelease(FSP_TRACE_THREAD *Thread)
+{
+    InterlockedExchange(&Thread->Busy, 0);
+}
+
+static FSP_TRACE_BUFFER *FspTraceBufferSteal(FSP_TRACE *Trace,
+    FSP_TRACE_THREAD *Self, ULONG RecordSize)
+{
+    FSP_TRACE_THREAD *Thread;
+    FSP_TRACE_BUFFER *Buffer = 0;
+
+    /* must be called with the trace lock held; threads that are recording are skipped */
+    for (Thread = Trace->ThreadList; 0 != Thread && 0 == Buffer; Thread = Thread->Next)
+    {
+        if (Self == Thread || 0 != InterlockedCompareExchange(&Thread->Busy, 1, 0))
+            continue;
+        Buffer = Thread->Buffer;
+        if (0 != Buffer && Buffer->Length + RecordSize <= FspTraceBufferSize)
+            Thread->Buffer = 0;
+        else
+            Buffer = 0;
+        FspTraceThreadRelease(Thread);
+    }
+
+    return Buffer;
+}
+
+static FSP_TRACE_BUFFER *FspTraceBufferGet(FSP_TRACE *Trace,
+    FSP_TRACE_THREAD *Self, ULONG RecordSize)
+{
+    FSP_TRACE_BUFFER *Buffer;
+    BOOLEAN Allocate = FALSE;
+
+    AcquireSRWLockExclusive(&Trace->Lock);
+    Buffer = Trace->FreeList;
+    if (0 != Buffer)
+        Trace->FreeList = Buffer->Next;
+    else if (FspTraceBufferCountMax > Trace->BufferCount)
+    {
+        Trace->BufferCount++;
+        Allocate = TRUE;
+    }
+    else
+    {
+        /* a partial buffer keeps its records; we append to it */
+        Buffer = FspTraceBufferSteal(Trace, Self, RecordSize);
+        ReleaseSRWLockExclusive(&Trace->Lock);
+        return Buffer;
+    }
+    ReleaseSRWLockExclusive(&Trace->Lock);
+
+    if (Allocate)
+    {
+        Buffer = MemAlloc(sizeof *Buffer + FspTraceBufferSize);
+        if (0 == Buffer)
+        {
+            AcquireSRWLockExclusive(&Trace->Lock);
+            Trace->BufferCount--;
+            ReleaseSRWLockExclusive(&Trace->Lock);
+        }
+    }
+
+    if (0 != Buffer)
+    {
+        Buffer->Next = 0;
+        Buffer->Length = 0;
+        Buffer->RecordCount = 0;
+    }
+
+    return Buffer;
+}
+
+static VOID FspTraceBufferQueue(FSP_TRACE *Trace, FSP_TRACE_BUFFER *Buffer)
+{
+    Buffer->Next = 0;
+
+    AcquireSRWLockExclusive(&Trace->Lock);
+    *Trace->FullListTail = Buffer;
+    Trace->FullListTail = &Buffer->Next;
+    ReleaseSRWLockExclusive(&Trace->Lock);
+
+    SetEvent(Trace->FlushEvent);
+}
+
+static DWORD WINAPI FspTraceFlushThread(PVOID Trace0)
+{
+    FSP_TRACE *Trace = Trace0;
+    FSP_TRACE_BUFFER *Buffer;
+    DWORD BytesTransferred;
+
+    for (;;)
+    {
+        WaitForSingleObject(Trace->FlushEvent, INFINITE);
+
+        for (;;)
+        {
+            AcquireSRWLockExclusive(&Trace->Lock);
+            Buffer = Trace->FullList;
+            if (0 != Buffer)
+            {
+                Trace->FullList = Buffer->Next;
+                if (0 == Trace->FullList)
+                    Trace->FullListTail = &Trace->FullList;
+            }
+            ReleaseSRWLockExclusive(&Trace->Lock);
+
+            if (0 == Buffer)
+                break;
+
+            if (!WriteFile(Trace->File, Buffer->Data, Buffer->Length, &BytesTransferred, 0))
+                InterlockedAdd64(&Trace->DropCount, Buffer->RecordCount);
+
+            AcquireSRWLockExclusive(&Trace->Lock);
+            Buffer->Next = Trace->FreeList;
+            Trace->FreeList = Buffer;
+            ReleaseSRWLockExclusive(&Trace->Lock);
+        }
+
+        if (Trace->FlushStop)
+            break;
+    }
+
+    return 0;
+}
+
+static VOID WINAPI FspTraceThreadExit(PVOID Thread0)
+{
+    FSP_TRACE_THREAD *Thread = Thread0;
+    FSP_TRACE *Trace = Thread->Trace;
+
+    /*
+     * Called through FLS when the thread exits (and for every thread when the trace is
+     * deleted). If tracing is stopped, the stopping thread queues (or has queued) the
+     * partial buffer; otherwise we queue it so that it is not pinned by a dead thread.
+     */
+    FspTraceThreadAcquire(Thread);
+    if (Trace->Active && 0 != Thread->Buffer)
+    {
+        FspTraceBufferQueue(Trace, Thread->Buffer);
+        Thread->Buffer = 0;
+    }
+    FspTraceThreadRelease(Thread);
+
+    AcquireSRWLockExclusive(&Trace->Lock);
+    Thread->Exited = TRUE;
+    ReleaseSRWLockExclusive(&Trace->Lock);
+}
+
+static FSP_TRACE_THREAD *FspTraceThreadGet(FSP_TRACE *Trace)
+{
+    FSP_TRACE_THREAD *Thread;
+
+    Thread = FlsGetValue(Trace->FlsKey);
+    if (0 != Thread)
+        return Thread;
+
+    /* reuse the trace thread object of an exited thread; it may still hold a buffer */
+    AcquireSRWLockExclusive(&Trace->Lock);
+    for (Thread = Trace->ThreadList; 0 != Thread; Thread = Thread->Next)
+        if (Thread->Exited)
+        {
+            Thread->Exited = FALSE;
+            Thread->ThreadId = GetCurrentThreadId();
+            break;
+        }
+    ReleaseSRWLockExclusive(&Trace->Lock);
+
+    if (0 == Thread)
+    {
+        Thread = MemAlloc(sizeof *Thread);
+        if (0 == Thread)
+            return 0;
+        memset(Thread, 0, sizeof *Thread);
+        Thread->Trace = Trace;
+        Thread->ThreadId = GetCurrentThreadId();
+
+        AcquireSRWLockExclusive(&Trace->Lock);
+        Thread->Next = Trace->ThreadList;
+        Trace->ThreadList = Thread;
+        ReleaseSRWLockExclusive(&Trace->Lock);
+    }
+
+    if (!FlsSetValue(Trace->FlsKey, Thread))
+    {
+        AcquireSRWLockExclusive(&Trace->Lock);
+        Thread->Exited = TRUE;
+        ReleaseSRWLockExclusive(&Trace->Lock);
+        return 0;
+    }
+
+    return Thread;
+}
+
+VOID FspFileSystemTraceRecord(PVOID Trace0, ULONG Type, PVOID Message, ULONG Size, UINT64 Time)
+{
+    FSP_TRACE *Trace = Trace0;
+    FSP_TRACE_THREAD *Thread;
+    FSP_TRACE_BUFFER *Buffer;
+    FSP_FILE_SYSTEM_TRACE_RECORD *Record;
+    ULONG RecordSize;
+
+    if (!Trace->Active)
+        return;
+
+    Thread = FspTraceThreadGet(Trace);
+    if (0 == Thread)
+    {
+        InterlockedIncrement64(&Trace->DropCount);
+        return;
+    }
+
+    FspTraceThreadAcquire(Thread);
+    if (!Trace->Active)
+        goto exit;
+
+    RecordSize = FSP_FSCTL_DEFAULT_ALIGN_UP(sizeof *Record + Size);
+    Buffer = Thread->Buffer;
+    if (0 == Buffer || Buffer->Length + RecordSize > FspTraceBufferSize)
+    {
+        if (0 != Buffer)
+            FspTraceBufferQueue(Trace, Buffer);
+        Thread->Buffer = Buffer = FspTraceBufferGet(Trace, Thread, RecordSize);
+        if (0 == Buffer)
+        {
+            InterlockedIncrement64(&Trace->DropCount);
+            goto exit;
+        }
+    }
+
+    Record = (PVOID)(Buffer->Data + Buffer->Length);
+    Record->Size = RecordSize;
+    Record->Type = (UINT16)Type;
+    Record->Reserved16 = 0;
+    Record->ThreadId = Thread->ThreadId;
+    Record->Reserved32 = 0;
+    Record->Time = Time;
+    memcpy(Record + 1, Message, Size);
+    memset((PUINT8)(Record + 1) + Size, 0, RecordSize - sizeof *Record - Size);
+    Buffer->Length += RecordSize;
+    Buffer->RecordCount++;
+
+exit:
+    FspTraceThreadRelease(Thread);
+}
+
+FSP_API NTSTATUS FspFileSystemStartTrace(FSP_FILE_SYSTEM *FileSystem, PWSTR FileName)
+{
+    FSP_TRACE *Trace = FileSystem->Trace;
+    FSP_FILE_SYSTEM_TRACE_HEADER Header;
+    LARGE_INTEGER Frequency, StartTime;
+    DWORD BytesTransferred;
+    NTSTATUS Result;
+
+    if (0 == Trace)
+    {
+        Trace = MemAlloc(sizeof *Trace);
+        if (0 == Trace)
+            return STATUS_INSUFFICIENT_RESOURCES;
+        memset(Trace, 0, sizeof *Trace);
+        Trace->File = INVALID_HANDLE_VALUE;
+        InitializeSRWLock(&Trace->Lock);
+        Trace->FullListTail = &Trace->FullList;
+
+        Trace->FlsKey = FlsAlloc(FspTraceThreadExit);
+        if (FLS_OUT_OF_INDEXES == Trace->FlsKey)
+        {
+            MemFree(Trace);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        Trace->FlushEvent = CreateEventW(0, FALSE, FALSE, 0);
+        if (0 == Trace->FlushEvent)
+        {
+            Result = FspNtStatusFromWin32(GetLastError());
+            FlsFree(Trace->FlsKey);
+            MemFree(Trace);
+            return Result;
+        }
+
+        FileSystem->Trace = Trace;
+    }
+
+    if (Trace->Active)
+        return STATUS_INVALID_PARAMETER;
+
+    Trace->File = CreateFileW(FileName,
+        GENERIC_WRITE, FILE_SHARE_READ, 0, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+    if (INVALID_HANDLE_VALUE == Trace->File)
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&StartTime);
+    memset(&Header, 0, sizeof Header);
+    Header.Signature = FSP_FILE_SYSTEM_TRACE_SIGNATURE;
+    Header.Version = sizeof Header;
+    Header.Frequency = Frequency.QuadPart;
+    Header.StartTime = StartTime.QuadPart;
+    GetSystemTimeAsFileTime((PFILETIME)&Header.StartSystemTime);
+    if (!WriteFile(Trace->File, &Header, sizeof Header, &BytesTransferred, 0))
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+
+    Trace->DropCount = 0;
+    Trace->FlushStop = 0;
+    Trace->FlushThread = CreateThread(0, 0, FspTraceFlushThread, Trace, 0, 0);
+    if (0 == Trace->FlushThread)
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+
+    InterlockedExchange(&Trace->Active, 1);
+
+    Result = STATUS_SUCCESS;
+
+exit:
+    if (!NT_SUCCESS(Result) && INVALID_HANDLE_VALUE != Trace->File)
+    {
+        CloseHandle(Trace->File);
+        Trace->File = INVALID_HANDLE_VALUE;
+    }
+
+    return Result;
+}
+
+FSP_API VOID FspFileSystemStopTrace(FSP_FILE_SYSTEM *FileSystem, PUINT64 PDropCount)
+{
+    FSP_TRACE *Trace = FileSystem->Trace;
+    FSP_TRACE_THREAD *Thread;
+
+    if (0 != PDropCount)
+        *PDropCount = 0;
+
+    if (0 == Trace || !Trace->Active)
+        return;
+
+    InterlockedExchange(&Trace->Active, 0);
+
+    /* wait for recording threads to finish and queue their partial buffers */
+    AcquireSRWLockExclusive(&Trace->Lock);
+    Thread = Trace->ThreadList;
+    ReleaseSRWLockExclusive(&Trace->Lock);
+    for (; 0 != Thread; Thread = Thread->Next)
+    {
+        FspTraceThreadAcquire(Thread);
+        if (0 != Thread->Buffer)
+        {
+            FspTraceBufferQueue(Trace, Thread->Buffer);
+            Thread->Buffer = 0;
+        }
+        FspTraceThreadRelease(Thread);
+    }
+
+    InterlockedExchange(&Trace->FlushStop, 1);
+    SetEvent(Trace->FlushEvent);
+    WaitForSingleObject(Trace->FlushThread, INFINITE);
+    CloseHandle(Trace->FlushThread);
+    Trace->FlushThread = 0;
+
+    CloseHandle(Trace->File);
+    Trace->File = INVALID_HANDLE_VALUE;
+
+    if (0 != PDropCount)
+        *PDropCount = Trace->DropCount;
+}
+
+VOID FspFileSystemTraceDelete(PVOID Trace0)
+{
+    FSP_TRACE *Trace = Trace0;
+    FSP_TRACE_THREAD *Thread, *NextThread;
+    FSP_TRACE_BUFFER *Buffer, *NextBuffer;
+
+    /* tracing is stopped; this runs FspTraceThreadExit for every live thread */
+    FlsFree(Trace->FlsKey);
+
+    for (Thread = Trace->ThreadList; 0 != Thread; Thread = NextThread)
+    {
+        NextThread = Thread->Next;
+        MemFree(Thread->Buffer);
+        MemFree(Thread);
+    }
+
+    for (Buffer = Trace->FreeList; 0 != Buffer; Buffer = NextBuffer)
+    {
+        NextBuffer = Buffer->Next;
+        MemFree(Buffer);
+    }
+
+    CloseHandle(Trace->FlushEvent);
+    MemFree(Trace);
+}
@@ -0,0 +1,248 @@
+/**
+ * @file dll/workq.c
+ *
+ * @copyright 2015-2021 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#include <dll/library.h>
+
+/*
+ * Work-stealing work queue.
+ *
+ * Every worker thread owns a deque of work items. Posted items are distributed
+ * round-robin among the deques. A worker takes items from the head of its own deque;
+ * when its deque is empty it steals items from the tail of the other deques. This
+ * way a worker that is blocked in a slow work item does not hold up the items
+ * queued behind it: any idle worker will steal them.
+ *
+ * Urgent items are inserted at the head of a deque, so that its owner takes them
+ * before any items already queued; thieves still steal the oldest non-urgent items
+ * from the tail.
+ *
+ * A semaphore counts the items that have been posted but not yet taken. A worker
+ * that acquires the semaphore is therefore guaranteed to find an item in one of
+ * the deques.
+ */
+
+typedef union
+{
+    struct
+    {
+        FSP_WORK_QUEUE *WorkQueue;
+        HANDLE Thread;
+        PVOID WorkerBuffer;
+        SRWLOCK Lock;
+        LIST_ENTRY ItemList;
+    } V;
+    UINT8 Padding[64];                  /* keep deques on separate cache lines */
+} FSP_WORK_QUEUE_DEQUE;
+
+struct _FSP_WORK_QUEUE
+{
+    HANDLE Semaphore;
+    volatile LONG Stopped;
+    volatile LONG PostIndex;
+    ULONG ThreadCount;
+    FSP_WORK_QUEUE_DEQUE Deques[];
+};
+
+static FSP_WORK_ITEM *FspWorkQueueTake(FSP_WORK_QUEUE *WorkQueue, ULONG Index)
+{
+    FSP_WORK_QUEUE_DEQUE *Deque;
+    PLIST_ENTRY ListEntry;
+
+    for (;;)
+    {
+        /* own deque: take from the head */
+        Deque = WorkQueue->Deques + Index;
+        AcquireSRWLockExclusive(&Deque->V.Lock);
+        ListEntry = Deque->V.ItemList.Flink;
+        if (&Deque->V.ItemList != ListEntry)
+        {
+            RemoveEntryList(ListEntry);
+            ReleaseSRWLockExclusive(&Deque->V.Lock);
+            return CONTAINING_RECORD(ListEntry, FSP_WORK_ITEM, ListEntry);
+        }
+        ReleaseSRWLockExclusive(&Deque->V.Lock);
+
+        /* other deques: steal from the tail */
+        for (ULONG I = 1; WorkQueue->ThreadCount > I; I++)
+        {
+            Deque = WorkQueue->Deques + (Index + I) % WorkQueue->ThreadCount;
+            AcquireSRWLockExclusive(&Deque->V.Lock);
+            ListEntry = Deque->V.ItemList.Blink;
+            if (&Deque->V.ItemList != ListEntry)
+            {
+                RemoveEntryList(ListEntry);
+                ReleaseSRWLockExclusive(&Deque->V.Lock);
+                return CONTAINING_RECORD(ListEntry, FSP_WORK_ITEM, ListEntry);
+            }
+            ReleaseSRWLockExclusive(&Deque->V.Lock);
+        }
+
+        /* an item is guaranteed to exist; it is being posted concurrently */
+        YieldProcessor();
+    }
+}
+
+static DWORD WINAPI FspWorkQueueThread(PVOID Deque0)
+{
+    FSP_WORK_QUEUE_DEQUE *Deque = Deque0;
+    FSP_WORK_QUEUE *WorkQueue = Deque->V.WorkQueue;
+    ULONG Index = (ULONG)(Deque - WorkQueue->Deques);
+    FSP_WORK_ITEM *WorkItem;
+
+    for (;;)
+    {
+        WaitForSingleObject(WorkQueue->Semaphore, INFINITE);
+        if (WorkQueue->Stopped)
+            break;
+
+        WorkItem = FspWorkQueueTake(WorkQueue, Index);
+        WorkItem->Routine(WorkItem, Deque->V.WorkerBuffer);
+    }
+
+    return 0;
+}
+
+NTSTATUS FspWorkQueueCreate(ULONG ThreadCount, SIZE_T WorkerBufferSize,
+    FSP_WORK_QUEUE **PWorkQueue)
+{
+    FSP_WORK_QUEUE *WorkQueue = 0;
+    FSP_WORK_QUEUE_DEQUE *Deque;
+    NTSTATUS Result;
+
+    *PWorkQueue = 0;
+
+    if (0 == ThreadCount)
+        return STATUS_INVALID_PARAMETER;
+
+    WorkQueue = MemAlloc(sizeof *WorkQueue + ThreadCount * sizeof(FSP_WORK_QUEUE_DEQUE));
+    if (0 == WorkQueue)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+    memset(WorkQueue, 0, sizeof *WorkQueue + ThreadCount * sizeof(FSP_WORK_QUEUE_DEQUE));
+
+    WorkQueue->Semaphore = CreateSemaphoreW(0, 0, MAXLONG, 0);
+    if (0 == WorkQueue->Semaphore)
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+
+    for (ULONG I = 0; ThreadCount > I; I++)
+    {
+        Deque = WorkQueue->Deques + I;
+        Deque->V.WorkQueue = WorkQueue;
+        InitializeSRWLock(&Deque->V.Lock);
+        InitializeListHead(&Deque->V.ItemList);
+        if (0 != WorkerBufferSize)
+        {
+            Deque->V.WorkerBuffer = MemAlloc(WorkerBufferSize);
+            if (0 == Deque->V.WorkerBuffer)
+            {
+                Result = STATUS_INSUFFICIENT_RESOURCES;
+                goto exit;
+            }
+        }
+    }
+
+    for (ULONG I = 0; ThreadCount > I; I++)
+    {
+        Deque = WorkQueue->Deques + I;
+        Deque->V.Thread = CreateThread(0, 0, FspWorkQueueThread, Deque, 0, 0);
+        if (0 == Deque->V.Thread)
+        {
+            Result = FspNtStatusFromWin32(GetLastError());
+            goto exit;
+        }
+        WorkQueue->ThreadCount++;
+    }
+
+    *PWorkQueue = WorkQueue;
+    Result = STATUS_SUCCESS;
+
+exit:
+    if (!NT_SUCCESS(Result) && 0 != WorkQueue)
+    {
+        if (0 != WorkQueue->Semaphore)
+        {
+            /* FspWorkQueueDelete does not know about deques that have no worker thread */
+            for (ULONG I = WorkQueue->ThreadCount; ThreadCount > I; I++)
+                MemFree(WorkQueue->Deques[I].V.WorkerBuffer);
+            FspWorkQueueDelete(WorkQueue);
+        }
+        else
+            MemFree(WorkQueue);
+    }
+
+    return Result;
+}
+
+VOID FspWorkQueueDelete(FSP_WORK_QUEUE *WorkQueue)
+{
+    FSP_WORK_QUEUE_DEQUE *Deque;
+    PLIST_ENTRY ListEntry;
+    FSP_WORK_ITEM *WorkItem;
+
+    InterlockedExchange(&WorkQueue->Stopped, 1);
+    if (0 != WorkQueue->ThreadCount)
+        ReleaseSemaphore(WorkQueue->Semaphore, WorkQueue->ThreadCount, 0);
+
+    for (ULONG I = 0; WorkQueue->ThreadCount > I; I++)
+    {
+        Deque = WorkQueue->Deques + I;
+        WaitForSingleObject(Deque->V.Thread, INFINITE);
+        CloseHandle(Deque->V.Thread);
+    }
+
+    /* cancel any items that were not taken by a worker */
+    for (ULONG I = 0; WorkQueue->ThreadCount > I; I++)
+    {
+        Deque = WorkQueue->Deques + I;
+        while (&Deque->V.ItemList != (ListEntry = Deque->V.ItemList.Flink))
+        {
+            RemoveEntryList(ListEntry);
+            WorkItem = CONTAINING_RECORD(ListEntry, FSP_WORK_ITEM, ListEntry);
+            WorkItem->Routine(WorkItem, 0);
+        }
+        MemFree(Deque->V.WorkerBuffer);
+    }
+
+    CloseHandle(WorkQueue->Semaphore);
+    MemFree(WorkQueue);
+}
+
+VOID FspWorkQueuePost(FSP_WORK_QUEUE *WorkQueue, FSP_WORK_ITEM *WorkItem, BOOLEAN Urgent)
+{
+    FSP_WORK_QUEUE_DEQUE *Deque;
+
+    Deque = WorkQueue->Deques +
+        (ULONG)InterlockedIncrement(&WorkQueue->PostIndex) % WorkQueue->ThreadCount;
+
+    AcquireSRWLockExclusive(&Deque->V.Lock);
+    if (Urgent)
+        InsertHeadList(&Deque->V.ItemList, &WorkItem->ListEntry);
+    else
+        InsertTailList(&Deque->V.ItemList, &WorkItem->ListEntry);
+    ReleaseSRWLockExclusive(&Deque->V.Lock);
+
+    ReleaseSemaphore(WorkQueue->Semaphore, 1, 0);
+}
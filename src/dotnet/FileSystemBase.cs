@@ -1316,6 +1316,7 @@ namespace Fsp
             Api.FspFileSystemEndDirInfo(Buffer, Length, out BytesTransferred);
             return STATUS_SUCCESS;
         }
+        private const UInt32 FillBufferSize = 64 * 1024;
         public Int32 BufferedReadDirectory(
             DirectoryBuffer DirectoryBuffer,
             Object FileNode,
@@ -1330,22 +1331,41 @@ namespace Fsp
             String FileName;
             DirInfo DirInfo = default(DirInfo);
             Int32 DirBufferResult = STATUS_SUCCESS;
+            IntPtr FillBuffer = IntPtr.Zero;
+            UInt32 FillBytes = 0;
             BytesTransferred = default(UInt32);
             if (Api.FspFileSystemAcquireDirectoryBuffer(ref DirectoryBuffer.DirBuffer, null == Marker,
                 out DirBufferResult))
                 try
                 {
+                    /* stage entries and hand them to the directory buffer in bulk */
+                    FillBuffer = Marshal.AllocHGlobal((int)FillBufferSize);
                     while (ReadDirectoryEntry(FileNode, FileDesc, Pattern, Marker,
                         ref Context, out FileName, out DirInfo.FileInfo))
                     {
                         DirInfo.SetFileNameBuf(FileName);
-                        if (!Api.FspFileSystemFillDirectoryBuffer(
-                            ref DirectoryBuffer.DirBuffer, ref DirInfo, out DirBufferResult))
+                        if (Api.FspFileSystemAddDirInfo(ref DirInfo,
+                            FillBuffer, FillBufferSize, out FillBytes))
+                            continue;
+                        if (!Api.FspFileSystemFillDirectoryBufferBulk(ref DirectoryBuffer.DirBuffer,
+                            FillBuffer, FillBytes, 0, out DirBufferResult))
+                        {
+                            FillBytes = 0;
+                            break;
+                        }
+                        FillBytes = 0;
+                        if (!Api.FspFileSystemAddDirInfo(ref DirInfo,
+                            FillBuffer, FillBufferSize, out FillBytes))
                             break;
                     }
+                    if (0 != FillBytes)
+                        Api.FspFileSystemFillDirectoryBufferBulk(ref DirectoryBuffer.DirBuffer,
+                            FillBuffer, FillBytes, 0, out DirBufferResult);
                 }
                 finally
                 {
+                    if (IntPtr.Zero != FillBuffer)
+                        Marshal.FreeHGlobal(FillBuffer);
                     Api.FspFileSystemReleaseDirectoryBuffer(ref DirectoryBuffer.DirBuffer);
                 }
             if (0 > DirBufferResult)
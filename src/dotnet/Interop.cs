@@ -914,6 +914,14 @@ namespace Fsp.Interop
                 ref DirInfo DirInfo,
                 out Int32 PResult);
             [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
+            [return: MarshalAs(UnmanagedType.U1)]
+            internal delegate Boolean FspFileSystemFillDirectoryBufferBulk(
+                ref IntPtr PDirBuffer,
+                IntPtr DirInfoBuffer,
+                UInt32 Length,
+                UInt32 SizeHint,
+                out Int32 PResult);
+            [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
             internal delegate void FspFileSystemReleaseDirectoryBuffer(
                 ref IntPtr PDirBuffer);
             [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
@@ -1045,6 +1053,7 @@ namespace Fsp.Interop
         internal static Proto.FspFileSystemAddNotifyInfo _FspFileSystemAddNotifyInfo;
         internal static Proto.FspFileSystemAcquireDirectoryBuffer FspFileSystemAcquireDirectoryBuffer;
         internal static Proto.FspFileSystemFillDirectoryBuffer FspFileSystemFillDirectoryBuffer;
+        internal static Proto.FspFileSystemFillDirectoryBufferBulk FspFileSystemFillDirectoryBufferBulk;
         internal static Proto.FspFileSystemReleaseDirectoryBuffer FspFileSystemReleaseDirectoryBuffer;
         internal static Proto.FspFileSystemReadDirectoryBuffer FspFileSystemReadDirectoryBuffer;
         internal static Proto.FspFileSystemDeleteDirectoryBuffer FspFileSystemDeleteDirectoryBuffer;
@@ -1491,6 +1500,7 @@ namespace Fsp.Interop
             _FspFileSystemAddNotifyInfo = GetEntryPoint<Proto.FspFileSystemAddNotifyInfo>(Module);
             FspFileSystemAcquireDirectoryBuffer = GetEntryPoint<Proto.FspFileSystemAcquireDirectoryBuffer>(Module);
             FspFileSystemFillDirectoryBuffer = GetEntryPoint<Proto.FspFileSystemFillDirectoryBuffer>(Module);
+            FspFileSystemFillDirectoryBufferBulk = GetEntryPoint<Proto.FspFileSystemFillDirectoryBufferBulk>(Module);
             FspFileSystemReleaseDirectoryBuffer = GetEntryPoint<Proto.FspFileSystemReleaseDirectoryBuffer>(Module);
             FspFileSystemReadDirectoryBuffer = GetEntryPoint<Proto.FspFileSystemReadDirectoryBuffer>(Module);
             FspFileSystemDeleteDirectoryBuffer = GetEntryPoint<Proto.FspFileSystemDeleteDirectoryBuffer>(Module);
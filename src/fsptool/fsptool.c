@@ -65,7 +65,8 @@ static void usage(void)
         //"    list                            list running file system processes\n"
         //"    kill                            kill file system process\n"
         "    id [NAME|SID|UID]               print user id\n"
-        "    perm [PATH|SDDL|UID:GID:MODE]   print permissions\n",
+        "    perm [PATH|SDDL|UID:GID:MODE]   print permissions\n"
+        "    trace FILE                      print binary request trace\n",
         PROGNAME);
 }
 
@@ -541,6 +542,174 @@ static int perm(int argc, wchar_t **argv)
     return FspWin32FromNtStatus(Result);
 }
 
+typedef struct
+{
+    HANDLE Handle;
+    ULONG Position, Length;
+    UINT8 Buffer[64 * 1024];
+} TRACE_READER;
+
+static BOOLEAN trace_read(TRACE_READER *Reader, PVOID Data, ULONG Size)
+{
+    ULONG Length;
+    DWORD BytesTransferred;
+
+    while (0 < Size)
+    {
+        if (Reader->Position == Reader->Length)
+        {
+            if (!ReadFile(Reader->Handle, Reader->Buffer, sizeof Reader->Buffer,
+                &BytesTransferred, 0) || 0 == BytesTransferred)
+                return FALSE;
+            Reader->Position = 0;
+            Reader->Length = BytesTransferred;
+        }
+
+        Length = Reader->Length - Reader->Position;
+        if (Length > Size)
+            Length = Size;
+        memcpy(Data, Reader->Buffer + Reader->Position, Length);
+        Reader->Position += Length;
+        Data = (PUINT8)Data + Length;
+        Size -= Length;
+    }
+
+    return TRUE;
+}
+
+static UINT64 trace_divmod(UINT64 Dividend, UINT32 Divisor, PUINT32 PRemainder)
+{
+    /* 64-bit by 32-bit division without the compiler's runtime helpers */
+    UINT64 Quotient = 0, Remainder = 0;
+
+    for (int I = 0; 64 > I; I++)
+    {
+        Remainder = (Remainder << 1) | (Dividend >> 63);
+        Dividend <<= 1;
+        Quotient <<= 1;
+        if (Remainder >= Divisor)
+        {
+            Remainder -= Divisor;
+            Quotient |= 1;
+        }
+    }
+
+    *PRemainder = (UINT32)Remainder;
+    return Quotient;
+}
+
+static NTSTATUS trace_file(PWSTR FileName)
+{
+    TRACE_READER *Reader = 0;
+    FSP_FILE_SYSTEM_TRACE_HEADER Header;
+    FSP_FILE_SYSTEM_TRACE_RECORD *Record = 0;
+    ULONG RecordSizeMax;
+    UINT64 Seconds;
+    UINT32 Frequency, Remainder;
+    NTSTATUS Result;
+
+    RecordSizeMax = sizeof *Record + FSP_FSCTL_TRANSACT_REQ_SIZEMAX + FSP_FSCTL_TRANSACT_RSP_SIZEMAX;
+    Reader = MemAlloc(sizeof *Reader);
+    if (0 != Reader)
+        Reader->Handle = INVALID_HANDLE_VALUE;
+    Record = MemAlloc(RecordSizeMax);
+    if (0 == Reader || 0 == Record)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+    Reader->Position = Reader->Length = 0;
+
+    Reader->Handle = CreateFileW(FileName,
+        GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+    if (INVALID_HANDLE_VALUE == Reader->Handle)
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+
+    if (!trace_read(Reader, &Header, sizeof(UINT32) * 2) ||
+        FSP_FILE_SYSTEM_TRACE_SIGNATURE != Header.Signature ||
+        sizeof Header > Header.Version ||
+        !trace_read(Reader, (PUINT8)&Header + sizeof(UINT32) * 2, sizeof Header - sizeof(UINT32) * 2))
+    {
+        Result = STATUS_INVALID_IMAGE_FORMAT;
+        goto exit;
+    }
+    for (ULONG Skip = Header.Version - sizeof Header; 0 < Skip; Skip--)
+        if (!trace_read(Reader, Record, 1))
+        {
+            Result = STATUS_INVALID_IMAGE_FORMAT;
+            goto exit;
+        }
+
+    /* only performance counter frequencies that fit in 32 bits are converted to time */
+    Frequency = 0 == (Header.Frequency >> 32) ? (UINT32)Header.Frequency : 0;
+
+    FspDebugLogSetHandle(GetStdHandle(STD_OUTPUT_HANDLE));
+
+    while (trace_read(Reader, Record, sizeof *Record))
+    {
+        if (sizeof *Record > Record->Size || RecordSizeMax < Record->Size ||
+            !trace_read(Reader, Record + 1, Record->Size - sizeof *Record))
+        {
+            Result = STATUS_INVALID_IMAGE_FORMAT;
+            goto exit;
+        }
+
+        if (0 != Frequency)
+        {
+            Seconds = trace_divmod(Record->Time - Header.StartTime, Frequency, &Remainder);
+            FspDebugLog("+%lu.%06lu [TID=%04lx] ",
+                (ULONG)Seconds,
+                (ULONG)trace_divmod(UInt32x32To64(Remainder, 1000000), Frequency, &Remainder),
+                Record->ThreadId);
+        }
+        else
+            FspDebugLog("+%lx:%lx [TID=%04lx] ",
+                (ULONG)((Record->Time - Header.StartTime) >> 32),
+                (ULONG)(Record->Time - Header.StartTime),
+                Record->ThreadId);
+
+        switch (Record->Type)
+        {
+        case FspFileSystemTraceRequest:
+            FspDebugLogRequest((FSP_FSCTL_TRANSACT_REQ *)(Record + 1));
+            break;
+        case FspFileSystemTraceResponse:
+            FspDebugLogResponse((FSP_FSCTL_TRANSACT_RSP *)(Record + 1));
+            break;
+        default:
+            FspDebugLog("UNKNOWN RECORD TYPE %u\n", Record->Type);
+            break;
+        }
+    }
+
+    Result = STATUS_SUCCESS;
+
+exit:
+    if (0 != Reader && INVALID_HANDLE_VALUE != Reader->Handle)
+        CloseHandle(Reader->Handle);
+    MemFree(Record);
+    MemFree(Reader);
+
+    return Result;
+}
+
+static int trace(int argc, wchar_t **argv)
+{
+    if (2 != argc)
+        usage();
+
+    NTSTATUS Result;
+
+    Result = trace_file(argv[1]);
+    if (!NT_SUCCESS(Result))
+        fatal(FspWin32FromNtStatus(Result), "cannot read trace file (Status=%lx)", Result);
+
+    return 0;
+}
+
 int wmain(int argc, wchar_t **argv)
 {
     argc--;
@@ -557,6 +726,9 @@ int wmain(int argc, wchar_t **argv)
     else
     if (0 == invariant_wcscmp(L"perm", argv[0]))
         return perm(argc, argv);
+    else
+    if (0 == invariant_wcscmp(L"trace", argv[0]))
+        return trace(argc, argv);
     else
         usage();
 
@@ -200,6 +200,16 @@ static inline void MemFree(void *Pointer)
         HeapFree(GetProcessHeap(), 0, Pointer);
 }
 
+static FORCEINLINE
+VOID InitializeListHead(PLIST_ENTRY ListHead)
+{
+    ListHead->Flink = ListHead->Blink = ListHead;
+}
+static FORCEINLINE
+BOOLEAN IsListEmpty(PLIST_ENTRY ListHead)
+{
+    return ListHead->Flink == ListHead;
+}
 static FORCEINLINE
 VOID InsertTailList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry)
 {
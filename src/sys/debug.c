@@ -180,6 +180,8 @@ const char *IoctlCodeSym(ULONG ControlCode)
     SYM(FSP_FSCTL_TRANSACT)
     SYM(FSP_FSCTL_TRANSACT_BATCH)
     SYM(FSP_FSCTL_STOP)
+    SYM(FSP_FSCTL_TRANSFER_BUFFERS)
+    SYM(FSP_FSCTL_QUEUE_INFO)
     SYM(FSP_FSCTL_WORK)
     SYM(FSP_FSCTL_WORK_BEST_EFFORT)
     // cygwin: sed -n '/[IF][OS]CTL.*CTL_CODE/s/^#define[ \t]*\([^ \t]*\).*/SYM(\1)/p'
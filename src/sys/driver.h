@@ -733,6 +733,19 @@ VOID FspProcessBufferCollect(HANDLE ProcessId);
 NTSTATUS FspProcessBufferAcquire(SIZE_T BufferSize, PVOID *PBufferCookie, PVOID *PBuffer);
 VOID FspProcessBufferRelease(PVOID BufferCookie, PVOID Buffer);
 
+/* registered transfer buffers */
+typedef struct _FSP_TRANSFER_BUFFER_POOL FSP_TRANSFER_BUFFER_POOL;
+NTSTATUS FspTransferBufferPoolCreate(const FSP_FSCTL_TRANSFER_BUFFERS *Params,
+    FSP_TRANSFER_BUFFER_POOL **PPool);
+VOID FspTransferBufferPoolDereference(FSP_TRANSFER_BUFFER_POOL *Pool);
+BOOLEAN FspTransferBufferAcquire(PDEVICE_OBJECT FsvolDeviceObject, ULONG Length,
+    FSP_TRANSFER_BUFFER_POOL **PPool, PULONG PIndex, PVOID *PUserAddress, PVOID *PSystemAddress);
+VOID FspTransferBufferRelease(FSP_TRANSFER_BUFFER_POOL *Pool, ULONG Index);
+/* request context cookies: process buffer cookies have bit 0 set; safe MDL's are aligned */
+#define FspTransferBufferCookie(Index)  ((PVOID)(((UINT_PTR)(Index) << 2) | 2))
+#define FspTransferBufferCookieIs(C)    (2 == ((UINT_PTR)(C) & 3))
+#define FspTransferBufferCookieIndex(C) ((ULONG)((UINT_PTR)(C) >> 2))
+
 /* IRP context */
 #define FspIrpTimestampInfinity         ((ULONG)-1L)
 #define FspIrpTimestamp(Irp)            \
@@ -934,10 +947,13 @@ typedef struct
 #else
     KEVENT PendingIrpEvent;
 #endif
-    LIST_ENTRY PendingIrpList, ProcessIrpList, RetriedIrpList;
+    LIST_ENTRY PendingIrpList[FspFsctlTransactClassCount], ProcessIrpList, RetriedIrpList;
     IO_CSQ PendingIoCsq, ProcessIoCsq, RetriedIoCsq;
     ULONG IrpTimeout;
     ULONG PendingIrpCapacity, PendingIrpCount, ProcessIrpCount, RetriedIrpCount;
+    ULONG PendingIrpClassCount[FspFsctlTransactClassCount];
+    ULONG PendingIrpClassTokens[FspFsctlTransactClassCount];
+    LONG DeliveredIrpClassCount[FspFsctlTransactClassCount];
     VOID (*CompleteCanceledIrp)(PIRP Irp);
     ULONG ProcessIrpBucketCount;
     PVOID ProcessIrpBuckets[];
@@ -953,10 +969,13 @@ BOOLEAN FspIoqPostIrpEx(FSP_IOQ *Ioq, PIRP Irp, BOOLEAN BestEffort, NTSTATUS *PR
 PIRP FspIoqNextPendingIrp(FSP_IOQ *Ioq, PIRP BoundaryIrp, PLARGE_INTEGER Timeout,
     PIRP CancellableIrp);
 ULONG FspIoqPendingIrpCount(FSP_IOQ *Ioq);
+VOID FspIoqPendingIrpClassCount(FSP_IOQ *Ioq,
+    PULONG PendingIrpClassCount, PULONG DeliveredIrpClassCount);
 BOOLEAN FspIoqPendingAboveWatermark(FSP_IOQ *Ioq, ULONG Watermark);
 BOOLEAN FspIoqStartProcessingIrp(FSP_IOQ *Ioq, PIRP Irp);
 PIRP FspIoqEndProcessingIrp(FSP_IOQ *Ioq, UINT_PTR IrpHint);
 ULONG FspIoqProcessIrpCount(FSP_IOQ *Ioq);
+VOID FspIoqWakePendingIrpWaiter(FSP_IOQ *Ioq);
 BOOLEAN FspIoqRetryCompleteIrp(FSP_IOQ *Ioq, PIRP Irp, NTSTATUS *PResult);
 PIRP FspIoqNextCompleteIrp(FSP_IOQ *Ioq, PIRP BoundaryIrp);
 ULONG FspIoqRetriedIrpCount(FSP_IOQ *Ioq);
@@ -1186,6 +1205,8 @@ typedef struct
     PNOTIFY_SYNC NotifySync;
     LIST_ENTRY NotifyList;
     FSP_STATISTICS *Statistics;
+    FSP_TRANSFER_BUFFER_POOL *TransferBufferPool;
+    BOOLEAN TransferBufferPoolClosed;       /* set under Base.SpinLock at volume delete */
     FSP_FSCTL_DECLSPEC_ALIGN UINT8 FsextData[];
 } FSP_FSVOL_DEVICE_EXTENSION;
 typedef struct
@@ -1340,6 +1361,21 @@ BOOLEAN FspWriteIrpShouldUseProcessBuffer(PIRP Irp, SIZE_T BufferSize)
     return FspProcessBufferSizeMax >= BufferSize;
 #endif
 }
+static inline
+BOOLEAN FspIrpShouldUseTransferBuffer(PIRP Irp, SIZE_T BufferSize)
+{
+    /*
+     * Small requests use process buffers. Large requests with a page aligned buffer are mapped
+     * into the file system process with no copy. Only large requests with an unaligned buffer,
+     * which need a "safe" MDL (allocated pages plus a copy) before they can be mapped, use
+     * transfer buffers: they still take one copy, but avoid the allocation and the mapping.
+     */
+    ASSERT(0 != Irp);
+    return FspProcessBufferSizeMax < BufferSize &&
+        !FspSafeMdlCheck(Irp->MdlAddress) &&
+        0 != FspFsvolDeviceExtension(IoGetCurrentIrpStackLocation(Irp)->DeviceObject)->
+            TransferBufferPool;
+}
 #if 0
 static inline
 BOOLEAN FspQueryDirectoryIrpShouldUseProcessBuffer(PIRP Irp, SIZE_T BufferSize)
@@ -1391,6 +1427,10 @@ NTSTATUS FspVolumeStop(
     PDEVICE_OBJECT FsctlDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp);
 NTSTATUS FspVolumeNotify(
     PDEVICE_OBJECT FsctlDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp);
+NTSTATUS FspVolumeTransferBuffers(
+    PDEVICE_OBJECT FsctlDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp);
+NTSTATUS FspVolumeQueueInfo(
+    PDEVICE_OBJECT FsctlDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp);
 NTSTATUS FspVolumeWork(
     PDEVICE_OBJECT FsvolDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp);
 
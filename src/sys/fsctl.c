@@ -124,6 +124,14 @@ static NTSTATUS FspFsctlFileSystemControl(
             if (0 != IrpSp->FileObject->FsContext2)
                 Result = FspVolumeNotify(FsctlDeviceObject, Irp, IrpSp);
             break;
+        case FSP_FSCTL_TRANSFER_BUFFERS:
+            if (0 != IrpSp->FileObject->FsContext2)
+                Result = FspVolumeTransferBuffers(FsctlDeviceObject, Irp, IrpSp);
+            break;
+        case FSP_FSCTL_QUEUE_INFO:
+            if (0 != IrpSp->FileObject->FsContext2)
+                Result = FspVolumeQueueInfo(FsctlDeviceObject, Irp, IrpSp);
+            break;
         default:
             if (CTL_CODE(0, 0xC00, 0, 0) ==
                 (IrpSp->Parameters.FileSystemControl.FsControlCode & CTL_CODE(0, 0xC00, 0, 0)))
@@ -133,6 +133,22 @@
  * UPDATE: We can now use a Queued Event which behaves like a SynchronizationEvent,
  * but has better performance. Unfortunately Queued Events cannot cleanly implement
  * an EventClear operation. However the EventClear operation is not strictly needed.
+ *
+ *
+ * Pending Queue Priority Classes
+ *
+ * The pending queue is actually one FIFO list per request class (metadata, small I/O,
+ * bulk I/O, background; see FspFsctlTransactRequestClass). The class of an IRP is
+ * computed from its request and does not change while the IRP is pending.
+ *
+ * NextPendingIrp chooses a class using a token bucket policy. Every class has a bucket
+ * that holds up to FspIoqPendingClassWeights[Class] tokens. The highest priority class
+ * that has pending IRP's and tokens is chosen and the delivery of an IRP consumes one
+ * of its tokens (IRP's that are cancelled or expire while pending consume none). When
+ * no class that has pending IRP's has any tokens left, all buckets are refilled. Thus
+ * metadata requests are preferred over large reads and writes, but no class can starve
+ * another: in every round each class is guaranteed to deliver at least as many IRP's
+ * as its weight.
  */
 
 /*
@@ -218,6 +234,48 @@ typedef struct
     ULONG ExpirationTime;
 } FSP_IOQ_PEEK_CONTEXT;
 
+static const ULONG FspIoqPendingClassWeights[FspFsctlTransactClassCount] =
+{
+    8,                                  /* FspFsctlTransactMetadataClass */
+    4,                                  /* FspFsctlTransactSmallIoClass */
+    2,                                  /* FspFsctlTransactBulkIoClass */
+    1,                                  /* FspFsctlTransactBackgroundClass */
+};
+
+static inline ULONG FspIoqIrpClass(PIRP Irp)
+{
+    FSP_FSCTL_TRANSACT_REQ *Request = FspIrpRequest(Irp);
+    return 0 != Request ? FspFsctlTransactRequestClass(Request) : FspFsctlTransactMetadataClass;
+}
+
+static inline ULONG FspIoqPendingSelectClass(FSP_IOQ *Ioq)
+{
+    for (ULONG Pass = 0; 2 > Pass; Pass++)
+    {
+        for (ULONG Class = 0; FspFsctlTransactClassCount > Class; Class++)
+            if (0 != Ioq->PendingIrpClassCount[Class] && 0 != Ioq->PendingIrpClassTokens[Class])
+                return Class;
+
+        /* no class with pending IRP's has any tokens left; start a new round */
+        for (ULONG Class = 0; FspFsctlTransactClassCount > Class; Class++)
+            Ioq->PendingIrpClassTokens[Class] = FspIoqPendingClassWeights[Class];
+    }
+    return 0;
+}
+
+static inline PIRP FspIoqPendingNextIrpInClassOrder(FSP_IOQ *Ioq, ULONG Class, PLIST_ENTRY Entry)
+{
+    /* return the IRP at Entry or the first IRP of a subsequent class */
+    for (;;)
+    {
+        if (&Ioq->PendingIrpList[Class] != Entry)
+            return CONTAINING_RECORD(Entry, IRP, Tail.Overlay.ListEntry);
+        if (FspFsctlTransactClassCount <= ++Class)
+            return 0;
+        Entry = Ioq->PendingIrpList[Class].Flink;
+    }
+}
+
 static inline VOID FspIoqPendingResetSynch(FSP_IOQ *Ioq)
 {
     /*
@@ -240,8 +298,10 @@ static NTSTATUS FspIoqPendingInsertIrpEx(PIO_CSQ IoCsq, PIRP Irp, PVOID InsertCo
         return STATUS_CANCELLED;
     if (!InsertContext && Ioq->PendingIrpCapacity <= Ioq->PendingIrpCount)
         return STATUS_INSUFFICIENT_RESOURCES;
+    ULONG Class = FspIoqIrpClass(Irp);
     Ioq->PendingIrpCount++;
-    InsertTailList(&Ioq->PendingIrpList, &Irp->Tail.Overlay.ListEntry);
+    Ioq->PendingIrpClassCount[Class]++;
+    InsertTailList(&Ioq->PendingIrpList[Class], &Irp->Tail.Overlay.ListEntry);
     FspIoqEventSet(&Ioq->PendingIrpEvent);
         /* equivalent to FspIoqPendingResetSynch(Ioq) */
     return STATUS_SUCCESS;
@@ -250,7 +310,9 @@ static NTSTATUS FspIoqPendingInsertIrpEx(PIO_CSQ IoCsq, PIRP Irp, PVOID InsertCo
 static VOID FspIoqPendingRemoveIrp(PIO_CSQ IoCsq, PIRP Irp)
 {
     FSP_IOQ *Ioq = CONTAINING_RECORD(IoCsq, FSP_IOQ, PendingIoCsq);
+    ULONG Class = FspIoqIrpClass(Irp);
     Ioq->PendingIrpCount--;
+    Ioq->PendingIrpClassCount[Class]--;
     RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
     FspIoqPendingResetSynch(Ioq);
 }
@@ -260,25 +322,41 @@ static PIRP FspIoqPendingPeekNextIrp(PIO_CSQ IoCsq, PIRP Irp, PVOID PeekContext)
     FSP_IOQ *Ioq = CONTAINING_RECORD(IoCsq, FSP_IOQ, PendingIoCsq);
     if (PeekContext && Ioq->Stopped)
         return 0;
-    PLIST_ENTRY Head = &Ioq->PendingIrpList;
-    PLIST_ENTRY Entry = 0 == Irp ? Head->Flink : Irp->Tail.Overlay.ListEntry.Flink;
-    if (Head == Entry)
-        return 0;
-    Irp = CONTAINING_RECORD(Entry, IRP, Tail.Overlay.ListEntry);
-    if (!PeekContext)
+    PVOID IrpHint = PeekContext ? ((FSP_IOQ_PEEK_CONTEXT *)PeekContext)->IrpHint : 0;
+    ULONG Class;
+    PLIST_ENTRY Entry;
+    if (0 == Irp)
+    {
+        /* NextPendingIrp chooses a class; all other peeks walk the classes in order */
+        Class = 0 != IrpHint ? FspIoqPendingSelectClass(Ioq) : 0;
+        Entry = Ioq->PendingIrpList[Class].Flink;
+    }
+    else
+    {
+        Class = FspIoqIrpClass(Irp);
+        Entry = Irp->Tail.Overlay.ListEntry.Flink;
+    }
+    Irp = FspIoqPendingNextIrpInClassOrder(Ioq, Class, Entry);
+    if (0 == Irp || !PeekContext)
         return Irp;
-    PVOID IrpHint = ((FSP_IOQ_PEEK_CONTEXT *)PeekContext)->IrpHint;
     if (0 == IrpHint)
     {
         ULONG ExpirationTime = ((FSP_IOQ_PEEK_CONTEXT *)PeekContext)->ExpirationTime;
         for (;;)
         {
+            Class = FspIoqIrpClass(Irp);
             if (FspIrpTimestampInfinity != FspIrpTimestamp(Irp))
-                return FspIrpTimestamp(Irp) <= ExpirationTime ? Irp : 0;
-            Entry = Entry->Flink;
-            if (Head == Entry)
+            {
+                if (FspIrpTimestamp(Irp) <= ExpirationTime)
+                    return Irp;
+                /* every class list is in timestamp order; skip the rest of this class */
+                Entry = &Ioq->PendingIrpList[Class];
+            }
+            else
+                Entry = Irp->Tail.Overlay.ListEntry.Flink;
+            Irp = FspIoqPendingNextIrpInClassOrder(Ioq, Class, Entry);
+            if (0 == Irp)
                 return 0;
-            Irp = CONTAINING_RECORD(Entry, IRP, Tail.Overlay.ListEntry);
         }
     }
     else
@@ -489,7 +567,11 @@ NTSTATUS FspIoqCreate(
 
     KeInitializeSpinLock(&Ioq->SpinLock);
     FspIoqEventInitialize(&Ioq->PendingIrpEvent);
-    InitializeListHead(&Ioq->PendingIrpList);
+    for (ULONG Class = 0; FspFsctlTransactClassCount > Class; Class++)
+    {
+        InitializeListHead(&Ioq->PendingIrpList[Class]);
+        Ioq->PendingIrpClassTokens[Class] = FspIoqPendingClassWeights[Class];
+    }
     InitializeListHead(&Ioq->ProcessIrpList);
     InitializeListHead(&Ioq->RetriedIrpList);
     IoCsqInitializeEx(&Ioq->PendingIoCsq,
@@ -598,6 +680,17 @@ BOOLEAN FspIoqPostIrpEx(FSP_IOQ *Ioq, PIRP Irp, BOOLEAN BestEffort, NTSTATUS *PR
     }
 }
 
+static VOID FspIoqPendingDeliverIrp(FSP_IOQ *Ioq, PIRP Irp)
+{
+    ULONG Class = FspIoqIrpClass(Irp);
+    KIRQL Irql;
+    KeAcquireSpinLock(&Ioq->SpinLock, &Irql);
+    if (0 != Ioq->PendingIrpClassTokens[Class])
+        Ioq->PendingIrpClassTokens[Class]--;
+    KeReleaseSpinLock(&Ioq->SpinLock, Irql);
+    InterlockedIncrement(&Ioq->DeliveredIrpClassCount[Class]);
+}
+
 PIRP FspIoqNextPendingIrp(FSP_IOQ *Ioq, PIRP BoundaryIrp, PLARGE_INTEGER Timeout,
     PIRP CancellableIrp)
 {
@@ -617,7 +710,9 @@ PIRP FspIoqNextPendingIrp(FSP_IOQ *Ioq, PIRP BoundaryIrp, PLARGE_INTEGER Timeout
             return FspIoqCancelled;
         ASSERT(STATUS_SUCCESS == Result);
         PendingIrp = IoCsqRemoveNextIrp(&Ioq->PendingIoCsq, &PeekContext);
-        if (0 == PendingIrp)
+        if (0 != PendingIrp)
+            FspIoqPendingDeliverIrp(Ioq, PendingIrp);
+        else
         {
             /*
              * The WaitForSingleObject call above has reset our PendingIrpEvent,
@@ -632,7 +727,11 @@ PIRP FspIoqNextPendingIrp(FSP_IOQ *Ioq, PIRP BoundaryIrp, PLARGE_INTEGER Timeout
         }
     }
     else
+    {
         PendingIrp = IoCsqRemoveNextIrp(&Ioq->PendingIoCsq, &PeekContext);
+        if (0 != PendingIrp)
+            FspIoqPendingDeliverIrp(Ioq, PendingIrp);
+    }
     return PendingIrp;
 }
 
@@ -646,6 +745,19 @@ ULONG FspIoqPendingIrpCount(FSP_IOQ *Ioq)
     return Result;
 }
 
+VOID FspIoqPendingIrpClassCount(FSP_IOQ *Ioq,
+    PULONG PendingIrpClassCount, PULONG DeliveredIrpClassCount)
+{
+    KIRQL Irql;
+    KeAcquireSpinLock(&Ioq->SpinLock, &Irql);
+    for (ULONG Class = 0; FspFsctlTransactClassCount > Class; Class++)
+    {
+        PendingIrpClassCount[Class] = Ioq->PendingIrpClassCount[Class];
+        DeliveredIrpClassCount[Class] = Ioq->DeliveredIrpClassCount[Class];
+    }
+    KeReleaseSpinLock(&Ioq->SpinLock, Irql);
+}
+
 BOOLEAN FspIoqPendingAboveWatermark(FSP_IOQ *Ioq, ULONG Watermark)
 {
     BOOLEAN Result;
@@ -689,6 +801,19 @@ ULONG FspIoqProcessIrpCount(FSP_IOQ *Ioq)
     return Result;
 }
 
+VOID FspIoqWakePendingIrpWaiter(FSP_IOQ *Ioq)
+{
+    /*
+     * Wake up a single thread waiting in FspIoqNextPendingIrp even if there is no IRP
+     * in the pending queue. The woken thread will fail to remove an IRP and will reset
+     * the PendingIrpEvent synchronization (see FspIoqPendingResetSynch).
+     */
+    KIRQL Irql;
+    KeAcquireSpinLock(&Ioq->SpinLock, &Irql);
+    FspIoqEventSet(&Ioq->PendingIrpEvent);
+    KeReleaseSpinLock(&Ioq->SpinLock, Irql);
+}
+
 BOOLEAN FspIoqRetryCompleteIrp(FSP_IOQ *Ioq, PIRP Irp, NTSTATUS *PResult)
 {
     NTSTATUS Result;
@@ -52,6 +52,7 @@ enum
     RequestSafeMdl                      = 1,
     RequestAddress                      = 2,
     RequestProcess                      = 3,
+    RequestTransferBufferPool           = 3,
 };
 FSP_FSCTL_STATIC_ASSERT(RequestCookie == RequestSafeMdl, "");
 
@@ -363,7 +364,32 @@ NTSTATUS FspFsvolReadPrepare(
 {
     PAGED_CODE();
 
-    if (FspReadIrpShouldUseProcessBuffer(Irp, Request->Req.Read.Length))
+    FSP_TRANSFER_BUFFER_POOL *TransferBufferPool;
+    ULONG TransferBufferIndex;
+    PVOID TransferBufferAddress, TransferBufferSystemAddress;
+
+    if (FspIrpShouldUseTransferBuffer(Irp, Request->Req.Read.Length) &&
+        FspTransferBufferAcquire(IoGetCurrentIrpStackLocation(Irp)->DeviceObject,
+            Request->Req.Read.Length,
+            &TransferBufferPool, &TransferBufferIndex,
+            &TransferBufferAddress, &TransferBufferSystemAddress))
+    {
+        if (0 == MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority))
+        {
+            FspTransferBufferRelease(TransferBufferPool, TransferBufferIndex);
+            return STATUS_INSUFFICIENT_RESOURCES; /* something is seriously screwy! */
+        }
+
+        Request->Req.Read.Address = (UINT64)(UINT_PTR)TransferBufferAddress;
+        Request->Req.Read.TransferBuffer = TransferBufferIndex + 1;
+
+        FspIopRequestContext(Request, RequestCookie) = FspTransferBufferCookie(TransferBufferIndex);
+        FspIopRequestContext(Request, RequestAddress) = TransferBufferSystemAddress;
+        FspIopRequestContext(Request, RequestTransferBufferPool) = TransferBufferPool;
+
+        return STATUS_SUCCESS;
+    }
+    else if (FspReadIrpShouldUseProcessBuffer(Irp, Request->Req.Read.Length))
     {
         NTSTATUS Result;
         PVOID Cookie;
@@ -446,7 +472,15 @@ NTSTATUS FspFsvolReadComplete(
     if (Response->IoStatus.Information > Request->Req.Read.Length)
         FSP_RETURN(Result = STATUS_INTERNAL_ERROR);
 
-    if ((UINT_PTR)FspIopRequestContext(Request, RequestCookie) & 1)
+    if (FspTransferBufferCookieIs(FspIopRequestContext(Request, RequestCookie)))
+    {
+        PVOID SystemAddress = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
+
+        /* both buffers are locked and mapped in system space: no need for exception handling */
+        RtlCopyMemory(SystemAddress,
+            FspIopRequestContext(Request, RequestAddress), Response->IoStatus.Information);
+    }
+    else if ((UINT_PTR)FspIopRequestContext(Request, RequestCookie) & 1)
     {
         PVOID Address = FspIopRequestContext(Request, RequestAddress);
         PVOID SystemAddress = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
@@ -510,7 +544,15 @@ static VOID FspFsvolReadNonCachedRequestFini(FSP_FSCTL_TRANSACT_REQ *Request, PV
 
     PIRP Irp = Context[RequestIrp];
 
-    if ((UINT_PTR)Context[RequestCookie] & 1)
+    if (FspTransferBufferCookieIs(Context[RequestCookie]))
+    {
+        FSP_TRANSFER_BUFFER_POOL *TransferBufferPool = Context[RequestTransferBufferPool];
+
+        if (0 != TransferBufferPool)
+            FspTransferBufferRelease(TransferBufferPool,
+                FspTransferBufferCookieIndex(Context[RequestCookie]));
+    }
+    else if ((UINT_PTR)Context[RequestCookie] & 1)
     {
         PVOID Cookie = (PVOID)((UINT_PTR)Context[RequestCookie] & ~1);
         PVOID Address = Context[RequestAddress];
@@ -52,6 +52,10 @@ NTSTATUS FspVolumeStop(
     PDEVICE_OBJECT FsctlDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp);
 NTSTATUS FspVolumeNotify(
     PDEVICE_OBJECT FsctlDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp);
+NTSTATUS FspVolumeTransferBuffers(
+    PDEVICE_OBJECT FsctlDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp);
+NTSTATUS FspVolumeQueueInfo(
+    PDEVICE_OBJECT FsctlDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp);
 static NTSTATUS FspVolumeNotifyLock(
     PDEVICE_OBJECT FsvolDeviceObject);
 static WORKER_THREAD_ROUTINE FspVolumeNotifyWork;
@@ -74,6 +78,8 @@ NTSTATUS FspVolumeWork(
 #pragma alloc_text(PAGE, FspVolumeTransactFsext)
 #pragma alloc_text(PAGE, FspVolumeStop)
 #pragma alloc_text(PAGE, FspVolumeNotify)
+#pragma alloc_text(PAGE, FspVolumeTransferBuffers)
+#pragma alloc_text(PAGE, FspVolumeQueueInfo)
 #pragma alloc_text(PAGE, FspVolumeNotifyLock)
 #pragma alloc_text(PAGE, FspVolumeNotifyWork)
 #pragma alloc_text(PAGE, FspVolumeWork)
@@ -412,6 +418,21 @@ static VOID FspVolumeDeleteNoLock(
     /* stop the I/O queue */
     FspIoqStop(FsvolDeviceExtension->Ioq, TRUE);
 
+    /* release the registered transfer buffers (if any) while the file system process is alive */
+    {
+        FSP_TRANSFER_BUFFER_POOL *TransferBufferPool;
+        KIRQL Irql;
+
+        KeAcquireSpinLock(&FsvolDeviceExtension->Base.SpinLock, &Irql);
+        TransferBufferPool = FsvolDeviceExtension->TransferBufferPool;
+        FsvolDeviceExtension->TransferBufferPool = 0;
+        FsvolDeviceExtension->TransferBufferPoolClosed = TRUE;
+        KeReleaseSpinLock(&FsvolDeviceExtension->Base.SpinLock, Irql);
+
+        if (0 != TransferBufferPool)
+            FspTransferBufferPoolDereference(TransferBufferPool);
+    }
+
     /* do we have a virtual disk device or are we registered with fsmup? */
     if (0 != FsvolDeviceExtension->FsvrtDeviceObject)
     {
@@ -1091,6 +1112,115 @@ NTSTATUS FspVolumeStop(
     return STATUS_SUCCESS;
 }
 
+NTSTATUS FspVolumeTransferBuffers(
+    PDEVICE_OBJECT FsctlDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp)
+{
+    PAGED_CODE();
+
+    ASSERT(IRP_MJ_FILE_SYSTEM_CONTROL == IrpSp->MajorFunction);
+    ASSERT(IRP_MN_USER_FS_REQUEST == IrpSp->MinorFunction);
+    ASSERT(FSP_FSCTL_TRANSFER_BUFFERS == IrpSp->Parameters.FileSystemControl.FsControlCode);
+    ASSERT(METHOD_BUFFERED == (IrpSp->Parameters.FileSystemControl.FsControlCode & 3));
+    ASSERT(0 != IrpSp->FileObject->FsContext2);
+
+    PDEVICE_OBJECT FsvolDeviceObject = IrpSp->FileObject->FsContext2;
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension = FspFsvolDeviceExtension(FsvolDeviceObject);
+    PVOID InputBuffer = Irp->AssociatedIrp.SystemBuffer;
+    ULONG InputBufferLength = IrpSp->Parameters.FileSystemControl.InputBufferLength;
+    FSP_TRANSFER_BUFFER_POOL *TransferBufferPool;
+    KIRQL Irql;
+    NTSTATUS Result;
+
+    if (sizeof(FSP_FSCTL_TRANSFER_BUFFERS) > InputBufferLength || 0 == InputBuffer)
+        return STATUS_INVALID_PARAMETER;
+
+    if (!FspDeviceReference(FsvolDeviceObject))
+        return STATUS_CANCELLED;
+
+    if (FspIoqStopped(FsvolDeviceExtension->Ioq))
+    {
+        Result = STATUS_CANCELLED;
+        goto exit;
+    }
+
+    /* lock and map the transfer buffers; we are in the context of the file system process */
+    Result = FspTransferBufferPoolCreate(InputBuffer, &TransferBufferPool);
+    if (!NT_SUCCESS(Result))
+        goto exit;
+
+    /*
+     * Transfer buffers can only be registered once per volume. FspVolumeDeleteNoLock releases
+     * the pool under the same lock; a pool registered after that would never be unlocked.
+     */
+    KeAcquireSpinLock(&FsvolDeviceExtension->Base.SpinLock, &Irql);
+    if (FsvolDeviceExtension->TransferBufferPoolClosed)
+        Result = STATUS_CANCELLED;
+    else if (0 != FsvolDeviceExtension->TransferBufferPool)
+        Result = STATUS_INVALID_DEVICE_STATE;
+    else
+    {
+        FsvolDeviceExtension->TransferBufferPool = TransferBufferPool;
+        TransferBufferPool = 0;
+    }
+    KeReleaseSpinLock(&FsvolDeviceExtension->Base.SpinLock, Irql);
+
+    if (0 != TransferBufferPool)
+        FspTransferBufferPoolDereference(TransferBufferPool);
+
+exit:
+    FspDeviceDereference(FsvolDeviceObject);
+
+    return Result;
+}
+
+NTSTATUS FspVolumeQueueInfo(
+    PDEVICE_OBJECT FsctlDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp)
+{
+    PAGED_CODE();
+
+    ASSERT(IRP_MJ_FILE_SYSTEM_CONTROL == IrpSp->MajorFunction);
+    ASSERT(IRP_MN_USER_FS_REQUEST == IrpSp->MinorFunction);
+    ASSERT(FSP_FSCTL_QUEUE_INFO == IrpSp->Parameters.FileSystemControl.FsControlCode);
+    ASSERT(METHOD_BUFFERED == (IrpSp->Parameters.FileSystemControl.FsControlCode & 3));
+    ASSERT(0 != IrpSp->FileObject->FsContext2);
+
+    /* check parameters */
+    ULONG InputBufferLength = IrpSp->Parameters.FileSystemControl.InputBufferLength;
+    ULONG OutputBufferLength = IrpSp->Parameters.FileSystemControl.OutputBufferLength;
+    PVOID SystemBuffer = Irp->AssociatedIrp.SystemBuffer;
+    if (sizeof(FSP_FSCTL_QUEUE_INFO) > InputBufferLength ||
+        sizeof(FSP_FSCTL_QUEUE_INFO) > OutputBufferLength || 0 == SystemBuffer)
+        return STATUS_BUFFER_TOO_SMALL;
+
+    PDEVICE_OBJECT FsvolDeviceObject = IrpSp->FileObject->FsContext2;
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension = FspFsvolDeviceExtension(FsvolDeviceObject);
+    FSP_FSCTL_QUEUE_INFO *QueueInfo = SystemBuffer;
+    UINT32 Flags = QueueInfo->Flags;
+
+    if (!FspDeviceReference(FsvolDeviceObject))
+        return STATUS_CANCELLED;
+
+    /*
+     * A woken dispatcher thread finds no IRP and completes its transaction as if it
+     * had timed out; this allows the user mode dispatcher to retire idle threads.
+     */
+    if (FlagOn(Flags, FspFsctlQueueInfoWakeDispatcher))
+        FspIoqWakePendingIrpWaiter(FsvolDeviceExtension->Ioq);
+
+    /* the counts are sampled independently; they are hints for dispatcher sizing */
+    RtlZeroMemory(QueueInfo, sizeof *QueueInfo);
+    QueueInfo->PendingIrpCount = FspIoqPendingIrpCount(FsvolDeviceExtension->Ioq);
+    QueueInfo->ProcessIrpCount = FspIoqProcessIrpCount(FsvolDeviceExtension->Ioq);
+    QueueInfo->PendingIrpCapacity = FsvolDeviceExtension->Ioq->PendingIrpCapacity;
+    FspIoqPendingIrpClassCount(FsvolDeviceExtension->Ioq,
+        (PULONG)QueueInfo->PendingIrpClassCount, (PULONG)QueueInfo->DeliveredIrpClassCount);
+
+    FspDeviceDereference(FsvolDeviceObject);
+
+    Irp->IoStatus.Information = sizeof *QueueInfo;
+    return STATUS_SUCCESS;
+}
+
 typedef struct
 {
     WORK_QUEUE_ITEM WorkItem;
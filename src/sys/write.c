@@ -53,6 +53,7 @@ enum
     RequestSafeMdl                      = 1,
     RequestAddress                      = 2,
     RequestProcess                      = 3,
+    RequestTransferBufferPool           = 3,
 };
 FSP_FSCTL_STATIC_ASSERT(RequestCookie == RequestSafeMdl, "");
 
@@ -429,7 +430,37 @@ NTSTATUS FspFsvolWritePrepare(
 {
     PAGED_CODE();
 
-    if (FspWriteIrpShouldUseProcessBuffer(Irp, Request->Req.Write.Length))
+    FSP_TRANSFER_BUFFER_POOL *TransferBufferPool;
+    ULONG TransferBufferIndex;
+    PVOID TransferBufferAddress, TransferBufferSystemAddress;
+
+    if (FspIrpShouldUseTransferBuffer(Irp, Request->Req.Write.Length) &&
+        FspTransferBufferAcquire(IoGetCurrentIrpStackLocation(Irp)->DeviceObject,
+            Request->Req.Write.Length,
+            &TransferBufferPool, &TransferBufferIndex,
+            &TransferBufferAddress, &TransferBufferSystemAddress))
+    {
+        PVOID SystemAddress = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
+
+        if (0 == SystemAddress)
+        {
+            FspTransferBufferRelease(TransferBufferPool, TransferBufferIndex);
+            return STATUS_INSUFFICIENT_RESOURCES; /* something is seriously screwy! */
+        }
+
+        /* both buffers are locked and mapped in system space: no need for exception handling */
+        RtlCopyMemory(TransferBufferSystemAddress, SystemAddress, Request->Req.Write.Length);
+
+        Request->Req.Write.Address = (UINT64)(UINT_PTR)TransferBufferAddress;
+        Request->Req.Write.TransferBuffer = TransferBufferIndex + 1;
+
+        FspIopRequestContext(Request, RequestCookie) = FspTransferBufferCookie(TransferBufferIndex);
+        FspIopRequestContext(Request, RequestAddress) = TransferBufferSystemAddress;
+        FspIopRequestContext(Request, RequestTransferBufferPool) = TransferBufferPool;
+
+        return STATUS_SUCCESS;
+    }
+    else if (FspWriteIrpShouldUseProcessBuffer(Irp, Request->Req.Write.Length))
     {
         NTSTATUS Result;
         PVOID Cookie;
@@ -583,7 +614,15 @@ static VOID FspFsvolWriteNonCachedRequestFini(FSP_FSCTL_TRANSACT_REQ *Request, P
 
     PIRP Irp = Context[RequestIrp];
 
-    if ((UINT_PTR)Context[RequestCookie] & 1)
+    if (FspTransferBufferCookieIs(Context[RequestCookie]))
+    {
+        FSP_TRANSFER_BUFFER_POOL *TransferBufferPool = Context[RequestTransferBufferPool];
+
+        if (0 != TransferBufferPool)
+            FspTransferBufferRelease(TransferBufferPool,
+                FspTransferBufferCookieIndex(Context[RequestCookie]));
+    }
+    else if ((UINT_PTR)Context[RequestCookie] & 1)
     {
         PVOID Cookie = (PVOID)((UINT_PTR)Context[RequestCookie] & ~1);
         PVOID Address = Context[RequestAddress];
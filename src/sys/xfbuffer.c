@@ -0,0 +1,219 @@
+/**
+ * @file sys/xfbuffer.c
+ *
+ * @copyright 2015-2021 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+
+#include <sys/driver.h>
+
+/*
+ * Registered transfer buffers
+ *
+ * A file system may register with its volume a pool of large transfer buffers that live
+ * in the file system process. The pool is locked and mapped into system space once, when
+ * it is registered. Non-cached reads and writes that fit in a transfer buffer then use a
+ * free buffer from the pool: the FSD copies between the IRP buffer and the system mapping
+ * of the transfer buffer and the file system accesses the transfer buffer directly. This
+ * avoids mapping the IRP buffer into the file system process (and the "safe" MDL that may
+ * be needed for that) on every request.
+ *
+ * When all transfer buffers are in use requests fall back to the regular paths.
+ */
+
+NTSTATUS FspTransferBufferPoolCreate(const FSP_FSCTL_TRANSFER_BUFFERS *Params,
+    FSP_TRANSFER_BUFFER_POOL **PPool);
+VOID FspTransferBufferPoolDereference(FSP_TRANSFER_BUFFER_POOL *Pool);
+BOOLEAN FspTransferBufferAcquire(PDEVICE_OBJECT FsvolDeviceObject, ULONG Length,
+    FSP_TRANSFER_BUFFER_POOL **PPool, PULONG PIndex, PVOID *PUserAddress, PVOID *PSystemAddress);
+VOID FspTransferBufferRelease(FSP_TRANSFER_BUFFER_POOL *Pool, ULONG Index);
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, FspTransferBufferPoolCreate)
+#endif
+
+struct _FSP_TRANSFER_BUFFER_POOL
+{
+    LONG RefCount;
+    KSPIN_LOCK SpinLock;
+    PEPROCESS Process;
+    PMDL Mdl;
+    PUINT8 UserAddress;
+    PUINT8 SystemAddress;
+    ULONG BufferSize;
+    ULONG BufferCount;
+    ULONG Hint;
+    UINT32 FreeMask[FSP_FSCTL_TRANSFER_BUFFER_COUNTMAX / 32];
+};
+
+NTSTATUS FspTransferBufferPoolCreate(const FSP_FSCTL_TRANSFER_BUFFERS *Params,
+    FSP_TRANSFER_BUFFER_POOL **PPool)
+{
+    PAGED_CODE();
+
+    FSP_TRANSFER_BUFFER_POOL *Pool;
+    PMDL Mdl;
+    PVOID SystemAddress;
+    UINT64 Size;
+    NTSTATUS Result;
+
+    *PPool = 0;
+
+    if (sizeof *Params > Params->Version ||
+        0 == Params->BufferSize ||
+        0 != Params->BufferSize % FSP_FSCTL_TRANSFER_BUFFER_ALIGNMENT ||
+        FSP_FSCTL_TRANSFER_BUFFER_SIZEMAX < Params->BufferSize ||
+        0 == Params->BufferCount ||
+        FSP_FSCTL_TRANSFER_BUFFER_COUNTMAX < Params->BufferCount ||
+        0 != Params->Address % PAGE_SIZE)
+        return STATUS_INVALID_PARAMETER;
+
+    Size = (UINT64)Params->BufferSize * Params->BufferCount;
+    if (FSP_FSCTL_TRANSFER_BUFFERS_SIZEMAX < Size ||
+        (UINT_PTR)Params->Address != Params->Address)
+        return STATUS_INVALID_PARAMETER;
+
+    Pool = FspAllocNonPaged(sizeof *Pool);
+    if (0 == Pool)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    RtlZeroMemory(Pool, sizeof *Pool);
+
+    Mdl = IoAllocateMdl((PVOID)(UINT_PTR)Params->Address, (ULONG)Size, FALSE, FALSE, 0);
+    if (0 == Mdl)
+    {
+        FspFree(Pool);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    try
+    {
+        MmProbeAndLockPages(Mdl, UserMode, IoModifyAccess);
+    }
+    except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        Result = GetExceptionCode();
+        Result = FsRtlIsNtstatusExpected(Result) ? STATUS_INVALID_USER_BUFFER : Result;
+        IoFreeMdl(Mdl);
+        FspFree(Pool);
+        return Result;
+    }
+
+    SystemAddress = MmGetSystemAddressForMdlSafe(Mdl, NormalPagePriority);
+    if (0 == SystemAddress)
+    {
+        MmUnlockPages(Mdl);
+        IoFreeMdl(Mdl);
+        FspFree(Pool);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    Pool->RefCount = 1;
+    KeInitializeSpinLock(&Pool->SpinLock);
+    Pool->Process = PsGetCurrentProcess();
+    ObReferenceObject(Pool->Process);
+    Pool->Mdl = Mdl;
+    Pool->UserAddress = (PUINT8)(UINT_PTR)Params->Address;
+    Pool->SystemAddress = SystemAddress;
+    Pool->BufferSize = Params->BufferSize;
+    Pool->BufferCount = Params->BufferCount;
+    for (ULONG Index = 0; Pool->BufferCount > Index; Index++)
+        Pool->FreeMask[Index / 32] |= 1 << (Index % 32);
+
+    *PPool = Pool;
+
+    return STATUS_SUCCESS;
+}
+
+VOID FspTransferBufferPoolDereference(FSP_TRANSFER_BUFFER_POOL *Pool)
+{
+    if (0 != InterlockedDecrement(&Pool->RefCount))
+        return;
+
+    /*
+     * The pages must be unlocked before the file system process terminates. The last
+     * reference is normally released when the volume is deleted (on cleanup of the volume
+     * handle) or when the last outstanding request that uses a transfer buffer completes,
+     * both of which happen before the process address space is torn down.
+     */
+    MmUnlockPages(Pool->Mdl);
+    IoFreeMdl(Pool->Mdl);
+    ObDereferenceObject(Pool->Process);
+    FspFree(Pool);
+}
+
+BOOLEAN FspTransferBufferAcquire(PDEVICE_OBJECT FsvolDeviceObject, ULONG Length,
+    FSP_TRANSFER_BUFFER_POOL **PPool, PULONG PIndex, PVOID *PUserAddress, PVOID *PSystemAddress)
+{
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension = FspFsvolDeviceExtension(FsvolDeviceObject);
+    FSP_TRANSFER_BUFFER_POOL *Pool;
+    ULONG Index = (ULONG)-1;
+    KIRQL Irql;
+
+    if (0 == FsvolDeviceExtension->TransferBufferPool)
+        return FALSE;
+
+    KeAcquireSpinLock(&FsvolDeviceExtension->Base.SpinLock, &Irql);
+    Pool = FsvolDeviceExtension->TransferBufferPool;
+    if (0 != Pool)
+        InterlockedIncrement(&Pool->RefCount);
+    KeReleaseSpinLock(&FsvolDeviceExtension->Base.SpinLock, Irql);
+
+    if (0 == Pool)
+        return FALSE;
+
+    /* the file system can only access the pool from its own process */
+    if (Pool->Process == PsGetCurrentProcess() && Pool->BufferSize >= Length)
+    {
+        KeAcquireSpinLock(&Pool->SpinLock, &Irql);
+        for (ULONG I = 0, J = Pool->Hint; Pool->BufferCount > I; I++, J = (J + 1) % Pool->BufferCount)
+            if (Pool->FreeMask[J / 32] & (1 << (J % 32)))
+            {
+                Pool->FreeMask[J / 32] &= ~(1 << (J % 32));
+                Pool->Hint = (J + 1) % Pool->BufferCount;
+                Index = J;
+                break;
+            }
+        KeReleaseSpinLock(&Pool->SpinLock, Irql);
+    }
+
+    if ((ULONG)-1 == Index)
+    {
+        FspTransferBufferPoolDereference(Pool);
+        return FALSE;
+    }
+
+    *PPool = Pool;
+    *PIndex = Index;
+    *PUserAddress = Pool->UserAddress + (SIZE_T)Index * Pool->BufferSize;
+    *PSystemAddress = Pool->SystemAddress + (SIZE_T)Index * Pool->BufferSize;
+
+    return TRUE;
+}
+
+VOID FspTransferBufferRelease(FSP_TRANSFER_BUFFER_POOL *Pool, ULONG Index)
+{
+    KIRQL Irql;
+
+    ASSERT(Pool->BufferCount > Index);
+
+    KeAcquireSpinLock(&Pool->SpinLock, &Irql);
+    Pool->FreeMask[Index / 32] |= 1 << (Index % 32);
+    KeReleaseSpinLock(&Pool->SpinLock, Irql);
+
+    FspTransferBufferPoolDereference(Pool);
+}
@@ -1138,6 +1138,32 @@ void AirfsDelete(AIRFS_ Airfs)
 
 //////////////////////////////////////////////////////////////////////
 
+//  Format 1.0 ordered case-insensitive names by _wcsicmp (lower case folding).
+//  Format 1.1 orders them by FspNameCompare (upper case folding, like the FSD),
+//  so the sibling trees of an older volume must be rebuilt before they are searched.
+static void ReindexCaselessNames(Where<NODE_> &Root)
+{
+    Where<NODE_> NewRoot((NODE_)0);
+    NODE_ Node;
+
+    while (Node = First(Root))
+    {
+        Detach(Root, Node);
+        WCHAR* key = Node->Name;
+        Attach(NewRoot, Node, CaselessNameCmp, key);
+    }
+    Root = NewRoot;
+
+    for (Node = First(Root); Node; Node = Next(Node))
+        for (NODE_ Equal = Node; Equal; Equal = Equal->E)
+        {
+            ReindexCaselessNames(Equal->Children);
+            ReindexCaselessNames(Equal->Streams);
+        }
+}
+
+//////////////////////////////////////////////////////////////////////
+
 NTSTATUS AirfsCreate(
     PWSTR StorageFileName,
     PWSTR MapName,
@@ -1169,7 +1195,7 @@ NTSTATUS AirfsCreate(
 
     if (ShouldFormat)
     {
-        memcpy(Airfs->Signature,"Airfs\0\0\0"  "\1\0\0\0"  "\0\0\0\0", 16);
+        memcpy(Airfs->Signature,"Airfs\0\0\0"  "\1\1\0\0"  "\0\0\0\0", 16);
 
         if (!RootSddl)
             RootSddl = L"O:BAG:BAD:P(A;;FA;;;SY)(A;;FA;;;BA)(A;;FA;;;WD)";
@@ -1250,6 +1276,16 @@ NTSTATUS AirfsCreate(
         ReferenceNode(RootNode);
         LocalFree(RootSecurity);
     }
+    else if (1 == Airfs->MapFormatVersion[0] && 1 > Airfs->MapFormatVersion[1])
+    {
+        if (Airfs->CaseInsensitive)
+        {
+            NODE_ RootNode = Airfs->Root;
+            ReindexCaselessNames(RootNode->Children);
+            ReindexCaselessNames(RootNode->Streams);
+        }
+        Airfs->MapFormatVersion[1] = 1;
+    }
 
     Result = FspFileSystemCreate(DevicePath, &Airfs->VolumeParams, &AirfsInterface, &Airfs->FileSystem);
     if (!NT_SUCCESS(Result))
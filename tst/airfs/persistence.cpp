@@ -54,7 +54,7 @@ int CaselessNameCmp ( void* key,  NODE_ x)
 { 
     WCHAR* c1 = (WCHAR*) key;
     WCHAR* c2 = x->Name;
-    return _wcsicmp(c1,c2); 
+    return FspNameCompare(c1, (ULONG)wcslen(c1), c2, (ULONG)wcslen(c2), TRUE); 
 }
 
 int ExactNameCmp ( void* key,  NODE_ x)
@@ -43,6 +43,7 @@ NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
     wchar_t **argp, **arge;
     ULONG DebugFlags = 0;
     PWSTR DebugLogFile = 0;
+    PWSTR TraceFile = 0;
     ULONG Flags = MemfsDisk;
     ULONG OtherFlags = 0;
     ULONG FileInfoTimeout = INFINITE;
@@ -67,6 +68,9 @@ NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
         {
         case L'?':
             goto usage;
+        case L'b':
+            OtherFlags |= MemfsTransactBatch;
+            break;
         case L'd':
             argtol(DebugFlags);
             break;
@@ -74,13 +78,13 @@ NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
             argtos(DebugLogFile);
             break;
         case L'f':
-            OtherFlags = MemfsFlushAndPurgeOnCleanup;
+            OtherFlags |= MemfsFlushAndPurgeOnCleanup;
             break;
         case L'F':
             argtos(FileSystemName);
             break;
         case L'i':
-            OtherFlags = MemfsCaseInsensitive;
+            OtherFlags |= MemfsCaseInsensitive;
             break;
         case L'm':
             argtos(MountPoint);
@@ -106,11 +110,26 @@ NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
         case L't':
             argtol(FileInfoTimeout);
             break;
+        case L'T':
+            argtos(TraceFile);
+            break;
         case L'u':
             argtos(VolumePrefix);
             if (0 != VolumePrefix && L'\0' != VolumePrefix[0])
                 Flags = MemfsNet;
             break;
+        case L'w':
+            OtherFlags |= MemfsWorkStealing;
+            break;
+        case L'a':
+            OtherFlags |= MemfsAdaptiveDispatcher;
+            break;
+        case L'N':
+            OtherFlags |= MemfsNumaAffinity;
+            break;
+        case L'z':
+            OtherFlags |= MemfsTransferBuffers;
+            break;
         default:
             goto usage;
         }
@@ -164,6 +183,16 @@ NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
 
     FspFileSystemSetDebugLog(MemfsFileSystem(Memfs), DebugFlags);
 
+    if (0 != TraceFile)
+    {
+        Result = FspFileSystemStartTrace(MemfsFileSystem(Memfs), TraceFile);
+        if (!NT_SUCCESS(Result))
+        {
+            fail(L"cannot start trace");
+            goto exit;
+        }
+    }
+
     if (0 != MountPoint && L'\0' != MountPoint[0])
     {
         Result = FspFileSystemSetMountPoint(MemfsFileSystem(Memfs),
@@ -184,8 +213,13 @@ NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
 
     MountPoint = FspFileSystemMountPoint(MemfsFileSystem(Memfs));
 
-    info(L"%s -t %ld -n %ld -s %ld%s%s%s%s%s%s",
-        L"" PROGNAME, FileInfoTimeout, MaxFileNodes, MaxFileSize,
+    info(L"%s%s%s%s%s%s -t %ld -n %ld -s %ld%s%s%s%s%s%s",
+        L"" PROGNAME, OtherFlags & MemfsTransactBatch ? L" -b" : L"",
+        OtherFlags & MemfsWorkStealing ? L" -w" : L"",
+        OtherFlags & MemfsAdaptiveDispatcher ? L" -a" : L"",
+        OtherFlags & MemfsNumaAffinity ? L" -N" : L"",
+        OtherFlags & MemfsTransferBuffers ? L" -z" : L"",
+        FileInfoTimeout, MaxFileNodes, MaxFileSize,
         RootSddl ? L" -S " : L"", RootSddl ? RootSddl : L"",
         0 != VolumePrefix && L'\0' != VolumePrefix[0] ? L" -u " : L"",
             0 != VolumePrefix && L'\0' != VolumePrefix[0] ? VolumePrefix : L"",
@@ -207,8 +241,15 @@ usage:
         "options:\n"
         "    -d DebugFlags       [-1: enable all debug logs]\n"
         "    -D DebugLogFile     [file path; use - for stderr]\n"
+        "    -T TraceFile        [binary request trace; see fsptool trace]\n"
+        "    -r ReplayFile       [replay request trace against an unmounted MEMFS]\n"
         "    -i                  [case insensitive file system]\n"
         "    -f                  [flush and purge cache on cleanup]\n"
+        "    -b                  [batch transactions with the FSD]\n"
+        "    -w                  [work-stealing dispatcher]\n"
+        "    -a                  [adaptive dispatcher thread count]\n"
+        "    -N                  [NUMA-aware dispatcher threads and buffers]\n"
+        "    -z                  [registered transfer buffers for large non-cached I/O]\n"
         "    -t FileInfoTimeout  [millis]\n"
         "    -n MaxFileNodes\n"
         "    -s MaxFileSize      [bytes]\n"
@@ -228,14 +269,187 @@ usage:
 NTSTATUS SvcStop(FSP_SERVICE *Service)
 {
     MEMFS *Memfs = Service->UserContext;
+    MEMFS_MEMORY_STATISTICS Statistics;
 
     MemfsStop(Memfs);
+
+    MemfsGetMemoryStatistics(Memfs, &Statistics);
+    info(L"%s: nodes=%llu bytes/node=%llu (records=%llu index=%llu names=%llu "
+        "security=%llu/%llu reparse=%llu/%llu ea=%llu/%llu)",
+        L"" PROGNAME,
+        Statistics.FileNodeCount, Statistics.BytesPerFileNode,
+        Statistics.FileNodeSize, Statistics.IndexSize, Statistics.NameArenaSize,
+        Statistics.SecuritySize, Statistics.SecurityCount,
+        Statistics.ReparseSize, Statistics.ReparseCount,
+        Statistics.EaSize, Statistics.EaCount);
+
     MemfsDelete(Memfs);
 
     return STATUS_SUCCESS;
 }
 
+static int ReplayMain(int argc, wchar_t **argv)
+{
+    static PWSTR KindNames[] =
+    {
+        0,
+        L"Create",
+        L"Overwrite",
+        L"Cleanup",
+        L"Close",
+        L"Read",
+        L"Write",
+        L"QueryInformation",
+        L"SetInformation",
+        L"QueryEa",
+        L"SetEa",
+        L"FlushBuffers",
+        L"QueryVolumeInformation",
+        L"SetVolumeInformation",
+        L"QueryDirectory",
+        L"FileSystemControl",
+        L"DeviceControl",
+        L"Shutdown",
+        L"LockControl",
+        L"QuerySecurity",
+        L"SetSecurity",
+        L"QueryStreamInformation",
+    };
+    wchar_t **argp, **arge;
+    PWSTR ReplayFile = 0;
+    ULONG ThreadCount = 1;
+    ULONG Speed = 0;
+    ULONG Flags = MemfsDetached;
+    ULONG FileInfoTimeout = INFINITE;
+    ULONG MaxFileNodes = 1024;
+    ULONG MaxFileSize = 16 * 1024 * 1024;
+    FSP_FILE_SYSTEM_REPLAY_PARAMS ReplayParams;
+    FSP_FILE_SYSTEM_REPLAY_RESULT ReplayResult;
+    static FSP_FILE_SYSTEM_STATISTICS StatisticsBuf;
+    FSP_FILE_SYSTEM_STATISTICS *Statistics = &StatisticsBuf;
+    FSP_FILE_SYSTEM_HISTOGRAM *Histogram;
+    MEMFS *Memfs = 0;
+    NTSTATUS Result;
+
+    for (argp = argv + 1, arge = argv + argc; arge > argp; argp++)
+    {
+        if (L'-' != argp[0][0])
+            break;
+        switch (argp[0][1])
+        {
+        case L'c':
+            argtol(ThreadCount);
+            break;
+        case L'i':
+            Flags |= MemfsCaseInsensitive;
+            break;
+        case L'n':
+            argtol(MaxFileNodes);
+            break;
+        case L'r':
+            argtos(ReplayFile);
+            break;
+        case L's':
+            argtol(MaxFileSize);
+            break;
+        case L'x':
+            argtol(Speed);
+            break;
+        default:
+            goto usage;
+        }
+    }
+
+    if (arge > argp || 0 == ReplayFile)
+        goto usage;
+
+    Result = MemfsCreateFunnel(
+        Flags,
+        FileInfoTimeout,
+        MaxFileNodes,
+        MaxFileSize,
+        0,
+        0,
+        0,
+        0,
+        0,
+        0,
+        &Memfs);
+    if (!NT_SUCCESS(Result))
+    {
+        fail(L"cannot create MEMFS");
+        goto exit;
+    }
+
+    FspFileSystemResetStatistics(MemfsFileSystem(Memfs));
+
+    memset(&ReplayParams, 0, sizeof ReplayParams);
+    ReplayParams.Version = sizeof ReplayParams;
+    ReplayParams.ThreadCount = ThreadCount;
+    ReplayParams.Speed = Speed;
+    Result = FspFileSystemReplayTrace(MemfsFileSystem(Memfs), ReplayFile,
+        &ReplayParams, &ReplayResult);
+    if (!NT_SUCCESS(Result))
+    {
+        fail(L"cannot replay trace %s (Status=%lx)", ReplayFile, Result);
+        goto exit;
+    }
+
+    Statistics->Version = sizeof *Statistics;
+    Result = FspFileSystemGetStatistics(MemfsFileSystem(Memfs), Statistics, FALSE);
+    if (!NT_SUCCESS(Result))
+        goto exit;
+
+    info(L"%s -r %s -c %ld -x %ld: requests=%llu skipped=%llu mismatched=%llu "
+        "elapsed=%llums throughput=%llu/s",
+        L"" PROGNAME, ReplayFile, ThreadCount, Speed,
+        ReplayResult.RequestCount, ReplayResult.SkipCount, ReplayResult.MismatchCount,
+        ReplayResult.ElapsedTime * 1000 / Statistics->Frequency,
+        0 != ReplayResult.ElapsedTime ?
+            ReplayResult.RequestCount * Statistics->Frequency / ReplayResult.ElapsedTime : 0);
+    for (ULONG Kind = 1; sizeof KindNames / sizeof KindNames[0] > Kind; Kind++)
+    {
+        Histogram = &Statistics->Kind[Kind];
+        if (0 == Histogram->Count)
+            continue;
+        info(L"    %-24s count=%llu p50=%lluus p99=%lluus max=%lluus",
+            KindNames[Kind], Histogram->Count,
+            FspFileSystemHistogramPercentile(Histogram, 500) * 1000000 / Statistics->Frequency,
+            FspFileSystemHistogramPercentile(Histogram, 990) * 1000000 / Statistics->Frequency,
+            Histogram->MaxTime * 1000000 / Statistics->Frequency);
+    }
+
+    Result = STATUS_SUCCESS;
+
+exit:
+    if (0 != Memfs)
+        MemfsDelete(Memfs);
+
+    return NT_SUCCESS(Result) ? 0 : 1;
+
+usage:
+    static wchar_t usage[] = L""
+        "usage: %s -r ReplayFile OPTIONS\n"
+        "\n"
+        "options:\n"
+        "    -r ReplayFile       [binary request trace recorded with -T]\n"
+        "    -c ThreadCount      [replay threads]\n"
+        "    -x Speed            [percent of recorded speed; 0: as fast as possible]\n"
+        "    -i                  [case insensitive file system]\n"
+        "    -n MaxFileNodes\n"
+        "    -s MaxFileSize      [bytes]\n";
+
+    fail(usage, L"" PROGNAME);
+
+    return 2;
+}
+
 int wmain(int argc, wchar_t **argv)
 {
+    /* -r: replay a request trace against a detached MEMFS instead of running the service */
+    for (int argi = 1; argc > argi; argi++)
+        if (0 == wcscmp(L"-r", argv[argi]))
+            return ReplayMain(argc, argv);
+
     return FspServiceRun(L"" PROGNAME, SvcStart, SvcStop, 0);
 }
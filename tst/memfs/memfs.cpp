@@ -27,13 +27,12 @@
 #include <map>
 #include <unordered_map>
 
-/* SLOWIO */
-#include <thread>
-
 #define MEMFS_MAX_PATH                  512
 FSP_FSCTL_STATIC_ASSERT(MEMFS_MAX_PATH > MAX_PATH,
     "MEMFS_MAX_PATH must be greater than MAX_PATH.");
 
+#define MEMFS_MAX_NAME                  256     /* path component incl. terminating NUL */
+
 /*
  * Define the MEMFS_STANDALONE macro when building MEMFS as a standalone file system.
  * This macro should be defined in the Visual Studio project settings, Makefile, etc.
@@ -88,6 +87,27 @@ FSP_FSCTL_STATIC_ASSERT(MEMFS_MAX_PATH > MAX_PATH,
 #define MEMFS_REJECT_EARLY_IRP
 #endif
 
+/*
+ * Size and count of the transfer buffers registered with the FSD (MemfsTransferBuffers).
+ */
+#define MEMFS_TRANSFER_BUFFER_SIZE      (1024 * 1024)
+#define MEMFS_TRANSFER_BUFFER_COUNT     16
+
+/*
+ * Maximum number of dispatcher threads when using the adaptive dispatcher (MemfsAdaptiveDispatcher).
+ */
+#define MEMFS_ADAPTIVE_THREAD_COUNT_MAX 32
+
+/*
+ * Idle time (millis) before the adaptive dispatcher retires a thread (MemfsAdaptiveDispatcher).
+ */
+#define MEMFS_ADAPTIVE_IDLE_TIMEOUT     250
+
+/*
+ * Number of threads that complete delayed I/O (MEMFS_SLOWIO).
+ */
+#define MEMFS_SLOWIO_ASYNC_THREAD_COUNT 4
+
 /*
  * Define the DEBUG_BUFFER_CHECK macro on Windows 8 or above. This includes
  * a check for the Write buffer to ensure that it is read-only.
@@ -170,6 +190,203 @@ VOID LargeHeapFree(PVOID Pointer)
         HeapFree(LargeHeap, 0, Pointer);
 }
 
+/*
+ * Sparse File Data
+ *
+ * File data is kept in fixed-size pages (allocated from the large heap) that hang off a
+ * radix tree indexed by page number. Pages that have never been written are holes and
+ * read as zeroes. The tree grows in height as the file grows, so extending a file never
+ * copies existing data.
+ *
+ * Invariant: there are no pages past the end of file and the bytes past the end of file
+ * in the last page are zero. Hence extending a file requires no work.
+ */
+
+#define FILE_DATA_PAGE_SHIFT            16
+#define FILE_DATA_PAGE_SIZE             (1 << FILE_DATA_PAGE_SHIFT)
+#define FILE_DATA_FANOUT_SHIFT          8
+#define FILE_DATA_FANOUT                (1 << FILE_DATA_FANOUT_SHIFT)
+
+typedef struct
+{
+    PVOID Root;                         /* page if Height == 0; else array of FILE_DATA_FANOUT */
+    UINT32 Height;
+    UINT32 PageCount;
+} FILE_DATA;
+
+static inline
+PUINT8 FileDataGetPage(FILE_DATA *Data, UINT64 PageIndex, BOOLEAN Create)
+{
+    PVOID *Slot, *Node;
+
+    while (0 != (PageIndex >> (Data->Height * FILE_DATA_FANOUT_SHIFT)))
+    {
+        if (!Create)
+            return 0;
+        if (0 != Data->Root)
+        {
+            Node = (PVOID *)calloc(FILE_DATA_FANOUT, sizeof(PVOID));
+            if (0 == Node)
+                return 0;
+            Node[0] = Data->Root;
+            Data->Root = Node;
+        }
+        Data->Height++;
+    }
+
+    Slot = &Data->Root;
+    for (UINT32 Height = Data->Height; 0 < Height; Height--)
+    {
+        if (0 == *Slot)
+        {
+            if (!Create)
+                return 0;
+            *Slot = calloc(FILE_DATA_FANOUT, sizeof(PVOID));
+            if (0 == *Slot)
+                return 0;
+        }
+        Slot = &((PVOID *)*Slot)[
+            (PageIndex >> ((Height - 1) * FILE_DATA_FANOUT_SHIFT)) & (FILE_DATA_FANOUT - 1)];
+    }
+
+    if (0 == *Slot)
+    {
+        if (!Create)
+            return 0;
+        *Slot = LargeHeapAlloc(FILE_DATA_PAGE_SIZE);
+        if (0 == *Slot)
+            return 0;
+        memset(*Slot, 0, FILE_DATA_PAGE_SIZE);
+        Data->PageCount++;
+    }
+
+    return (PUINT8)*Slot;
+}
+
+static inline
+VOID FileDataRead(FILE_DATA *Data, UINT64 Offset, PVOID Buffer, SIZE_T Length)
+{
+    PUINT8 P = (PUINT8)Buffer, Page;
+    SIZE_T PageOffset, Part;
+
+    while (0 < Length)
+    {
+        PageOffset = (SIZE_T)(Offset & (FILE_DATA_PAGE_SIZE - 1));
+        Part = FILE_DATA_PAGE_SIZE - PageOffset;
+        if (Part > Length)
+            Part = Length;
+
+        Page = FileDataGetPage(Data, Offset >> FILE_DATA_PAGE_SHIFT, FALSE);
+        if (0 != Page)
+            memcpy(P, Page + PageOffset, Part);
+        else
+            memset(P, 0, Part);
+
+        P += Part;
+        Offset += Part;
+        Length -= Part;
+    }
+}
+
+static inline
+BOOLEAN FileDataIsZero(PUINT8 P, SIZE_T Length)
+{
+    for (; 0 < Length && 0 != ((UINT_PTR)P & (sizeof(UINT_PTR) - 1)); P++, Length--)
+        if (0 != *P)
+            return FALSE;
+    for (; sizeof(UINT_PTR) <= Length; P += sizeof(UINT_PTR), Length -= sizeof(UINT_PTR))
+        if (0 != *(UINT_PTR *)P)
+            return FALSE;
+    for (; 0 < Length; P++, Length--)
+        if (0 != *P)
+            return FALSE;
+    return TRUE;
+}
+
+static inline
+BOOLEAN FileDataWrite(FILE_DATA *Data, UINT64 Offset, PVOID Buffer, SIZE_T Length)
+{
+    PUINT8 P = (PUINT8)Buffer, Page;
+    SIZE_T PageOffset, Part;
+
+    while (0 < Length)
+    {
+        PageOffset = (SIZE_T)(Offset & (FILE_DATA_PAGE_SIZE - 1));
+        Part = FILE_DATA_PAGE_SIZE - PageOffset;
+        if (Part > Length)
+            Part = Length;
+
+        /* zeroes written into a hole leave the hole in place */
+        Page = FileDataGetPage(Data, Offset >> FILE_DATA_PAGE_SHIFT, FALSE);
+        if (0 == Page && !FileDataIsZero(P, Part))
+        {
+            Page = FileDataGetPage(Data, Offset >> FILE_DATA_PAGE_SHIFT, TRUE);
+            if (0 == Page)
+                return FALSE;
+        }
+        if (0 != Page)
+            memcpy(Page + PageOffset, P, Part);
+
+        P += Part;
+        Offset += Part;
+        Length -= Part;
+    }
+
+    return TRUE;
+}
+
+static inline
+VOID FileDataFreeFrom(FILE_DATA *Data, PVOID *Slot, UINT32 Height, UINT64 FirstPage, UINT64 KeepPages)
+{
+    /* free all pages under *Slot (which covers pages starting at FirstPage) at or past KeepPages */
+    if (0 == *Slot)
+        return;
+
+    if (FirstPage >= KeepPages)
+    {
+        if (0 < Height)
+        {
+            for (ULONG I = 0; FILE_DATA_FANOUT > I; I++)
+                FileDataFreeFrom(Data, &((PVOID *)*Slot)[I], Height - 1, FirstPage, KeepPages);
+            free(*Slot);
+        }
+        else
+        {
+            LargeHeapFree(*Slot);
+            Data->PageCount--;
+        }
+        *Slot = 0;
+    }
+    else if (0 < Height)
+    {
+        UINT64 ChildPages = (UINT64)1 << ((Height - 1) * FILE_DATA_FANOUT_SHIFT);
+        /* children before I are kept in full; child I may be kept in part */
+        UINT64 I = (KeepPages - FirstPage) / ChildPages;
+        for (; FILE_DATA_FANOUT > I; I++)
+            FileDataFreeFrom(Data, &((PVOID *)*Slot)[I], Height - 1, FirstPage + I * ChildPages, KeepPages);
+    }
+}
+
+static inline
+VOID FileDataTruncate(FILE_DATA *Data, UINT64 NewSize)
+{
+    UINT64 KeepPages = (NewSize + FILE_DATA_PAGE_SIZE - 1) >> FILE_DATA_PAGE_SHIFT;
+    SIZE_T PageOffset = (SIZE_T)(NewSize & (FILE_DATA_PAGE_SIZE - 1));
+    PUINT8 Page;
+
+    FileDataFreeFrom(Data, &Data->Root, Data->Height, 0, KeepPages);
+    if (0 == Data->Root)
+        Data->Height = 0;
+
+    /* maintain the invariant that the bytes past the end of file are zero */
+    if (0 != PageOffset)
+    {
+        Page = FileDataGetPage(Data, NewSize >> FILE_DATA_PAGE_SHIFT, FALSE);
+        if (0 != Page)
+            memset(Page + PageOffset, 0, FILE_DATA_PAGE_SIZE - PageOffset);
+    }
+}
+
 /*
  * MEMFS
  */
@@ -187,7 +404,7 @@ int MemfsFileNameCompare(PWSTR a, int alen, PWSTR b, int blen, BOOLEAN CaseInsen
 {
     PWSTR p, endp, partp, q, endq, partq;
     WCHAR c, d;
-    int plen, qlen, len, res;
+    int plen, qlen, res;
 
     if (-1 == alen)
         alen = lstrlenW(a);
@@ -223,22 +440,7 @@ int MemfsFileNameCompare(PWSTR a, int alen, PWSTR b, int blen, BOOLEAN CaseInsen
         plen = (int)(p - partp);
         qlen = (int)(q - partq);
 
-        len = plen < qlen ? plen : qlen;
-
-        if (CaseInsensitive)
-        {
-            res = CompareStringW(LOCALE_INVARIANT, NORM_IGNORECASE, partp, plen, partq, qlen);
-            if (0 != res)
-                res -= 2;
-            else
-                res = _wcsnicmp(partp, partq, len);
-        }
-        else
-            res = wcsncmp(partp, partq, len);
-
-        if (0 == res)
-            res = plen - qlen;
-
+        res = FspNameCompare(partp, plen, partq, qlen, CaseInsensitive);
         if (0 != res)
             return res;
     }
@@ -277,52 +479,328 @@ int MemfsEaNameCompare(PSTR a, PSTR b)
 
     return res;
 }
+#endif
 
-struct MEMFS_FILE_NODE_EA_LESS
+struct MEMFS_FILE_NODE_LESS
 {
-    MEMFS_FILE_NODE_EA_LESS()
+    MEMFS_FILE_NODE_LESS(BOOLEAN CaseInsensitive) : CaseInsensitive(CaseInsensitive)
     {
     }
-    bool operator()(PSTR a, PSTR b) const
+    bool operator()(PWSTR a, PWSTR b) const
     {
-        return 0 > MemfsEaNameCompare(a, b);
+        return 0 > MemfsFileNameCompare(a, -1, b, -1, CaseInsensitive);
     }
+    BOOLEAN CaseInsensitive;
 };
-typedef std::map<PSTR, FILE_FULL_EA_INFORMATION *, MEMFS_FILE_NODE_EA_LESS> MEMFS_FILE_NODE_EA_MAP;
-#endif
+typedef std::map<PWSTR, struct _MEMFS_FILE_NODE *, MEMFS_FILE_NODE_LESS> MEMFS_FILE_NODE_INDEX;
+
+/*
+ * File names are allocated from a per-volume arena of 64K chunks with per-size-class
+ * free lists, so a node pays only for the length of its own name (rounded up to 4 WCHAR's).
+ */
+#define MEMFS_NAME_ARENA_CHUNK_SIZE     (64 * 1024)
+#define MEMFS_NAME_ARENA_GRANULARITY    4       /* WCHAR's; a freed name must hold a PVOID */
+#define MEMFS_NAME_ARENA_CLASS_COUNT    (MEMFS_MAX_NAME / MEMFS_NAME_ARENA_GRANULARITY)
+FSP_FSCTL_STATIC_ASSERT(MEMFS_NAME_ARENA_GRANULARITY * sizeof(WCHAR) >= sizeof(PVOID),
+    "MEMFS_NAME_ARENA_GRANULARITY too small.");
+
+typedef struct _MEMFS_NAME_ARENA
+{
+    SRWLOCK Lock;
+    PVOID ChunkList;                    /* chunks are linked through their first PVOID */
+    PUINT8 ChunkNext, ChunkEnd;
+    PVOID FreeList[MEMFS_NAME_ARENA_CLASS_COUNT];
+    SIZE_T ReservedSize, UsedSize;
+} MEMFS_NAME_ARENA;
+
+static inline
+SIZE_T MemfsNameArenaClass(SIZE_T Length)
+{
+    /* Length excludes the terminating NUL and must be less than MEMFS_MAX_NAME */
+    return (Length + MEMFS_NAME_ARENA_GRANULARITY) / MEMFS_NAME_ARENA_GRANULARITY - 1;
+}
+
+static inline
+PWSTR MemfsNameArenaAlloc(MEMFS_NAME_ARENA *Arena, PWSTR Name)
+{
+    SIZE_T Length = wcslen(Name);
+    SIZE_T Class = MemfsNameArenaClass(Length);
+    SIZE_T Size = (Class + 1) * MEMFS_NAME_ARENA_GRANULARITY * sizeof(WCHAR);
+    PWSTR Result;
+
+    assert(MEMFS_MAX_NAME > Length);
+
+    AcquireSRWLockExclusive(&Arena->Lock);
+    if (0 != Arena->FreeList[Class])
+    {
+        Result = (PWSTR)Arena->FreeList[Class];
+        Arena->FreeList[Class] = *(PVOID *)Result;
+    }
+    else
+    {
+        if ((SIZE_T)(Arena->ChunkEnd - Arena->ChunkNext) < Size)
+        {
+            PVOID Chunk = malloc(MEMFS_NAME_ARENA_CHUNK_SIZE);
+            if (0 == Chunk)
+            {
+                ReleaseSRWLockExclusive(&Arena->Lock);
+                return 0;
+            }
+            *(PVOID *)Chunk = Arena->ChunkList;
+            Arena->ChunkList = Chunk;
+            Arena->ChunkNext = (PUINT8)Chunk + sizeof(PVOID);
+            Arena->ChunkEnd = (PUINT8)Chunk + MEMFS_NAME_ARENA_CHUNK_SIZE;
+            Arena->ReservedSize += MEMFS_NAME_ARENA_CHUNK_SIZE;
+        }
+        Result = (PWSTR)Arena->ChunkNext;
+        Arena->ChunkNext += Size;
+    }
+    Arena->UsedSize += Size;
+    ReleaseSRWLockExclusive(&Arena->Lock);
+
+    memcpy(Result, Name, (Length + 1) * sizeof(WCHAR));
+
+    return Result;
+}
+
+static inline
+VOID MemfsNameArenaFree(MEMFS_NAME_ARENA *Arena, PWSTR Name)
+{
+    SIZE_T Class;
+
+    if (0 == Name)
+        return;
+
+    Class = MemfsNameArenaClass(wcslen(Name));
+
+    AcquireSRWLockExclusive(&Arena->Lock);
+    *(PVOID *)Name = Arena->FreeList[Class];
+    Arena->FreeList[Class] = Name;
+    Arena->UsedSize -= (Class + 1) * MEMFS_NAME_ARENA_GRANULARITY * sizeof(WCHAR);
+    ReleaseSRWLockExclusive(&Arena->Lock);
+}
+
+static inline
+VOID MemfsNameArenaFinalize(MEMFS_NAME_ARENA *Arena)
+{
+    for (PVOID Chunk = Arena->ChunkList, NextChunk; 0 != Chunk; Chunk = NextChunk)
+    {
+        NextChunk = *(PVOID *)Chunk;
+        free(Chunk);
+    }
+    memset(Arena, 0, sizeof *Arena);
+}
+
+/*
+ * Security descriptors, reparse data and extended attributes are immutable once attached
+ * to a node. Identical blobs are hash-consed into a per-volume table and shared by
+ * reference count; a node that changes one of them interns the new contents and releases
+ * the old.
+ */
+typedef struct _MEMFS_SHARED_BLOB
+{
+    struct _MEMFS_SHARED_BLOB *HashNext;
+    ULONG Hash;
+    ULONG RefCount;                     /* protected by the table lock */
+    SIZE_T Size;
+    FSP_FSCTL_DECLSPEC_ALIGN UINT8 Data[];
+} MEMFS_SHARED_BLOB;
+
+typedef struct _MEMFS_SHARED_BLOB_TABLE
+{
+    SRWLOCK Lock;
+    MEMFS_SHARED_BLOB **Buckets;
+    ULONG BucketCount;
+    ULONG Count;                        /* distinct blobs */
+    SIZE_T References;                  /* blob references held by nodes */
+    SIZE_T DataSize;                    /* bytes held by distinct blobs including headers */
+} MEMFS_SHARED_BLOB_TABLE;
+
+static inline
+ULONG MemfsSharedBlobHash(PVOID Data, SIZE_T Size)
+{
+    /* FNV-1a */
+    ULONG Hash = 2166136261;
+    for (PUINT8 P = (PUINT8)Data, EndP = P + Size; EndP > P; P++)
+        Hash = (Hash ^ *P) * 16777619;
+    return Hash;
+}
+
+static inline
+SIZE_T MemfsSharedBlobSize(PVOID Data)
+{
+    return 0 != Data ? CONTAINING_RECORD(Data, MEMFS_SHARED_BLOB, Data)->Size : 0;
+}
+
+static inline
+PVOID MemfsSharedBlobIntern(MEMFS_SHARED_BLOB_TABLE *Table, PVOID Data, SIZE_T Size)
+{
+    ULONG Hash = MemfsSharedBlobHash(Data, Size);
+    MEMFS_SHARED_BLOB *Blob;
+
+    AcquireSRWLockExclusive(&Table->Lock);
+
+    if (Table->Count >= Table->BucketCount)
+    {
+        /* grow to keep the load factor at or below 1; on failure keep the current buckets */
+        ULONG BucketCount = 0 != Table->BucketCount ? Table->BucketCount * 2 : 64;
+        MEMFS_SHARED_BLOB **Buckets = (MEMFS_SHARED_BLOB **)calloc(BucketCount, sizeof *Buckets);
+        if (0 != Buckets)
+        {
+            for (ULONG I = 0; Table->BucketCount > I; I++)
+                for (MEMFS_SHARED_BLOB *NextBlob; 0 != (Blob = Table->Buckets[I]); )
+                {
+                    NextBlob = Blob->HashNext;
+                    Blob->HashNext = Buckets[Blob->Hash % BucketCount];
+                    Buckets[Blob->Hash % BucketCount] = Blob;
+                    Table->Buckets[I] = NextBlob;
+                }
+            free(Table->Buckets);
+            Table->Buckets = Buckets;
+            Table->BucketCount = BucketCount;
+        }
+        else if (0 == Table->BucketCount)
+        {
+            ReleaseSRWLockExclusive(&Table->Lock);
+            return 0;
+        }
+    }
+
+    for (Blob = Table->Buckets[Hash % Table->BucketCount]; 0 != Blob; Blob = Blob->HashNext)
+        if (Hash == Blob->Hash && Size == Blob->Size && 0 == memcmp(Data, Blob->Data, Size))
+            break;
+
+    if (0 == Blob)
+    {
+        Blob = (MEMFS_SHARED_BLOB *)malloc(sizeof *Blob + Size);
+        if (0 == Blob)
+        {
+            ReleaseSRWLockExclusive(&Table->Lock);
+            return 0;
+        }
+        Blob->Hash = Hash;
+        Blob->RefCount = 0;
+        Blob->Size = Size;
+        memcpy(Blob->Data, Data, Size);
+        Blob->HashNext = Table->Buckets[Hash % Table->BucketCount];
+        Table->Buckets[Hash % Table->BucketCount] = Blob;
+        Table->Count++;
+        Table->DataSize += sizeof *Blob + Size;
+    }
+
+    Blob->RefCount++;
+    Table->References++;
+
+    ReleaseSRWLockExclusive(&Table->Lock);
+
+    return Blob->Data;
+}
 
+static inline
+VOID MemfsSharedBlobRelease(MEMFS_SHARED_BLOB_TABLE *Table, PVOID Data)
+{
+    MEMFS_SHARED_BLOB *Blob, **PBlob;
+
+    if (0 == Data)
+        return;
+
+    Blob = CONTAINING_RECORD(Data, MEMFS_SHARED_BLOB, Data);
+
+    AcquireSRWLockExclusive(&Table->Lock);
+
+    Table->References--;
+    if (0 == --Blob->RefCount)
+    {
+        for (PBlob = &Table->Buckets[Blob->Hash % Table->BucketCount]; Blob != *PBlob;
+            PBlob = &(*PBlob)->HashNext)
+            ;
+        *PBlob = Blob->HashNext;
+        Table->Count--;
+        Table->DataSize -= sizeof *Blob + Blob->Size;
+        free(Blob);
+    }
+
+    ReleaseSRWLockExclusive(&Table->Lock);
+}
+
+static inline
+VOID MemfsSharedBlobTableFinalize(MEMFS_SHARED_BLOB_TABLE *Table)
+{
+    /* free blobs still referenced by nodes that were removed but never closed */
+    for (ULONG I = 0; Table->BucketCount > I; I++)
+        for (MEMFS_SHARED_BLOB *Blob = Table->Buckets[I], *NextBlob; 0 != Blob; Blob = NextBlob)
+        {
+            NextBlob = Blob->HashNext;
+            free(Blob);
+        }
+    free(Table->Buckets);
+    memset(Table, 0, sizeof *Table);
+}
+
+/*
+ * The MEMFS namespace is a tree. Every directory indexes its children by name and every
+ * file indexes its named streams by stream name; nodes point back to their parent directory.
+ * Nodes store only their last path component, so lookups walk one index per path component
+ * and renaming a directory re-indexes a single node regardless of how many descendants it has.
+ *
+ * MEMFS does its own locking; it does not rely on the operation guard of the FSP_FILE_SYSTEM:
+ *
+ * - Lock protects the node's file information, data, security, reparse data and EA's.
+ *   Named streams keep their own size and data, but their remaining metadata lives in
+ *   (and is protected by the Lock of) their main file.
+ * - IndexLock protects the node's ChildIndex and StreamIndex, as well as the FileName and
+ *   ParentNode of the nodes in them. FileName and ParentNode also change only while the
+ *   node's own IndexLock is held exclusive. The ParentNode of a linked file or directory is
+ *   also changed only while its Lock is held exclusive, so that it can be followed while the
+ *   node's FileInfo is being changed.
+ * - The RenameLock of the MEMFS_FILE_NODE_MAP serializes renames (so that a rename can
+ *   check for cycles) and is held shared to construct a consistent full path for a node.
+ *
+ * Lookups acquire the IndexLock of each path component while holding the IndexLock of its
+ * parent (lock coupling) and return a referenced node, so they never hold more than two
+ * index locks and never block namespace changes in unrelated directories. Locks are acquired
+ * in the order: RenameLock, IndexLock (parent before child), Lock (named stream before main
+ * file). Reads and writes of different files therefore share no locks at all.
+ */
 typedef struct _MEMFS_FILE_NODE
 {
-    WCHAR FileName[MEMFS_MAX_PATH];
+    SRWLOCK Lock;
+    SRWLOCK IndexLock;
+    PWSTR FileName;                     /* last path component; stream name if named stream */
+    struct _MEMFS_FILE_NODE *ParentNode;/* directory (main file if stream); 0 if root or removed */
+    MEMFS_FILE_NODE_INDEX *ChildIndex;  /* directory children; created on first insert */
     FSP_FSCTL_FILE_INFO FileInfo;
-    SIZE_T FileSecuritySize;
-    PVOID FileSecurity;
-    PVOID FileData;
+    PVOID FileSecurity;                 /* shared blob */
+    FILE_DATA FileData;
 #if defined(MEMFS_REPARSE_POINTS)
-    SIZE_T ReparseDataSize;
-    PVOID ReparseData;
+    PVOID ReparseData;                  /* shared blob */
 #endif
 #if defined(MEMFS_EA)
-    MEMFS_FILE_NODE_EA_MAP *EaMap;
+    PVOID EaData;                       /* shared blob: FILE_FULL_EA_INFORMATION list sorted by name */
 #endif
     volatile LONG RefCount;
+    volatile LONG64 ChangeGeneration;   /* directory only; see MemfsFileNodeChanged */
 #if defined(MEMFS_NAMED_STREAMS)
-    struct _MEMFS_FILE_NODE *MainFileNode;
+    struct _MEMFS_FILE_NODE *MainFileNode;/* referenced by the named stream */
+    MEMFS_FILE_NODE_INDEX *StreamIndex; /* named streams; created on first insert */
 #endif
 } MEMFS_FILE_NODE;
 
-struct MEMFS_FILE_NODE_LESS
+typedef struct _MEMFS_FILE_NODE_MAP
 {
-    MEMFS_FILE_NODE_LESS(BOOLEAN CaseInsensitive) : CaseInsensitive(CaseInsensitive)
-    {
-    }
-    bool operator()(PWSTR a, PWSTR b) const
-    {
-        return 0 > MemfsFileNameCompare(a, -1, b, -1, CaseInsensitive);
-    }
+    MEMFS_FILE_NODE *RootNode;
+    volatile LONG Count;
     BOOLEAN CaseInsensitive;
-};
-typedef std::map<PWSTR, MEMFS_FILE_NODE *, MEMFS_FILE_NODE_LESS> MEMFS_FILE_NODE_MAP;
+    SRWLOCK RenameLock;
+    MEMFS_NAME_ARENA NameArena;
+    MEMFS_SHARED_BLOB_TABLE SecurityTable;
+#if defined(MEMFS_REPARSE_POINTS)
+    MEMFS_SHARED_BLOB_TABLE ReparseTable;
+#endif
+#if defined(MEMFS_EA)
+    MEMFS_SHARED_BLOB_TABLE EaTable;
+#endif
+} MEMFS_FILE_NODE_MAP;
 
 typedef struct _MEMFS
 {
@@ -334,16 +812,24 @@ typedef struct _MEMFS
     ULONG SlowioMaxDelay;
     ULONG SlowioPercentDelay;
     ULONG SlowioRarefyDelay;
-    volatile LONG SlowioThreadsRunning;
 #endif
+    BOOLEAN TransactBatch, WorkStealing, TransferBuffers, AdaptiveDispatcher, NumaAffinity;
+    SRWLOCK CreateLock;                 /* see MemfsEnterOperation */
+    SRWLOCK VolumeLock;
+    PVOID DirectorySnapshotCache;       /* see ReadDirectory */
+    volatile LONG64 DirectorySnapshotBuildCount;
     UINT16 VolumeLabelLength;
     WCHAR VolumeLabel[32];
 } MEMFS;
 
 static inline
-NTSTATUS MemfsFileNodeCreate(PWSTR FileName, MEMFS_FILE_NODE **PFileNode)
+VOID MemfsFileNodeDereference(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode);
+
+static inline
+NTSTATUS MemfsFileNodeCreate(MEMFS_FILE_NODE_MAP *FileNodeMap, PWSTR FileName,
+    MEMFS_FILE_NODE **PFileNode)
 {
-    static UINT64 IndexNumber = 1;
+    static volatile LONG64 IndexNumber = 0;
     MEMFS_FILE_NODE *FileNode;
 
     *PFileNode = 0;
@@ -353,12 +839,20 @@ NTSTATUS MemfsFileNodeCreate(PWSTR FileName, MEMFS_FILE_NODE **PFileNode)
         return STATUS_INSUFFICIENT_RESOURCES;
 
     memset(FileNode, 0, sizeof *FileNode);
-    wcscpy_s(FileNode->FileName, sizeof FileNode->FileName / sizeof(WCHAR), FileName);
+    InitializeSRWLock(&FileNode->Lock);
+    InitializeSRWLock(&FileNode->IndexLock);
+    FileNode->FileName = MemfsNameArenaAlloc(&FileNodeMap->NameArena, FileName);
+        /* caller ensures that FileName is a path component shorter than MEMFS_MAX_NAME */
+    if (0 == FileNode->FileName)
+    {
+        free(FileNode);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
     FileNode->FileInfo.CreationTime =
     FileNode->FileInfo.LastAccessTime =
     FileNode->FileInfo.LastWriteTime =
     FileNode->FileInfo.ChangeTime = MemfsGetSystemTime();
-    FileNode->FileInfo.IndexNumber = IndexNumber++;
+    FileNode->FileInfo.IndexNumber = InterlockedIncrement64(&IndexNumber);
 
     *PFileNode = FileNode;
 
@@ -367,31 +861,37 @@ NTSTATUS MemfsFileNodeCreate(PWSTR FileName, MEMFS_FILE_NODE **PFileNode)
 
 #if defined(MEMFS_EA)
 static inline
-VOID MemfsFileNodeDeleteEaMap(MEMFS_FILE_NODE *FileNode)
+VOID MemfsFileNodeDeleteEa(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode)
 {
-    if (0 != FileNode->EaMap)
+    if (0 != FileNode->EaData)
     {
-        for (MEMFS_FILE_NODE_EA_MAP::iterator p = FileNode->EaMap->begin(), q = FileNode->EaMap->end();
-            p != q; ++p)
-            free(p->second);
-        delete FileNode->EaMap;
-        FileNode->EaMap = 0;
+        MemfsSharedBlobRelease(&FileNodeMap->EaTable, FileNode->EaData);
+        FileNode->EaData = 0;
         FileNode->FileInfo.EaSize = 0;
     }
 }
 #endif
 
 static inline
-VOID MemfsFileNodeDelete(MEMFS_FILE_NODE *FileNode)
+VOID MemfsFileNodeDelete(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode)
 {
 #if defined(MEMFS_EA)
-    MemfsFileNodeDeleteEaMap(FileNode);
+    MemfsFileNodeDeleteEa(FileNodeMap, FileNode);
 #endif
 #if defined(MEMFS_REPARSE_POINTS)
-    free(FileNode->ReparseData);
+    MemfsSharedBlobRelease(&FileNodeMap->ReparseTable, FileNode->ReparseData);
+#endif
+    FileDataTruncate(&FileNode->FileData, 0);
+    MemfsSharedBlobRelease(&FileNodeMap->SecurityTable, FileNode->FileSecurity);
+#if defined(MEMFS_NAMED_STREAMS)
+    delete FileNode->StreamIndex;
+#endif
+    delete FileNode->ChildIndex;
+    MemfsNameArenaFree(&FileNodeMap->NameArena, FileNode->FileName);
+#if defined(MEMFS_NAMED_STREAMS)
+    if (0 != FileNode->MainFileNode)
+        MemfsFileNodeDereference(FileNodeMap, FileNode->MainFileNode);
 #endif
-    LargeHeapFree(FileNode->FileData);
-    free(FileNode->FileSecurity);
     free(FileNode);
 }
 
@@ -402,21 +902,24 @@ VOID MemfsFileNodeReference(MEMFS_FILE_NODE *FileNode)
 }
 
 static inline
-VOID MemfsFileNodeDereference(MEMFS_FILE_NODE *FileNode)
+VOID MemfsFileNodeDereference(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode)
 {
     if (0 == InterlockedDecrement(&FileNode->RefCount))
-        MemfsFileNodeDelete(FileNode);
+        MemfsFileNodeDelete(FileNodeMap, FileNode);
 }
 
 static inline
 VOID MemfsFileNodeGetFileInfo(MEMFS_FILE_NODE *FileNode, FSP_FSCTL_FILE_INFO *FileInfo)
 {
+    /* caller holds FileNode->Lock; for a named stream it must not hold the main file Lock */
 #if defined(MEMFS_NAMED_STREAMS)
     if (0 == FileNode->MainFileNode)
         *FileInfo = FileNode->FileInfo;
     else
     {
+        AcquireSRWLockShared(&FileNode->MainFileNode->Lock);
         *FileInfo = FileNode->MainFileNode->FileInfo;
+        ReleaseSRWLockShared(&FileNode->MainFileNode->Lock);
         FileInfo->FileAttributes &= ~FILE_ATTRIBUTE_DIRECTORY;
             /* named streams cannot be directories */
         FileInfo->AllocationSize = FileNode->FileInfo.AllocationSize;
@@ -429,27 +932,25 @@ VOID MemfsFileNodeGetFileInfo(MEMFS_FILE_NODE *FileNode, FSP_FSCTL_FILE_INFO *Fi
 
 #if defined(MEMFS_EA)
 static inline
-NTSTATUS MemfsFileNodeGetEaMap(MEMFS_FILE_NODE *FileNode, MEMFS_FILE_NODE_EA_MAP **PEaMap)
+PFILE_FULL_EA_INFORMATION MemfsFileNodeNextEa(PFILE_FULL_EA_INFORMATION Ea)
 {
-#if defined(MEMFS_NAMED_STREAMS)
-    if (0 != FileNode->MainFileNode)
-        FileNode = FileNode->MainFileNode;
-#endif
+    return 0 != Ea->NextEntryOffset ?
+        (PFILE_FULL_EA_INFORMATION)((PUINT8)Ea + Ea->NextEntryOffset) : 0;
+}
 
-    *PEaMap = FileNode->EaMap;
-    if (0 != *PEaMap)
-        return STATUS_SUCCESS;
+static inline
+VOID MemfsFileNodeAppendEa(PUINT8 *PBufferP, PFILE_FULL_EA_INFORMATION *PPrevEa,
+    PFILE_FULL_EA_INFORMATION Ea, ULONG EaLength)
+{
+    PFILE_FULL_EA_INFORMATION NewEa = (PFILE_FULL_EA_INFORMATION)*PBufferP;
 
-    try
-    {
-        *PEaMap = FileNode->EaMap = new MEMFS_FILE_NODE_EA_MAP(MEMFS_FILE_NODE_EA_LESS());
-        return STATUS_SUCCESS;
-    }
-    catch (...)
-    {
-        *PEaMap = 0;
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
+    if (0 != *PPrevEa)
+        (*PPrevEa)->NextEntryOffset = (ULONG)((PUINT8)NewEa - (PUINT8)*PPrevEa);
+    memcpy(NewEa, Ea, EaLength);
+    NewEa->NextEntryOffset = 0;
+
+    *PPrevEa = NewEa;
+    *PBufferP += FSP_FSCTL_ALIGN_UP(EaLength, sizeof(ULONG));
 }
 
 static inline
@@ -457,51 +958,74 @@ NTSTATUS MemfsFileNodeSetEa(
     FSP_FILE_SYSTEM *FileSystem, PVOID Context,
     PFILE_FULL_EA_INFORMATION Ea)
 {
+    /*
+     * Rebuild the (immutable) EA list with Ea added/replaced/removed and intern it.
+     * Caller holds the main file Lock exclusive (unless the node is not yet in the map).
+     */
+    MEMFS_FILE_NODE_MAP *FileNodeMap = ((MEMFS *)FileSystem->UserContext)->FileNodeMap;
     MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)Context;
-    MEMFS_FILE_NODE_EA_MAP *EaMap;
-    FILE_FULL_EA_INFORMATION *FileNodeEa = 0;
-    MEMFS_FILE_NODE_EA_MAP::iterator p;
+    MEMFS_FILE_NODE *MainFileNode = FileNode;
+    PFILE_FULL_EA_INFORMATION FileNodeEa, PrevEa = 0;
+    PUINT8 Buffer, BufferP;
+    ULONG EaLength, NewEaLength = 0;
     ULONG EaSizePlus = 0, EaSizeMinus = 0;
-    NTSTATUS Result;
+    BOOLEAN Inserted = FALSE;
+    PVOID EaData;
 
-    Result = MemfsFileNodeGetEaMap(FileNode, &EaMap);
-    if (!NT_SUCCESS(Result))
-        return Result;
+#if defined(MEMFS_NAMED_STREAMS)
+    if (0 != MainFileNode->MainFileNode)
+        MainFileNode = MainFileNode->MainFileNode;
+#endif
 
     if (0 != Ea->EaValueLength)
     {
-        EaSizePlus = FIELD_OFFSET(FILE_FULL_EA_INFORMATION, EaName) +
+        NewEaLength = FIELD_OFFSET(FILE_FULL_EA_INFORMATION, EaName) +
             Ea->EaNameLength + 1 + Ea->EaValueLength;
-        FileNodeEa = (FILE_FULL_EA_INFORMATION *)malloc(EaSizePlus);
-        if (0 == FileNodeEa)
-            return STATUS_INSUFFICIENT_RESOURCES;
-        memcpy(FileNodeEa, Ea, EaSizePlus);
-        FileNodeEa->NextEntryOffset = 0;
-
         EaSizePlus = FspFileSystemGetEaPackedSize(Ea);
     }
 
-    p = EaMap->find(Ea->EaName);
-    if (p != EaMap->end())
-    {
-        EaSizeMinus = FspFileSystemGetEaPackedSize(Ea);
-
-        free(p->second);
-        EaMap->erase(p);
-    }
+    Buffer = (PUINT8)malloc(MemfsSharedBlobSize(MainFileNode->EaData) +
+        FSP_FSCTL_ALIGN_UP(NewEaLength, sizeof(ULONG)) + 1);
+    if (0 == Buffer)
+        return STATUS_INSUFFICIENT_RESOURCES;
 
-    if (0 != Ea->EaValueLength)
+    BufferP = Buffer;
+    for (FileNodeEa = (PFILE_FULL_EA_INFORMATION)MainFileNode->EaData;
+        0 != FileNodeEa; FileNodeEa = MemfsFileNodeNextEa(FileNodeEa))
     {
-        try
+        int Cmp = MemfsEaNameCompare(FileNodeEa->EaName, Ea->EaName);
+        if (0 < Cmp && !Inserted)
         {
-            EaMap->insert(MEMFS_FILE_NODE_EA_MAP::value_type(FileNodeEa->EaName, FileNodeEa));
+            if (0 != NewEaLength)
+                MemfsFileNodeAppendEa(&BufferP, &PrevEa, Ea, NewEaLength);
+            Inserted = TRUE;
         }
-        catch (...)
+        if (0 == Cmp)
+        {
+            EaSizeMinus = FspFileSystemGetEaPackedSize(FileNodeEa);
+            continue;
+        }
+        EaLength = FIELD_OFFSET(FILE_FULL_EA_INFORMATION, EaName) +
+            FileNodeEa->EaNameLength + 1 + FileNodeEa->EaValueLength;
+        MemfsFileNodeAppendEa(&BufferP, &PrevEa, FileNodeEa, EaLength);
+    }
+    if (!Inserted && 0 != NewEaLength)
+        MemfsFileNodeAppendEa(&BufferP, &PrevEa, Ea, NewEaLength);
+
+    EaData = 0;
+    if (Buffer < BufferP)
+    {
+        EaData = MemfsSharedBlobIntern(&FileNodeMap->EaTable, Buffer, BufferP - Buffer);
+        if (0 == EaData)
         {
-            free(FileNodeEa);
+            free(Buffer);
             return STATUS_INSUFFICIENT_RESOURCES;
         }
     }
+    free(Buffer);
+
+    MemfsSharedBlobRelease(&FileNodeMap->EaTable, MainFileNode->EaData);
+    MainFileNode->EaData = EaData;
 
     FileNode->FileInfo.EaSize = FileNode->FileInfo.EaSize + EaSizePlus - EaSizeMinus;
 
@@ -516,13 +1040,10 @@ BOOLEAN MemfsFileNodeNeedEa(MEMFS_FILE_NODE *FileNode)
         FileNode = FileNode->MainFileNode;
 #endif
 
-    if (0 != FileNode->EaMap)
-    {
-        for (MEMFS_FILE_NODE_EA_MAP::iterator p = FileNode->EaMap->begin(), q = FileNode->EaMap->end();
-            p != q; ++p)
-            if (0 != (p->second->Flags & FILE_NEED_EA))
-                return TRUE;
-    }
+    for (PFILE_FULL_EA_INFORMATION Ea = (PFILE_FULL_EA_INFORMATION)FileNode->EaData;
+        0 != Ea; Ea = MemfsFileNodeNextEa(Ea))
+        if (0 != (Ea->Flags & FILE_NEED_EA))
+            return TRUE;
 
     return FALSE;
 }
@@ -536,74 +1057,302 @@ BOOLEAN MemfsFileNodeEnumerateEa(MEMFS_FILE_NODE *FileNode,
         FileNode = FileNode->MainFileNode;
 #endif
 
-    if (0 != FileNode->EaMap)
+    for (PFILE_FULL_EA_INFORMATION Ea = (PFILE_FULL_EA_INFORMATION)FileNode->EaData;
+        0 != Ea; Ea = MemfsFileNodeNextEa(Ea))
+        if (!EnumFn(Ea, Context))
+            return FALSE;
+
+    return TRUE;
+}
+#endif
+
+static inline
+BOOLEAN MemfsFileNodeIsStream(MEMFS_FILE_NODE *FileNode)
+{
+#if defined(MEMFS_NAMED_STREAMS)
+    return 0 != FileNode->MainFileNode;
+#else
+    return FALSE;
+#endif
+}
+
+static inline
+NTSTATUS MemfsFileNodeGetFileName(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode,
+    PWSTR FileName, SIZE_T FileNameCount)
+{
+    /*
+     * Reconstruct the full path from the node's ancestors (right to left). The RenameLock
+     * keeps the path consistent; the IndexLock of every node keeps its parent from going away.
+     */
+    WCHAR Buffer[MEMFS_MAX_PATH];
+    MEMFS_FILE_NODE *Node, *ParentNode;
+    SIZE_T Length, NameLength;
+    NTSTATUS Result = STATUS_SUCCESS;
+    PWSTR P;
+
+    P = Buffer + MEMFS_MAX_PATH;
+    *--P = L'\0';
+
+    AcquireSRWLockShared(&FileNodeMap->RenameLock);
+    MemfsFileNodeReference(FileNode);
+    for (Node = FileNode;; Node = ParentNode)
     {
-        for (MEMFS_FILE_NODE_EA_MAP::iterator p = FileNode->EaMap->begin(), q = FileNode->EaMap->end();
-            p != q; ++p)
-            if (!EnumFn(p->second, Context))
-                return FALSE;
+        AcquireSRWLockShared(&Node->IndexLock);
+        ParentNode = Node->ParentNode;
+        if (0 != ParentNode)
+        {
+            NameLength = wcslen(Node->FileName);
+            if ((SIZE_T)(P - Buffer) <= NameLength + 1)
+                Result = STATUS_OBJECT_NAME_INVALID;
+            else
+            {
+                P -= NameLength;
+                memcpy(P, Node->FileName, NameLength * sizeof(WCHAR));
+                *--P = MemfsFileNodeIsStream(Node) ? L':' : L'\\';
+                MemfsFileNodeReference(ParentNode);
+            }
+        }
+        ReleaseSRWLockShared(&Node->IndexLock);
+        MemfsFileNodeDereference(FileNodeMap, Node);
+
+        if (0 == ParentNode || !NT_SUCCESS(Result))
+            break;
     }
+    ReleaseSRWLockShared(&FileNodeMap->RenameLock);
 
-    return TRUE;
+    if (!NT_SUCCESS(Result))
+        return Result;
+
+    if (L'\0' == *P)
+        *--P = L'\\';
+    Length = Buffer + MEMFS_MAX_PATH - 1 - P;
+    if (FileNameCount <= Length)
+        return STATUS_OBJECT_NAME_INVALID;
+    memcpy(FileName, P, (Length + 1) * sizeof(WCHAR));
+
+    return STATUS_SUCCESS;
 }
+
+static inline
+VOID MemfsFileNodeMapDumpNode(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode)
+{
+    WCHAR FileName[MEMFS_MAX_PATH];
+
+    if (!NT_SUCCESS(MemfsFileNodeGetFileName(FileNodeMap, FileNode, FileName, MEMFS_MAX_PATH)))
+        wcscpy_s(FileName, MEMFS_MAX_PATH, FileNode->FileName);
+    FspDebugLog("%c %04lx %6lu %S\n",
+        FILE_ATTRIBUTE_DIRECTORY & FileNode->FileInfo.FileAttributes ? 'd' : 'f',
+        (ULONG)FileNode->FileInfo.FileAttributes,
+        (ULONG)FileNode->FileInfo.FileSize,
+        FileName);
+
+#if defined(MEMFS_NAMED_STREAMS)
+    if (0 != FileNode->StreamIndex)
+        for (MEMFS_FILE_NODE_INDEX::iterator p = FileNode->StreamIndex->begin(), q = FileNode->StreamIndex->end();
+            p != q; ++p)
+            MemfsFileNodeMapDumpNode(FileNodeMap, p->second);
 #endif
+    if (0 != FileNode->ChildIndex)
+        for (MEMFS_FILE_NODE_INDEX::iterator p = FileNode->ChildIndex->begin(), q = FileNode->ChildIndex->end();
+            p != q; ++p)
+            MemfsFileNodeMapDumpNode(FileNodeMap, p->second);
+}
 
 static inline
 VOID MemfsFileNodeMapDump(MEMFS_FILE_NODE_MAP *FileNodeMap)
 {
-    for (MEMFS_FILE_NODE_MAP::iterator p = FileNodeMap->begin(), q = FileNodeMap->end(); p != q; ++p)
-        FspDebugLog("%c %04lx %6lu %S\n",
-            FILE_ATTRIBUTE_DIRECTORY & p->second->FileInfo.FileAttributes ? 'd' : 'f',
-            (ULONG)p->second->FileInfo.FileAttributes,
-            (ULONG)p->second->FileInfo.FileSize,
-            p->second->FileName);
+    if (0 != FileNodeMap->RootNode)
+        MemfsFileNodeMapDumpNode(FileNodeMap, FileNodeMap->RootNode);
 }
 
 static inline
 BOOLEAN MemfsFileNodeMapIsCaseInsensitive(MEMFS_FILE_NODE_MAP *FileNodeMap)
 {
-    return FileNodeMap->key_comp().CaseInsensitive;
+    return FileNodeMap->CaseInsensitive;
 }
 
 static inline
 NTSTATUS MemfsFileNodeMapCreate(BOOLEAN CaseInsensitive, MEMFS_FILE_NODE_MAP **PFileNodeMap)
 {
+    MEMFS_FILE_NODE_MAP *FileNodeMap;
+
     *PFileNodeMap = 0;
-    try
-    {
-        *PFileNodeMap = new MEMFS_FILE_NODE_MAP(MEMFS_FILE_NODE_LESS(CaseInsensitive));
-        return STATUS_SUCCESS;
-    }
-    catch (...)
-    {
+
+    FileNodeMap = (MEMFS_FILE_NODE_MAP *)malloc(sizeof *FileNodeMap);
+    if (0 == FileNodeMap)
         return STATUS_INSUFFICIENT_RESOURCES;
-    }
+
+    memset(FileNodeMap, 0, sizeof *FileNodeMap);
+    FileNodeMap->CaseInsensitive = CaseInsensitive;
+    InitializeSRWLock(&FileNodeMap->RenameLock);
+    InitializeSRWLock(&FileNodeMap->NameArena.Lock);
+    InitializeSRWLock(&FileNodeMap->SecurityTable.Lock);
+#if defined(MEMFS_REPARSE_POINTS)
+    InitializeSRWLock(&FileNodeMap->ReparseTable.Lock);
+#endif
+#if defined(MEMFS_EA)
+    InitializeSRWLock(&FileNodeMap->EaTable.Lock);
+#endif
+
+    *PFileNodeMap = FileNodeMap;
+
+    return STATUS_SUCCESS;
+}
+
+static inline
+VOID MemfsFileNodeMapDeleteNode(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode)
+{
+#if defined(MEMFS_NAMED_STREAMS)
+    if (0 != FileNode->StreamIndex)
+        for (MEMFS_FILE_NODE_INDEX::iterator p = FileNode->StreamIndex->begin(), q = FileNode->StreamIndex->end();
+            p != q; ++p)
+            MemfsFileNodeMapDeleteNode(FileNodeMap, p->second);
+#endif
+    if (0 != FileNode->ChildIndex)
+        for (MEMFS_FILE_NODE_INDEX::iterator p = FileNode->ChildIndex->begin(), q = FileNode->ChildIndex->end();
+            p != q; ++p)
+            MemfsFileNodeMapDeleteNode(FileNodeMap, p->second);
+
+    MemfsFileNodeDelete(FileNodeMap, FileNode);
 }
 
 static inline
 VOID MemfsFileNodeMapDelete(MEMFS_FILE_NODE_MAP *FileNodeMap)
 {
-    for (MEMFS_FILE_NODE_MAP::iterator p = FileNodeMap->begin(), q = FileNodeMap->end(); p != q; ++p)
-        MemfsFileNodeDelete(p->second);
+    if (0 != FileNodeMap->RootNode)
+        MemfsFileNodeMapDeleteNode(FileNodeMap, FileNodeMap->RootNode);
 
-    delete FileNodeMap;
+#if defined(MEMFS_EA)
+    MemfsSharedBlobTableFinalize(&FileNodeMap->EaTable);
+#endif
+#if defined(MEMFS_REPARSE_POINTS)
+    MemfsSharedBlobTableFinalize(&FileNodeMap->ReparseTable);
+#endif
+    MemfsSharedBlobTableFinalize(&FileNodeMap->SecurityTable);
+    MemfsNameArenaFinalize(&FileNodeMap->NameArena);
+
+    free(FileNodeMap);
 }
 
 static inline
 SIZE_T MemfsFileNodeMapCount(MEMFS_FILE_NODE_MAP *FileNodeMap)
 {
-    return FileNodeMap->size();
+    return FileNodeMap->Count;
 }
 
 static inline
-MEMFS_FILE_NODE *MemfsFileNodeMapGet(MEMFS_FILE_NODE_MAP *FileNodeMap, PWSTR FileName)
+MEMFS_FILE_NODE *MemfsFileNodeIndexGet(MEMFS_FILE_NODE_INDEX *Index, PWSTR FileName)
 {
-    MEMFS_FILE_NODE_MAP::iterator iter = FileNodeMap->find(FileName);
-    if (iter == FileNodeMap->end())
+    if (0 == Index)
+        return 0;
+    MEMFS_FILE_NODE_INDEX::iterator iter = Index->find(FileName);
+    if (iter == Index->end())
         return 0;
     return iter->second;
 }
 
+static inline
+MEMFS_FILE_NODE *MemfsFileNodeMapLookup(MEMFS_FILE_NODE_MAP *FileNodeMap, PWSTR FileName0,
+    BOOLEAN Parent, PNTSTATUS PResult)
+{
+    /*
+     * Walk the tree one path component at a time. If Parent is TRUE stop at the directory
+     * that contains the last path component. The returned node is referenced.
+     */
+    MEMFS_FILE_NODE *FileNode = FileNodeMap->RootNode, *ChildNode;
+    WCHAR Name[MEMFS_MAX_PATH];
+    PWSTR Component;
+    ULONG Length, Index, ComponentLength;
+#if defined(MEMFS_NAMED_STREAMS)
+    ULONG StreamIndex;
+#endif
+    BOOLEAN IsDirectory;
+
+    Length = (ULONG)wcslen(FileName0);
+    if (MEMFS_MAX_PATH <= Length)
+    {
+        *PResult = STATUS_OBJECT_NAME_INVALID;
+        return 0;
+    }
+
+    AcquireSRWLockShared(&FileNode->IndexLock);
+    for (Index = 0; FspPathNextComponent(FileName0, Length, &Index, &Component, &ComponentLength);)
+    {
+        if (Parent && Length == Index)
+            break;
+
+        /* only the component is copied; the index is keyed by NUL-terminated names */
+        memcpy(Name, Component, ComponentLength * sizeof(WCHAR));
+        Name[ComponentLength] = L'\0';
+#if defined(MEMFS_NAMED_STREAMS)
+        StreamIndex = FspPathScan(Name, ComponentLength, L':', L':');
+        if (ComponentLength > StreamIndex)
+            Name[StreamIndex] = L'\0';
+        ChildNode = MemfsFileNodeIndexGet(FileNode->ChildIndex, Name);
+        if (0 != ChildNode && ComponentLength > StreamIndex)
+        {
+            AcquireSRWLockShared(&ChildNode->IndexLock);
+            ReleaseSRWLockShared(&FileNode->IndexLock);
+            FileNode = ChildNode;
+            ChildNode = MemfsFileNodeIndexGet(FileNode->StreamIndex, Name + StreamIndex + 1);
+        }
+#else
+        ChildNode = MemfsFileNodeIndexGet(FileNode->ChildIndex, Name);
+#endif
+
+        if (0 == ChildNode)
+        {
+            ReleaseSRWLockShared(&FileNode->IndexLock);
+            *PResult = Length == Index ? STATUS_OBJECT_NAME_NOT_FOUND : STATUS_OBJECT_PATH_NOT_FOUND;
+            return 0;
+        }
+
+        AcquireSRWLockShared(&ChildNode->IndexLock);
+        ReleaseSRWLockShared(&FileNode->IndexLock);
+        FileNode = ChildNode;
+    }
+
+    if (Parent)
+    {
+        AcquireSRWLockShared(&FileNode->Lock);
+        IsDirectory = 0 != (FileNode->FileInfo.FileAttributes & FILE_ATTRIBUTE_DIRECTORY);
+        ReleaseSRWLockShared(&FileNode->Lock);
+        if (!IsDirectory)
+        {
+            ReleaseSRWLockShared(&FileNode->IndexLock);
+            *PResult = STATUS_NOT_A_DIRECTORY;
+            return 0;
+        }
+    }
+
+    MemfsFileNodeReference(FileNode);
+    ReleaseSRWLockShared(&FileNode->IndexLock);
+
+    return FileNode;
+}
+
+static inline
+MEMFS_FILE_NODE *MemfsFileNodeMapGet(MEMFS_FILE_NODE_MAP *FileNodeMap, PWSTR FileName)
+{
+    NTSTATUS Result;
+    return MemfsFileNodeMapLookup(FileNodeMap, FileName, FALSE, &Result);
+}
+
+static inline
+MEMFS_FILE_NODE *MemfsFileNodeMapGetChild(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *ParentNode,
+    PWSTR FileName)
+{
+    MEMFS_FILE_NODE *FileNode;
+
+    AcquireSRWLockShared(&ParentNode->IndexLock);
+    FileNode = MemfsFileNodeIndexGet(ParentNode->ChildIndex, FileName);
+    if (0 != FileNode)
+        MemfsFileNodeReference(FileNode);
+    ReleaseSRWLockShared(&ParentNode->IndexLock);
+
+    return FileNode;
+}
+
 #if defined(MEMFS_NAMED_STREAMS)
 static inline
 MEMFS_FILE_NODE *MemfsFileNodeMapGetMain(MEMFS_FILE_NODE_MAP *FileNodeMap, PWSTR FileName0)
@@ -614,147 +1363,326 @@ MEMFS_FILE_NODE *MemfsFileNodeMapGetMain(MEMFS_FILE_NODE_MAP *FileNodeMap, PWSTR
     if (0 == StreamName)
         return 0;
     StreamName[0] = L'\0';
-    MEMFS_FILE_NODE_MAP::iterator iter = FileNodeMap->find(FileName);
-    if (iter == FileNodeMap->end())
-        return 0;
-    return iter->second;
+    return MemfsFileNodeMapGet(FileNodeMap, FileName);
 }
 #endif
 
 static inline
-MEMFS_FILE_NODE *MemfsFileNodeMapGetParent(MEMFS_FILE_NODE_MAP *FileNodeMap, PWSTR FileName0,
+MEMFS_FILE_NODE *MemfsFileNodeMapGetParent(MEMFS_FILE_NODE_MAP *FileNodeMap, PWSTR FileName,
     PNTSTATUS PResult)
 {
-    WCHAR Root[2] = L"\\";
-    PWSTR Remain, Suffix;
-    WCHAR FileName[MEMFS_MAX_PATH];
-    wcscpy_s(FileName, sizeof FileName / sizeof(WCHAR), FileName0);
-    FspPathSuffix(FileName, &Remain, &Suffix, Root);
-    MEMFS_FILE_NODE_MAP::iterator iter = FileNodeMap->find(Remain);
-    FspPathCombine(FileName, Suffix);
-    if (iter == FileNodeMap->end())
+    NTSTATUS Result;
+    MEMFS_FILE_NODE *ParentNode = MemfsFileNodeMapLookup(FileNodeMap, FileName, TRUE, &Result);
+    if (0 == ParentNode)
     {
-        *PResult = STATUS_OBJECT_PATH_NOT_FOUND;
+        *PResult = STATUS_NOT_A_DIRECTORY == Result || STATUS_OBJECT_NAME_INVALID == Result ?
+            Result : STATUS_OBJECT_PATH_NOT_FOUND;
         return 0;
     }
-    if (0 == (iter->second->FileInfo.FileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+    return ParentNode;
+}
+
+static inline
+VOID MemfsFileNodeChanged(MEMFS_FILE_NODE *FileNode)
+{
+    /*
+     * Called after the FileInfo of a node changes; caller holds FileNode->Lock exclusive,
+     * which keeps FileNode->ParentNode from being unlinked. The ChangeGeneration of the
+     * directory that lists the node moves on and snapshots of that directory taken before
+     * the change are no longer used (see ReadDirectory). Named streams are not listed.
+     */
+    if (!MemfsFileNodeIsStream(FileNode) && 0 != FileNode->ParentNode)
+        InterlockedIncrement64(&FileNode->ParentNode->ChangeGeneration);
+}
+
+static inline
+UINT64 MemfsFileNodeGeneration(MEMFS_FILE_NODE *FileNode)
+{
+    return InterlockedCompareExchange64(&FileNode->ChangeGeneration, 0, 0);
+}
+
+static inline
+VOID MemfsFileNodeMapTouchParent(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode)
+{
+    /* caller holds the IndexLock of FileNode->ParentNode */
+    MEMFS_FILE_NODE *Parent = FileNode->ParentNode;
+#if defined(MEMFS_NAMED_STREAMS)
+    if (0 != FileNode->MainFileNode && 0 != Parent)
+        Parent = Parent->ParentNode;
+#endif
+    if (0 != Parent)
     {
-        *PResult = STATUS_NOT_A_DIRECTORY;
-        return 0;
+        /* a name was inserted into or removed from Parent, whose times change as well */
+        InterlockedIncrement64(&Parent->ChangeGeneration);
+        AcquireSRWLockExclusive(&Parent->Lock);
+        Parent->FileInfo.LastAccessTime =
+        Parent->FileInfo.LastWriteTime =
+        Parent->FileInfo.ChangeTime = MemfsGetSystemTime();
+        MemfsFileNodeChanged(Parent);
+        ReleaseSRWLockExclusive(&Parent->Lock);
     }
-    return iter->second;
 }
 
 static inline
-VOID MemfsFileNodeMapTouchParent(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode)
+MEMFS_FILE_NODE_INDEX **MemfsFileNodeMapIndexOf(MEMFS_FILE_NODE *ParentNode, MEMFS_FILE_NODE *FileNode)
 {
-    NTSTATUS Result;
-    MEMFS_FILE_NODE *Parent;
-    if (L'\\' == FileNode->FileName[0] && L'\0' == FileNode->FileName[1])
-        return;
-    Parent = MemfsFileNodeMapGetParent(FileNodeMap, FileNode->FileName, &Result);
-    if (0 == Parent)
-        return;
-    Parent->FileInfo.LastAccessTime =
-    Parent->FileInfo.LastWriteTime =
-    Parent->FileInfo.ChangeTime = MemfsGetSystemTime();
+    /* the index that contains (or will contain) FileNode */
+#if defined(MEMFS_NAMED_STREAMS)
+    if (0 != FileNode->MainFileNode)
+        return &FileNode->MainFileNode->StreamIndex;
+#endif
+    return &ParentNode->ChildIndex;
+}
+
+static inline
+MEMFS_FILE_NODE *MemfsFileNodeMapParentOf(MEMFS_FILE_NODE *ParentNode, MEMFS_FILE_NODE *FileNode)
+{
+#if defined(MEMFS_NAMED_STREAMS)
+    if (0 != FileNode->MainFileNode)
+        return FileNode->MainFileNode;
+#endif
+    return ParentNode;
+}
+
+static inline
+BOOLEAN MemfsFileNodeMapIsLinked(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode)
+{
+    /* caller holds FileNode->IndexLock (or the IndexLock of its parent) */
+    return 0 != FileNode->ParentNode || FileNodeMap->RootNode == FileNode;
 }
 
 static inline
-NTSTATUS MemfsFileNodeMapInsert(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode,
-    PBOOLEAN PInserted)
+NTSTATUS MemfsFileNodeMapInsert(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *ParentNode,
+    MEMFS_FILE_NODE *FileNode, PBOOLEAN PInserted)
 {
+    MEMFS_FILE_NODE *IndexNode;
+    MEMFS_FILE_NODE_INDEX **PIndex;
+    NTSTATUS Result;
+
     *PInserted = 0;
+
+    if (0 == ParentNode)
+    {
+        /* root directory */
+        if (0 == FileNodeMap->RootNode)
+        {
+            FileNodeMap->RootNode = FileNode;
+            InterlockedIncrement(&FileNodeMap->Count);
+            MemfsFileNodeReference(FileNode);
+            *PInserted = 1;
+        }
+        return STATUS_SUCCESS;
+    }
+
+    IndexNode = MemfsFileNodeMapParentOf(ParentNode, FileNode);
+    PIndex = MemfsFileNodeMapIndexOf(ParentNode, FileNode);
+
+    AcquireSRWLockExclusive(&IndexNode->IndexLock);
+
+    /* the parent directory (or main file) may have been removed since it was looked up */
+    if (!MemfsFileNodeMapIsLinked(FileNodeMap, IndexNode))
+    {
+        Result = IndexNode != ParentNode ? STATUS_OBJECT_NAME_NOT_FOUND : STATUS_OBJECT_PATH_NOT_FOUND;
+        goto exit;
+    }
+
     try
     {
-        *PInserted = FileNodeMap->insert(MEMFS_FILE_NODE_MAP::value_type(FileNode->FileName, FileNode)).second;
+        if (0 == *PIndex)
+            *PIndex = new MEMFS_FILE_NODE_INDEX(MEMFS_FILE_NODE_LESS(FileNodeMap->CaseInsensitive));
+        *PInserted = (*PIndex)->insert(MEMFS_FILE_NODE_INDEX::value_type(FileNode->FileName, FileNode)).second;
         if (*PInserted)
         {
+            FileNode->ParentNode = IndexNode;
+            InterlockedIncrement(&FileNodeMap->Count);
             MemfsFileNodeReference(FileNode);
             MemfsFileNodeMapTouchParent(FileNodeMap, FileNode);
         }
-        return STATUS_SUCCESS;
+        Result = STATUS_SUCCESS;
     }
     catch (...)
     {
-        return STATUS_INSUFFICIENT_RESOURCES;
+        Result = STATUS_INSUFFICIENT_RESOURCES;
     }
+
+exit:
+    ReleaseSRWLockExclusive(&IndexNode->IndexLock);
+
+    return Result;
 }
 
 static inline
-VOID MemfsFileNodeMapRemove(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode)
+BOOLEAN MemfsFileNodeMapUnlink(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode)
 {
-    if (FileNodeMap->erase(FileNode->FileName))
+    /*
+     * Remove FileNode (and its named streams) from its parent's index, unless it is a
+     * non-empty directory. Caller holds the IndexLock of FileNode->ParentNode exclusive.
+     */
+    MEMFS_FILE_NODE_INDEX *Index = *MemfsFileNodeMapIndexOf(FileNode->ParentNode, FileNode);
+
+    AcquireSRWLockExclusive(&FileNode->IndexLock);
+
+    if (0 != FileNode->ChildIndex && !FileNode->ChildIndex->empty())
     {
-        MemfsFileNodeMapTouchParent(FileNodeMap, FileNode);
-        MemfsFileNodeDereference(FileNode);
+        ReleaseSRWLockExclusive(&FileNode->IndexLock);
+        return FALSE;
     }
+
+#if defined(MEMFS_NAMED_STREAMS)
+    if (0 != FileNode->StreamIndex)
+    {
+        for (MEMFS_FILE_NODE_INDEX::iterator p = FileNode->StreamIndex->begin(), q = FileNode->StreamIndex->end();
+            p != q; ++p)
+        {
+            p->second->ParentNode = 0;
+            InterlockedDecrement(&FileNodeMap->Count);
+            MemfsFileNodeDereference(FileNodeMap, p->second);
+        }
+        FileNode->StreamIndex->clear();
+    }
+#endif
+
+    Index->erase(FileNode->FileName);
+    MemfsFileNodeMapTouchParent(FileNodeMap, FileNode);
+    AcquireSRWLockExclusive(&FileNode->Lock);
+    FileNode->ParentNode = 0;
+    ReleaseSRWLockExclusive(&FileNode->Lock);
+
+    ReleaseSRWLockExclusive(&FileNode->IndexLock);
+
+    InterlockedDecrement(&FileNodeMap->Count);
+    MemfsFileNodeDereference(FileNodeMap, FileNode);
+
+    return TRUE;
 }
 
 static inline
-BOOLEAN MemfsFileNodeMapHasChild(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode)
+VOID MemfsFileNodeMapRemove(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode)
 {
-    BOOLEAN Result = FALSE;
-    WCHAR Root[2] = L"\\";
-    PWSTR Remain, Suffix;
-    MEMFS_FILE_NODE_MAP::iterator iter = FileNodeMap->upper_bound(FileNode->FileName);
-    for (; FileNodeMap->end() != iter; ++iter)
+    MEMFS_FILE_NODE *ParentNode;
+
+    /* FileNode->IndexLock keeps ParentNode in the map while we reference it */
+    AcquireSRWLockShared(&FileNode->IndexLock);
+    ParentNode = FileNode->ParentNode;
+    if (0 != ParentNode)
+        MemfsFileNodeReference(ParentNode);
+    ReleaseSRWLockShared(&FileNode->IndexLock);
+
+    if (0 == ParentNode)
+        return;
+
+    AcquireSRWLockExclusive(&ParentNode->IndexLock);
+    if (ParentNode == FileNode->ParentNode)
+        MemfsFileNodeMapUnlink(FileNodeMap, FileNode);
+    ReleaseSRWLockExclusive(&ParentNode->IndexLock);
+
+    MemfsFileNodeDereference(FileNodeMap, ParentNode);
+}
+
+static inline
+NTSTATUS MemfsFileNodeMapMove(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode,
+    MEMFS_FILE_NODE *NewParentNode, PWSTR NewFileName)
+{
+    /*
+     * Descendants are unaffected: only FileNode itself is re-indexed. Caller holds the
+     * RenameLock and the IndexLock's of FileNode->ParentNode and NewParentNode exclusive.
+     */
+    MEMFS_FILE_NODE *ParentNode = FileNode->ParentNode;
+    PWSTR FileName, NewName;
+
+    assert(0 != ParentNode && !MemfsFileNodeIsStream(FileNode));
+    assert(MEMFS_MAX_NAME > wcslen(NewFileName));
+
+    NewName = MemfsNameArenaAlloc(&FileNodeMap->NameArena, NewFileName);
+    if (0 == NewName)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    try
     {
-#if defined(MEMFS_NAMED_STREAMS)
-        if (0 != wcschr(iter->second->FileName, L':'))
-            continue;
-#endif
-        FspPathSuffix(iter->second->FileName, &Remain, &Suffix, Root);
-        Result = 0 == MemfsFileNameCompare(Remain, -1, FileNode->FileName, -1,
-            MemfsFileNodeMapIsCaseInsensitive(FileNodeMap));
-        FspPathCombine(iter->second->FileName, Suffix);
-        break;
+        if (0 == NewParentNode->ChildIndex)
+            NewParentNode->ChildIndex = new MEMFS_FILE_NODE_INDEX(
+                MEMFS_FILE_NODE_LESS(FileNodeMap->CaseInsensitive));
     }
-    return Result;
+    catch (...)
+    {
+        MemfsNameArenaFree(&FileNodeMap->NameArena, NewName);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    AcquireSRWLockExclusive(&FileNode->IndexLock);
+
+    ParentNode->ChildIndex->erase(FileNode->FileName);
+    MemfsFileNodeMapTouchParent(FileNodeMap, FileNode);
+
+    FileName = FileNode->FileName;
+    FileNode->FileName = NewName;
+    try
+    {
+        NewParentNode->ChildIndex->insert(MEMFS_FILE_NODE_INDEX::value_type(FileNode->FileName, FileNode));
+    }
+    catch (...)
+    {
+        FileNode->FileName = FileName;
+        MemfsNameArenaFree(&FileNodeMap->NameArena, NewName);
+        try
+        {
+            ParentNode->ChildIndex->insert(MEMFS_FILE_NODE_INDEX::value_type(FileNode->FileName, FileNode));
+        }
+        catch (...)
+        {
+            FspDebugLog(__FUNCTION__ ": cannot insert into FileNodeMap; aborting\n");
+            abort();
+        }
+        ReleaseSRWLockExclusive(&FileNode->IndexLock);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    MemfsNameArenaFree(&FileNodeMap->NameArena, FileName);
+
+    AcquireSRWLockExclusive(&FileNode->Lock);
+    FileNode->ParentNode = NewParentNode;
+    ReleaseSRWLockExclusive(&FileNode->Lock);
+    MemfsFileNodeMapTouchParent(FileNodeMap, FileNode);
+
+    ReleaseSRWLockExclusive(&FileNode->IndexLock);
+
+    return STATUS_SUCCESS;
+}
+
+static inline
+BOOLEAN MemfsFileNodeMapHasChild(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode)
+{
+    /* caller holds FileNode->IndexLock */
+    return 0 != FileNode->ChildIndex && !FileNode->ChildIndex->empty();
 }
 
 static inline
 BOOLEAN MemfsFileNodeMapEnumerateChildren(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode,
     PWSTR PrevFileName0, BOOLEAN (*EnumFn)(MEMFS_FILE_NODE *, PVOID), PVOID Context)
 {
-    WCHAR Root[2] = L"\\";
-    PWSTR Remain, Suffix;
-    MEMFS_FILE_NODE_MAP::iterator iter;
-    BOOLEAN IsDirectoryChild;
-    if (0 != PrevFileName0)
-    {
-        WCHAR PrevFileName[MEMFS_MAX_PATH + 256];
-        size_t Length0 = wcslen(FileNode->FileName);
-        size_t Length1 = 1 != Length0 || L'\\' != FileNode->FileName[0];
-        size_t Length2 = wcslen(PrevFileName0);
-        assert(MEMFS_MAX_PATH + 256 > Length0 + Length1 + Length2);
-        memcpy(PrevFileName, FileNode->FileName, Length0 * sizeof(WCHAR));
-        memcpy(PrevFileName + Length0, L"\\", Length1 * sizeof(WCHAR));
-        memcpy(PrevFileName + Length0 + Length1, PrevFileName0, Length2 * sizeof(WCHAR));
-        PrevFileName[Length0 + Length1 + Length2] = L'\0';
-        iter = FileNodeMap->upper_bound(PrevFileName);
-    }
-    else
-        iter = FileNodeMap->upper_bound(FileNode->FileName);
-    for (; FileNodeMap->end() != iter; ++iter)
+    /* EnumFn is called with FileNode->IndexLock held shared */
+    MEMFS_FILE_NODE_INDEX::iterator iter;
+    BOOLEAN Result = TRUE;
+
+    AcquireSRWLockShared(&FileNode->IndexLock);
+    if (0 != FileNode->ChildIndex)
     {
-        if (!MemfsFileNameHasPrefix(iter->second->FileName, FileNode->FileName,
-            MemfsFileNodeMapIsCaseInsensitive(FileNodeMap)))
-            break;
-        FspPathSuffix(iter->second->FileName, &Remain, &Suffix, Root);
-        IsDirectoryChild = 0 == MemfsFileNameCompare(Remain, -1, FileNode->FileName, -1,
-            MemfsFileNodeMapIsCaseInsensitive(FileNodeMap));
-#if defined(MEMFS_NAMED_STREAMS)
-        IsDirectoryChild = IsDirectoryChild && 0 == wcschr(Suffix, L':');
-#endif
-        FspPathCombine(iter->second->FileName, Suffix);
-        if (IsDirectoryChild)
+        if (0 != PrevFileName0)
+            iter = FileNode->ChildIndex->upper_bound(PrevFileName0);
+        else
+            iter = FileNode->ChildIndex->begin();
+        for (; FileNode->ChildIndex->end() != iter; ++iter)
         {
             if (!EnumFn(iter->second, Context))
-                return FALSE;
+            {
+                Result = FALSE;
+                break;
+            }
         }
     }
-    return TRUE;
+    ReleaseSRWLockShared(&FileNode->IndexLock);
+
+    return Result;
 }
 
 #if defined(MEMFS_NAMED_STREAMS)
@@ -762,37 +1690,27 @@ static inline
 BOOLEAN MemfsFileNodeMapEnumerateNamedStreams(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode,
     BOOLEAN (*EnumFn)(MEMFS_FILE_NODE *, PVOID), PVOID Context)
 {
-    MEMFS_FILE_NODE_MAP::iterator iter = FileNodeMap->upper_bound(FileNode->FileName);
-    for (; FileNodeMap->end() != iter; ++iter)
-    {
-        if (!MemfsFileNameHasPrefix(iter->second->FileName, FileNode->FileName,
-            MemfsFileNodeMapIsCaseInsensitive(FileNodeMap)))
-            break;
-        if (L':' != iter->second->FileName[wcslen(FileNode->FileName)])
-            break;
-        if (!EnumFn(iter->second, Context))
-            return FALSE;
-    }
-    return TRUE;
-}
-#endif
+    /* EnumFn is called with FileNode->IndexLock held shared */
+    BOOLEAN Result = TRUE;
 
-static inline
-BOOLEAN MemfsFileNodeMapEnumerateDescendants(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode,
-    BOOLEAN (*EnumFn)(MEMFS_FILE_NODE *, PVOID), PVOID Context)
-{
-    WCHAR Root[2] = L"\\";
-    MEMFS_FILE_NODE_MAP::iterator iter = FileNodeMap->lower_bound(FileNode->FileName);
-    for (; FileNodeMap->end() != iter; ++iter)
+    AcquireSRWLockShared(&FileNode->IndexLock);
+    if (0 != FileNode->StreamIndex)
     {
-        if (!MemfsFileNameHasPrefix(iter->second->FileName, FileNode->FileName,
-            MemfsFileNodeMapIsCaseInsensitive(FileNodeMap)))
-            break;
-        if (!EnumFn(iter->second, Context))
-            return FALSE;
+        for (MEMFS_FILE_NODE_INDEX::iterator iter = FileNode->StreamIndex->begin();
+            FileNode->StreamIndex->end() != iter; ++iter)
+        {
+            if (!EnumFn(iter->second, Context))
+            {
+                Result = FALSE;
+                break;
+            }
+        }
     }
-    return TRUE;
+    ReleaseSRWLockShared(&FileNode->IndexLock);
+
+    return Result;
 }
+#endif
 
 typedef struct _MEMFS_FILE_NODE_MAP_ENUM_CONTEXT
 {
@@ -828,19 +1746,60 @@ BOOLEAN MemfsFileNodeMapEnumerateFn(MEMFS_FILE_NODE *FileNode, PVOID Context0)
 }
 
 static inline
-VOID MemfsFileNodeMapEnumerateFree(MEMFS_FILE_NODE_MAP_ENUM_CONTEXT *Context)
+VOID MemfsFileNodeMapEnumerateFree(MEMFS_FILE_NODE_MAP *FileNodeMap,
+    MEMFS_FILE_NODE_MAP_ENUM_CONTEXT *Context)
 {
     if (Context->Reference)
     {
         for (ULONG Index = 0; Context->Count > Index; Index++)
         {
             MEMFS_FILE_NODE *FileNode = Context->FileNodes[Index];
-            MemfsFileNodeDereference(FileNode);
+            MemfsFileNodeDereference(FileNodeMap, FileNode);
         }
     }
     free(Context->FileNodes);
 }
 
+static inline
+UINT64 MemfsFileNodeMapPageCountNode(MEMFS_FILE_NODE *FileNode)
+{
+    UINT64 PageCount;
+
+    AcquireSRWLockShared(&FileNode->IndexLock);
+
+    AcquireSRWLockShared(&FileNode->Lock);
+    PageCount = FileNode->FileData.PageCount;
+    ReleaseSRWLockShared(&FileNode->Lock);
+
+#if defined(MEMFS_NAMED_STREAMS)
+    if (0 != FileNode->StreamIndex)
+        for (MEMFS_FILE_NODE_INDEX::iterator p = FileNode->StreamIndex->begin(), q = FileNode->StreamIndex->end();
+            p != q; ++p)
+            PageCount += MemfsFileNodeMapPageCountNode(p->second);
+#endif
+    if (0 != FileNode->ChildIndex)
+        for (MEMFS_FILE_NODE_INDEX::iterator p = FileNode->ChildIndex->begin(), q = FileNode->ChildIndex->end();
+            p != q; ++p)
+            PageCount += MemfsFileNodeMapPageCountNode(p->second);
+
+    ReleaseSRWLockShared(&FileNode->IndexLock);
+
+    return PageCount;
+}
+
+static inline
+UINT64 MemfsFileNodeMapPageCount(MEMFS_FILE_NODE_MAP *FileNodeMap)
+{
+    UINT64 PageCount;
+
+    /* walks the whole tree; the RenameLock keeps nodes from moving under the walk */
+    AcquireSRWLockShared(&FileNodeMap->RenameLock);
+    PageCount = MemfsFileNodeMapPageCountNode(FileNodeMap->RootNode);
+    ReleaseSRWLockShared(&FileNodeMap->RenameLock);
+
+    return PageCount;
+}
+
 #ifdef MEMFS_SLOWIO
 /*
  * SLOWIO
@@ -878,86 +1837,133 @@ static inline BOOLEAN SlowioReturnPending(FSP_FILE_SYSTEM *FileSystem)
     return PseudoRandom(100) < Memfs->SlowioPercentDelay;
 }
 
-static inline VOID SlowioSnooze(FSP_FILE_SYSTEM *FileSystem)
+static inline ULONG SlowioDelay(FSP_FILE_SYSTEM *FileSystem)
 {
     MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
     if (0 == Memfs->SlowioMaxDelay)
-        return;
-    ULONG millis = PseudoRandom(Memfs->SlowioMaxDelay + 1) >> PseudoRandom(Memfs->SlowioRarefyDelay + 1);
-    Sleep(millis);
+        return 0;
+    return PseudoRandom(Memfs->SlowioMaxDelay + 1) >> PseudoRandom(Memfs->SlowioRarefyDelay + 1);
+}
+
+static inline VOID SlowioSnooze(FSP_FILE_SYSTEM *FileSystem)
+{
+    ULONG millis = SlowioDelay(FileSystem);
+    if (0 != millis)
+        Sleep(millis);
 }
 
-void SlowioReadThread(
+typedef struct _SLOWIO_CONTEXT
+{
+    MEMFS_FILE_NODE *FileNode;
+    PVOID Buffer;
+    UINT64 Offset;
+    UINT64 EndOffset;
+} SLOWIO_CONTEXT;
+
+static BOOLEAN SlowioPost(
     FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_ASYNC_ROUTINE *Routine,
     MEMFS_FILE_NODE *FileNode,
-    PVOID Buffer, 
-    UINT64 Offset, 
-    UINT64 EndOffset,
-    UINT64 RequestHint)
+    PVOID Buffer,
+    UINT64 Offset,
+    UINT64 EndOffset)
 {
-    SlowioSnooze(FileSystem);
+    /*
+     * Capture the request in an async context and post a routine to complete it
+     * after a delay. The routine runs on the (bounded) async thread pool.
+     */
+    FSP_FILE_SYSTEM_ASYNC_CONTEXT *AsyncContext;
+    SLOWIO_CONTEXT *Context;
 
-    memcpy(Buffer, (PUINT8)FileNode->FileData + Offset, (size_t)(EndOffset - Offset));
-    UINT32 BytesTransferred = (ULONG)(EndOffset - Offset);
+    Context = (SLOWIO_CONTEXT *)malloc(sizeof *Context);
+    if (0 == Context)
+        return FALSE;
+    Context->FileNode = FileNode;
+    Context->Buffer = Buffer;
+    Context->Offset = Offset;
+    Context->EndOffset = EndOffset;
+
+    if (!NT_SUCCESS(FspFileSystemAsyncBegin(FileSystem, 0, &AsyncContext)))
+    {
+        free(Context);
+        return FALSE;
+    }
 
-    FSP_FSCTL_TRANSACT_RSP ResponseBuf;
-    memset(&ResponseBuf, 0, sizeof ResponseBuf);
-    ResponseBuf.Size = sizeof ResponseBuf;
-    ResponseBuf.Kind = FspFsctlTransactReadKind;
-    ResponseBuf.Hint = RequestHint;                         // IRP that is being completed
-    ResponseBuf.IoStatus.Status = STATUS_SUCCESS;
-    ResponseBuf.IoStatus.Information = BytesTransferred;    // bytes read
-    FspFileSystemSendResponse(FileSystem, &ResponseBuf);
+    if (!NT_SUCCESS(FspFileSystemAsyncPost(AsyncContext,
+        SlowioDelay(FileSystem), Routine, Context)))
+    {
+        /* cannot return STATUS_PENDING any more; complete the request synchronously */
+        FspFileSystemAsyncClaim(AsyncContext);
+        Routine(FileSystem, AsyncContext, Context, FALSE);
+    }
 
-    MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
-    InterlockedDecrement(&Memfs->SlowioThreadsRunning);
+    return TRUE;
 }
 
-void SlowioWriteThread(
+static VOID SlowioReadRoutine(
     FSP_FILE_SYSTEM *FileSystem,
-    MEMFS_FILE_NODE *FileNode,
-    PVOID Buffer, 
-    UINT64 Offset, 
-    UINT64 EndOffset,
-    UINT64 RequestHint)
+    FSP_FILE_SYSTEM_ASYNC_CONTEXT *AsyncContext,
+    PVOID Context0,
+    BOOLEAN Cancelled)
 {
-    SlowioSnooze(FileSystem);
+    SLOWIO_CONTEXT *Context = (SLOWIO_CONTEXT *)Context0;
+    UINT32 BytesTransferred = 0;
 
-    memcpy((PUINT8)FileNode->FileData + Offset, Buffer, (size_t)(EndOffset - Offset));
-    UINT32 BytesTransferred = (ULONG)(EndOffset - Offset);
+    if (!Cancelled)
+    {
+        AcquireSRWLockShared(&Context->FileNode->Lock);
+        FileDataRead(&Context->FileNode->FileData, Context->Offset, Context->Buffer,
+            (size_t)(Context->EndOffset - Context->Offset));
+        ReleaseSRWLockShared(&Context->FileNode->Lock);
+        BytesTransferred = (ULONG)(Context->EndOffset - Context->Offset);
+    }
 
-    FSP_FSCTL_TRANSACT_RSP ResponseBuf;
-    memset(&ResponseBuf, 0, sizeof ResponseBuf);
-    ResponseBuf.Size = sizeof ResponseBuf;
-    ResponseBuf.Kind = FspFsctlTransactWriteKind;
-    ResponseBuf.Hint = RequestHint;                         // IRP that is being completed
-    ResponseBuf.IoStatus.Status = STATUS_SUCCESS;
-    ResponseBuf.IoStatus.Information = BytesTransferred;    // bytes written
-    MemfsFileNodeGetFileInfo(FileNode, &ResponseBuf.Rsp.Write.FileInfo);
-    FspFileSystemSendResponse(FileSystem, &ResponseBuf);
+    FspFileSystemAsyncCompleteRead(AsyncContext, STATUS_SUCCESS, BytesTransferred);
 
-    MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
-    InterlockedDecrement(&Memfs->SlowioThreadsRunning);
+    free(Context);
 }
 
-void SlowioReadDirectoryThread(
+static VOID SlowioWriteRoutine(
     FSP_FILE_SYSTEM *FileSystem,
-    ULONG BytesTransferred,
-    UINT64 RequestHint)
+    FSP_FILE_SYSTEM_ASYNC_CONTEXT *AsyncContext,
+    PVOID Context0,
+    BOOLEAN Cancelled)
 {
-    SlowioSnooze(FileSystem);
+    SLOWIO_CONTEXT *Context = (SLOWIO_CONTEXT *)Context0;
+    NTSTATUS Result = STATUS_SUCCESS;
+    UINT32 BytesTransferred = 0;
+    FSP_FSCTL_FILE_INFO FileInfo;
 
-    FSP_FSCTL_TRANSACT_RSP ResponseBuf;
-    memset(&ResponseBuf, 0, sizeof ResponseBuf);
-    ResponseBuf.Size = sizeof ResponseBuf;
-    ResponseBuf.Kind = FspFsctlTransactQueryDirectoryKind;
-    ResponseBuf.Hint = RequestHint;                         // IRP that is being completed
-    ResponseBuf.IoStatus.Status = STATUS_SUCCESS;
-    ResponseBuf.IoStatus.Information = BytesTransferred;    // bytes of directory info read
-    FspFileSystemSendResponse(FileSystem, &ResponseBuf);
+    AcquireSRWLockExclusive(&Context->FileNode->Lock);
+    if (!Cancelled)
+    {
+        if (FileDataWrite(&Context->FileNode->FileData, Context->Offset, Context->Buffer,
+            (size_t)(Context->EndOffset - Context->Offset)))
+            BytesTransferred = (ULONG)(Context->EndOffset - Context->Offset);
+        else
+            Result = STATUS_INSUFFICIENT_RESOURCES;
+    }
+    MemfsFileNodeGetFileInfo(Context->FileNode, &FileInfo);
+    ReleaseSRWLockExclusive(&Context->FileNode->Lock);
 
-    MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
-    InterlockedDecrement(&Memfs->SlowioThreadsRunning);
+    FspFileSystemAsyncCompleteWrite(AsyncContext, Result, BytesTransferred, &FileInfo);
+
+    free(Context);
+}
+
+static VOID SlowioReadDirectoryRoutine(
+    FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_ASYNC_CONTEXT *AsyncContext,
+    PVOID Context0,
+    BOOLEAN Cancelled)
+{
+    SLOWIO_CONTEXT *Context = (SLOWIO_CONTEXT *)Context0;
+
+    /* the directory buffer has already been filled; EndOffset is the bytes transferred */
+    FspFileSystemAsyncCompleteReadDirectory(AsyncContext, STATUS_SUCCESS,
+        (ULONG)Context->EndOffset);
+
+    free(Context);
 }
 #endif
 
@@ -974,6 +1980,9 @@ static NTSTATUS GetReparsePointByName(
 static NTSTATUS SetFileSizeInternal(FSP_FILE_SYSTEM *FileSystem,
     PVOID FileNode0, UINT64 NewSize, BOOLEAN SetAllocationSize);
 
+static VOID SetNormalizedName(MEMFS *Memfs, MEMFS_FILE_NODE *FileNode,
+    FSP_FSCTL_FILE_INFO *FileInfo);
+
 static NTSTATUS GetVolumeInfo(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_VOLUME_INFO *VolumeInfo)
 {
@@ -982,8 +1991,10 @@ static NTSTATUS GetVolumeInfo(FSP_FILE_SYSTEM *FileSystem,
     VolumeInfo->TotalSize = Memfs->MaxFileNodes * (UINT64)Memfs->MaxFileSize;
     VolumeInfo->FreeSize = (Memfs->MaxFileNodes - MemfsFileNodeMapCount(Memfs->FileNodeMap)) *
         (UINT64)Memfs->MaxFileSize;
+    AcquireSRWLockShared(&Memfs->VolumeLock);
     VolumeInfo->VolumeLabelLength = Memfs->VolumeLabelLength;
     memcpy(VolumeInfo->VolumeLabel, Memfs->VolumeLabel, Memfs->VolumeLabelLength);
+    ReleaseSRWLockShared(&Memfs->VolumeLock);
 
     return STATUS_SUCCESS;
 }
@@ -994,6 +2005,7 @@ static NTSTATUS SetVolumeLabel(FSP_FILE_SYSTEM *FileSystem,
 {
     MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
 
+    AcquireSRWLockExclusive(&Memfs->VolumeLock);
     Memfs->VolumeLabelLength = (UINT16)(wcslen(VolumeLabel) * sizeof(WCHAR));
     if (Memfs->VolumeLabelLength > sizeof Memfs->VolumeLabel)
         Memfs->VolumeLabelLength = sizeof Memfs->VolumeLabel;
@@ -1004,6 +2016,7 @@ static NTSTATUS SetVolumeLabel(FSP_FILE_SYSTEM *FileSystem,
         (Memfs->MaxFileNodes - MemfsFileNodeMapCount(Memfs->FileNodeMap)) * Memfs->MaxFileSize;
     VolumeInfo->VolumeLabelLength = Memfs->VolumeLabelLength;
     memcpy(VolumeInfo->VolumeLabel, Memfs->VolumeLabel, Memfs->VolumeLabelLength);
+    ReleaseSRWLockExclusive(&Memfs->VolumeLock);
 
     return STATUS_SUCCESS;
 }
@@ -1013,7 +2026,7 @@ static NTSTATUS GetSecurityByName(FSP_FILE_SYSTEM *FileSystem,
     PSECURITY_DESCRIPTOR SecurityDescriptor, SIZE_T *PSecurityDescriptorSize)
 {
     MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
-    MEMFS_FILE_NODE *FileNode;
+    MEMFS_FILE_NODE *FileNode, *MainFileNode;
     NTSTATUS Result;
 
     FileNode = MemfsFileNodeMapGet(Memfs->FileNodeMap, FileName);
@@ -1027,40 +2040,52 @@ static NTSTATUS GetSecurityByName(FSP_FILE_SYSTEM *FileSystem,
             Result = STATUS_REPARSE;
         else
 #endif
-            MemfsFileNodeMapGetParent(Memfs->FileNodeMap, FileName, &Result);
+        {
+            MEMFS_FILE_NODE *ParentNode = MemfsFileNodeMapGetParent(Memfs->FileNodeMap, FileName, &Result);
+            if (0 != ParentNode)
+                MemfsFileNodeDereference(Memfs->FileNodeMap, ParentNode);
+        }
 
         return Result;
     }
 
+    MainFileNode = FileNode;
+    Result = STATUS_SUCCESS;
+
 #if defined(MEMFS_NAMED_STREAMS)
     UINT32 FileAttributesMask = ~(UINT32)0;
     if (0 != FileNode->MainFileNode)
     {
         FileAttributesMask = ~(UINT32)FILE_ATTRIBUTE_DIRECTORY;
-        FileNode = FileNode->MainFileNode;
+        MainFileNode = FileNode->MainFileNode;
     }
 
+    AcquireSRWLockShared(&MainFileNode->Lock);
+
     if (0 != PFileAttributes)
-        *PFileAttributes = FileNode->FileInfo.FileAttributes & FileAttributesMask;
+        *PFileAttributes = MainFileNode->FileInfo.FileAttributes & FileAttributesMask;
 #else
+    AcquireSRWLockShared(&MainFileNode->Lock);
+
     if (0 != PFileAttributes)
-        *PFileAttributes = FileNode->FileInfo.FileAttributes;
+        *PFileAttributes = MainFileNode->FileInfo.FileAttributes;
 #endif
 
     if (0 != PSecurityDescriptorSize)
     {
-        if (FileNode->FileSecuritySize > *PSecurityDescriptorSize)
-        {
-            *PSecurityDescriptorSize = FileNode->FileSecuritySize;
-            return STATUS_BUFFER_OVERFLOW;
-        }
-
-        *PSecurityDescriptorSize = FileNode->FileSecuritySize;
-        if (0 != SecurityDescriptor)
-            memcpy(SecurityDescriptor, FileNode->FileSecurity, FileNode->FileSecuritySize);
+        if (MemfsSharedBlobSize(MainFileNode->FileSecurity) > *PSecurityDescriptorSize)
+            Result = STATUS_BUFFER_OVERFLOW;
+        else if (0 != SecurityDescriptor)
+            memcpy(SecurityDescriptor, MainFileNode->FileSecurity,
+                MemfsSharedBlobSize(MainFileNode->FileSecurity));
+        *PSecurityDescriptorSize = MemfsSharedBlobSize(MainFileNode->FileSecurity);
     }
 
-    return STATUS_SUCCESS;
+    ReleaseSRWLockShared(&MainFileNode->Lock);
+
+    MemfsFileNodeDereference(Memfs->FileNodeMap, FileNode);
+
+    return Result;
 }
 
 static NTSTATUS Create(FSP_FILE_SYSTEM *FileSystem,
@@ -1072,8 +2097,11 @@ static NTSTATUS Create(FSP_FILE_SYSTEM *FileSystem,
     PVOID *PFileNode, FSP_FSCTL_FILE_INFO *FileInfo)
 {
     MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
-#if defined(MEMFS_NAME_NORMALIZATION)
-    WCHAR FileNameBuf[MEMFS_MAX_PATH];
+    WCHAR Root[2] = L"\\";
+    PWSTR Remain, Suffix, Name;
+#if defined(MEMFS_NAMED_STREAMS)
+    MEMFS_FILE_NODE *MainFileNode = 0;
+    PWSTR StreamName;
 #endif
     MEMFS_FILE_NODE *FileNode;
     MEMFS_FILE_NODE *ParentNode;
@@ -1088,49 +2116,59 @@ static NTSTATUS Create(FSP_FILE_SYSTEM *FileSystem,
 
     FileNode = MemfsFileNodeMapGet(Memfs->FileNodeMap, FileName);
     if (0 != FileNode)
+    {
+        MemfsFileNodeDereference(Memfs->FileNodeMap, FileNode);
         return STATUS_OBJECT_NAME_COLLISION;
+    }
 
     ParentNode = MemfsFileNodeMapGetParent(Memfs->FileNodeMap, FileName, &Result);
     if (0 == ParentNode)
         return Result;
 
     if (MemfsFileNodeMapCount(Memfs->FileNodeMap) >= Memfs->MaxFileNodes)
-        return STATUS_CANNOT_MAKE;
+    {
+        Result = STATUS_CANNOT_MAKE;
+        goto exit;
+    }
 
     if (AllocationSize > Memfs->MaxFileSize)
-        return STATUS_DISK_FULL;
-
-#if defined(MEMFS_NAME_NORMALIZATION)
-    if (MemfsFileNodeMapIsCaseInsensitive(Memfs->FileNodeMap))
     {
-        WCHAR Root[2] = L"\\";
-        PWSTR Remain, Suffix;
-        size_t RemainLength, BSlashLength, SuffixLength;
-
-        FspPathSuffix(FileName, &Remain, &Suffix, Root);
-        assert(0 == MemfsFileNameCompare(Remain, -1, ParentNode->FileName, -1, TRUE));
-        FspPathCombine(FileName, Suffix);
-
-        RemainLength = wcslen(ParentNode->FileName);
-        BSlashLength = 1 < RemainLength;
-        SuffixLength = wcslen(Suffix);
-        if (MEMFS_MAX_PATH <= RemainLength + BSlashLength + SuffixLength)
-            return STATUS_OBJECT_NAME_INVALID;
+        Result = STATUS_DISK_FULL;
+        goto exit;
+    }
 
-        memcpy(FileNameBuf, ParentNode->FileName, RemainLength * sizeof(WCHAR));
-        memcpy(FileNameBuf + RemainLength, L"\\", BSlashLength * sizeof(WCHAR));
-        memcpy(FileNameBuf + RemainLength + BSlashLength, Suffix, (SuffixLength + 1) * sizeof(WCHAR));
+#if defined(MEMFS_NAMED_STREAMS)
+    MainFileNode = MemfsFileNodeMapGetMain(Memfs->FileNodeMap, FileName);
+#endif
 
-        FileName = FileNameBuf;
+    /* nodes are named by their last path component (or stream name) */
+    FspPathSuffix(FileName, &Remain, &Suffix, Root);
+    Name = Suffix;
+#if defined(MEMFS_NAMED_STREAMS)
+    StreamName = wcschr(Suffix, L':');
+    if (0 != StreamName)
+    {
+        if (0 == MainFileNode)
+        {
+            FspPathCombine(FileName, Suffix);
+            Result = STATUS_OBJECT_NAME_NOT_FOUND;
+            goto exit;
+        }
+        Name = StreamName + 1;
     }
 #endif
-
-    Result = MemfsFileNodeCreate(FileName, &FileNode);
+    if (MEMFS_MAX_NAME <= wcslen(Name))
+        Result = STATUS_OBJECT_NAME_INVALID;
+    else
+        Result = MemfsFileNodeCreate(Memfs->FileNodeMap, Name, &FileNode);
+    FspPathCombine(FileName, Suffix);
     if (!NT_SUCCESS(Result))
-        return Result;
+        goto exit;
 
 #if defined(MEMFS_NAMED_STREAMS)
-    FileNode->MainFileNode = MemfsFileNodeMapGetMain(Memfs->FileNodeMap, FileName);
+    /* the named stream takes over our reference to its main file */
+    FileNode->MainFileNode = MainFileNode;
+    MainFileNode = 0;
 #endif
 
     FileNode->FileInfo.FileAttributes = (FileAttributes & FILE_ATTRIBUTE_DIRECTORY) ?
@@ -1138,14 +2176,14 @@ static NTSTATUS Create(FSP_FILE_SYSTEM *FileSystem,
 
     if (0 != SecurityDescriptor)
     {
-        FileNode->FileSecuritySize = GetSecurityDescriptorLength(SecurityDescriptor);
-        FileNode->FileSecurity = (PSECURITY_DESCRIPTOR)malloc(FileNode->FileSecuritySize);
+        FileNode->FileSecurity = MemfsSharedBlobIntern(&Memfs->FileNodeMap->SecurityTable,
+            SecurityDescriptor, GetSecurityDescriptorLength(SecurityDescriptor));
         if (0 == FileNode->FileSecurity)
         {
-            MemfsFileNodeDelete(FileNode);
-            return STATUS_INSUFFICIENT_RESOURCES;
+            MemfsFileNodeDelete(Memfs->FileNodeMap, FileNode);
+            Result = STATUS_INSUFFICIENT_RESOURCES;
+            goto exit;
         }
-        memcpy(FileNode->FileSecurity, SecurityDescriptor, FileNode->FileSecuritySize);
     }
 
 #if defined(MEMFS_EA) || defined(MEMFS_WSL)
@@ -1154,12 +2192,19 @@ static NTSTATUS Create(FSP_FILE_SYSTEM *FileSystem,
 #if defined(MEMFS_EA)
         if (!ExtraBufferIsReparsePoint)
         {
+            /* the EA's of a named stream belong to its main file (already in the map) */
+            MEMFS_FILE_NODE *EaFileNode = MemfsFileNodeIsStream(FileNode) ?
+                FileNode->MainFileNode : 0;
+            if (0 != EaFileNode)
+                AcquireSRWLockExclusive(&EaFileNode->Lock);
             Result = FspFileSystemEnumerateEa(FileSystem, MemfsFileNodeSetEa, FileNode,
                 (PFILE_FULL_EA_INFORMATION)ExtraBuffer, ExtraLength);
+            if (0 != EaFileNode)
+                ReleaseSRWLockExclusive(&EaFileNode->Lock);
             if (!NT_SUCCESS(Result))
             {
-                MemfsFileNodeDelete(FileNode);
-                return Result;
+                MemfsFileNodeDelete(Memfs->FileNodeMap, FileNode);
+                goto exit;
             }
         }
 #endif
@@ -1167,21 +2212,22 @@ static NTSTATUS Create(FSP_FILE_SYSTEM *FileSystem,
         if (ExtraBufferIsReparsePoint)
         {
 #if defined(MEMFS_REPARSE_POINTS)
-            FileNode->ReparseDataSize = ExtraLength;
-            FileNode->ReparseData = malloc(ExtraLength);
-            if (0 == FileNode->ReparseData && 0 != ExtraLength)
+            FileNode->ReparseData = MemfsSharedBlobIntern(&Memfs->FileNodeMap->ReparseTable,
+                ExtraBuffer, ExtraLength);
+            if (0 == FileNode->ReparseData)
             {
-                MemfsFileNodeDelete(FileNode);
-                return STATUS_INSUFFICIENT_RESOURCES;
+                MemfsFileNodeDelete(Memfs->FileNodeMap, FileNode);
+                Result = STATUS_INSUFFICIENT_RESOURCES;
+                goto exit;
             }
 
             FileNode->FileInfo.FileAttributes |= FILE_ATTRIBUTE_REPARSE_POINT;
             FileNode->FileInfo.ReparseTag = *(PULONG)ExtraBuffer;
                 /* the first field in a reparse buffer is the reparse tag */
-            memcpy(FileNode->ReparseData, ExtraBuffer, ExtraLength);
 #else
-            MemfsFileNodeDelete(FileNode);
-            return STATUS_INVALID_PARAMETER;
+            MemfsFileNodeDelete(Memfs->FileNodeMap, FileNode);
+            Result = STATUS_INVALID_PARAMETER;
+            goto exit;
 #endif
         }
 #endif
@@ -1189,41 +2235,35 @@ static NTSTATUS Create(FSP_FILE_SYSTEM *FileSystem,
 #endif
 
     FileNode->FileInfo.AllocationSize = AllocationSize;
-    if (0 != FileNode->FileInfo.AllocationSize)
-    {
-        FileNode->FileData = LargeHeapAlloc((size_t)FileNode->FileInfo.AllocationSize);
-        if (0 == FileNode->FileData)
-        {
-            MemfsFileNodeDelete(FileNode);
-            return STATUS_INSUFFICIENT_RESOURCES;
-        }
-    }
 
-    Result = MemfsFileNodeMapInsert(Memfs->FileNodeMap, FileNode, &Inserted);
+    /* the insert fails if another thread created the same name since our lookup */
+    Result = MemfsFileNodeMapInsert(Memfs->FileNodeMap, ParentNode, FileNode, &Inserted);
     if (!NT_SUCCESS(Result) || !Inserted)
     {
-        MemfsFileNodeDelete(FileNode);
+        MemfsFileNodeDelete(Memfs->FileNodeMap, FileNode);
         if (NT_SUCCESS(Result))
-            Result = STATUS_OBJECT_NAME_COLLISION; /* should not happen! */
-        return Result;
+            Result = STATUS_OBJECT_NAME_COLLISION;
+        goto exit;
     }
 
     MemfsFileNodeReference(FileNode);
     *PFileNode = FileNode;
+    AcquireSRWLockShared(&FileNode->Lock);
     MemfsFileNodeGetFileInfo(FileNode, FileInfo);
+    ReleaseSRWLockShared(&FileNode->Lock);
 
-#if defined(MEMFS_NAME_NORMALIZATION)
-    if (MemfsFileNodeMapIsCaseInsensitive(Memfs->FileNodeMap))
-    {
-        FSP_FSCTL_OPEN_FILE_INFO *OpenFileInfo = FspFileSystemGetOpenFileInfo(FileInfo);
+    SetNormalizedName(Memfs, FileNode, FileInfo);
 
-        wcscpy_s(OpenFileInfo->NormalizedName, OpenFileInfo->NormalizedNameSize / sizeof(WCHAR),
-            FileNode->FileName);
-        OpenFileInfo->NormalizedNameSize = (UINT16)(wcslen(FileNode->FileName) * sizeof(WCHAR));
-    }
+    Result = STATUS_SUCCESS;
+
+exit:
+#if defined(MEMFS_NAMED_STREAMS)
+    if (0 != MainFileNode)
+        MemfsFileNodeDereference(Memfs->FileNodeMap, MainFileNode);
 #endif
+    MemfsFileNodeDereference(Memfs->FileNodeMap, ParentNode);
 
-    return STATUS_SUCCESS;
+    return Result;
 }
 
 static NTSTATUS Open(FSP_FILE_SYSTEM *FileSystem,
@@ -1237,11 +2277,15 @@ static NTSTATUS Open(FSP_FILE_SYSTEM *FileSystem,
     if (MEMFS_MAX_PATH <= wcslen(FileName))
         return STATUS_OBJECT_NAME_INVALID;
 
+    /* the lookup reference becomes the reference of the open file */
     FileNode = MemfsFileNodeMapGet(Memfs->FileNodeMap, FileName);
     if (0 == FileNode)
     {
+        MEMFS_FILE_NODE *ParentNode;
         Result = STATUS_OBJECT_NAME_NOT_FOUND;
-        MemfsFileNodeMapGetParent(Memfs->FileNodeMap, FileName, &Result);
+        ParentNode = MemfsFileNodeMapGetParent(Memfs->FileNodeMap, FileName, &Result);
+        if (0 != ParentNode)
+            MemfsFileNodeDereference(Memfs->FileNodeMap, ParentNode);
         return Result;
     }
 
@@ -1253,30 +2297,44 @@ static NTSTATUS Open(FSP_FILE_SYSTEM *FileSystem,
 #endif
         )
     {
-        if (MemfsFileNodeNeedEa(FileNode))
+        BOOLEAN NeedEa;
+
+        AcquireSRWLockShared(&FileNode->Lock);
+        NeedEa = MemfsFileNodeNeedEa(FileNode);
+        ReleaseSRWLockShared(&FileNode->Lock);
+
+        if (NeedEa)
         {
+            MemfsFileNodeDereference(Memfs->FileNodeMap, FileNode);
             Result = STATUS_ACCESS_DENIED;
             return Result;
         }
     }
 #endif
 
-    MemfsFileNodeReference(FileNode);
     *PFileNode = FileNode;
+    AcquireSRWLockShared(&FileNode->Lock);
     MemfsFileNodeGetFileInfo(FileNode, FileInfo);
+    ReleaseSRWLockShared(&FileNode->Lock);
+
+    SetNormalizedName(Memfs, FileNode, FileInfo);
 
+    return STATUS_SUCCESS;
+}
+
+static VOID SetNormalizedName(MEMFS *Memfs, MEMFS_FILE_NODE *FileNode,
+    FSP_FSCTL_FILE_INFO *FileInfo)
+{
 #if defined(MEMFS_NAME_NORMALIZATION)
     if (MemfsFileNodeMapIsCaseInsensitive(Memfs->FileNodeMap))
     {
         FSP_FSCTL_OPEN_FILE_INFO *OpenFileInfo = FspFileSystemGetOpenFileInfo(FileInfo);
 
-        wcscpy_s(OpenFileInfo->NormalizedName, OpenFileInfo->NormalizedNameSize / sizeof(WCHAR),
-            FileNode->FileName);
-        OpenFileInfo->NormalizedNameSize = (UINT16)(wcslen(FileNode->FileName) * sizeof(WCHAR));
+        if (NT_SUCCESS(MemfsFileNodeGetFileName(Memfs->FileNodeMap, FileNode,
+            OpenFileInfo->NormalizedName, OpenFileInfo->NormalizedNameSize / sizeof(WCHAR))))
+            OpenFileInfo->NormalizedNameSize = (UINT16)(wcslen(OpenFileInfo->NormalizedName) * sizeof(WCHAR));
     }
 #endif
-
-    return STATUS_SUCCESS;
 }
 
 static NTSTATUS Overwrite(FSP_FILE_SYSTEM *FileSystem,
@@ -1303,36 +2361,52 @@ static NTSTATUS Overwrite(FSP_FILE_SYSTEM *FileSystem,
         if (2 >= RefCount)
             MemfsFileNodeMapRemove(Memfs->FileNodeMap, Context.FileNodes[Index]);
     }
-    MemfsFileNodeMapEnumerateFree(&Context);
+    MemfsFileNodeMapEnumerateFree(Memfs->FileNodeMap, &Context);
 #endif
 
+    AcquireSRWLockExclusive(&FileNode->Lock);
+
 #if defined(MEMFS_EA)
-    MemfsFileNodeDeleteEaMap(FileNode);
+#if defined(MEMFS_NAMED_STREAMS)
+    if (0 != FileNode->MainFileNode)
+        AcquireSRWLockExclusive(&FileNode->MainFileNode->Lock);
+#endif
+    MemfsFileNodeDeleteEa(Memfs->FileNodeMap, FileNode);
+    Result = STATUS_SUCCESS;
     if (0 != Ea)
-    {
         Result = FspFileSystemEnumerateEa(FileSystem, MemfsFileNodeSetEa, FileNode, Ea, EaLength);
-        if (!NT_SUCCESS(Result))
-            return Result;
-    }
+#if defined(MEMFS_NAMED_STREAMS)
+    if (0 != FileNode->MainFileNode)
+        ReleaseSRWLockExclusive(&FileNode->MainFileNode->Lock);
+#endif
+    if (!NT_SUCCESS(Result))
+        goto exit;
 #endif
 
     Result = SetFileSizeInternal(FileSystem, FileNode, AllocationSize, TRUE);
     if (!NT_SUCCESS(Result))
-        return Result;
+        goto exit;
 
     if (ReplaceFileAttributes)
         FileNode->FileInfo.FileAttributes = FileAttributes | FILE_ATTRIBUTE_ARCHIVE;
     else
         FileNode->FileInfo.FileAttributes |= FileAttributes | FILE_ATTRIBUTE_ARCHIVE;
 
+    FileDataTruncate(&FileNode->FileData, 0);
     FileNode->FileInfo.FileSize = 0;
     FileNode->FileInfo.LastAccessTime =
     FileNode->FileInfo.LastWriteTime =
     FileNode->FileInfo.ChangeTime = MemfsGetSystemTime();
+    MemfsFileNodeChanged(FileNode);
 
     MemfsFileNodeGetFileInfo(FileNode, FileInfo);
 
-    return STATUS_SUCCESS;
+    Result = STATUS_SUCCESS;
+
+exit:
+    ReleaseSRWLockExclusive(&FileNode->Lock);
+
+    return Result;
 }
 
 static VOID Cleanup(FSP_FILE_SYSTEM *FileSystem,
@@ -1349,48 +2423,48 @@ static VOID Cleanup(FSP_FILE_SYSTEM *FileSystem,
 
     assert(0 != Flags); /* FSP_FSCTL_VOLUME_PARAMS::PostCleanupWhenModifiedOnly ensures this */
 
-    if (Flags & FspCleanupSetArchiveBit)
+    if (Flags & (FspCleanupSetArchiveBit |
+        FspCleanupSetLastAccessTime | FspCleanupSetLastWriteTime | FspCleanupSetChangeTime))
     {
-        if (0 == (MainFileNode->FileInfo.FileAttributes & FILE_ATTRIBUTE_DIRECTORY))
-            MainFileNode->FileInfo.FileAttributes |= FILE_ATTRIBUTE_ARCHIVE;
-    }
+        AcquireSRWLockExclusive(&MainFileNode->Lock);
 
-    if (Flags & (FspCleanupSetLastAccessTime | FspCleanupSetLastWriteTime | FspCleanupSetChangeTime))
-    {
-        UINT64 SystemTime = MemfsGetSystemTime();
+        if (Flags & FspCleanupSetArchiveBit)
+        {
+            if (0 == (MainFileNode->FileInfo.FileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+                MainFileNode->FileInfo.FileAttributes |= FILE_ATTRIBUTE_ARCHIVE;
+        }
+
+        if (Flags & (FspCleanupSetLastAccessTime | FspCleanupSetLastWriteTime | FspCleanupSetChangeTime))
+        {
+            UINT64 SystemTime = MemfsGetSystemTime();
+
+            if (Flags & FspCleanupSetLastAccessTime)
+                MainFileNode->FileInfo.LastAccessTime = SystemTime;
+            if (Flags & FspCleanupSetLastWriteTime)
+                MainFileNode->FileInfo.LastWriteTime = SystemTime;
+            if (Flags & FspCleanupSetChangeTime)
+                MainFileNode->FileInfo.ChangeTime = SystemTime;
+        }
 
-        if (Flags & FspCleanupSetLastAccessTime)
-            MainFileNode->FileInfo.LastAccessTime = SystemTime;
-        if (Flags & FspCleanupSetLastWriteTime)
-            MainFileNode->FileInfo.LastWriteTime = SystemTime;
-        if (Flags & FspCleanupSetChangeTime)
-            MainFileNode->FileInfo.ChangeTime = SystemTime;
+        MemfsFileNodeChanged(MainFileNode);
+        ReleaseSRWLockExclusive(&MainFileNode->Lock);
     }
 
     if (Flags & FspCleanupSetAllocationSize)
     {
         UINT64 AllocationUnit = MEMFS_SECTOR_SIZE * MEMFS_SECTORS_PER_ALLOCATION_UNIT;
-        UINT64 AllocationSize = (FileNode->FileInfo.FileSize + AllocationUnit - 1) /
-            AllocationUnit * AllocationUnit;
+        UINT64 AllocationSize;
 
+        AcquireSRWLockExclusive(&FileNode->Lock);
+        AllocationSize = (FileNode->FileInfo.FileSize + AllocationUnit - 1) /
+            AllocationUnit * AllocationUnit;
         SetFileSizeInternal(FileSystem, FileNode, AllocationSize, TRUE);
+        ReleaseSRWLockExclusive(&FileNode->Lock);
     }
 
-    if ((Flags & FspCleanupDelete) && !MemfsFileNodeMapHasChild(Memfs->FileNodeMap, FileNode))
-    {
-#if defined(MEMFS_NAMED_STREAMS)
-        MEMFS_FILE_NODE_MAP_ENUM_CONTEXT Context = { FALSE };
-        ULONG Index;
-
-        MemfsFileNodeMapEnumerateNamedStreams(Memfs->FileNodeMap, FileNode,
-            MemfsFileNodeMapEnumerateFn, &Context);
-        for (Index = 0; Context.Count > Index; Index++)
-            MemfsFileNodeMapRemove(Memfs->FileNodeMap, Context.FileNodes[Index]);
-        MemfsFileNodeMapEnumerateFree(&Context);
-#endif
-
+    /* a non-empty directory is not removed; a file is removed together with its named streams */
+    if (Flags & FspCleanupDelete)
         MemfsFileNodeMapRemove(Memfs->FileNodeMap, FileNode);
-    }
 }
 
 static VOID Close(FSP_FILE_SYSTEM *FileSystem,
@@ -1399,7 +2473,7 @@ static VOID Close(FSP_FILE_SYSTEM *FileSystem,
     MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
     MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
 
-    MemfsFileNodeDereference(FileNode);
+    MemfsFileNodeDereference(Memfs->FileNodeMap, FileNode);
 }
 
 static NTSTATUS Read(FSP_FILE_SYSTEM *FileSystem,
@@ -1409,8 +2483,13 @@ static NTSTATUS Read(FSP_FILE_SYSTEM *FileSystem,
     MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
     UINT64 EndOffset;
 
+    AcquireSRWLockShared(&FileNode->Lock);
+
     if (Offset >= FileNode->FileInfo.FileSize)
+    {
+        ReleaseSRWLockShared(&FileNode->Lock);
         return STATUS_END_OF_FILE;
+    }
 
     EndOffset = Offset + Length;
     if (EndOffset > FileNode->FileInfo.FileSize)
@@ -1419,25 +2498,17 @@ static NTSTATUS Read(FSP_FILE_SYSTEM *FileSystem,
 #ifdef MEMFS_SLOWIO
     if (SlowioReturnPending(FileSystem))
     {
-        MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
-        try
-        {
-            InterlockedIncrement(&Memfs->SlowioThreadsRunning);
-            std::thread(SlowioReadThread,
-                FileSystem, FileNode, Buffer, Offset, EndOffset,
-                FspFileSystemGetOperationContext()->Request->Hint).
-                detach();
+        ReleaseSRWLockShared(&FileNode->Lock);
+        if (SlowioPost(FileSystem, SlowioReadRoutine, FileNode, Buffer, Offset, EndOffset))
             return STATUS_PENDING;
-        }
-        catch (...)
-        {
-            InterlockedDecrement(&Memfs->SlowioThreadsRunning);
-        }
+        AcquireSRWLockShared(&FileNode->Lock);
     }
     SlowioSnooze(FileSystem);
 #endif
 
-    memcpy(Buffer, (PUINT8)FileNode->FileData + Offset, (size_t)(EndOffset - Offset));
+    FileDataRead(&FileNode->FileData, Offset, Buffer, (size_t)(EndOffset - Offset));
+
+    ReleaseSRWLockShared(&FileNode->Lock);
 
     *PBytesTransferred = (ULONG)(EndOffset - Offset);
 
@@ -1469,10 +2540,15 @@ static NTSTATUS Write(FSP_FILE_SYSTEM *FileSystem,
     UINT64 EndOffset;
     NTSTATUS Result;
 
+    AcquireSRWLockExclusive(&FileNode->Lock);
+
     if (ConstrainedIo)
     {
         if (Offset >= FileNode->FileInfo.FileSize)
-            return STATUS_SUCCESS;
+        {
+            Result = STATUS_SUCCESS;
+            goto exit;
+        }
         EndOffset = Offset + Length;
         if (EndOffset > FileNode->FileInfo.FileSize)
             EndOffset = FileNode->FileInfo.FileSize;
@@ -1486,37 +2562,36 @@ static NTSTATUS Write(FSP_FILE_SYSTEM *FileSystem,
         {
             Result = SetFileSizeInternal(FileSystem, FileNode, EndOffset, FALSE);
             if (!NT_SUCCESS(Result))
-                return Result;
+                goto exit;
         }
     }
 
 #ifdef MEMFS_SLOWIO
     if (SlowioReturnPending(FileSystem))
     {
-        MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
-        try
-        {
-            InterlockedIncrement(&Memfs->SlowioThreadsRunning);
-            std::thread(SlowioWriteThread,
-                FileSystem, FileNode, Buffer, Offset, EndOffset,
-                FspFileSystemGetOperationContext()->Request->Hint).
-                detach();
+        ReleaseSRWLockExclusive(&FileNode->Lock);
+        if (SlowioPost(FileSystem, SlowioWriteRoutine, FileNode, Buffer, Offset, EndOffset))
             return STATUS_PENDING;
-        }
-        catch (...)
-        {
-            InterlockedDecrement(&Memfs->SlowioThreadsRunning);
-        }
+        AcquireSRWLockExclusive(&FileNode->Lock);
     }
     SlowioSnooze(FileSystem);
 #endif
 
-    memcpy((PUINT8)FileNode->FileData + Offset, Buffer, (size_t)(EndOffset - Offset));
+    if (!FileDataWrite(&FileNode->FileData, Offset, Buffer, (size_t)(EndOffset - Offset)))
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
 
     *PBytesTransferred = (ULONG)(EndOffset - Offset);
     MemfsFileNodeGetFileInfo(FileNode, FileInfo);
 
-    return STATUS_SUCCESS;
+    Result = STATUS_SUCCESS;
+
+exit:
+    ReleaseSRWLockExclusive(&FileNode->Lock);
+
+    return Result;
 }
 
 NTSTATUS Flush(FSP_FILE_SYSTEM *FileSystem,
@@ -1542,7 +2617,9 @@ NTSTATUS Flush(FSP_FILE_SYSTEM *FileSystem,
         FileNode->FileInfo.ChangeTime = MemfsGetSystemTime();
 #endif
 
+        AcquireSRWLockShared(&FileNode->Lock);
         MemfsFileNodeGetFileInfo(FileNode, FileInfo);
+        ReleaseSRWLockShared(&FileNode->Lock);
     }
 
     return STATUS_SUCCESS;
@@ -1554,7 +2631,9 @@ static NTSTATUS GetFileInfo(FSP_FILE_SYSTEM *FileSystem,
 {
     MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
 
+    AcquireSRWLockShared(&FileNode->Lock);
     MemfsFileNodeGetFileInfo(FileNode, FileInfo);
+    ReleaseSRWLockShared(&FileNode->Lock);
 
     return STATUS_SUCCESS;
 }
@@ -1564,6 +2643,7 @@ static NTSTATUS SetBasicInfo(FSP_FILE_SYSTEM *FileSystem,
     UINT64 CreationTime, UINT64 LastAccessTime, UINT64 LastWriteTime, UINT64 ChangeTime,
     FSP_FSCTL_FILE_INFO *FileInfo)
 {
+    MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
     MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
 
 #if defined(MEMFS_NAMED_STREAMS)
@@ -1571,6 +2651,8 @@ static NTSTATUS SetBasicInfo(FSP_FILE_SYSTEM *FileSystem,
         FileNode = FileNode->MainFileNode;
 #endif
 
+    AcquireSRWLockExclusive(&FileNode->Lock);
+
     if (INVALID_FILE_ATTRIBUTES != FileAttributes)
         FileNode->FileInfo.FileAttributes = FileAttributes;
     if (0 != CreationTime)
@@ -1581,15 +2663,19 @@ static NTSTATUS SetBasicInfo(FSP_FILE_SYSTEM *FileSystem,
         FileNode->FileInfo.LastWriteTime = LastWriteTime;
     if (0 != ChangeTime)
         FileNode->FileInfo.ChangeTime = ChangeTime;
+    MemfsFileNodeChanged(FileNode);
 
     MemfsFileNodeGetFileInfo(FileNode, FileInfo);
 
+    ReleaseSRWLockExclusive(&FileNode->Lock);
+
     return STATUS_SUCCESS;
 }
 
 static NTSTATUS SetFileSizeInternal(FSP_FILE_SYSTEM *FileSystem,
     PVOID FileNode0, UINT64 NewSize, BOOLEAN SetAllocationSize)
 {
+    /* caller holds FileNode->Lock exclusive */
     MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
     MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
 
@@ -1600,15 +2686,14 @@ static NTSTATUS SetFileSizeInternal(FSP_FILE_SYSTEM *FileSystem,
             if (NewSize > Memfs->MaxFileSize)
                 return STATUS_DISK_FULL;
 
-            PVOID FileData = LargeHeapRealloc(FileNode->FileData, (size_t)NewSize);
-            if (0 == FileData && 0 != NewSize)
-                return STATUS_INSUFFICIENT_RESOURCES;
-
-            FileNode->FileData = FileData;
-
+            /* pages are allocated on write; only shrinking the allocation frees data */
             FileNode->FileInfo.AllocationSize = NewSize;
             if (FileNode->FileInfo.FileSize > NewSize)
+            {
+                FileDataTruncate(&FileNode->FileData, NewSize);
                 FileNode->FileInfo.FileSize = NewSize;
+            }
+            MemfsFileNodeChanged(FileNode);
         }
     }
     else
@@ -1625,10 +2710,11 @@ static NTSTATUS SetFileSizeInternal(FSP_FILE_SYSTEM *FileSystem,
                     return Result;
             }
 
-            if (FileNode->FileInfo.FileSize < NewSize)
-                memset((PUINT8)FileNode->FileData + FileNode->FileInfo.FileSize, 0,
-                    (size_t)(NewSize - FileNode->FileInfo.FileSize));
+            /* extending leaves a hole; no need to zero it */
+            if (FileNode->FileInfo.FileSize > NewSize)
+                FileDataTruncate(&FileNode->FileData, NewSize);
             FileNode->FileInfo.FileSize = NewSize;
+            MemfsFileNodeChanged(FileNode);
         }
     }
 
@@ -1642,13 +2728,15 @@ static NTSTATUS SetFileSize(FSP_FILE_SYSTEM *FileSystem,
     MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
     NTSTATUS Result;
 
+    AcquireSRWLockExclusive(&FileNode->Lock);
+
     Result = SetFileSizeInternal(FileSystem, FileNode0, NewSize, SetAllocationSize);
-    if (!NT_SUCCESS(Result))
-        return Result;
+    if (NT_SUCCESS(Result))
+        MemfsFileNodeGetFileInfo(FileNode, FileInfo);
 
-    MemfsFileNodeGetFileInfo(FileNode, FileInfo);
+    ReleaseSRWLockExclusive(&FileNode->Lock);
 
-    return STATUS_SUCCESS;
+    return Result;
 }
 
 static NTSTATUS CanDelete(FSP_FILE_SYSTEM *FileSystem,
@@ -1656,11 +2744,13 @@ static NTSTATUS CanDelete(FSP_FILE_SYSTEM *FileSystem,
 {
     MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
     MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
+    BOOLEAN HasChild;
 
-    if (MemfsFileNodeMapHasChild(Memfs->FileNodeMap, FileNode))
-        return STATUS_DIRECTORY_NOT_EMPTY;
+    AcquireSRWLockShared(&FileNode->IndexLock);
+    HasChild = MemfsFileNodeMapHasChild(Memfs->FileNodeMap, FileNode);
+    ReleaseSRWLockShared(&FileNode->IndexLock);
 
-    return STATUS_SUCCESS;
+    return HasChild ? STATUS_DIRECTORY_NOT_EMPTY : STATUS_SUCCESS;
 }
 
 static NTSTATUS Rename(FSP_FILE_SYSTEM *FileSystem,
@@ -1668,72 +2758,118 @@ static NTSTATUS Rename(FSP_FILE_SYSTEM *FileSystem,
     PWSTR FileName, PWSTR NewFileName, BOOLEAN ReplaceIfExists)
 {
     MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
+    MEMFS_FILE_NODE_MAP *FileNodeMap = Memfs->FileNodeMap;
     MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
-    MEMFS_FILE_NODE *NewFileNode, *DescendantFileNode;
-    MEMFS_FILE_NODE_MAP_ENUM_CONTEXT Context = { TRUE };
-    ULONG Index, FileNameLen, NewFileNameLen;
-    BOOLEAN Inserted;
+    MEMFS_FILE_NODE *ParentNode, *NewFileNode, *NewParentNode, *AncestorNode;
+    MEMFS_FILE_NODE *FirstLockNode, *SecondLockNode;
+    WCHAR Root[2] = L"\\";
+    PWSTR Remain, Suffix;
     NTSTATUS Result;
 
-    NewFileNode = MemfsFileNodeMapGet(Memfs->FileNodeMap, NewFileName);
+    /* renames are serialized so that the cycle check below sees a stable tree */
+    AcquireSRWLockExclusive(&FileNodeMap->RenameLock);
+
+    NewParentNode = MemfsFileNodeMapGetParent(FileNodeMap, NewFileName, &Result);
+    if (0 == NewParentNode)
+    {
+        ReleaseSRWLockExclusive(&FileNodeMap->RenameLock);
+        return Result;
+    }
+
+    AcquireSRWLockShared(&FileNode->IndexLock);
+    ParentNode = FileNode->ParentNode;
+    if (0 != ParentNode)
+        MemfsFileNodeReference(ParentNode);
+    ReleaseSRWLockShared(&FileNode->IndexLock);
+    if (0 == ParentNode)
+    {
+        MemfsFileNodeDereference(FileNodeMap, NewParentNode);
+        ReleaseSRWLockExclusive(&FileNodeMap->RenameLock);
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
+    /*
+     * Other threads only ever wait for a child's IndexLock while holding its parent's.
+     * So if one of the two directories is the parent of the other lock the parent first.
+     */
+    FirstLockNode = ParentNode;
+    SecondLockNode = ParentNode != NewParentNode ? NewParentNode : 0;
+    if (ParentNode->ParentNode == NewParentNode)
+    {
+        FirstLockNode = NewParentNode;
+        SecondLockNode = ParentNode;
+    }
+    AcquireSRWLockExclusive(&FirstLockNode->IndexLock);
+    if (0 != SecondLockNode)
+        AcquireSRWLockExclusive(&SecondLockNode->IndexLock);
+
+    FspPathSuffix(NewFileName, &Remain, &Suffix, Root);
+
+    if (ParentNode != FileNode->ParentNode)
+    {
+        Result = STATUS_OBJECT_NAME_NOT_FOUND;
+        goto exit;
+    }
+
+    if (!MemfsFileNodeMapIsLinked(FileNodeMap, NewParentNode))
+    {
+        Result = STATUS_OBJECT_PATH_NOT_FOUND;
+        goto exit;
+    }
+
+    NewFileNode = MemfsFileNodeIndexGet(NewParentNode->ChildIndex, Suffix);
     if (0 != NewFileNode && FileNode != NewFileNode)
     {
+        BOOLEAN IsDirectory;
+
         if (!ReplaceIfExists)
         {
             Result = STATUS_OBJECT_NAME_COLLISION;
             goto exit;
         }
 
-        if (NewFileNode->FileInfo.FileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+        AcquireSRWLockShared(&NewFileNode->Lock);
+        IsDirectory = 0 != (NewFileNode->FileInfo.FileAttributes & FILE_ATTRIBUTE_DIRECTORY);
+        ReleaseSRWLockShared(&NewFileNode->Lock);
+        if (IsDirectory)
         {
             Result = STATUS_ACCESS_DENIED;
             goto exit;
         }
     }
 
-    MemfsFileNodeMapEnumerateDescendants(Memfs->FileNodeMap, FileNode,
-        MemfsFileNodeMapEnumerateFn, &Context);
-
-    FileNameLen = (ULONG)wcslen(FileNode->FileName);
-    NewFileNameLen = (ULONG)wcslen(NewFileName);
-    for (Index = 0; Context.Count > Index; Index++)
-    {
-        DescendantFileNode = Context.FileNodes[Index];
-        if (MEMFS_MAX_PATH <= wcslen(DescendantFileNode->FileName) - FileNameLen + NewFileNameLen)
+    /* a directory cannot be moved into its own subtree */
+    for (AncestorNode = NewParentNode; 0 != AncestorNode; AncestorNode = AncestorNode->ParentNode)
+        if (FileNode == AncestorNode)
         {
-            Result = STATUS_OBJECT_NAME_INVALID;
+            Result = STATUS_INVALID_PARAMETER;
             goto exit;
         }
-    }
 
-    if (0 != NewFileNode)
+    if (MEMFS_MAX_NAME <= wcslen(Suffix))
     {
-        MemfsFileNodeReference(NewFileNode);
-        MemfsFileNodeMapRemove(Memfs->FileNodeMap, NewFileNode);
-        MemfsFileNodeDereference(NewFileNode);
+        Result = STATUS_OBJECT_NAME_INVALID;
+        goto exit;
     }
 
-    for (Index = 0; Context.Count > Index; Index++)
-    {
-        DescendantFileNode = Context.FileNodes[Index];
-        MemfsFileNodeMapRemove(Memfs->FileNodeMap, DescendantFileNode);
-        memmove(DescendantFileNode->FileName + NewFileNameLen,
-            DescendantFileNode->FileName + FileNameLen,
-            (wcslen(DescendantFileNode->FileName) + 1 - FileNameLen) * sizeof(WCHAR));
-        memcpy(DescendantFileNode->FileName, NewFileName, NewFileNameLen * sizeof(WCHAR));
-        Result = MemfsFileNodeMapInsert(Memfs->FileNodeMap, DescendantFileNode, &Inserted);
-        if (!NT_SUCCESS(Result))
-        {
-            FspDebugLog(__FUNCTION__ ": cannot insert into FileNodeMap; aborting\n");
-            abort();
-        }
-        assert(Inserted);
-    }
+    /* the replaced file goes away together with its named streams */
+    if (0 != NewFileNode && FileNode != NewFileNode)
+        MemfsFileNodeMapUnlink(FileNodeMap, NewFileNode);
 
-    Result = STATUS_SUCCESS;
+    /* descendants follow FileNode because they only store their own name */
+    Result = MemfsFileNodeMapMove(FileNodeMap, FileNode, NewParentNode, Suffix);
 
 exit:
-    MemfsFileNodeMapEnumerateFree(&Context);
+    FspPathCombine(NewFileName, Suffix);
+
+    if (0 != SecondLockNode)
+        ReleaseSRWLockExclusive(&SecondLockNode->IndexLock);
+    ReleaseSRWLockExclusive(&FirstLockNode->IndexLock);
+
+    MemfsFileNodeDereference(FileNodeMap, ParentNode);
+    MemfsFileNodeDereference(FileNodeMap, NewParentNode);
+
+    ReleaseSRWLockExclusive(&FileNodeMap->RenameLock);
 
     return Result;
 }
@@ -1744,31 +2880,33 @@ static NTSTATUS GetSecurity(FSP_FILE_SYSTEM *FileSystem,
 {
     MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
 
+    NTSTATUS Result = STATUS_SUCCESS;
+
 #if defined(MEMFS_NAMED_STREAMS)
     if (0 != FileNode->MainFileNode)
         FileNode = FileNode->MainFileNode;
 #endif
 
-    if (FileNode->FileSecuritySize > *PSecurityDescriptorSize)
-    {
-        *PSecurityDescriptorSize = FileNode->FileSecuritySize;
-        return STATUS_BUFFER_OVERFLOW;
-    }
+    AcquireSRWLockShared(&FileNode->Lock);
 
-    *PSecurityDescriptorSize = FileNode->FileSecuritySize;
-    if (0 != SecurityDescriptor)
-        memcpy(SecurityDescriptor, FileNode->FileSecurity, FileNode->FileSecuritySize);
+    if (MemfsSharedBlobSize(FileNode->FileSecurity) > *PSecurityDescriptorSize)
+        Result = STATUS_BUFFER_OVERFLOW;
+    else if (0 != SecurityDescriptor)
+        memcpy(SecurityDescriptor, FileNode->FileSecurity, MemfsSharedBlobSize(FileNode->FileSecurity));
+    *PSecurityDescriptorSize = MemfsSharedBlobSize(FileNode->FileSecurity);
 
-    return STATUS_SUCCESS;
+    ReleaseSRWLockShared(&FileNode->Lock);
+
+    return Result;
 }
 
 static NTSTATUS SetSecurity(FSP_FILE_SYSTEM *FileSystem,
     PVOID FileNode0,
     SECURITY_INFORMATION SecurityInformation, PSECURITY_DESCRIPTOR ModificationDescriptor)
 {
+    MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
     MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
     PSECURITY_DESCRIPTOR NewSecurityDescriptor, FileSecurity;
-    SIZE_T FileSecuritySize;
     NTSTATUS Result;
 
 #if defined(MEMFS_NAMED_STREAMS)
@@ -1776,57 +2914,64 @@ static NTSTATUS SetSecurity(FSP_FILE_SYSTEM *FileSystem,
         FileNode = FileNode->MainFileNode;
 #endif
 
+    AcquireSRWLockExclusive(&FileNode->Lock);
+
     Result = FspSetSecurityDescriptor(
         FileNode->FileSecurity,
         SecurityInformation,
         ModificationDescriptor,
         &NewSecurityDescriptor);
     if (!NT_SUCCESS(Result))
-        return Result;
+        goto exit;
 
-    FileSecuritySize = GetSecurityDescriptorLength(NewSecurityDescriptor);
-    FileSecurity = (PSECURITY_DESCRIPTOR)malloc(FileSecuritySize);
+    FileSecurity = MemfsSharedBlobIntern(&Memfs->FileNodeMap->SecurityTable,
+        NewSecurityDescriptor, GetSecurityDescriptorLength(NewSecurityDescriptor));
+    FspDeleteSecurityDescriptor(NewSecurityDescriptor, (NTSTATUS (*)())FspSetSecurityDescriptor);
     if (0 == FileSecurity)
     {
-        FspDeleteSecurityDescriptor(NewSecurityDescriptor, (NTSTATUS (*)())FspSetSecurityDescriptor);
-        return STATUS_INSUFFICIENT_RESOURCES;
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
     }
-    memcpy(FileSecurity, NewSecurityDescriptor, FileSecuritySize);
-    FspDeleteSecurityDescriptor(NewSecurityDescriptor, (NTSTATUS (*)())FspSetSecurityDescriptor);
 
-    free(FileNode->FileSecurity);
-    FileNode->FileSecuritySize = FileSecuritySize;
+    MemfsSharedBlobRelease(&Memfs->FileNodeMap->SecurityTable, FileNode->FileSecurity);
     FileNode->FileSecurity = FileSecurity;
 
-    return STATUS_SUCCESS;
+    Result = STATUS_SUCCESS;
+
+exit:
+    ReleaseSRWLockExclusive(&FileNode->Lock);
+
+    return Result;
 }
 
 typedef struct _MEMFS_READ_DIRECTORY_CONTEXT
 {
-    PVOID Buffer;
-    ULONG Length;
-    PULONG PBytesTransferred;
+    PVOID *PDirBuffer;
+    NTSTATUS Result;
 } MEMFS_READ_DIRECTORY_CONTEXT;
 
-static BOOLEAN AddDirInfo(MEMFS_FILE_NODE *FileNode, PWSTR FileName,
-    PVOID Buffer, ULONG Length, PULONG PBytesTransferred)
+static VOID GetDirInfo(MEMFS_FILE_NODE *FileNode, PWSTR FileName,
+    FSP_FSCTL_DIR_INFO *DirInfo)
 {
-    UINT8 DirInfoBuf[sizeof(FSP_FSCTL_DIR_INFO) + sizeof FileNode->FileName];
-    FSP_FSCTL_DIR_INFO *DirInfo = (FSP_FSCTL_DIR_INFO *)DirInfoBuf;
-    WCHAR Root[2] = L"\\";
-    PWSTR Remain, Suffix;
-
+    /* if FileName is 0 the caller holds the IndexLock of FileNode->ParentNode */
     if (0 == FileName)
-    {
-        FspPathSuffix(FileNode->FileName, &Remain, &Suffix, Root);
-        FileName = Suffix;
-        FspPathCombine(FileNode->FileName, Suffix);
-    }
+        FileName = FileNode->FileName;
 
     memset(DirInfo->Padding, 0, sizeof DirInfo->Padding);
     DirInfo->Size = (UINT16)(sizeof(FSP_FSCTL_DIR_INFO) + wcslen(FileName) * sizeof(WCHAR));
+    AcquireSRWLockShared(&FileNode->Lock);
     DirInfo->FileInfo = FileNode->FileInfo;
+    ReleaseSRWLockShared(&FileNode->Lock);
     memcpy(DirInfo->FileNameBuf, FileName, DirInfo->Size - sizeof(FSP_FSCTL_DIR_INFO));
+}
+
+static BOOLEAN AddDirInfo(MEMFS_FILE_NODE *FileNode, PWSTR FileName,
+    PVOID Buffer, ULONG Length, PULONG PBytesTransferred)
+{
+    UINT8 DirInfoBuf[sizeof(FSP_FSCTL_DIR_INFO) + MEMFS_MAX_NAME * sizeof(WCHAR)];
+    FSP_FSCTL_DIR_INFO *DirInfo = (FSP_FSCTL_DIR_INFO *)DirInfoBuf;
+
+    GetDirInfo(FileNode, FileName, DirInfo);
 
     return FspFileSystemAddDirInfo(DirInfo, Buffer, Length, PBytesTransferred);
 }
@@ -1834,9 +2979,12 @@ static BOOLEAN AddDirInfo(MEMFS_FILE_NODE *FileNode, PWSTR FileName,
 static BOOLEAN ReadDirectoryEnumFn(MEMFS_FILE_NODE *FileNode, PVOID Context0)
 {
     MEMFS_READ_DIRECTORY_CONTEXT *Context = (MEMFS_READ_DIRECTORY_CONTEXT *)Context0;
+    UINT8 DirInfoBuf[sizeof(FSP_FSCTL_DIR_INFO) + MEMFS_MAX_NAME * sizeof(WCHAR)];
+    FSP_FSCTL_DIR_INFO *DirInfo = (FSP_FSCTL_DIR_INFO *)DirInfoBuf;
 
-    return AddDirInfo(FileNode, 0,
-        Context->Buffer, Context->Length, Context->PBytesTransferred);
+    GetDirInfo(FileNode, 0, DirInfo);
+
+    return FspFileSystemFillDirectoryBuffer(Context->PDirBuffer, DirInfo, &Context->Result);
 }
 
 static NTSTATUS ReadDirectory(FSP_FILE_SYSTEM *FileSystem,
@@ -1849,54 +2997,69 @@ static NTSTATUS ReadDirectory(FSP_FILE_SYSTEM *FileSystem,
     MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
     MEMFS_FILE_NODE *ParentNode;
     MEMFS_READ_DIRECTORY_CONTEXT Context;
-    NTSTATUS Result;
-
-    Context.Buffer = Buffer;
-    Context.Length = Length;
-    Context.PBytesTransferred = PBytesTransferred;
+    PVOID DirBuffer = 0;
 
-    if (L'\0' != FileNode->FileName[1])
+    if (Memfs->FileNodeMap->RootNode != FileNode)
     {
         /* if this is not the root directory add the dot entries */
+        BOOLEAN Added = TRUE;
 
-        ParentNode = MemfsFileNodeMapGetParent(Memfs->FileNodeMap, FileNode->FileName, &Result);
+        AcquireSRWLockShared(&FileNode->IndexLock);
+        ParentNode = FileNode->ParentNode;
+        if (0 != ParentNode)
+            MemfsFileNodeReference(ParentNode);
+        ReleaseSRWLockShared(&FileNode->IndexLock);
         if (0 == ParentNode)
-            return Result;
+            return STATUS_OBJECT_PATH_NOT_FOUND;
 
         if (0 == Marker)
+            Added = AddDirInfo(FileNode, L".", Buffer, Length, PBytesTransferred);
+        if (Added && (0 == Marker || (L'.' == Marker[0] && L'\0' == Marker[1])))
         {
-            if (!AddDirInfo(FileNode, L".", Buffer, Length, PBytesTransferred))
-                return STATUS_SUCCESS;
-        }
-        if (0 == Marker || (L'.' == Marker[0] && L'\0' == Marker[1]))
-        {
-            if (!AddDirInfo(ParentNode, L"..", Buffer, Length, PBytesTransferred))
-                return STATUS_SUCCESS;
+            Added = AddDirInfo(ParentNode, L"..", Buffer, Length, PBytesTransferred);
             Marker = 0;
         }
+
+        MemfsFileNodeDereference(Memfs->FileNodeMap, ParentNode);
+        if (!Added)
+            return STATUS_SUCCESS;
     }
 
-    if (MemfsFileNodeMapEnumerateChildren(Memfs->FileNodeMap, FileNode, Marker,
-        ReadDirectoryEnumFn, &Context))
-        FspFileSystemAddDirInfo(0, Buffer, Length, PBytesTransferred);
+    /*
+     * The children are listed from a directory snapshot that is shared by all handles
+     * (and all pages of an enumeration) until the directory changes (see MemfsFileNodeChanged).
+     * The dot entries above are not part of the snapshot, because they describe nodes
+     * outside this directory.
+     */
+    Context.PDirBuffer = &DirBuffer;
+    Context.Result = STATUS_SUCCESS;
+    if (FspFileSystemAcquireDirectorySnapshot(&Memfs->DirectorySnapshotCache,
+        FileNode->FileInfo.IndexNumber, MemfsFileNodeGeneration(FileNode), FALSE,
+        &DirBuffer, &Context.Result))
+    {
+        InterlockedIncrement64(&Memfs->DirectorySnapshotBuildCount);
+        MemfsFileNodeMapEnumerateChildren(Memfs->FileNodeMap, FileNode, 0,
+            ReadDirectoryEnumFn, &Context);
+        FspFileSystemReleaseDirectoryBuffer(&DirBuffer);
 
-#ifdef MEMFS_SLOWIO
-    if (SlowioReturnPending(FileSystem))
+        /* do not let other handles see an incomplete snapshot */
+        if (!NT_SUCCESS(Context.Result))
+            FspFileSystemInvalidateDirectorySnapshot(&Memfs->DirectorySnapshotCache,
+                FileNode->FileInfo.IndexNumber);
+    }
+    if (!NT_SUCCESS(Context.Result))
     {
-        try
-        {
-            InterlockedIncrement(&Memfs->SlowioThreadsRunning);
-            std::thread(SlowioReadDirectoryThread,
-                FileSystem, *PBytesTransferred,
-                FspFileSystemGetOperationContext()->Request->Hint).
-                detach();
-            return STATUS_PENDING;
-        }
-        catch (...)
-        {
-            InterlockedDecrement(&Memfs->SlowioThreadsRunning);
-        }
+        FspFileSystemDeleteDirectoryBuffer(&DirBuffer);
+        return Context.Result;
     }
+
+    FspFileSystemReadDirectoryBuffer(&DirBuffer, Marker, Buffer, Length, PBytesTransferred);
+    FspFileSystemDeleteDirectoryBuffer(&DirBuffer);
+
+#ifdef MEMFS_SLOWIO
+    if (SlowioReturnPending(FileSystem) &&
+        SlowioPost(FileSystem, SlowioReadDirectoryRoutine, FileNode, 0, 0, *PBytesTransferred))
+        return STATUS_PENDING;
     SlowioSnooze(FileSystem);
 #endif
 
@@ -1911,36 +3074,27 @@ static NTSTATUS GetDirInfoByName(FSP_FILE_SYSTEM *FileSystem,
     MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
     MEMFS_FILE_NODE *ParentNode = (MEMFS_FILE_NODE *)ParentNode0;
     MEMFS_FILE_NODE *FileNode;
-    WCHAR FileNameBuf[MEMFS_MAX_PATH];
-    size_t ParentLength, BSlashLength, FileNameLength;
-    WCHAR Root[2] = L"\\";
-    PWSTR Remain, Suffix;
-
-    ParentLength = wcslen(ParentNode->FileName);
-    BSlashLength = 1 < ParentLength;
-    FileNameLength = wcslen(FileName);
-    if (MEMFS_MAX_PATH <= ParentLength + BSlashLength + FileNameLength)
-        return STATUS_OBJECT_NAME_NOT_FOUND; //STATUS_OBJECT_NAME_INVALID?
 
-    memcpy(FileNameBuf, ParentNode->FileName, ParentLength * sizeof(WCHAR));
-    memcpy(FileNameBuf + ParentLength, L"\\", BSlashLength * sizeof(WCHAR));
-    memcpy(FileNameBuf + ParentLength + BSlashLength, FileName, (FileNameLength + 1) * sizeof(WCHAR));
+    AcquireSRWLockShared(&ParentNode->IndexLock);
 
-    FileName = FileNameBuf;
-
-    FileNode = MemfsFileNodeMapGet(Memfs->FileNodeMap, FileName);
+    FileNode = MemfsFileNodeIndexGet(ParentNode->ChildIndex, FileName);
     if (0 == FileNode)
+    {
+        ReleaseSRWLockShared(&ParentNode->IndexLock);
         return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
 
-    FspPathSuffix(FileNode->FileName, &Remain, &Suffix, Root);
-    FileName = Suffix;
-    FspPathCombine(FileNode->FileName, Suffix);
+    FileName = FileNode->FileName;
 
     //memset(DirInfo->Padding, 0, sizeof DirInfo->Padding);
     DirInfo->Size = (UINT16)(sizeof(FSP_FSCTL_DIR_INFO) + wcslen(FileName) * sizeof(WCHAR));
+    AcquireSRWLockShared(&FileNode->Lock);
     DirInfo->FileInfo = FileNode->FileInfo;
+    ReleaseSRWLockShared(&FileNode->Lock);
     memcpy(DirInfo->FileNameBuf, FileName, DirInfo->Size - sizeof(FSP_FSCTL_DIR_INFO));
 
+    ReleaseSRWLockShared(&ParentNode->IndexLock);
+
     return STATUS_SUCCESS;
 }
 #endif
@@ -1967,23 +3121,31 @@ static NTSTATUS GetReparsePointByName(
     assert(0 == wcschr(FileName, L':'));
 #endif
 
+    NTSTATUS Result = STATUS_SUCCESS;
+
     FileNode = MemfsFileNodeMapGet(Memfs->FileNodeMap, FileName);
     if (0 == FileNode)
         return STATUS_OBJECT_NAME_NOT_FOUND;
 
-    if (0 == (FileNode->FileInfo.FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
-        return STATUS_NOT_A_REPARSE_POINT;
+    AcquireSRWLockShared(&FileNode->Lock);
 
-    if (0 != Buffer)
+    if (0 == (FileNode->FileInfo.FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+        Result = STATUS_NOT_A_REPARSE_POINT;
+    else if (0 != Buffer)
     {
-        if (FileNode->ReparseDataSize > *PSize)
-            return STATUS_BUFFER_TOO_SMALL;
-
-        *PSize = FileNode->ReparseDataSize;
-        memcpy(Buffer, FileNode->ReparseData, FileNode->ReparseDataSize);
+        if (MemfsSharedBlobSize(FileNode->ReparseData) > *PSize)
+            Result = STATUS_BUFFER_TOO_SMALL;
+        else
+        {
+            *PSize = MemfsSharedBlobSize(FileNode->ReparseData);
+            memcpy(Buffer, FileNode->ReparseData, MemfsSharedBlobSize(FileNode->ReparseData));
+        }
     }
 
-    return STATUS_SUCCESS;
+    ReleaseSRWLockShared(&FileNode->Lock);
+    MemfsFileNodeDereference(Memfs->FileNodeMap, FileNode);
+
+    return Result;
 }
 
 static NTSTATUS GetReparsePoint(FSP_FILE_SYSTEM *FileSystem,
@@ -1991,22 +3153,28 @@ static NTSTATUS GetReparsePoint(FSP_FILE_SYSTEM *FileSystem,
     PWSTR FileName, PVOID Buffer, PSIZE_T PSize)
 {
     MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
+    NTSTATUS Result = STATUS_SUCCESS;
 
 #if defined(MEMFS_NAMED_STREAMS)
     if (0 != FileNode->MainFileNode)
         FileNode = FileNode->MainFileNode;
 #endif
 
-    if (0 == (FileNode->FileInfo.FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
-        return STATUS_NOT_A_REPARSE_POINT;
+    AcquireSRWLockShared(&FileNode->Lock);
 
-    if (FileNode->ReparseDataSize > *PSize)
-        return STATUS_BUFFER_TOO_SMALL;
+    if (0 == (FileNode->FileInfo.FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+        Result = STATUS_NOT_A_REPARSE_POINT;
+    else if (MemfsSharedBlobSize(FileNode->ReparseData) > *PSize)
+        Result = STATUS_BUFFER_TOO_SMALL;
+    else
+    {
+        *PSize = MemfsSharedBlobSize(FileNode->ReparseData);
+        memcpy(Buffer, FileNode->ReparseData, MemfsSharedBlobSize(FileNode->ReparseData));
+    }
 
-    *PSize = FileNode->ReparseDataSize;
-    memcpy(Buffer, FileNode->ReparseData, FileNode->ReparseDataSize);
+    ReleaseSRWLockShared(&FileNode->Lock);
 
-    return STATUS_SUCCESS;
+    return Result;
 }
 
 static NTSTATUS SetReparsePoint(FSP_FILE_SYSTEM *FileSystem,
@@ -2023,36 +3191,54 @@ static NTSTATUS SetReparsePoint(FSP_FILE_SYSTEM *FileSystem,
         FileNode = FileNode->MainFileNode;
 #endif
 
+    /* hold the IndexLock so that no child can be inserted while the reparse point is set */
+    AcquireSRWLockShared(&FileNode->IndexLock);
+    AcquireSRWLockExclusive(&FileNode->Lock);
+
     if (MemfsFileNodeMapHasChild(Memfs->FileNodeMap, FileNode))
-        return STATUS_DIRECTORY_NOT_EMPTY;
+    {
+        Result = STATUS_DIRECTORY_NOT_EMPTY;
+        goto exit;
+    }
 
     if (0 != FileNode->ReparseData)
     {
         Result = FspFileSystemCanReplaceReparsePoint(
-            FileNode->ReparseData, FileNode->ReparseDataSize,
+            FileNode->ReparseData, MemfsSharedBlobSize(FileNode->ReparseData),
             Buffer, Size);
         if (!NT_SUCCESS(Result))
-            return Result;
+            goto exit;
     }
 
-    ReparseData = realloc(FileNode->ReparseData, Size);
-    if (0 == ReparseData && 0 != Size)
-        return STATUS_INSUFFICIENT_RESOURCES;
+    ReparseData = MemfsSharedBlobIntern(&Memfs->FileNodeMap->ReparseTable, Buffer, Size);
+    if (0 == ReparseData)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+
+    MemfsSharedBlobRelease(&Memfs->FileNodeMap->ReparseTable, FileNode->ReparseData);
 
     FileNode->FileInfo.FileAttributes |= FILE_ATTRIBUTE_REPARSE_POINT;
     FileNode->FileInfo.ReparseTag = *(PULONG)Buffer;
         /* the first field in a reparse buffer is the reparse tag */
-    FileNode->ReparseDataSize = Size;
     FileNode->ReparseData = ReparseData;
-    memcpy(FileNode->ReparseData, Buffer, Size);
+    MemfsFileNodeChanged(FileNode);
 
-    return STATUS_SUCCESS;
+    Result = STATUS_SUCCESS;
+
+exit:
+    ReleaseSRWLockExclusive(&FileNode->Lock);
+    ReleaseSRWLockShared(&FileNode->IndexLock);
+
+    return Result;
 }
 
 static NTSTATUS DeleteReparsePoint(FSP_FILE_SYSTEM *FileSystem,
     PVOID FileNode0,
     PWSTR FileName, PVOID Buffer, SIZE_T Size)
 {
+    MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
     MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
     NTSTATUS Result;
 
@@ -2061,25 +3247,35 @@ static NTSTATUS DeleteReparsePoint(FSP_FILE_SYSTEM *FileSystem,
         FileNode = FileNode->MainFileNode;
 #endif
 
+    AcquireSRWLockExclusive(&FileNode->Lock);
+
     if (0 != FileNode->ReparseData)
     {
         Result = FspFileSystemCanReplaceReparsePoint(
-            FileNode->ReparseData, FileNode->ReparseDataSize,
+            FileNode->ReparseData, MemfsSharedBlobSize(FileNode->ReparseData),
             Buffer, Size);
         if (!NT_SUCCESS(Result))
-            return Result;
+            goto exit;
     }
     else
-        return STATUS_NOT_A_REPARSE_POINT;
+    {
+        Result = STATUS_NOT_A_REPARSE_POINT;
+        goto exit;
+    }
 
-    free(FileNode->ReparseData);
+    MemfsSharedBlobRelease(&Memfs->FileNodeMap->ReparseTable, FileNode->ReparseData);
 
     FileNode->FileInfo.FileAttributes &= ~FILE_ATTRIBUTE_REPARSE_POINT;
     FileNode->FileInfo.ReparseTag = 0;
-    FileNode->ReparseDataSize = 0;
     FileNode->ReparseData = 0;
+    MemfsFileNodeChanged(FileNode);
 
-    return STATUS_SUCCESS;
+    Result = STATUS_SUCCESS;
+
+exit:
+    ReleaseSRWLockExclusive(&FileNode->Lock);
+
+    return Result;
 }
 #endif
 
@@ -2094,19 +3290,18 @@ typedef struct _MEMFS_GET_STREAM_INFO_CONTEXT
 static BOOLEAN AddStreamInfo(MEMFS_FILE_NODE *FileNode,
     PVOID Buffer, ULONG Length, PULONG PBytesTransferred)
 {
-    UINT8 StreamInfoBuf[sizeof(FSP_FSCTL_STREAM_INFO) + sizeof FileNode->FileName];
+    UINT8 StreamInfoBuf[sizeof(FSP_FSCTL_STREAM_INFO) + MEMFS_MAX_NAME * sizeof(WCHAR)];
     FSP_FSCTL_STREAM_INFO *StreamInfo = (FSP_FSCTL_STREAM_INFO *)StreamInfoBuf;
     PWSTR StreamName;
 
-    StreamName = wcschr(FileNode->FileName, L':');
-    if (0 != StreamName)
-        StreamName++;
-    else
-        StreamName = L"";
+    /* if the node is a stream the caller holds the IndexLock of its main file */
+    StreamName = 0 != FileNode->MainFileNode ? FileNode->FileName : L"";
 
     StreamInfo->Size = (UINT16)(sizeof(FSP_FSCTL_STREAM_INFO) + wcslen(StreamName) * sizeof(WCHAR));
+    AcquireSRWLockShared(&FileNode->Lock);
     StreamInfo->StreamSize = FileNode->FileInfo.FileSize;
     StreamInfo->StreamAllocationSize = FileNode->FileInfo.AllocationSize;
+    ReleaseSRWLockShared(&FileNode->Lock);
     memcpy(StreamInfo->StreamNameBuf, StreamName, StreamInfo->Size - sizeof(FSP_FSCTL_STREAM_INFO));
 
     return FspFileSystemAddStreamInfo(StreamInfo, Buffer, Length, PBytesTransferred);
@@ -2207,8 +3402,15 @@ static NTSTATUS GetEa(FSP_FILE_SYSTEM *FileSystem,
     Context.EaLength = EaLength;
     Context.PBytesTransferred = PBytesTransferred;
 
+#if defined(MEMFS_NAMED_STREAMS)
+    if (0 != FileNode->MainFileNode)
+        FileNode = FileNode->MainFileNode;
+#endif
+
+    AcquireSRWLockShared(&FileNode->Lock);
     if (MemfsFileNodeEnumerateEa(FileNode, GetEaEnumFn, &Context))
         FspFileSystemAddEa(0, Ea, EaLength, PBytesTransferred);
+    ReleaseSRWLockShared(&FileNode->Lock);
 
     return STATUS_SUCCESS;
 }
@@ -2218,14 +3420,26 @@ static NTSTATUS SetEa(FSP_FILE_SYSTEM *FileSystem,
     PFILE_FULL_EA_INFORMATION Ea, ULONG EaLength,
     FSP_FSCTL_FILE_INFO *FileInfo)
 {
+    MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
     MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
+    MEMFS_FILE_NODE *MainFileNode = FileNode;
     NTSTATUS Result;
 
+#if defined(MEMFS_NAMED_STREAMS)
+    if (0 != FileNode->MainFileNode)
+        MainFileNode = FileNode->MainFileNode;
+#endif
+
+    AcquireSRWLockExclusive(&MainFileNode->Lock);
     Result = FspFileSystemEnumerateEa(FileSystem, MemfsFileNodeSetEa, FileNode, Ea, EaLength);
+    MemfsFileNodeChanged(MainFileNode);
+    ReleaseSRWLockExclusive(&MainFileNode->Lock);
     if (!NT_SUCCESS(Result))
         return Result;
 
+    AcquireSRWLockShared(&FileNode->Lock);
     MemfsFileNodeGetFileInfo(FileNode, FileInfo);
+    ReleaseSRWLockShared(&FileNode->Lock);
 
     return STATUS_SUCCESS;
 }
@@ -2302,6 +3516,79 @@ static FSP_FILE_SYSTEM_INTERFACE MemfsInterface =
 #endif
 };
 
+/*
+ * Operation guard
+ *
+ * MEMFS does its own node-level locking, so it does not need the DLL operation guard.
+ * The only thing that it cannot make atomic internally is the open-or-create sequence
+ * that the DLL performs for the FILE_OPEN_IF, FILE_OVERWRITE_IF and FILE_SUPERSEDE
+ * dispositions (Open followed by Create). These take the CreateLock exclusive; requests
+ * that can make a name appear (FILE_CREATE and rename) take it shared. All other requests
+ * run unguarded.
+ */
+
+static inline
+ULONG MemfsOperationGuardKind(FSP_FSCTL_TRANSACT_REQ *Request)
+{
+    /* 0: none, 1: shared, 2: exclusive */
+    if (FspFsctlTransactCreateKind == Request->Kind)
+    {
+        switch ((Request->Req.Create.CreateOptions >> 24) & 0xff)
+        {
+        case FILE_OPEN_IF:
+        case FILE_OVERWRITE_IF:
+        case FILE_SUPERSEDE:
+            return 2;
+        case FILE_CREATE:
+            return 1;
+        default:
+            return 0;
+        }
+    }
+    else
+    if (FspFsctlTransactSetInformationKind == Request->Kind &&
+        10/*FileRenameInformation*/ == Request->Req.SetInformation.FileInformationClass)
+        return 1;
+    else
+        return 0;
+}
+
+static NTSTATUS MemfsEnterOperation(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
+
+    switch (MemfsOperationGuardKind(Request))
+    {
+    case 2:
+        AcquireSRWLockExclusive(&Memfs->CreateLock);
+        break;
+    case 1:
+        AcquireSRWLockShared(&Memfs->CreateLock);
+        break;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS MemfsLeaveOperation(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
+
+    switch (MemfsOperationGuardKind(Request))
+    {
+    case 2:
+        ReleaseSRWLockExclusive(&Memfs->CreateLock);
+        break;
+    case 1:
+        ReleaseSRWLockShared(&Memfs->CreateLock);
+        break;
+    }
+
+    return STATUS_SUCCESS;
+}
+
 /*
  * Public API
  */
@@ -2323,8 +3610,14 @@ NTSTATUS MemfsCreateFunnel(
     FSP_FSCTL_VOLUME_PARAMS VolumeParams;
     BOOLEAN CaseInsensitive = !!(Flags & MemfsCaseInsensitive);
     BOOLEAN FlushAndPurgeOnCleanup = !!(Flags & MemfsFlushAndPurgeOnCleanup);
+    BOOLEAN TransactBatch = !!(Flags & MemfsTransactBatch);
+    BOOLEAN WorkStealing = !!(Flags & MemfsWorkStealing);
+    BOOLEAN TransferBuffers = !!(Flags & MemfsTransferBuffers);
+    BOOLEAN AdaptiveDispatcher = !!(Flags & MemfsAdaptiveDispatcher);
+    BOOLEAN NumaAffinity = !!(Flags & MemfsNumaAffinity);
     PWSTR DevicePath = MemfsNet == (Flags & MemfsDeviceMask) ?
-        L"" FSP_FSCTL_NET_DEVICE_NAME : L"" FSP_FSCTL_DISK_DEVICE_NAME;
+        L"" FSP_FSCTL_NET_DEVICE_NAME :
+        MemfsDetached == (Flags & MemfsDeviceMask) ? 0 : L"" FSP_FSCTL_DISK_DEVICE_NAME;
     UINT64 AllocationUnit;
     MEMFS *Memfs;
     MEMFS_FILE_NODE *RootNode;
@@ -2355,6 +3648,13 @@ NTSTATUS MemfsCreateFunnel(
     Memfs->MaxFileNodes = MaxFileNodes;
     AllocationUnit = MEMFS_SECTOR_SIZE * MEMFS_SECTORS_PER_ALLOCATION_UNIT;
     Memfs->MaxFileSize = (ULONG)((MaxFileSize + AllocationUnit - 1) / AllocationUnit * AllocationUnit);
+    InitializeSRWLock(&Memfs->CreateLock);
+    InitializeSRWLock(&Memfs->VolumeLock);
+    Memfs->TransactBatch = TransactBatch;
+    Memfs->WorkStealing = WorkStealing;
+    Memfs->TransferBuffers = TransferBuffers;
+    Memfs->AdaptiveDispatcher = AdaptiveDispatcher;
+    Memfs->NumaAffinity = NumaAffinity;
 
 #ifdef MEMFS_SLOWIO
     Memfs->SlowioMaxDelay = SlowioMaxDelay;
@@ -2422,16 +3722,18 @@ NTSTATUS MemfsCreateFunnel(
     Memfs->VolumeLabelLength = sizeof L"MEMFS" - sizeof(WCHAR);
     memcpy(Memfs->VolumeLabel, L"MEMFS", Memfs->VolumeLabelLength);
 
+    FspFileSystemSetOperationGuard(Memfs->FileSystem, MemfsEnterOperation, MemfsLeaveOperation);
 #if 0
     FspFileSystemSetOperationGuardStrategy(Memfs->FileSystem,
         FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_COARSE);
+    FspFileSystemSetOperationGuard(Memfs->FileSystem, FspFileSystemOpEnter, FspFileSystemOpLeave);
 #endif
 
     /*
      * Create root directory.
      */
 
-    Result = MemfsFileNodeCreate(L"\\", &RootNode);
+    Result = MemfsFileNodeCreate(Memfs->FileNodeMap, L"\\", &RootNode);
     if (!NT_SUCCESS(Result))
     {
         MemfsDelete(Memfs);
@@ -2441,21 +3743,20 @@ NTSTATUS MemfsCreateFunnel(
 
     RootNode->FileInfo.FileAttributes = FILE_ATTRIBUTE_DIRECTORY;
 
-    RootNode->FileSecurity = malloc(RootSecuritySize);
+    RootNode->FileSecurity = MemfsSharedBlobIntern(&Memfs->FileNodeMap->SecurityTable,
+        RootSecurity, RootSecuritySize);
     if (0 == RootNode->FileSecurity)
     {
-        MemfsFileNodeDelete(RootNode);
+        MemfsFileNodeDelete(Memfs->FileNodeMap, RootNode);
         MemfsDelete(Memfs);
         LocalFree(RootSecurity);
         return STATUS_INSUFFICIENT_RESOURCES;
     }
-    RootNode->FileSecuritySize = RootSecuritySize;
-    memcpy(RootNode->FileSecurity, RootSecurity, RootSecuritySize);
 
-    Result = MemfsFileNodeMapInsert(Memfs->FileNodeMap, RootNode, &Inserted);
+    Result = MemfsFileNodeMapInsert(Memfs->FileNodeMap, 0, RootNode, &Inserted);
     if (!NT_SUCCESS(Result))
     {
-        MemfsFileNodeDelete(RootNode);
+        MemfsFileNodeDelete(Memfs->FileNodeMap, RootNode);
         MemfsDelete(Memfs);
         LocalFree(RootSecurity);
         return Result;
@@ -2472,6 +3773,8 @@ VOID MemfsDelete(MEMFS *Memfs)
 {
     FspFileSystemDelete(Memfs->FileSystem);
 
+    FspFileSystemDeleteDirectorySnapshotCache(&Memfs->DirectorySnapshotCache);
+
     MemfsFileNodeMapDelete(Memfs->FileNodeMap);
 
     free(Memfs);
@@ -2479,21 +3782,41 @@ VOID MemfsDelete(MEMFS *Memfs)
 
 NTSTATUS MemfsStart(MEMFS *Memfs)
 {
+    FSP_FILE_SYSTEM_DISPATCHER_PARAMS DispatcherParams;
+
+    if (Memfs->TransferBuffers && 0 == Memfs->FileSystem->TransferBuffers)
+    {
+        NTSTATUS Result = FspFileSystemRegisterTransferBuffers(Memfs->FileSystem,
+            MEMFS_TRANSFER_BUFFER_SIZE, MEMFS_TRANSFER_BUFFER_COUNT);
+        if (!NT_SUCCESS(Result))
+            return Result;
+    }
+
+    memset(&DispatcherParams, 0, sizeof DispatcherParams);
+    DispatcherParams.Version = sizeof DispatcherParams;
+    if (Memfs->TransactBatch)
+        DispatcherParams.TransactBatchSize = FSP_FSCTL_TRANSACT_BATCH_BUFFER_SIZEMIN;
+    if (Memfs->WorkStealing)
+        DispatcherParams.Strategy = FSP_FILE_SYSTEM_DISPATCHER_STRATEGY_WORK_STEALING;
+    if (Memfs->AdaptiveDispatcher)
+    {
+        DispatcherParams.ThreadCountMax = MEMFS_ADAPTIVE_THREAD_COUNT_MAX;
+        DispatcherParams.IdleTimeout = MEMFS_ADAPTIVE_IDLE_TIMEOUT;
+    }
+    if (Memfs->NumaAffinity)
+        DispatcherParams.Affinity = FSP_FILE_SYSTEM_DISPATCHER_AFFINITY_NUMA;
 #ifdef MEMFS_SLOWIO
-    Memfs->SlowioThreadsRunning = 0;
+    if (0 != Memfs->SlowioMaxDelay)
+        DispatcherParams.AsyncThreadCount = MEMFS_SLOWIO_ASYNC_THREAD_COUNT;
 #endif
 
-    return FspFileSystemStartDispatcher(Memfs->FileSystem, 0);
+    return FspFileSystemStartDispatcherEx(Memfs->FileSystem, &DispatcherParams);
 }
 
 VOID MemfsStop(MEMFS *Memfs)
 {
+    /* this also runs (or cancels) any delayed I/O completions */
     FspFileSystemStopDispatcher(Memfs->FileSystem);
-
-#ifdef MEMFS_SLOWIO
-    while (Memfs->SlowioThreadsRunning)
-        Sleep(1);
-#endif
 }
 
 FSP_FILE_SYSTEM *MemfsFileSystem(MEMFS *Memfs)
@@ -2501,6 +3824,62 @@ FSP_FILE_SYSTEM *MemfsFileSystem(MEMFS *Memfs)
     return Memfs->FileSystem;
 }
 
+static VOID MemfsGetSharedBlobStatistics(MEMFS_SHARED_BLOB_TABLE *Table,
+    UINT64 *PCount, UINT64 *PReferences, UINT64 *PSize)
+{
+    AcquireSRWLockShared(&Table->Lock);
+    *PCount = Table->Count;
+    *PReferences = Table->References;
+    *PSize = Table->DataSize + Table->BucketCount * sizeof *Table->Buckets;
+    ReleaseSRWLockShared(&Table->Lock);
+}
+
+VOID MemfsGetMemoryStatistics(MEMFS *Memfs, MEMFS_MEMORY_STATISTICS *Statistics)
+{
+    MEMFS_FILE_NODE_MAP *FileNodeMap = Memfs->FileNodeMap;
+
+    memset(Statistics, 0, sizeof *Statistics);
+
+    Statistics->FileNodeCount = MemfsFileNodeMapCount(FileNodeMap);
+    Statistics->FileNodeSize = Statistics->FileNodeCount * sizeof(MEMFS_FILE_NODE);
+
+    /* approximate std::map node: 3 links, color/nil flags and the key/value pair */
+    Statistics->IndexSize = Statistics->FileNodeCount *
+        (4 * sizeof(PVOID) + sizeof(MEMFS_FILE_NODE_INDEX::value_type));
+
+    AcquireSRWLockShared(&FileNodeMap->NameArena.Lock);
+    Statistics->NameArenaSize = FileNodeMap->NameArena.ReservedSize;
+    Statistics->NameArenaUsedSize = FileNodeMap->NameArena.UsedSize;
+    ReleaseSRWLockShared(&FileNodeMap->NameArena.Lock);
+
+    MemfsGetSharedBlobStatistics(&FileNodeMap->SecurityTable,
+        &Statistics->SecurityCount, &Statistics->SecurityReferences, &Statistics->SecuritySize);
+#if defined(MEMFS_REPARSE_POINTS)
+    MemfsGetSharedBlobStatistics(&FileNodeMap->ReparseTable,
+        &Statistics->ReparseCount, &Statistics->ReparseReferences, &Statistics->ReparseSize);
+#endif
+#if defined(MEMFS_EA)
+    MemfsGetSharedBlobStatistics(&FileNodeMap->EaTable,
+        &Statistics->EaCount, &Statistics->EaReferences, &Statistics->EaSize);
+#endif
+
+    Statistics->TotalSize =
+        Statistics->FileNodeSize +
+        Statistics->IndexSize +
+        Statistics->NameArenaSize +
+        Statistics->SecuritySize +
+        Statistics->ReparseSize +
+        Statistics->EaSize;
+    if (0 != Statistics->FileNodeCount)
+        Statistics->BytesPerFileNode = Statistics->TotalSize / Statistics->FileNodeCount;
+
+    Statistics->FileDataPageCount = MemfsFileNodeMapPageCount(FileNodeMap);
+    Statistics->FileDataSize = Statistics->FileDataPageCount * FILE_DATA_PAGE_SIZE;
+
+    Statistics->DirectorySnapshotBuildCount =
+        InterlockedCompareExchange64(&Memfs->DirectorySnapshotBuildCount, 0, 0);
+}
+
 NTSTATUS MemfsHeapConfigure(SIZE_T InitialSize, SIZE_T MaximumSize, SIZE_T Alignment)
 {
     return LargeHeapInitialize(0, InitialSize, MaximumSize, LargeHeapAlignment) ?
@@ -34,9 +34,15 @@ enum
 {
     MemfsDisk                           = 0x00000000,
     MemfsNet                            = 0x00000001,
+    MemfsDetached                       = 0x00000002,   /* not connected to the FSD; for replay */
     MemfsDeviceMask                     = 0x0000000f,
     MemfsCaseInsensitive                = 0x80000000,
     MemfsFlushAndPurgeOnCleanup         = 0x40000000,
+    MemfsTransactBatch                  = 0x20000000,
+    MemfsWorkStealing                   = 0x10000000,
+    MemfsTransferBuffers                = 0x08000000,
+    MemfsAdaptiveDispatcher             = 0x04000000,
+    MemfsNumaAffinity                   = 0x02000000,
 };
 
 #define MemfsCreate(Flags, FileInfoTimeout, MaxFileNodes, MaxFileSize,             VolumePrefix, RootSddl, PMemfs)\
@@ -69,6 +75,30 @@ NTSTATUS MemfsStart(MEMFS *Memfs);
 VOID MemfsStop(MEMFS *Memfs);
 FSP_FILE_SYSTEM *MemfsFileSystem(MEMFS *Memfs);
 
+typedef struct _MEMFS_MEMORY_STATISTICS
+{
+    UINT64 FileNodeCount;
+    UINT64 FileNodeSize;                /* fixed-size node records */
+    UINT64 IndexSize;                   /* directory and stream index entries (estimate) */
+    UINT64 NameArenaSize;               /* name arena: reserved */
+    UINT64 NameArenaUsedSize;           /* name arena: in use */
+    UINT64 SecurityCount;               /* distinct security descriptors */
+    UINT64 SecurityReferences;          /* nodes sharing them */
+    UINT64 SecuritySize;
+    UINT64 ReparseCount;
+    UINT64 ReparseReferences;
+    UINT64 ReparseSize;
+    UINT64 EaCount;
+    UINT64 EaReferences;
+    UINT64 EaSize;
+    UINT64 TotalSize;                   /* metadata only; file data is not included */
+    UINT64 BytesPerFileNode;
+    UINT64 DirectorySnapshotBuildCount; /* directory listings built; others shared a snapshot */
+    UINT64 FileDataPageCount;           /* file data pages allocated; holes take none */
+    UINT64 FileDataSize;
+} MEMFS_MEMORY_STATISTICS;
+VOID MemfsGetMemoryStatistics(MEMFS *Memfs, MEMFS_MEMORY_STATISTICS *Statistics);
+
 NTSTATUS MemfsHeapConfigure(SIZE_T InitialSize, SIZE_T MaximumSize, SIZE_T Alignment);
 
 #ifdef __cplusplus
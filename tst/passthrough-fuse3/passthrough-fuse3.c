@@ -160,6 +160,62 @@ static int ptfs_write(const char *path, const char *buf, size_t size, fuse_off_t
     return -1 != (nb = pwrite(fd, buf, size, off)) ? nb : -errno;
 }
 
+#if defined(PTFS_BUFOPS)
+/*
+ * Build with PTFS_BUFOPS to serve I/O through read_buf/write_buf instead of read/write;
+ * this allows the two paths through the FUSE layer to be compared.
+ */
+static int ptfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, fuse_off_t off,
+    struct fuse_file_info *fi)
+{
+    int fd = fi_fd(fi);
+
+    struct fuse_bufvec *bufv;
+    int nb;
+
+    if (0 == (bufv = malloc(sizeof *bufv)))
+        return -ENOMEM;
+    *bufv = FUSE_BUFVEC_INIT(size);
+    if (0 == (bufv->buf[0].mem = malloc(size)))
+        return free(bufv), -ENOMEM;
+
+    if (-1 == (nb = pread(fd, bufv->buf[0].mem, size, off)))
+    {
+        nb = -errno;
+        free(bufv->buf[0].mem);
+        free(bufv);
+        return nb;
+    }
+
+    bufv->buf[0].size = nb;
+    *bufp = bufv;
+    return 0;
+}
+
+static int ptfs_write_buf(const char *path, struct fuse_bufvec *bufv, fuse_off_t off,
+    struct fuse_file_info *fi)
+{
+    int fd = fi_fd(fi);
+
+    struct fuse_buf *buf;
+    int nb, tot = 0;
+
+    for (; bufv->count > bufv->idx; bufv->idx++, bufv->off = 0)
+    {
+        buf = &bufv->buf[bufv->idx];
+        if (buf->flags & FUSE_BUF_IS_FD)
+            return 0 != tot ? tot : -ENOSYS;
+        if (-1 == (nb = pwrite(fd, (char *)buf->mem + bufv->off, buf->size - bufv->off, off + tot)))
+            return 0 != tot ? tot : -errno;
+        tot += nb;
+        if ((size_t)nb < buf->size - bufv->off)
+            break;
+    }
+
+    return tot;
+}
+#endif
+
 static int ptfs_statfs(const char *path, struct fuse_statvfs *stbuf)
 {
     ptfs_impl_fullpath(path);
@@ -289,6 +345,10 @@ static struct fuse_operations ptfs_ops =
     .open = ptfs_open,
     .read = ptfs_read,
     .write = ptfs_write,
+#if defined(PTFS_BUFOPS)
+    .read_buf = ptfs_read_buf,
+    .write_buf = ptfs_write_buf,
+#endif
     .statfs = ptfs_statfs,
     .release = ptfs_release,
     .fsync = ptfs_fsync,
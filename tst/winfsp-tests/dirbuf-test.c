@@ -21,6 +21,7 @@
 
 #include <winfsp/winfsp.h>
 #include <tlib/testsuite.h>
+#include <strsafe.h>
 #include <time.h>
 
 #include "winfsp-tests.h"
@@ -376,6 +377,470 @@ static void dirbuf_fill_test(void)
     }
 }
 
+static void dirbuf_fill_bulk_dotest(unsigned seed, ULONG Count, ULONG StageLength)
+{
+    PVOID DirBuffer = 0;
+    NTSTATUS Result;
+    BOOLEAN Success;
+    union
+    {
+        UINT8 B[sizeof(FSP_FSCTL_DIR_INFO) + MAX_PATH * sizeof(WCHAR)];
+        FSP_FSCTL_DIR_INFO D;
+    } DirInfoBuf;
+    FSP_FSCTL_DIR_INFO *DirInfo = &DirInfoBuf.D, *DirInfoEnd;
+    PUINT8 Stage, Buffer;
+    ULONG StageBytes, Length, BytesTransferred;
+    WCHAR CurrFileName[MAX_PATH], PrevFileName[MAX_PATH];
+    ULONG N;
+
+    srand(seed);
+
+    Stage = malloc(StageLength);
+    ASSERT(0 != Stage);
+    Length = Count * FSP_FSCTL_DEFAULT_ALIGN_UP(sizeof DirInfoBuf) + sizeof(UINT16);
+    Buffer = malloc(Length);
+    ASSERT(0 != Buffer);
+
+    Result = STATUS_UNSUCCESSFUL;
+    Success = FspFileSystemAcquireDirectoryBuffer(&DirBuffer, FALSE, &Result);
+    ASSERT(Success);
+    ASSERT(STATUS_SUCCESS == Result);
+
+    StageBytes = 0;
+    for (ULONG I = 0; Count > I; I++)
+    {
+        memset(&DirInfoBuf, 0, sizeof DirInfoBuf);
+        N = 24 + rand() % (32 - 24);
+        for (ULONG J = 0; N > J; J++)
+            DirInfo->FileNameBuf[J] = 'A' + rand() % 26;
+        DirInfo->Size = (UINT16)(sizeof(FSP_FSCTL_DIR_INFO) + N * sizeof(WCHAR));
+
+        if (!FspFileSystemAddDirInfo(DirInfo, Stage, StageLength, &StageBytes))
+        {
+            Result = STATUS_UNSUCCESSFUL;
+            Success = FspFileSystemFillDirectoryBufferBulk(&DirBuffer, Stage, StageBytes,
+                Count * (FSP_FSCTL_DEFAULT_ALIGN_UP(DirInfo->Size) + sizeof(ULONG)), &Result);
+            ASSERT(Success);
+            ASSERT(STATUS_SUCCESS == Result);
+
+            StageBytes = 0;
+            Success = FspFileSystemAddDirInfo(DirInfo, Stage, StageLength, &StageBytes);
+            ASSERT(Success);
+        }
+    }
+    FspFileSystemAddDirInfo(0, Stage, StageLength, &StageBytes);
+    Result = STATUS_UNSUCCESSFUL;
+    Success = FspFileSystemFillDirectoryBufferBulk(&DirBuffer, Stage, StageBytes, 0, &Result);
+    ASSERT(Success);
+    ASSERT(STATUS_SUCCESS == Result);
+
+    /* malformed entries are rejected */
+    memset(&DirInfoBuf, 0, sizeof DirInfoBuf);
+    DirInfo->Size = sizeof(FSP_FSCTL_DIR_INFO) + 4 * sizeof(WCHAR);
+    Result = STATUS_UNSUCCESSFUL;
+    Success = FspFileSystemFillDirectoryBufferBulk(&DirBuffer, DirInfo, sizeof(FSP_FSCTL_DIR_INFO), 0,
+        &Result);
+    ASSERT(!Success);
+    ASSERT(STATUS_INVALID_PARAMETER == Result);
+
+    FspFileSystemReleaseDirectoryBuffer(&DirBuffer);
+
+    BytesTransferred = 0;
+    FspFileSystemReadDirectoryBuffer(&DirBuffer, 0, Buffer, Length, &BytesTransferred);
+
+    N = 0;
+    PrevFileName[0] = L'\0';
+    for (
+        DirInfo = (PVOID)Buffer, DirInfoEnd = (PVOID)((PUINT8)Buffer + BytesTransferred);
+        DirInfoEnd > DirInfo && 0 != DirInfo->Size;
+        DirInfo = (PVOID)((PUINT8)DirInfo + FSP_FSCTL_DEFAULT_ALIGN_UP(DirInfo->Size)), N++)
+    {
+        memcpy(CurrFileName, DirInfo->FileNameBuf, DirInfo->Size - sizeof *DirInfo);
+        CurrFileName[(DirInfo->Size - sizeof *DirInfo) / sizeof(WCHAR)] = L'\0';
+        ASSERT(wcscmp(PrevFileName, CurrFileName) <= 0);
+        memcpy(PrevFileName, CurrFileName, sizeof CurrFileName);
+    }
+    ASSERT(DirInfoEnd > DirInfo);
+    ASSERT(0 == DirInfo->Size);
+    ASSERT(N == Count);
+
+    FspFileSystemDeleteDirectoryBuffer(&DirBuffer);
+
+    free(Buffer);
+    free(Stage);
+}
+
+static void dirbuf_fill_bulk_test(void)
+{
+    unsigned seed = (unsigned)time(0);
+
+    for (ULONG I = 0; 100 > I; I++)
+    {
+        dirbuf_fill_bulk_dotest(seed + I, 10, 512);
+        dirbuf_fill_bulk_dotest(seed + I, 1000, 4096);
+        dirbuf_fill_bulk_dotest(seed + I, 1000, 64 * 1024);
+    }
+}
+
+static void dirbuf_snapshot_fill(PVOID *PDirBuffer, PWSTR FileName)
+{
+    union
+    {
+        UINT8 B[sizeof(FSP_FSCTL_DIR_INFO) + MAX_PATH * sizeof(WCHAR)];
+        FSP_FSCTL_DIR_INFO D;
+    } DirInfoBuf;
+    FSP_FSCTL_DIR_INFO *DirInfo = &DirInfoBuf.D;
+    ULONG FileNameLen = (ULONG)wcslen(FileName);
+    NTSTATUS Result;
+    BOOLEAN Success;
+
+    memset(&DirInfoBuf, 0, sizeof DirInfoBuf);
+    DirInfo->Size = (UINT16)(sizeof(FSP_FSCTL_DIR_INFO) + FileNameLen * sizeof(WCHAR));
+    memcpy(DirInfo->FileNameBuf, FileName, FileNameLen * sizeof(WCHAR));
+    Result = STATUS_UNSUCCESSFUL;
+    Success = FspFileSystemFillDirectoryBuffer(PDirBuffer, DirInfo, &Result);
+    ASSERT(Success);
+    ASSERT(STATUS_SUCCESS == Result);
+}
+
+static ULONG dirbuf_snapshot_read(PVOID *PDirBuffer, PWSTR Marker,
+    PWSTR LastFileName, PBOOLEAN PEndOfDirectory)
+{
+    FSP_FSCTL_DIR_INFO *DirInfo, *DirInfoEnd;
+    UINT8 Buffer[1024];
+    ULONG BytesTransferred;
+    ULONG N;
+
+    BytesTransferred = 0;
+    FspFileSystemReadDirectoryBuffer(PDirBuffer, Marker, Buffer, sizeof Buffer, &BytesTransferred);
+
+    N = 0;
+    for (
+        DirInfo = (PVOID)Buffer, DirInfoEnd = (PVOID)(Buffer + BytesTransferred);
+        DirInfoEnd > DirInfo && 0 != DirInfo->Size;
+        DirInfo = (PVOID)((PUINT8)DirInfo + FSP_FSCTL_DEFAULT_ALIGN_UP(DirInfo->Size)), N++)
+    {
+        memcpy(LastFileName, DirInfo->FileNameBuf, DirInfo->Size - sizeof *DirInfo);
+        LastFileName[(DirInfo->Size - sizeof *DirInfo) / sizeof(WCHAR)] = L'\0';
+    }
+    *PEndOfDirectory = DirInfoEnd > DirInfo && 0 == DirInfo->Size;
+
+    return N;
+}
+
+static void dirbuf_snapshot_test(void)
+{
+    PVOID SnapshotCache = 0;
+    PVOID DirBuffer1 = 0, DirBuffer2 = 0;
+    NTSTATUS Result;
+    BOOLEAN Success, EndOfDirectory;
+    WCHAR FileName[MAX_PATH];
+    ULONG N;
+
+    /* first handle builds the snapshot */
+    Result = STATUS_UNSUCCESSFUL;
+    Success = FspFileSystemAcquireDirectorySnapshot(&SnapshotCache, 42, 1, FALSE, &DirBuffer1, &Result);
+    ASSERT(Success);
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(0 != SnapshotCache);
+    dirbuf_snapshot_fill(&DirBuffer1, L"b");
+    dirbuf_snapshot_fill(&DirBuffer1, L"a");
+    dirbuf_snapshot_fill(&DirBuffer1, L"c");
+    FspFileSystemReleaseDirectoryBuffer(&DirBuffer1);
+
+    /* same handle and generation: nothing to do */
+    Result = STATUS_UNSUCCESSFUL;
+    Success = FspFileSystemAcquireDirectorySnapshot(&SnapshotCache, 42, 1, FALSE, &DirBuffer1, &Result);
+    ASSERT(!Success);
+    ASSERT(STATUS_SUCCESS == Result);
+
+    /* second handle shares the snapshot */
+    Result = STATUS_UNSUCCESSFUL;
+    Success = FspFileSystemAcquireDirectorySnapshot(&SnapshotCache, 42, 1, FALSE, &DirBuffer2, &Result);
+    ASSERT(!Success);
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(DirBuffer1 == DirBuffer2);
+
+    N = dirbuf_snapshot_read(&DirBuffer2, 0, FileName, &EndOfDirectory);
+    ASSERT(3 == N);
+    ASSERT(0 == wcscmp(FileName, L"c"));
+    ASSERT(EndOfDirectory);
+    N = dirbuf_snapshot_read(&DirBuffer2, L"a", FileName, &EndOfDirectory);
+    ASSERT(2 == N);
+    ASSERT(EndOfDirectory);
+
+    /* plain directory buffer operations are not allowed on snapshots */
+    Result = STATUS_UNSUCCESSFUL;
+    Success = FspFileSystemAcquireDirectoryBuffer(&DirBuffer2, TRUE, &Result);
+    ASSERT(!Success);
+    ASSERT(STATUS_INVALID_PARAMETER == Result);
+
+    /* a generation change rebuilds; the first handle keeps its old snapshot */
+    Result = STATUS_UNSUCCESSFUL;
+    Success = FspFileSystemAcquireDirectorySnapshot(&SnapshotCache, 42, 2, FALSE, &DirBuffer2, &Result);
+    ASSERT(Success);
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(DirBuffer1 != DirBuffer2);
+    dirbuf_snapshot_fill(&DirBuffer2, L"d");
+    FspFileSystemReleaseDirectoryBuffer(&DirBuffer2);
+
+    N = dirbuf_snapshot_read(&DirBuffer2, 0, FileName, &EndOfDirectory);
+    ASSERT(1 == N);
+    ASSERT(0 == wcscmp(FileName, L"d"));
+    N = dirbuf_snapshot_read(&DirBuffer1, 0, FileName, &EndOfDirectory);
+    ASSERT(3 == N);
+
+    FspFileSystemDeleteDirectoryBuffer(&DirBuffer1);
+    ASSERT(0 == DirBuffer1);
+
+    /* invalidation forces a rebuild */
+    FspFileSystemInvalidateDirectorySnapshot(&SnapshotCache, 42);
+    Result = STATUS_UNSUCCESSFUL;
+    Success = FspFileSystemAcquireDirectorySnapshot(&SnapshotCache, 42, 2, FALSE, &DirBuffer1, &Result);
+    ASSERT(Success);
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(DirBuffer1 != DirBuffer2);
+    FspFileSystemReleaseDirectoryBuffer(&DirBuffer1);
+
+    N = dirbuf_snapshot_read(&DirBuffer1, 0, FileName, &EndOfDirectory);
+    ASSERT(0 == N);
+    ASSERT(EndOfDirectory);
+
+    FspFileSystemDeleteDirectoryBuffer(&DirBuffer1);
+    FspFileSystemDeleteDirectorySnapshotCache(&SnapshotCache);
+    ASSERT(0 == SnapshotCache);
+
+    /* snapshots outlive the cache while referenced */
+    N = dirbuf_snapshot_read(&DirBuffer2, 0, FileName, &EndOfDirectory);
+    ASSERT(1 == N);
+    FspFileSystemDeleteDirectoryBuffer(&DirBuffer2);
+}
+
+static void dirbuf_snapshot_streaming_test(void)
+{
+    PVOID SnapshotCache = 0;
+    PVOID DirBuffer1 = 0, DirBuffer2 = 0;
+    NTSTATUS Result;
+    BOOLEAN Success, EndOfDirectory;
+    WCHAR FileName[MAX_PATH];
+    ULONG N;
+
+    Result = STATUS_UNSUCCESSFUL;
+    Success = FspFileSystemAcquireDirectorySnapshot(&SnapshotCache, 7, 1, TRUE, &DirBuffer1, &Result);
+    ASSERT(Success);
+    ASSERT(STATUS_SUCCESS == Result);
+    dirbuf_snapshot_fill(&DirBuffer1, L"a");
+    dirbuf_snapshot_fill(&DirBuffer1, L"b");
+
+    Result = STATUS_UNSUCCESSFUL;
+    Success = FspFileSystemAcquireDirectorySnapshot(&SnapshotCache, 7, 1, TRUE, &DirBuffer2, &Result);
+    ASSERT(!Success);
+    ASSERT(STATUS_SUCCESS == Result);
+
+    /* first page is available before the enumeration completes */
+    N = dirbuf_snapshot_read(&DirBuffer2, 0, FileName, &EndOfDirectory);
+    ASSERT(2 == N);
+    ASSERT(0 == wcscmp(FileName, L"b"));
+    ASSERT(!EndOfDirectory);
+
+    dirbuf_snapshot_fill(&DirBuffer1, L"c");
+    N = dirbuf_snapshot_read(&DirBuffer2, L"b", FileName, &EndOfDirectory);
+    ASSERT(1 == N);
+    ASSERT(0 == wcscmp(FileName, L"c"));
+    ASSERT(!EndOfDirectory);
+
+    /* out of order entry stops publishing; release sorts */
+    dirbuf_snapshot_fill(&DirBuffer1, L"e");
+    dirbuf_snapshot_fill(&DirBuffer1, L"d");
+    N = dirbuf_snapshot_read(&DirBuffer2, L"c", FileName, &EndOfDirectory);
+    ASSERT(1 == N);
+    ASSERT(0 == wcscmp(FileName, L"e"));
+    FspFileSystemReleaseDirectoryBuffer(&DirBuffer1);
+
+    N = dirbuf_snapshot_read(&DirBuffer2, 0, FileName, &EndOfDirectory);
+    ASSERT(5 == N);
+    ASSERT(0 == wcscmp(FileName, L"e"));
+    ASSERT(EndOfDirectory);
+
+    FspFileSystemDeleteDirectoryBuffer(&DirBuffer1);
+    FspFileSystemDeleteDirectoryBuffer(&DirBuffer2);
+    FspFileSystemDeleteDirectorySnapshotCache(&SnapshotCache);
+}
+
+/*
+ * Reference quick sort: the pre-merge-sort directory buffer sort (see dirbuf.c),
+ * used by dirbuf_sort_bench_test as a baseline.
+ */
+static int dirbuf_sort_bench_cmp(PUINT8 Buffer, ULONG a, ULONG b)
+{
+    FSP_FSCTL_DIR_INFO *DirInfoA = (PVOID)(Buffer + a), *DirInfoB = (PVOID)(Buffer + b);
+    PWSTR NameA = DirInfoA->FileNameBuf, NameB = DirInfoB->FileNameBuf;
+    int LenA = (DirInfoA->Size - sizeof *DirInfoA) / sizeof(WCHAR);
+    int LenB = (DirInfoB->Size - sizeof *DirInfoB) / sizeof(WCHAR);
+    int Res;
+
+    if (1 == LenA && L'.' == NameA[0])
+        NameA = L"\1";
+    else if (2 == LenA && L'.' == NameA[0] && L'.' == NameA[1])
+        NameA = L"\1\1";
+    if (1 == LenB && L'.' == NameB[0])
+        NameB = L"\1";
+    else if (2 == LenB && L'.' == NameB[0] && L'.' == NameB[1])
+        NameB = L"\1\1";
+
+    Res = wcsncmp(NameA, NameB, LenA < LenB ? LenA : LenB);
+    return 0 != Res ? Res : LenA - LenB;
+}
+
+static void dirbuf_sort_bench_qsort(PUINT8 Buffer, PULONG Index, int l, int r)
+{
+    int stack[64], stackpos = 0;
+    int i, j;
+    ULONG v, t;
+
+    for (;;)
+    {
+        while (r > l)
+        {
+            i = l - 1, j = r, v = Index[r];
+            for (;;)
+            {
+                while (0 > dirbuf_sort_bench_cmp(Buffer, Index[++i], v))
+                    ;
+                while (0 > dirbuf_sort_bench_cmp(Buffer, v, Index[--j]))
+                    if (j == l)
+                        break;
+                if (i >= j)
+                    break;
+                t = Index[i]; Index[i] = Index[j]; Index[j] = t;
+            }
+            t = Index[i]; Index[i] = Index[r]; Index[r] = t;
+
+            if (i - l > r - i)
+            {
+                stack[stackpos++] = l; stack[stackpos++] = i - 1;
+                l = i + 1;
+            }
+            else
+            {
+                stack[stackpos++] = i + 1; stack[stackpos++] = r;
+                r = i - 1;
+            }
+        }
+
+        if (0 == stackpos)
+            break;
+
+        r = stack[--stackpos]; l = stack[--stackpos];
+    }
+}
+
+static void dirbuf_sort_bench_dotest(unsigned seed, ULONG Count, BOOLEAN CommonPrefix)
+{
+    PVOID DirBuffer = 0;
+    NTSTATUS Result;
+    BOOLEAN Success;
+    union
+    {
+        UINT8 B[sizeof(FSP_FSCTL_DIR_INFO) + MAX_PATH * sizeof(WCHAR)];
+        FSP_FSCTL_DIR_INFO D;
+    } DirInfoBuf;
+    FSP_FSCTL_DIR_INFO *DirInfo = &DirInfoBuf.D, *RefDirInfo;
+    PUINT8 RefBuffer, ReadBuffer;
+    PULONG RefIndex;
+    ULONG RefSize, Offset, ReadLength, BytesTransferred;
+    ULONG N, Perm, T;
+    DWORD times[4];
+
+    srand(seed);
+
+    RefBuffer = malloc(Count * FSP_FSCTL_DEFAULT_ALIGN_UP(sizeof DirInfoBuf));
+    RefIndex = malloc(Count * sizeof(ULONG));
+    ReadLength = 64 * 1024;
+    ReadBuffer = malloc(ReadLength);
+    ASSERT(0 != RefBuffer && 0 != RefIndex && 0 != ReadBuffer);
+
+    Result = STATUS_UNSUCCESSFUL;
+    Success = FspFileSystemAcquireDirectoryBuffer(&DirBuffer, FALSE, &Result);
+    ASSERT(Success);
+    ASSERT(STATUS_SUCCESS == Result);
+
+    /* names are filled in a random permutation (multiplicative hash of I) */
+    Perm = 2654435761u;
+    Offset = 0;
+    for (ULONG I = 0; Count > I; I++)
+    {
+        memset(&DirInfoBuf, 0, sizeof DirInfoBuf);
+        if (CommonPrefix)
+        {
+            StringCbPrintfW(DirInfo->FileNameBuf, MAX_PATH * sizeof(WCHAR),
+                L"file%08lx.dat", (ULONG)(I * Perm));
+            N = lstrlenW(DirInfo->FileNameBuf);
+        }
+        else
+        {
+            N = 8 + rand() % 24;
+            for (ULONG J = 0; N > J; J++)
+                DirInfo->FileNameBuf[J] = 'A' + rand() % 26;
+        }
+        DirInfo->Size = (UINT16)(sizeof(FSP_FSCTL_DIR_INFO) + N * sizeof(WCHAR));
+
+        Success = FspFileSystemFillDirectoryBuffer(&DirBuffer, DirInfo, &Result);
+        ASSERT(Success);
+        ASSERT(STATUS_SUCCESS == Result);
+
+        RefSize = FSP_FSCTL_DEFAULT_ALIGN_UP(DirInfo->Size);
+        memcpy(RefBuffer + Offset, DirInfo, DirInfo->Size);
+        RefIndex[I] = Offset;
+        Offset += RefSize;
+    }
+
+    times[0] = GetTickCount();
+    FspFileSystemReleaseDirectoryBuffer(&DirBuffer);
+    times[1] = GetTickCount();
+
+    times[2] = GetTickCount();
+    dirbuf_sort_bench_qsort(RefBuffer, RefIndex, 0, Count - 1);
+    times[3] = GetTickCount();
+
+    /* first page must match the reference order */
+    BytesTransferred = 0;
+    FspFileSystemReadDirectoryBuffer(&DirBuffer, 0, ReadBuffer, ReadLength, &BytesTransferred);
+    T = 0;
+    for (
+        DirInfo = (PVOID)ReadBuffer;
+        (PUINT8)DirInfo < ReadBuffer + BytesTransferred && 0 != DirInfo->Size;
+        DirInfo = (PVOID)((PUINT8)DirInfo + FSP_FSCTL_DEFAULT_ALIGN_UP(DirInfo->Size)), T++)
+    {
+        ASSERT(Count > T);
+        RefDirInfo = (PVOID)(RefBuffer + RefIndex[T]);
+        ASSERT(RefDirInfo->Size == DirInfo->Size);
+        ASSERT(0 == memcmp(RefDirInfo->FileNameBuf, DirInfo->FileNameBuf,
+            DirInfo->Size - sizeof *DirInfo));
+    }
+    ASSERT(0 < T);
+
+    FspDebugLog(__FUNCTION__ "(Count=%lu, CommonPrefix=%d): sort %ldms, reference quicksort %ldms\n",
+        Count, CommonPrefix, times[1] - times[0], times[3] - times[2]);
+
+    FspFileSystemDeleteDirectoryBuffer(&DirBuffer);
+
+    free(ReadBuffer);
+    free(RefIndex);
+    free(RefBuffer);
+}
+
+static void dirbuf_sort_bench_test(void)
+{
+    unsigned seed = (unsigned)time(0);
+
+    for (ULONG Count = 10000; 1000000 >= Count; Count *= 10)
+    {
+        dirbuf_sort_bench_dotest(seed, Count, FALSE);
+        dirbuf_sort_bench_dotest(seed, Count, TRUE);
+    }
+}
+
 void dirbuf_tests(void)
 {
     if (OptExternal)
@@ -384,4 +849,8 @@ void dirbuf_tests(void)
     TEST(dirbuf_empty_test);
     TEST(dirbuf_dots_test);
     TEST(dirbuf_fill_test);
+    TEST(dirbuf_fill_bulk_test);
+    TEST(dirbuf_snapshot_test);
+    TEST(dirbuf_snapshot_streaming_test);
+    TEST_OPT(dirbuf_sort_bench_test);
 }
@@ -19,6 +19,7 @@
  * associated repository.
  */
 
+#include <fuse/fuse.h>
 #include <fuse/fuse_opt.h>
 #include <tlib/testsuite.h>
 #include <stddef.h>
@@ -372,10 +373,30 @@ void fuse_opt_parse_test(void)
     free(data.esc);
 }
 
+void fuse_opt_lib_option_test(void)
+{
+    ASSERT(fuse_is_lib_option("attr_timeout=5"));
+    ASSERT(fuse_is_lib_option("AttrCache"));
+    ASSERT(fuse_is_lib_option("negative_timeout=5"));
+    ASSERT(fuse_is_lib_option("negative_timeout=0"));
+    ASSERT(fuse_is_lib_option("PathShardedGuard"));
+    ASSERT(fuse_is_lib_option("DirInfoThreadCount=4"));
+    ASSERT(fuse_is_lib_option("ReadAheadSize=65536"));
+    ASSERT(fuse_is_lib_option("WriteBackSize=65536"));
+    ASSERT(fuse_is_lib_option("FileInfoTimeout=1000"));
+
+    /* AttrCache is a flag; its timeouts are attr_timeout and negative_timeout */
+    ASSERT(!fuse_is_lib_option("AttrCache=1"));
+
+    ASSERT(!fuse_is_lib_option("NoSuchOption"));
+    ASSERT(!fuse_is_lib_option("NoSuchOption=5"));
+}
+
 void fuse_opt_tests(void)
 {
     if (OptExternal)
         return;
 
     TEST(fuse_opt_parse_test);
+    TEST(fuse_opt_lib_option_test);
 }
@@ -22,7 +22,12 @@
 #include <fuse/fuse.h>
 #include <tlib/testsuite.h>
 #include <process.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strsafe.h>
 
+/* the tests below mount their own file system; do not redirect or case-randomize its paths */
+#define WINFSP_TESTS_NO_HOOKS
 #include "winfsp-tests.h"
 
 static unsigned __stdcall fuse_tests_thread(void *f)
@@ -108,6 +113,1053 @@ static void fuse_parallel_test(void)
     }
 }
 
+/*
+ * A small in-memory FUSE file system that counts the calls made into it, so that the tests
+ * can observe what the FUSE layer does on behalf of Windows file operations. Nodes live in
+ * a fixed table indexed by ino - 1; FUSE_ROOT_ID is the root directory.
+ */
+#define FUSE_TESTS_NODE_COUNT           1024
+#define FUSE_TESTS_LOG_COUNT            256
+
+struct fuse_tests_node
+{
+    fuse_ino_t ino;                     /* 0: free */
+    fuse_ino_t parent;
+    char name[64];
+    int isdir;
+    char *data;
+    size_t size;
+};
+
+struct fuse_tests_io
+{
+    fuse_off_t off;
+    size_t size;
+};
+
+static struct
+{
+    SRWLOCK Lock;
+    struct fuse_tests_node Nodes[FUSE_TESTS_NODE_COUNT];
+    const char *EnoentName;             /* listed by readdir, but getattr fails with ENOENT */
+    int WriteError;                     /* write fails with this error when non-zero */
+    ULONG GetattrDelay;
+    volatile LONG GetattrCount, EnoentCount, InFlight, MaxInFlight;
+    volatile LONG LookupCount, ForgetCount;
+    volatile LONG64 NLookup[FUSE_TESTS_NODE_COUNT];
+    volatile LONG ReadCount, WriteCount;
+    struct fuse_tests_io Reads[FUSE_TESTS_LOG_COUNT], Writes[FUSE_TESTS_LOG_COUNT];
+} fuse_tests_fs;
+
+static void fuse_tests_fs_reset(void)
+{
+    for (ULONG I = 0; FUSE_TESTS_NODE_COUNT > I; I++)
+        free(fuse_tests_fs.Nodes[I].data);
+    memset(&fuse_tests_fs, 0, sizeof fuse_tests_fs);
+    InitializeSRWLock(&fuse_tests_fs.Lock);
+
+    fuse_tests_fs.Nodes[0].ino = FUSE_ROOT_ID;
+    fuse_tests_fs.Nodes[0].parent = FUSE_ROOT_ID;
+    fuse_tests_fs.Nodes[0].isdir = 1;
+}
+
+static void fuse_tests_fs_reset_counts(void)
+{
+    fuse_tests_fs.GetattrCount = 0;
+    fuse_tests_fs.EnoentCount = 0;
+    fuse_tests_fs.InFlight = 0;
+    fuse_tests_fs.MaxInFlight = 0;
+    fuse_tests_fs.LookupCount = 0;
+    fuse_tests_fs.ReadCount = 0;
+    fuse_tests_fs.WriteCount = 0;
+}
+
+static struct fuse_tests_node *fuse_tests_fs_child(fuse_ino_t parent,
+    const char *name, size_t namelen)
+{
+    for (ULONG I = 1; FUSE_TESTS_NODE_COUNT > I; I++)
+    {
+        struct fuse_tests_node *node = &fuse_tests_fs.Nodes[I];
+        if (0 != node->ino && parent == node->parent &&
+            namelen == strlen(node->name) && 0 == memcmp(name, node->name, namelen))
+            return node;
+    }
+    return 0;
+}
+
+static struct fuse_tests_node *fuse_tests_fs_lookup(const char *path,
+    struct fuse_tests_node **pparent, const char **pname)
+{
+    struct fuse_tests_node *node = &fuse_tests_fs.Nodes[0], *parent = 0;
+    const char *name = path, *nameend;
+
+    if (0 != pparent)
+        *pparent = 0;
+
+    for (;;)
+    {
+        while ('/' == *name)
+            name++;
+        if ('\0' == *name)
+            break;
+        if (0 == node)
+            return 0;
+        for (nameend = name; '\0' != *nameend && '/' != *nameend; nameend++)
+            ;
+        parent = node;
+        if (0 != pname)
+            *pname = name;
+        node = fuse_tests_fs_child(parent->ino, name, nameend - name);
+        name = nameend;
+    }
+
+    if (0 != pparent)
+        *pparent = parent;
+    return node;
+}
+
+static struct fuse_tests_node *fuse_tests_fs_new(fuse_ino_t parent, const char *name, int isdir)
+{
+    for (ULONG I = 1; FUSE_TESTS_NODE_COUNT > I; I++)
+    {
+        struct fuse_tests_node *node = &fuse_tests_fs.Nodes[I];
+        if (0 == node->ino)
+        {
+            node->ino = I + 1;
+            node->parent = parent;
+            StringCbCopyA(node->name, sizeof node->name, name);
+            node->isdir = isdir;
+            return node;
+        }
+    }
+    return 0;
+}
+
+static int fuse_tests_fs_resize(struct fuse_tests_node *node, size_t size)
+{
+    char *data;
+
+    if (size > node->size)
+    {
+        data = realloc(node->data, size);
+        if (0 == data)
+            return -ENOMEM;
+        memset(data + node->size, 0, size - node->size);
+        node->data = data;
+    }
+    node->size = size;
+    return 0;
+}
+
+/* create or resize a file behind the back of the FUSE layer; the parent must exist */
+static fuse_ino_t fuse_tests_fs_setfile(const char *path, size_t size, int isdir)
+{
+    struct fuse_tests_node *node, *parent;
+    const char *name;
+
+    AcquireSRWLockExclusive(&fuse_tests_fs.Lock);
+    node = fuse_tests_fs_lookup(path, &parent, &name);
+    if (0 == node)
+    {
+        ASSERT(0 != parent);
+        node = fuse_tests_fs_new(parent->ino, name, isdir);
+    }
+    ASSERT(0 != node);
+    if (!isdir)
+    {
+        ASSERT(0 == fuse_tests_fs_resize(node, size));
+        for (size_t I = 0; size > I; I++)
+            node->data[I] = (char)(I * 7 + I / 4096);
+    }
+    ReleaseSRWLockExclusive(&fuse_tests_fs.Lock);
+
+    return node->ino;
+}
+
+static size_t fuse_tests_fs_filesize(const char *path)
+{
+    struct fuse_tests_node *node;
+    size_t size;
+
+    AcquireSRWLockShared(&fuse_tests_fs.Lock);
+    node = fuse_tests_fs_lookup(path, 0, 0);
+    size = 0 != node ? node->size : (size_t)-1;
+    ReleaseSRWLockShared(&fuse_tests_fs.Lock);
+
+    return size;
+}
+
+static void fuse_tests_fs_log(volatile LONG *PCount, struct fuse_tests_io *Log,
+    fuse_off_t off, size_t size)
+{
+    LONG Index = InterlockedIncrement(PCount) - 1;
+    if (FUSE_TESTS_LOG_COUNT > Index)
+    {
+        Log[Index].off = off;
+        Log[Index].size = size;
+    }
+}
+
+static void fuse_tests_fs_stat(struct fuse_tests_node *node, struct fuse_stat *stbuf)
+{
+    memset(stbuf, 0, sizeof *stbuf);
+    stbuf->st_ino = node->ino;
+    stbuf->st_mode = (node->isdir ? 0040000 : 0100000) | 0777;
+    stbuf->st_nlink = 1;
+    stbuf->st_size = node->size;
+}
+
+static int fuse_tests_getattr(const char *path, struct fuse_stat *stbuf)
+{
+    struct fuse_tests_node *node;
+    LONG InFlight, MaxInFlight;
+    int err = 0;
+
+    InterlockedIncrement(&fuse_tests_fs.GetattrCount);
+    InFlight = InterlockedIncrement(&fuse_tests_fs.InFlight);
+    while (InFlight > (MaxInFlight = fuse_tests_fs.MaxInFlight) &&
+        MaxInFlight != InterlockedCompareExchange(&fuse_tests_fs.MaxInFlight, InFlight, MaxInFlight))
+        ;
+    if (0 != fuse_tests_fs.GetattrDelay)
+        Sleep(fuse_tests_fs.GetattrDelay);
+
+    AcquireSRWLockShared(&fuse_tests_fs.Lock);
+    node = fuse_tests_fs_lookup(path, 0, 0);
+    if (0 != node && 0 != fuse_tests_fs.EnoentName && 0 == strcmp(fuse_tests_fs.EnoentName, node->name))
+    {
+        InterlockedIncrement(&fuse_tests_fs.EnoentCount);
+        node = 0;
+    }
+    if (0 != node)
+        fuse_tests_fs_stat(node, stbuf);
+    else
+        err = -ENOENT;
+    ReleaseSRWLockShared(&fuse_tests_fs.Lock);
+
+    InterlockedDecrement(&fuse_tests_fs.InFlight);
+
+    return err;
+}
+
+static int fuse_tests_readdir(const char *path, void *buf, fuse_fill_dir_t filler, fuse_off_t off,
+    struct fuse_file_info *fi)
+{
+    struct fuse_tests_node *dir;
+    int err = 0;
+
+    AcquireSRWLockShared(&fuse_tests_fs.Lock);
+    dir = fuse_tests_fs_lookup(path, 0, 0);
+    if (0 != dir && dir->isdir)
+    {
+        /* names only; the FUSE layer must getattr every entry */
+        filler(buf, ".", 0, 0);
+        filler(buf, "..", 0, 0);
+        for (ULONG I = 1; FUSE_TESTS_NODE_COUNT > I; I++)
+            if (0 != fuse_tests_fs.Nodes[I].ino && dir->ino == fuse_tests_fs.Nodes[I].parent)
+                filler(buf, fuse_tests_fs.Nodes[I].name, 0, 0);
+    }
+    else
+        err = -ENOTDIR;
+    ReleaseSRWLockShared(&fuse_tests_fs.Lock);
+
+    return err;
+}
+
+static int fuse_tests_open(const char *path, struct fuse_file_info *fi)
+{
+    struct fuse_tests_node *node;
+
+    AcquireSRWLockShared(&fuse_tests_fs.Lock);
+    node = fuse_tests_fs_lookup(path, 0, 0);
+    ReleaseSRWLockShared(&fuse_tests_fs.Lock);
+
+    return 0 != node ? 0 : -ENOENT;
+}
+
+static int fuse_tests_mknode(const char *path, int isdir)
+{
+    struct fuse_tests_node *node, *parent;
+    const char *name;
+    int err = 0;
+
+    AcquireSRWLockExclusive(&fuse_tests_fs.Lock);
+    node = fuse_tests_fs_lookup(path, &parent, &name);
+    if (0 != node)
+        err = -EEXIST;
+    else if (0 == parent || !parent->isdir)
+        err = -ENOENT;
+    else if (0 == fuse_tests_fs_new(parent->ino, name, isdir))
+        err = -ENOSPC;
+    ReleaseSRWLockExclusive(&fuse_tests_fs.Lock);
+
+    return err;
+}
+
+static int fuse_tests_create(const char *path, fuse_mode_t mode, struct fuse_file_info *fi)
+{
+    return fuse_tests_mknode(path, 0);
+}
+
+static int fuse_tests_mkdir(const char *path, fuse_mode_t mode)
+{
+    return fuse_tests_mknode(path, 1);
+}
+
+static int fuse_tests_remove(const char *path)
+{
+    struct fuse_tests_node *node;
+    int err = 0;
+
+    AcquireSRWLockExclusive(&fuse_tests_fs.Lock);
+    node = fuse_tests_fs_lookup(path, 0, 0);
+    if (0 == node)
+        err = -ENOENT;
+    else
+    {
+        for (ULONG I = 1; FUSE_TESTS_NODE_COUNT > I; I++)
+            if (0 != fuse_tests_fs.Nodes[I].ino && node->ino == fuse_tests_fs.Nodes[I].parent)
+            {
+                err = -ENOTEMPTY;
+                break;
+            }
+        if (0 == err)
+        {
+            free(node->data);
+            memset(node, 0, sizeof *node);
+        }
+    }
+    ReleaseSRWLockExclusive(&fuse_tests_fs.Lock);
+
+    return err;
+}
+
+static int fuse_tests_rename(const char *oldpath, const char *newpath)
+{
+    struct fuse_tests_node *node, *newnode, *newparent;
+    const char *newname;
+    int err = 0;
+
+    AcquireSRWLockExclusive(&fuse_tests_fs.Lock);
+    node = fuse_tests_fs_lookup(oldpath, 0, 0);
+    newnode = fuse_tests_fs_lookup(newpath, &newparent, &newname);
+    if (0 == node || 0 == newparent)
+        err = -ENOENT;
+    else if (node != newnode)
+    {
+        if (0 != newnode)
+        {
+            free(newnode->data);
+            memset(newnode, 0, sizeof *newnode);
+        }
+        node->parent = newparent->ino;
+        StringCbCopyA(node->name, sizeof node->name, newname);
+    }
+    ReleaseSRWLockExclusive(&fuse_tests_fs.Lock);
+
+    return err;
+}
+
+static int fuse_tests_truncate(const char *path, fuse_off_t size)
+{
+    struct fuse_tests_node *node;
+    int err;
+
+    AcquireSRWLockExclusive(&fuse_tests_fs.Lock);
+    node = fuse_tests_fs_lookup(path, 0, 0);
+    err = 0 != node ? fuse_tests_fs_resize(node, (size_t)size) : -ENOENT;
+    ReleaseSRWLockExclusive(&fuse_tests_fs.Lock);
+
+    return err;
+}
+
+static int fuse_tests_read(const char *path, char *buf, size_t size, fuse_off_t off,
+    struct fuse_file_info *fi)
+{
+    struct fuse_tests_node *node;
+    int bytes;
+
+    fuse_tests_fs_log(&fuse_tests_fs.ReadCount, fuse_tests_fs.Reads, off, size);
+
+    AcquireSRWLockShared(&fuse_tests_fs.Lock);
+    node = fuse_tests_fs_lookup(path, 0, 0);
+    if (0 == node)
+        bytes = -ENOENT;
+    else if ((size_t)off >= node->size)
+        bytes = 0;
+    else
+    {
+        if (size > node->size - (size_t)off)
+            size = node->size - (size_t)off;
+        memcpy(buf, node->data + off, size);
+        bytes = (int)size;
+    }
+    ReleaseSRWLockShared(&fuse_tests_fs.Lock);
+
+    return bytes;
+}
+
+static int fuse_tests_write(const char *path, const char *buf, size_t size, fuse_off_t off,
+    struct fuse_file_info *fi)
+{
+    struct fuse_tests_node *node;
+    int bytes;
+
+    if (0 != fuse_tests_fs.WriteError)
+        return fuse_tests_fs.WriteError;
+
+    fuse_tests_fs_log(&fuse_tests_fs.WriteCount, fuse_tests_fs.Writes, off, size);
+
+    AcquireSRWLockExclusive(&fuse_tests_fs.Lock);
+    node = fuse_tests_fs_lookup(path, 0, 0);
+    if (0 == node)
+        bytes = -ENOENT;
+    else if ((size_t)off + size > node->size &&
+        0 != (bytes = fuse_tests_fs_resize(node, (size_t)off + size)))
+        ;
+    else
+    {
+        memcpy(node->data + off, buf, size);
+        bytes = (int)size;
+    }
+    ReleaseSRWLockExclusive(&fuse_tests_fs.Lock);
+
+    return bytes;
+}
+
+static struct fuse_operations fuse_tests_ops =
+{
+    .getattr = fuse_tests_getattr,
+    .mkdir = fuse_tests_mkdir,
+    .unlink = fuse_tests_remove,
+    .rmdir = fuse_tests_remove,
+    .rename = fuse_tests_rename,
+    .truncate = fuse_tests_truncate,
+    .open = fuse_tests_open,
+    .read = fuse_tests_read,
+    .write = fuse_tests_write,
+    .readdir = fuse_tests_readdir,
+    .create = fuse_tests_create,
+};
+
+static int fuse_tests_ino_lookup(fuse_ino_t parent, const char *name, struct fuse_stat *stbuf,
+    uint64_t *generation)
+{
+    struct fuse_tests_node *node;
+    int err = 0;
+
+    InterlockedIncrement(&fuse_tests_fs.LookupCount);
+
+    AcquireSRWLockShared(&fuse_tests_fs.Lock);
+    node = fuse_tests_fs_child(parent, name, strlen(name));
+    if (0 != node)
+    {
+        fuse_tests_fs_stat(node, stbuf);
+        *generation = 0;
+        InterlockedIncrement64(&fuse_tests_fs.NLookup[node->ino - 1]);
+    }
+    else
+        err = -ENOENT;
+    ReleaseSRWLockShared(&fuse_tests_fs.Lock);
+
+    return err;
+}
+
+static void fuse_tests_ino_forget(fuse_ino_t ino, uint64_t nlookup)
+{
+    InterlockedExchangeAdd64(&fuse_tests_fs.NLookup[ino - 1], -(LONG64)nlookup);
+    InterlockedIncrement(&fuse_tests_fs.ForgetCount);
+}
+
+static int fuse_tests_ino_getattr(fuse_ino_t ino, struct fuse_stat *stbuf,
+    struct fuse_file_info *fi)
+{
+    struct fuse_tests_node *node;
+    int err = 0;
+
+    InterlockedIncrement(&fuse_tests_fs.GetattrCount);
+
+    AcquireSRWLockShared(&fuse_tests_fs.Lock);
+    node = FUSE_TESTS_NODE_COUNT >= ino ? &fuse_tests_fs.Nodes[ino - 1] : 0;
+    if (0 != node && ino == node->ino)
+        fuse_tests_fs_stat(node, stbuf);
+    else
+        err = -ENOENT;
+    ReleaseSRWLockShared(&fuse_tests_fs.Lock);
+
+    return err;
+}
+
+static struct fuse_ino_operations fuse_tests_ino_ops =
+{
+    .lookup = fuse_tests_ino_lookup,
+    .forget = fuse_tests_ino_forget,
+    .getattr = fuse_tests_ino_getattr,
+};
+
+struct fuse_tests_mount
+{
+    char MountPoint[3];
+    WCHAR Root[4];
+    struct fuse_chan *ch;
+    struct fuse *f;
+    HANDLE Thread;
+};
+
+static unsigned __stdcall fuse_tests_thread_st(void *f)
+{
+    return fuse_loop(f);
+}
+
+/*
+ * Mount the test file system on a free drive. The options are passed to fuse_new in
+ * addition to "uid=-1,gid=-1,FileInfoTimeout=0": files are owned by the current user and
+ * the FSD does not cache their metadata, so that every access reaches the FUSE layer.
+ */
+static void fuse_tests_mount(struct fuse_tests_mount *Mount, const char *Options,
+    BOOLEAN SingleThreaded, const struct fuse_ino_operations *InoOps)
+{
+    char OptionsBuf[256];
+    char *argv[] = { "UNKNOWN", "-o", OptionsBuf, 0 };
+    struct fuse_args args = FUSE_ARGS_INIT(3, argv);
+    DWORD Drives;
+    WCHAR Drive;
+    ULONG Timeout;
+
+    StringCbPrintfA(OptionsBuf, sizeof OptionsBuf, "uid=-1,gid=-1,FileInfoTimeout=0%s%s",
+        0 != Options ? "," : "", 0 != Options ? Options : "");
+
+    Drives = GetLogicalDrives();
+    ASSERT(0 != Drives);
+    for (Drive = 'Z'; 'D' <= Drive; Drive--)
+        if (0 == (Drives & (1 << (Drive - 'A'))))
+            break;
+    ASSERT('D' <= Drive);
+
+    memset(Mount, 0, sizeof *Mount);
+    Mount->MountPoint[0] = (char)Drive;
+    Mount->MountPoint[1] = ':';
+    Mount->Root[0] = Drive;
+    Mount->Root[1] = L':';
+    Mount->Root[2] = L'\\';
+
+    Mount->ch = fuse_mount(Mount->MountPoint, &args);
+    ASSERT(0 != Mount->ch);
+
+    Mount->f = fuse_new(Mount->ch, &args, &fuse_tests_ops, sizeof fuse_tests_ops, 0);
+    ASSERT(0 != Mount->f);
+
+    if (0 != InoOps)
+        ASSERT(0 == fuse_set_ino_operations(Mount->f, InoOps, sizeof *InoOps));
+
+    Mount->Thread = (HANDLE)_beginthreadex(0, 0,
+        SingleThreaded ? fuse_tests_thread_st : fuse_tests_thread, Mount->f, 0, 0);
+    ASSERT(0 != Mount->Thread);
+
+    for (Timeout = 0; INVALID_FILE_ATTRIBUTES == GetFileAttributesW(Mount->Root); Timeout += 50)
+    {
+        ASSERT(10000 > Timeout);
+        Sleep(50);
+    }
+
+    fuse_tests_fs_reset_counts();
+}
+
+static void fuse_tests_unmount(struct fuse_tests_mount *Mount)
+{
+    DWORD ExitCode;
+
+    fuse_exit(Mount->f);
+
+    WaitForSingleObject(Mount->Thread, INFINITE);
+    GetExitCodeThread(Mount->Thread, &ExitCode);
+    CloseHandle(Mount->Thread);
+
+    fuse_destroy(Mount->f);
+
+    fuse_unmount(Mount->MountPoint, Mount->ch);
+
+    ASSERT(0 == ExitCode);
+}
+
+static void fuse_tests_path(struct fuse_tests_mount *Mount, PWSTR Name, PWSTR FilePath, ULONG Size)
+{
+    StringCbPrintfW(FilePath, Size, L"%s%s", Mount->Root, Name);
+}
+
+static UINT64 fuse_tests_filesize(struct fuse_tests_mount *Mount, PWSTR Name)
+{
+    WCHAR FilePath[MAX_PATH];
+    WIN32_FILE_ATTRIBUTE_DATA AttributeData;
+
+    fuse_tests_path(Mount, Name, FilePath, sizeof FilePath);
+    if (!GetFileAttributesExW(FilePath, GetFileExInfoStandard, &AttributeData))
+        return (UINT64)-1;
+    return ((UINT64)AttributeData.nFileSizeHigh << 32) | AttributeData.nFileSizeLow;
+}
+
+static void fuse_attrcache_test(void)
+{
+    struct fuse_tests_mount Mount;
+    WCHAR FilePath[MAX_PATH], NewFilePath[MAX_PATH];
+    HANDLE Handle;
+    LARGE_INTEGER FileSize;
+    LONG GetattrCount;
+
+    fuse_tests_fs_reset();
+    fuse_tests_fs_setfile("/a", 10, 0);
+    fuse_tests_fs_setfile("/c", 5, 0);
+    fuse_tests_mount(&Mount, "AttrCache,attr_timeout=60", FALSE, 0);
+
+    /* the first access misses, the following ones hit */
+    ASSERT(10 == fuse_tests_filesize(&Mount, L"a"));
+    GetattrCount = fuse_tests_fs.GetattrCount;
+    ASSERT(0 < GetattrCount);
+    for (ULONG I = 0; 10 > I; I++)
+        ASSERT(10 == fuse_tests_filesize(&Mount, L"a"));
+    ASSERT(GetattrCount == fuse_tests_fs.GetattrCount);
+
+    /* changes behind our back are not seen until fuse_notify */
+    fuse_tests_fs_setfile("/a", 20, 0);
+    ASSERT(10 == fuse_tests_filesize(&Mount, L"a"));
+    ASSERT(GetattrCount == fuse_tests_fs.GetattrCount);
+    ASSERT(0 == fuse_notify(Mount.f, "/a", 0));
+    ASSERT(20 == fuse_tests_filesize(&Mount, L"a"));
+    ASSERT(GetattrCount < fuse_tests_fs.GetattrCount);
+
+    /* SetFileSize invalidates */
+    fuse_tests_path(&Mount, L"a", FilePath, sizeof FilePath);
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    FileSize.QuadPart = 30;
+    ASSERT(SetFilePointerEx(Handle, FileSize, 0, FILE_BEGIN));
+    ASSERT(SetEndOfFile(Handle));
+    CloseHandle(Handle);
+    ASSERT(30 == fuse_tests_fs_filesize("/a"));
+    ASSERT(30 == fuse_tests_filesize(&Mount, L"a"));
+
+    /* Rename invalidates all entries, not just the renamed ones */
+    ASSERT(5 == fuse_tests_filesize(&Mount, L"c"));
+    fuse_tests_fs_setfile("/c", 6, 0);
+    ASSERT(5 == fuse_tests_filesize(&Mount, L"c"));
+    fuse_tests_path(&Mount, L"d", NewFilePath, sizeof NewFilePath);
+    ASSERT(MoveFileExW(FilePath, NewFilePath, 0));
+    ASSERT((UINT64)-1 == fuse_tests_filesize(&Mount, L"a"));
+    ASSERT(30 == fuse_tests_filesize(&Mount, L"d"));
+    ASSERT(6 == fuse_tests_filesize(&Mount, L"c"));
+
+    /* without negative_timeout failed lookups are not cached */
+    GetattrCount = fuse_tests_fs.GetattrCount;
+    ASSERT((UINT64)-1 == fuse_tests_filesize(&Mount, L"b"));
+    ASSERT(GetattrCount < fuse_tests_fs.GetattrCount);
+    GetattrCount = fuse_tests_fs.GetattrCount;
+    ASSERT((UINT64)-1 == fuse_tests_filesize(&Mount, L"b"));
+    ASSERT(GetattrCount < fuse_tests_fs.GetattrCount);
+
+    fuse_tests_unmount(&Mount);
+}
+
+static void fuse_attrcache_expiry_test(void)
+{
+    struct fuse_tests_mount Mount;
+
+    fuse_tests_fs_reset();
+    fuse_tests_fs_setfile("/a", 10, 0);
+    fuse_tests_mount(&Mount, "AttrCache,attr_timeout=1", FALSE, 0);
+
+    ASSERT(10 == fuse_tests_filesize(&Mount, L"a"));
+    fuse_tests_fs_setfile("/a", 20, 0);
+    ASSERT(10 == fuse_tests_filesize(&Mount, L"a"));
+
+    Sleep(1500);
+    ASSERT(20 == fuse_tests_filesize(&Mount, L"a"));
+
+    fuse_tests_unmount(&Mount);
+
+    /* AttrCache without attr_timeout uses the libfuse default of 1 second */
+    fuse_tests_fs_setfile("/a", 10, 0);
+    fuse_tests_mount(&Mount, "AttrCache", FALSE, 0);
+
+    ASSERT(10 == fuse_tests_filesize(&Mount, L"a"));
+    fuse_tests_fs_setfile("/a", 20, 0);
+    ASSERT(10 == fuse_tests_filesize(&Mount, L"a"));
+
+    Sleep(1500);
+    ASSERT(20 == fuse_tests_filesize(&Mount, L"a"));
+
+    fuse_tests_unmount(&Mount);
+}
+
+static void fuse_attrcache_negative_test(void)
+{
+    struct fuse_tests_mount Mount;
+    WCHAR FilePath[MAX_PATH];
+    HANDLE Handle;
+    LONG GetattrCount;
+
+    fuse_tests_fs_reset();
+    fuse_tests_fs_setfile("/a", 10, 0);
+    fuse_tests_mount(&Mount, "negative_timeout=60", FALSE, 0);
+
+    /* negative_timeout alone caches failed lookups only */
+    ASSERT((UINT64)-1 == fuse_tests_filesize(&Mount, L"b"));
+    GetattrCount = fuse_tests_fs.GetattrCount;
+    ASSERT((UINT64)-1 == fuse_tests_filesize(&Mount, L"b"));
+    ASSERT(GetattrCount == fuse_tests_fs.GetattrCount);
+
+    ASSERT(10 == fuse_tests_filesize(&Mount, L"a"));
+    GetattrCount = fuse_tests_fs.GetattrCount;
+    ASSERT(10 == fuse_tests_filesize(&Mount, L"a"));
+    ASSERT(GetattrCount < fuse_tests_fs.GetattrCount);
+
+    /* Create invalidates the negative entry */
+    fuse_tests_path(&Mount, L"b", FilePath, sizeof FilePath);
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ | GENERIC_WRITE, 0, 0, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    CloseHandle(Handle);
+    ASSERT(0 == fuse_tests_filesize(&Mount, L"b"));
+
+    fuse_tests_unmount(&Mount);
+
+    /* negative_timeout=0 disables negative caching */
+    fuse_tests_mount(&Mount, "AttrCache,negative_timeout=0", FALSE, 0);
+
+    ASSERT((UINT64)-1 == fuse_tests_filesize(&Mount, L"c"));
+    GetattrCount = fuse_tests_fs.GetattrCount;
+    ASSERT((UINT64)-1 == fuse_tests_filesize(&Mount, L"c"));
+    ASSERT(GetattrCount < fuse_tests_fs.GetattrCount);
+
+    fuse_tests_unmount(&Mount);
+}
+
+/* list the root and check that every file "fNNN" has size NNN + 1; returns the file count */
+static ULONG fuse_tests_list(struct fuse_tests_mount *Mount)
+{
+    WCHAR FilePath[MAX_PATH];
+    HANDLE Handle;
+    WIN32_FIND_DATAW FindData;
+    ULONG Index, Count = 0;
+
+    fuse_tests_path(Mount, L"*", FilePath, sizeof FilePath);
+    Handle = FindFirstFileW(FilePath, &FindData);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    do
+    {
+        if (0 == wcscmp(FindData.cFileName, L".") || 0 == wcscmp(FindData.cFileName, L".."))
+            continue;
+
+        ASSERT(L'f' == FindData.cFileName[0]);
+        Index = wcstoul(FindData.cFileName + 1, 0, 10);
+        ASSERT(0 == FindData.nFileSizeHigh);
+        ASSERT(Index + 1 == FindData.nFileSizeLow);
+        ASSERT(0 == (FindData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY));
+        Count++;
+    } while (FindNextFileW(Handle, &FindData));
+    ASSERT(ERROR_NO_MORE_FILES == GetLastError());
+    FindClose(Handle);
+
+    return Count;
+}
+
+static void fuse_dirinfo_test(void)
+{
+    struct fuse_tests_mount Mount;
+    char Path[16];
+    LONG GetattrCount;
+
+    fuse_tests_fs_reset();
+    for (ULONG I = 0; 100 > I; I++)
+    {
+        StringCbPrintfA(Path, sizeof Path, "/f%03u", I);
+        fuse_tests_fs_setfile(Path, I + 1, 0);
+    }
+    fuse_tests_fs_setfile("/gone", 1, 0);
+    fuse_tests_fs.EnoentName = "gone";
+    fuse_tests_fs.GetattrDelay = 5;
+
+    /* readdir returns names only; the entries are filled by parallel getattr's */
+    fuse_tests_mount(&Mount, "DirInfoThreadCount=4", FALSE, 0);
+
+    ASSERT(100 == fuse_tests_list(&Mount));
+    ASSERT(1 == fuse_tests_fs.EnoentCount);
+    ASSERT(1 < fuse_tests_fs.MaxInFlight);
+    ASSERT(5 >= fuse_tests_fs.MaxInFlight);
+
+    fuse_tests_unmount(&Mount);
+
+    /* with negative_timeout the entry that failed getattr is not asked for again */
+    fuse_tests_mount(&Mount, "DirInfoThreadCount=4,negative_timeout=60", FALSE, 0);
+
+    ASSERT(100 == fuse_tests_list(&Mount));
+    ASSERT(1 == fuse_tests_fs.EnoentCount);
+    GetattrCount = fuse_tests_fs.GetattrCount;
+    ASSERT(100 == fuse_tests_list(&Mount));
+    ASSERT(1 == fuse_tests_fs.EnoentCount);
+    ASSERT(GetattrCount + 100 <= fuse_tests_fs.GetattrCount);
+
+    fuse_tests_unmount(&Mount);
+
+    /* single-threaded (-s) file systems never fan out */
+    fuse_tests_mount(&Mount, "DirInfoThreadCount=4", TRUE, 0);
+
+    ASSERT(100 == fuse_tests_list(&Mount));
+    ASSERT(1 == fuse_tests_fs.EnoentCount);
+    ASSERT(1 == fuse_tests_fs.MaxInFlight);
+
+    fuse_tests_unmount(&Mount);
+}
+
+static void fuse_tests_open_close(struct fuse_tests_mount *Mount, PWSTR Name)
+{
+    WCHAR FilePath[MAX_PATH];
+    HANDLE Handle;
+
+    fuse_tests_path(Mount, Name, FilePath, sizeof FilePath);
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    CloseHandle(Handle);
+}
+
+static void fuse_node_rename_test(void)
+{
+    struct fuse_tests_mount Mount;
+    WCHAR FilePath[MAX_PATH], NewFilePath[MAX_PATH];
+    fuse_ino_t DirIno, FileIno;
+    LONG LookupCount;
+    ULONG Timeout;
+
+    fuse_tests_fs_reset();
+    DirIno = fuse_tests_fs_setfile("/d", 0, 1);
+    FileIno = fuse_tests_fs_setfile("/d/f", 10, 0);
+    fuse_tests_mount(&Mount, 0, FALSE, &fuse_tests_ino_ops);
+
+    /* the first open looks up every component, the next ones follow the links */
+    fuse_tests_open_close(&Mount, L"d\\f");
+    ASSERT(2 == fuse_tests_fs.LookupCount);
+    fuse_tests_open_close(&Mount, L"d\\f");
+    ASSERT(2 == fuse_tests_fs.LookupCount);
+
+    /* after a rename the node is looked up once under its new name and linked again */
+    fuse_tests_path(&Mount, L"d", FilePath, sizeof FilePath);
+    fuse_tests_path(&Mount, L"e", NewFilePath, sizeof NewFilePath);
+    ASSERT(MoveFileExW(FilePath, NewFilePath, 0));
+    fuse_tests_open_close(&Mount, L"e\\f");
+    LookupCount = fuse_tests_fs.LookupCount;
+    for (ULONG I = 0; 10 > I; I++)
+        fuse_tests_open_close(&Mount, L"e\\f");
+    ASSERT(LookupCount == fuse_tests_fs.LookupCount);
+
+    ASSERT(2 == fuse_tests_fs.NLookup[DirIno - 1]);
+    ASSERT(1 == fuse_tests_fs.NLookup[FileIno - 1]);
+    ASSERT(0 == fuse_tests_fs.ForgetCount);
+
+    /* deleting the nodes forgets every lookup that returned them */
+    fuse_tests_path(&Mount, L"e\\f", FilePath, sizeof FilePath);
+    ASSERT(DeleteFileW(FilePath));
+    ASSERT(RemoveDirectoryW(NewFilePath));
+    for (Timeout = 0;
+        0 != fuse_tests_fs.NLookup[DirIno - 1] || 0 != fuse_tests_fs.NLookup[FileIno - 1];
+        Timeout += 50)
+    {
+        ASSERT(10000 > Timeout);
+        Sleep(50);
+    }
+    ASSERT(2 == fuse_tests_fs.ForgetCount);
+
+    fuse_tests_unmount(&Mount);
+}
+
+/* read or write at an offset on a synchronous handle; returns the bytes transferred or -1 */
+static LONG fuse_tests_io(HANDLE Handle, BOOLEAN Write, PVOID Buffer, UINT64 Offset, ULONG Length)
+{
+    OVERLAPPED Overlapped;
+    DWORD BytesTransferred;
+    BOOL Success;
+
+    memset(&Overlapped, 0, sizeof Overlapped);
+    Overlapped.Offset = (DWORD)Offset;
+    Overlapped.OffsetHigh = (DWORD)(Offset >> 32);
+    Success = Write ?
+        WriteFile(Handle, Buffer, Length, &BytesTransferred, &Overlapped) :
+        ReadFile(Handle, Buffer, Length, &BytesTransferred, &Overlapped);
+    if (!Success)
+        return ERROR_HANDLE_EOF == GetLastError() ? 0 : -1;
+    return (LONG)BytesTransferred;
+}
+
+/* open a file for non-cached I/O, so that every Read and Write reaches the FUSE layer */
+static HANDLE fuse_tests_open_nobuf(struct fuse_tests_mount *Mount, PWSTR Name)
+{
+    WCHAR FilePath[MAX_PATH];
+
+    fuse_tests_path(Mount, Name, FilePath, sizeof FilePath);
+    return CreateFileW(FilePath,
+        GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, 0,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING, 0);
+}
+
+static void fuse_readahead_test(void)
+{
+    struct fuse_tests_mount Mount;
+    HANDLE Handle;
+    PUINT8 Buffer;
+    ULONG FileSize = 256 * 1024, MaxSize = 0;
+    LONG ReadCount;
+
+    Buffer = VirtualAlloc(0, 4096, MEM_COMMIT, PAGE_READWRITE);
+    ASSERT(0 != Buffer);
+
+    fuse_tests_fs_reset();
+    fuse_tests_fs_setfile("/r", FileSize, 0);
+    fuse_tests_mount(&Mount, "ReadAheadSize=65536", FALSE, 0);
+
+    Handle = fuse_tests_open_nobuf(&Mount, L"r");
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+
+    /* sequential reads grow the window up to ReadAheadSize */
+    for (ULONG Offset = 0; FileSize > Offset; Offset += 4096)
+    {
+        ASSERT(4096 == fuse_tests_io(Handle, FALSE, Buffer, Offset, 4096));
+        for (ULONG I = 0; 4096 > I; I++)
+            ASSERT((UINT8)((Offset + I) * 7 + (Offset + I) / 4096) == Buffer[I]);
+    }
+    ASSERT(0 == fuse_tests_io(Handle, FALSE, Buffer, FileSize, 4096));
+    ReadCount = fuse_tests_fs.ReadCount;
+    ASSERT(8 >= ReadCount);
+    ASSERT(8192 == fuse_tests_fs.Reads[0].size);
+    for (LONG I = 0; ReadCount > I; I++)
+    {
+        if (0 < I)
+            ASSERT(fuse_tests_fs.Reads[I - 1].size <= fuse_tests_fs.Reads[I].size);
+        if (MaxSize < fuse_tests_fs.Reads[I].size)
+            MaxSize = (ULONG)fuse_tests_fs.Reads[I].size;
+    }
+    ASSERT(65536 == MaxSize);
+
+    /* a read elsewhere collapses the window; it grows again from the size of the read */
+    ASSERT(4096 == fuse_tests_io(Handle, FALSE, Buffer, 0, 4096));
+    ASSERT(ReadCount + 1 == fuse_tests_fs.ReadCount);
+    ASSERT(0 == fuse_tests_fs.Reads[ReadCount].off);
+    ASSERT(4096 == fuse_tests_fs.Reads[ReadCount].size);
+    ASSERT(4096 == fuse_tests_io(Handle, FALSE, Buffer, 4096, 4096));
+    ASSERT(ReadCount + 2 == fuse_tests_fs.ReadCount);
+    ASSERT(4096 == fuse_tests_fs.Reads[ReadCount + 1].off);
+    ASSERT(8192 == fuse_tests_fs.Reads[ReadCount + 1].size);
+    for (ULONG I = 0; 4096 > I; I++)
+        ASSERT((UINT8)((4096 + I) * 7 + 1) == Buffer[I]);
+
+    CloseHandle(Handle);
+
+    fuse_tests_unmount(&Mount);
+
+    VirtualFree(Buffer, 0, MEM_RELEASE);
+}
+
+static void fuse_writeback_test(void)
+{
+    struct fuse_tests_mount Mount;
+    HANDLE Handle;
+    PUINT8 Buffer;
+    LARGE_INTEGER FileSize;
+    ULONG Timeout;
+
+    Buffer = VirtualAlloc(0, 4096, MEM_COMMIT, PAGE_READWRITE);
+    ASSERT(0 != Buffer);
+
+    fuse_tests_fs_reset();
+    fuse_tests_fs_setfile("/w", 0, 0);
+    fuse_tests_mount(&Mount, "WriteBackSize=65536,AttrCache,attr_timeout=60", FALSE, 0);
+
+    Handle = fuse_tests_open_nobuf(&Mount, L"w");
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+
+    /* writes that continue each other are coalesced */
+    for (ULONG Offset = 0; 32768 > Offset; Offset += 4096)
+    {
+        memset(Buffer, (UINT8)(Offset / 4096 + 1), 4096);
+        ASSERT(4096 == fuse_tests_io(Handle, TRUE, Buffer, Offset, 4096));
+    }
+    ASSERT(0 == fuse_tests_fs.WriteCount);
+
+    /* the handle sees its buffered writes; other handles (and the cache) do not */
+    ASSERT(GetFileSizeEx(Handle, &FileSize));
+    ASSERT(32768 == FileSize.QuadPart);
+    ASSERT(0 == fuse_tests_filesize(&Mount, L"w"));
+
+    ASSERT(FlushFileBuffers(Handle));
+    ASSERT(1 == fuse_tests_fs.WriteCount);
+    ASSERT(0 == fuse_tests_fs.Writes[0].off);
+    ASSERT(32768 == fuse_tests_fs.Writes[0].size);
+    ASSERT(32768 == fuse_tests_fs_filesize("/w"));
+    ASSERT(32768 == fuse_tests_filesize(&Mount, L"w"));
+
+    /* a write that does not continue the buffer writes it out */
+    ASSERT(4096 == fuse_tests_io(Handle, TRUE, Buffer, 0, 4096));
+    ASSERT(4096 == fuse_tests_io(Handle, TRUE, Buffer, 65536, 4096));
+    ASSERT(2 == fuse_tests_fs.WriteCount);
+    ASSERT(0 == fuse_tests_fs.Writes[1].off);
+    ASSERT(4096 == fuse_tests_fs.Writes[1].size);
+
+    /* Cleanup (or Close, which the FSD may post later) writes out the rest */
+    CloseHandle(Handle);
+    for (Timeout = 0; 3 > fuse_tests_fs.WriteCount; Timeout += 50)
+    {
+        ASSERT(10000 > Timeout);
+        Sleep(50);
+    }
+    ASSERT(3 == fuse_tests_fs.WriteCount);
+    ASSERT(65536 == fuse_tests_fs.Writes[2].off);
+    ASSERT(4096 == fuse_tests_fs.Writes[2].size);
+    ASSERT(65536 + 4096 == fuse_tests_fs_filesize("/w"));
+
+    fuse_tests_unmount(&Mount);
+
+    VirtualFree(Buffer, 0, MEM_RELEASE);
+}
+
+static void fuse_writeback_error_test(void)
+{
+    struct fuse_tests_mount Mount;
+    HANDLE Handle;
+    PUINT8 Buffer;
+
+    Buffer = VirtualAlloc(0, 4096, MEM_COMMIT, PAGE_READWRITE);
+    ASSERT(0 != Buffer);
+
+    fuse_tests_fs_reset();
+    fuse_tests_fs_setfile("/h", 8192, 0);
+    fuse_tests_mount(&Mount, "WriteBackSize=65536", FALSE, 0);
+
+    Handle = fuse_tests_open_nobuf(&Mount, L"h");
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+
+    /* an error writing out on Read is held and returned by the next Write */
+    ASSERT(4096 == fuse_tests_io(Handle, TRUE, Buffer, 0, 4096));
+    fuse_tests_fs.WriteError = -EIO;
+    ASSERT(4096 == fuse_tests_io(Handle, FALSE, Buffer, 4096, 4096));
+    fuse_tests_fs.WriteError = 0;
+    ASSERT(-1 == fuse_tests_io(Handle, TRUE, Buffer, 0, 4096));
+    ASSERT(4096 == fuse_tests_io(Handle, TRUE, Buffer, 0, 4096));
+    ASSERT(FlushFileBuffers(Handle));
+
+    /* ... or by the next Flush */
+    ASSERT(4096 == fuse_tests_io(Handle, TRUE, Buffer, 0, 4096));
+    fuse_tests_fs.WriteError = -EIO;
+    ASSERT(4096 == fuse_tests_io(Handle, FALSE, Buffer, 4096, 4096));
+    fuse_tests_fs.WriteError = 0;
+    ASSERT(!FlushFileBuffers(Handle));
+    ASSERT(FlushFileBuffers(Handle));
+
+    CloseHandle(Handle);
+
+    fuse_tests_unmount(&Mount);
+
+    VirtualFree(Buffer, 0, MEM_RELEASE);
+}
+
 void fuse_tests(void)
 {
     if (OptExternal)
@@ -115,4 +1167,12 @@ void fuse_tests(void)
 
     TEST_OPT(fuse_sequential_test);
     TEST_OPT(fuse_parallel_test);
+    TEST(fuse_attrcache_test);
+    TEST(fuse_attrcache_expiry_test);
+    TEST(fuse_attrcache_negative_test);
+    TEST(fuse_dirinfo_test);
+    TEST(fuse_node_rename_test);
+    TEST(fuse_readahead_test);
+    TEST(fuse_writeback_test);
+    TEST(fuse_writeback_error_test);
 }
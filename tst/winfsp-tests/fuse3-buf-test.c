@@ -0,0 +1,177 @@
+/**
+ * @file fuse3-buf-test.c
+ *
+ * @copyright 2015-2021 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+/* the FUSE2 and FUSE3 headers cannot be included in the same file */
+#include <fuse3/fuse_common.h>
+#include <tlib/testsuite.h>
+#include <errno.h>
+#include <string.h>
+
+#include "winfsp-tests.h"
+
+/* struct fuse_bufvec declares a single buffer; make room for more */
+struct bufvec3
+{
+    struct fuse_bufvec v;
+    struct fuse_buf extra[2];
+};
+
+static char fuse3_buf_src[15], fuse3_buf_dst[18];
+
+/* point the buffers of bufv at consecutive ranges of mem with the given sizes */
+static void fuse3_buf_init(struct bufvec3 *bufv, char *mem, size_t size0, size_t size1, size_t size2)
+{
+    size_t size[3] = { size0, size1, size2 };
+
+    memset(bufv, 0, sizeof *bufv);
+    bufv->v.count = 3;
+    for (size_t i = 0; 3 > i; mem += size[i], i++)
+    {
+        bufv->v.buf[i].size = size[i];
+        bufv->v.buf[i].mem = mem;
+        bufv->v.buf[i].fd = -1;
+    }
+}
+
+static void fuse3_buf_size_test(void)
+{
+    struct bufvec3 bufv;
+
+    fuse3_buf_init(&bufv, fuse3_buf_src, 3, 5, 7);
+    ASSERT(15 == fuse_buf_size(&bufv.v));
+
+    /* idx and off do not change the size */
+    bufv.v.idx = 1;
+    bufv.v.off = 2;
+    ASSERT(15 == fuse_buf_size(&bufv.v));
+
+    bufv.v.count = 1;
+    ASSERT(3 == fuse_buf_size(&bufv.v));
+
+    bufv.v.count = 0;
+    ASSERT(0 == fuse_buf_size(&bufv.v));
+}
+
+static void fuse3_buf_copy_test(void)
+{
+    struct bufvec3 src, dst;
+
+    for (int i = 0; sizeof fuse3_buf_src > i; i++)
+        fuse3_buf_src[i] = (char)(i + 1);
+    memset(fuse3_buf_dst, 0, sizeof fuse3_buf_dst);
+
+    /* source buffers of 3, 5 and 7 bytes into destination buffers of 4, 6 and 8 bytes */
+    fuse3_buf_init(&src, fuse3_buf_src, 3, 5, 7);
+    fuse3_buf_init(&dst, fuse3_buf_dst, 4, 6, 8);
+    src.v.idx = 1;
+    src.v.off = 2;
+    dst.v.off = 2;
+
+    ASSERT(10 == fuse_buf_copy(&dst.v, &src.v, 0));
+    ASSERT(3 == src.v.idx);
+    ASSERT(0 == src.v.off);
+    ASSERT(2 == dst.v.idx);
+    ASSERT(2 == dst.v.off);
+
+    ASSERT(0 == fuse3_buf_dst[0] && 0 == fuse3_buf_dst[1]);
+    for (int i = 0; 10 > i; i++)
+        ASSERT(6 + i == fuse3_buf_dst[2 + i]);
+    for (int i = 12; sizeof fuse3_buf_dst > i; i++)
+        ASSERT(0 == fuse3_buf_dst[i]);
+
+    /* nothing is left to copy */
+    ASSERT(0 == fuse_buf_copy(&dst.v, &src.v, 0));
+}
+
+static void fuse3_buf_copy_short_test(void)
+{
+    struct bufvec3 src, dst;
+
+    for (int i = 0; sizeof fuse3_buf_src > i; i++)
+        fuse3_buf_src[i] = (char)(i + 1);
+    memset(fuse3_buf_dst, 0, sizeof fuse3_buf_dst);
+
+    /* the destination has room for 5 of the 15 bytes */
+    fuse3_buf_init(&src, fuse3_buf_src, 3, 5, 7);
+    fuse3_buf_init(&dst, fuse3_buf_dst, 2, 3, 0);
+    dst.v.count = 2;
+
+    ASSERT(5 == fuse_buf_copy(&dst.v, &src.v, 0));
+    ASSERT(1 == src.v.idx);
+    ASSERT(2 == src.v.off);
+    for (int i = 0; 5 > i; i++)
+        ASSERT(1 + i == fuse3_buf_dst[i]);
+    ASSERT(0 == fuse3_buf_dst[5]);
+
+    /* a second copy continues where the first one stopped */
+    fuse3_buf_init(&dst, fuse3_buf_dst + 5, 13, 0, 0);
+    dst.v.count = 1;
+
+    ASSERT(10 == fuse_buf_copy(&dst.v, &src.v, 0));
+    for (int i = 0; sizeof fuse3_buf_src > i; i++)
+        ASSERT(1 + i == fuse3_buf_dst[i]);
+}
+
+static void fuse3_buf_copy_fd_test(void)
+{
+    struct bufvec3 src, dst;
+
+    for (int i = 0; sizeof fuse3_buf_src > i; i++)
+        fuse3_buf_src[i] = (char)(i + 1);
+    memset(fuse3_buf_dst, 0, sizeof fuse3_buf_dst);
+
+    /* file descriptor buffers cannot be copied */
+    fuse3_buf_init(&src, fuse3_buf_src, 3, 5, 7);
+    fuse3_buf_init(&dst, fuse3_buf_dst, 18, 0, 0);
+    dst.v.count = 1;
+    src.v.buf[0].flags = FUSE_BUF_IS_FD;
+    src.v.buf[0].fd = 0;
+
+    ASSERT(-ENOSYS == fuse_buf_copy(&dst.v, &src.v, 0));
+    ASSERT(0 == src.v.idx && 0 == src.v.off);
+    ASSERT(0 == dst.v.idx && 0 == dst.v.off);
+
+    /* the bytes copied before reaching one are reported instead */
+    fuse3_buf_init(&src, fuse3_buf_src, 3, 5, 7);
+    src.v.buf[1].flags = FUSE_BUF_IS_FD;
+    src.v.buf[1].fd = 0;
+
+    ASSERT(3 == fuse_buf_copy(&dst.v, &src.v, 0));
+    ASSERT(1 == src.v.idx && 0 == src.v.off);
+    ASSERT(-ENOSYS == fuse_buf_copy(&dst.v, &src.v, 0));
+
+    /* ... and the same holds for the destination */
+    fuse3_buf_init(&src, fuse3_buf_src, 3, 5, 7);
+    fuse3_buf_init(&dst, fuse3_buf_dst, 4, 6, 8);
+    dst.v.buf[1].flags = FUSE_BUF_IS_FD;
+    dst.v.buf[1].fd = 0;
+
+    ASSERT(4 == fuse_buf_copy(&dst.v, &src.v, 0));
+    ASSERT(-ENOSYS == fuse_buf_copy(&dst.v, &src.v, 0));
+}
+
+void fuse3_buf_tests(void)
+{
+    TEST(fuse3_buf_size_test);
+    TEST(fuse3_buf_copy_test);
+    TEST(fuse3_buf_copy_short_test);
+    TEST(fuse3_buf_copy_fd_test);
+}
@@ -22,6 +22,8 @@
 #include <winfsp/winfsp.h>
 #include <tlib/testsuite.h>
 #include <process.h>
+#include <sddl.h>
+#include <strsafe.h>
 #include "memfs.h"
 
 #include "winfsp-tests.h"
@@ -51,7 +53,7 @@ void *memfs_start_ex(ULONG Flags, ULONG FileInfoTimeout)
         10, /*SlowioPercentDelay*/
         5,  /*SlowioRarefyDelay*/
         0,
-        MemfsNet == Flags ? L"\\memfs\\share" : 0,
+        MemfsNet == (Flags & MemfsDeviceMask) ? L"\\memfs\\share" : 0,
         0,
         &Memfs);
     ASSERT(NT_SUCCESS(Result));
@@ -113,10 +115,2021 @@ void memfs_test(void)
         memfs_dotest(MemfsNet);
 }
 
+static unsigned __stdcall memfs_batch_dotest_thread(void *Context)
+{
+    PWSTR Prefix = Context;
+    HANDLE Handle;
+    BOOL Success;
+    WCHAR FilePath[MAX_PATH];
+
+    for (int j = 1; 100 >= j; j++)
+    {
+        StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\file%lu.%d",
+            Prefix, GetCurrentThreadId(), j);
+        Handle = CreateFileW(FilePath,
+            GENERIC_ALL, 0, 0, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, 0);
+        ASSERT(INVALID_HANDLE_VALUE != Handle);
+        Success = CloseHandle(Handle);
+        ASSERT(Success);
+
+        ASSERT(INVALID_FILE_ATTRIBUTES != GetFileAttributesW(FilePath));
+
+        Success = DeleteFileW(FilePath);
+        ASSERT(Success);
+    }
+
+    return 0;
+}
+
+ULONG memfs_batch_dotest(ULONG Flags)
+{
+    void *memfs = memfs_start(Flags);
+    FSP_FILE_SYSTEM *FileSystem = MemfsFileSystem(memfs);
+    FSP_FILE_SYSTEM_STATISTICS *Statistics;
+
+    WCHAR Prefix[MAX_PATH];
+    HANDLE Thread[32];
+    DWORD ExitCode;
+    DWORD times[2];
+    UINT64 TransactCount, RequestCount;
+    NTSTATUS Result;
+
+    StringCbPrintfW(Prefix, sizeof Prefix, L"\\\\?\\GLOBALROOT%s", memfs_volumename(memfs));
+
+    Statistics = malloc(sizeof *Statistics);
+    ASSERT(0 != Statistics);
+
+    FspFileSystemResetStatistics(FileSystem);
+    times[0] = GetTickCount();
+
+    /* more client threads than dispatcher threads, so that requests queue up */
+    for (int i = 0; sizeof Thread / sizeof Thread[0] > i; i++)
+    {
+        Thread[i] = (HANDLE)_beginthreadex(0, 0, memfs_batch_dotest_thread, Prefix, 0, 0);
+        ASSERT(0 != Thread[i]);
+    }
+
+    for (int i = 0; sizeof Thread / sizeof Thread[0] > i; i++)
+    {
+        WaitForSingleObject(Thread[i], INFINITE);
+        GetExitCodeThread(Thread[i], &ExitCode);
+        CloseHandle(Thread[i]);
+
+        ASSERT(0 == ExitCode);
+    }
+
+    times[1] = GetTickCount();
+    Statistics->Version = sizeof *Statistics;
+    Result = FspFileSystemGetStatistics(FileSystem, Statistics, FALSE);
+    ASSERT(STATUS_SUCCESS == Result);
+    TransactCount = Statistics->TransactCount;
+    RequestCount = Statistics->RequestCount;
+    ASSERT(0 < RequestCount);
+
+    FspDebugLog(__FUNCTION__ "(Flags=%lx): %ldms, %lld transactions, %lld requests, "
+        "%lld.%02lld transactions/request\n",
+        Flags, times[1] - times[0], TransactCount, RequestCount,
+        TransactCount / RequestCount, TransactCount * 100 / RequestCount % 100);
+
+    free(Statistics);
+
+    memfs_stop(memfs);
+
+    /* transactions per request (in hundredths) */
+    return (ULONG)(TransactCount * 100 / RequestCount);
+}
+
+void memfs_batch_test(void)
+{
+    if (WinFspDiskTests)
+    {
+        ULONG Baseline, Batch;
+
+        Baseline = memfs_batch_dotest(MemfsDisk);
+        Batch = memfs_batch_dotest(MemfsDisk | MemfsTransactBatch);
+
+        /* every single request transaction receives one request at most */
+        ASSERT(100 <= Baseline);
+        /* a batch transaction receives all queued requests (that fit) at once */
+        ASSERT(Batch < Baseline);
+    }
+}
+
+void memfs_workstealing_test(void)
+{
+    if (WinFspDiskTests)
+    {
+        memfs_batch_dotest(MemfsDisk | MemfsWorkStealing);
+        memfs_batch_dotest(MemfsDisk | MemfsWorkStealing | MemfsTransactBatch);
+    }
+}
+
+void memfs_adaptive_dotest(ULONG Flags)
+{
+    void *memfs = memfs_start(Flags);
+    FSP_FILE_SYSTEM *FileSystem = MemfsFileSystem(memfs);
+    FSP_FILE_SYSTEM_STATISTICS *Statistics;
+    SYSTEM_INFO SystemInfo;
+    NTSTATUS Result;
+
+    WCHAR Prefix[MAX_PATH];
+    HANDLE Thread[32];
+    DWORD ExitCode;
+    ULONG ThreadCountMin, ThreadCountPeak;
+
+    StringCbPrintfW(Prefix, sizeof Prefix, L"\\\\?\\GLOBALROOT%s", memfs_volumename(memfs));
+
+    Statistics = malloc(sizeof *Statistics);
+    ASSERT(0 != Statistics);
+
+    Statistics->Version = sizeof *Statistics;
+    Result = FspFileSystemGetStatistics(FileSystem, Statistics, FALSE);
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(0 < Statistics->DispatcherThreadCountMin);
+    ASSERT(Statistics->DispatcherThreadCountMin < Statistics->DispatcherThreadCountMax);
+    ThreadCountMin = Statistics->DispatcherThreadCountMin;
+    ThreadCountPeak = 0;
+
+    /* more client threads than dispatcher threads, so that requests queue up */
+    for (int i = 0; sizeof Thread / sizeof Thread[0] > i; i++)
+    {
+        Thread[i] = (HANDLE)_beginthreadex(0, 0, memfs_batch_dotest_thread, Prefix, 0, 0);
+        ASSERT(0 != Thread[i]);
+    }
+
+    /* sample the pool while the load runs */
+    while (WAIT_TIMEOUT == WaitForMultipleObjects(
+        sizeof Thread / sizeof Thread[0], Thread, TRUE, 10))
+    {
+        Result = FspFileSystemGetStatistics(FileSystem, Statistics, FALSE);
+        ASSERT(STATUS_SUCCESS == Result);
+        ASSERT(Statistics->DispatcherLiveThreadCount <= Statistics->DispatcherThreadCountMax);
+        if (ThreadCountPeak < Statistics->DispatcherLiveThreadCount)
+            ThreadCountPeak = Statistics->DispatcherLiveThreadCount;
+    }
+
+    for (int i = 0; sizeof Thread / sizeof Thread[0] > i; i++)
+    {
+        GetExitCodeThread(Thread[i], &ExitCode);
+        CloseHandle(Thread[i]);
+
+        ASSERT(0 == ExitCode);
+    }
+
+    /* the pool grows freely only while it has fewer threads than processors */
+    GetSystemInfo(&SystemInfo);
+    if (ThreadCountMin < SystemInfo.dwNumberOfProcessors)
+        ASSERT(ThreadCountMin < ThreadCountPeak);
+
+    /* once idle it retires a thread per idle timeout until it is back to the minimum */
+    for (ULONG I = 0; 3000 > I; I++)
+    {
+        Result = FspFileSystemGetStatistics(FileSystem, Statistics, FALSE);
+        ASSERT(STATUS_SUCCESS == Result);
+        if (ThreadCountMin == Statistics->DispatcherLiveThreadCount)
+            break;
+        Sleep(10);
+    }
+    ASSERT(ThreadCountMin == Statistics->DispatcherLiveThreadCount);
+
+    FspDebugLog(__FUNCTION__ "(Flags=%lx): threads min=%lu peak=%lu\n",
+        Flags, ThreadCountMin, ThreadCountPeak);
+
+    free(Statistics);
+
+    memfs_stop(memfs);
+}
+
+void memfs_adaptive_test(void)
+{
+    if (WinFspDiskTests)
+    {
+        memfs_adaptive_dotest(MemfsDisk | MemfsAdaptiveDispatcher);
+        memfs_adaptive_dotest(MemfsDisk | MemfsAdaptiveDispatcher | MemfsTransactBatch);
+    }
+    if (WinFspNetTests)
+        memfs_adaptive_dotest(MemfsNet | MemfsAdaptiveDispatcher);
+}
+
+void memfs_statistics_dotest(ULONG Flags)
+{
+    void *memfs = memfs_start(Flags);
+    FSP_FILE_SYSTEM *FileSystem = MemfsFileSystem(memfs);
+    FSP_FILE_SYSTEM_STATISTICS *Statistics;
+    FSP_FILE_SYSTEM_HISTOGRAM *Histogram;
+    NTSTATUS Result;
+
+    WCHAR Prefix[MAX_PATH];
+    UINT64 BucketCount;
+
+    StringCbPrintfW(Prefix, sizeof Prefix, L"\\\\?\\GLOBALROOT%s", memfs_volumename(memfs));
+
+    Statistics = malloc(sizeof *Statistics);
+    ASSERT(0 != Statistics);
+
+    Statistics->Version = sizeof(UINT16);
+    Result = FspFileSystemGetStatistics(FileSystem, Statistics, FALSE);
+    ASSERT(STATUS_INVALID_PARAMETER == Result);
+
+    FspFileSystemResetStatistics(FileSystem);
+
+    ASSERT(0 == memfs_batch_dotest_thread(Prefix));
+
+    Statistics->Version = sizeof *Statistics;
+    Result = FspFileSystemGetStatistics(FileSystem, Statistics, TRUE);
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(sizeof *Statistics == Statistics->Version);
+    ASSERT(0 != Statistics->Frequency);
+    ASSERT(0 < Statistics->RequestCount);
+
+    Histogram = &Statistics->Kind[FspFsctlTransactCreateKind];
+    ASSERT(100 <= Histogram->Count);
+    ASSERT(Histogram->TotalTime >= Histogram->MaxTime);
+    BucketCount = 0;
+    for (ULONG I = 0; FSP_FILE_SYSTEM_HISTOGRAM_BUCKET_COUNT > I; I++)
+        BucketCount += Histogram->Buckets[I];
+    ASSERT(Histogram->Count == BucketCount);
+    ASSERT(100 <= Statistics->CreateDisposition[FILE_CREATE].Count);
+    ASSERT(FspFileSystemHistogramPercentile(Histogram, 500) <=
+        FspFileSystemHistogramPercentile(Histogram, 990));
+    ASSERT(FspFileSystemHistogramPercentile(Histogram, 990) <=
+        FspFileSystemHistogramPercentile(Histogram, 1000));
+    ASSERT(0 < Statistics->Kind[FspFsctlTransactCloseKind].Count);
+    ASSERT(2 <= Statistics->DispatcherThreadCount);
+    for (ULONG I = 0; Statistics->DispatcherThreadCount > I; I++)
+    {
+        ASSERT(0 != Statistics->DispatcherThreads[I].ThreadId);
+        ASSERT(FSP_FILE_SYSTEM_STATISTICS_NUMA_NODE_ANY == Statistics->DispatcherThreads[I].NumaNode);
+    }
+
+    FspDebugLog(__FUNCTION__ "(Flags=%lx): Create count=%lld p50=%lld p99=%lld max=%lld "
+        "(freq=%lld)\n",
+        Flags, Histogram->Count,
+        FspFileSystemHistogramPercentile(Histogram, 500),
+        FspFileSystemHistogramPercentile(Histogram, 990),
+        Histogram->MaxTime,
+        Statistics->Frequency);
+
+    /* statistics were reset by the previous call */
+    Result = FspFileSystemGetStatistics(FileSystem, Statistics, FALSE);
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(100 > Statistics->Kind[FspFsctlTransactCreateKind].Count);
+
+    free(Statistics);
+
+    memfs_stop(memfs);
+}
+
+void memfs_statistics_test(void)
+{
+    if (WinFspDiskTests)
+        memfs_statistics_dotest(MemfsDisk);
+}
+
+void memfs_numa_dotest(ULONG Flags)
+{
+    void *memfs = memfs_start(Flags);
+    FSP_FILE_SYSTEM *FileSystem = MemfsFileSystem(memfs);
+    FSP_FILE_SYSTEM_STATISTICS *Statistics;
+    FSP_FILE_SYSTEM_DISPATCHER_THREAD_INFO *ThreadInfo;
+    GROUP_AFFINITY NodeAffinity, ThreadAffinity;
+    ULONG HighestNode;
+    HANDLE Thread;
+    NTSTATUS Result;
+    BOOL Success;
+
+    WCHAR Prefix[MAX_PATH];
+
+    StringCbPrintfW(Prefix, sizeof Prefix, L"\\\\?\\GLOBALROOT%s", memfs_volumename(memfs));
+
+    ASSERT(0 == memfs_batch_dotest_thread(Prefix));
+
+    Success = GetNumaHighestNodeNumber(&HighestNode);
+    ASSERT(Success);
+
+    Statistics = malloc(sizeof *Statistics);
+    ASSERT(0 != Statistics);
+
+    Statistics->Version = sizeof *Statistics;
+    Result = FspFileSystemGetStatistics(FileSystem, Statistics, FALSE);
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(2 <= Statistics->DispatcherThreadCount);
+
+    for (ULONG I = 0; Statistics->DispatcherThreadCount > I; I++)
+    {
+        ThreadInfo = Statistics->DispatcherThreads + I;
+        ASSERT(HighestNode >= ThreadInfo->NumaNode);
+
+        /* the thread must be pinned to (a subset of) the processors of its node */
+        Thread = OpenThread(THREAD_QUERY_LIMITED_INFORMATION, FALSE, ThreadInfo->ThreadId);
+        if (0 == Thread)
+            continue;               /* thread may have exited */
+        Success = GetThreadGroupAffinity(Thread, &ThreadAffinity);
+        ASSERT(Success);
+        Success = GetNumaNodeProcessorMaskEx(ThreadInfo->NumaNode, &NodeAffinity);
+        ASSERT(Success);
+        ASSERT(NodeAffinity.Group == ThreadAffinity.Group);
+        ASSERT(0 == (ThreadAffinity.Mask & ~NodeAffinity.Mask));
+        CloseHandle(Thread);
+
+        FspDebugLog(__FUNCTION__ "(Flags=%lx): thread %lu: node %u\n",
+            Flags, ThreadInfo->ThreadId, ThreadInfo->NumaNode);
+    }
+
+    free(Statistics);
+
+    memfs_stop(memfs);
+}
+
+void memfs_numa_test(void)
+{
+    if (WinFspDiskTests)
+    {
+        memfs_numa_dotest(MemfsDisk | MemfsNumaAffinity);
+        memfs_numa_dotest(MemfsDisk | MemfsNumaAffinity | MemfsTransferBuffers);
+        memfs_batch_dotest(MemfsDisk | MemfsNumaAffinity | MemfsAdaptiveDispatcher);
+    }
+    if (WinFspNetTests)
+        memfs_numa_dotest(MemfsNet | MemfsNumaAffinity);
+}
+
+void memfs_trace_dotest(ULONG Flags)
+{
+    void *memfs = memfs_start(Flags);
+    FSP_FILE_SYSTEM *FileSystem = MemfsFileSystem(memfs);
+    FSP_FILE_SYSTEM_TRACE_HEADER *Header;
+    FSP_FILE_SYSTEM_TRACE_RECORD *Record;
+    FSP_FSCTL_TRANSACT_REQ *Request;
+    FSP_FSCTL_TRANSACT_RSP *Response;
+    NTSTATUS Result;
+    HANDLE Handle;
+    BOOL Success;
+    DWORD FileSize, BytesTransferred;
+    PUINT8 TraceBuf, TraceBufEnd;
+    UINT64 DropCount;
+    ULONG CreateRequestCount, CreateResponseCount;
+
+    WCHAR Prefix[MAX_PATH];
+    WCHAR TempPath[MAX_PATH], TraceFile[MAX_PATH];
+
+    StringCbPrintfW(Prefix, sizeof Prefix, L"\\\\?\\GLOBALROOT%s", memfs_volumename(memfs));
+
+    ASSERT(0 != GetTempPathW(MAX_PATH, TempPath));
+    ASSERT(0 != GetTempFileNameW(TempPath, L"fsp", 0, TraceFile));
+
+    Result = FspFileSystemStartTrace(FileSystem, TraceFile);
+    ASSERT(STATUS_SUCCESS == Result);
+
+    Result = FspFileSystemStartTrace(FileSystem, TraceFile);
+    ASSERT(STATUS_INVALID_PARAMETER == Result);
+
+    ASSERT(0 == memfs_batch_dotest_thread(Prefix));
+
+    FspFileSystemStopTrace(FileSystem, &DropCount);
+    ASSERT(0 == DropCount);
+
+    Handle = CreateFileW(TraceFile,
+        GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_DELETE_ON_CLOSE, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    FileSize = GetFileSize(Handle, 0);
+    ASSERT(sizeof *Header < FileSize);
+    TraceBuf = malloc(FileSize);
+    ASSERT(0 != TraceBuf);
+    Success = ReadFile(Handle, TraceBuf, FileSize, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(FileSize == BytesTransferred);
+    Success = CloseHandle(Handle);
+    ASSERT(Success);
+
+    Header = (PVOID)TraceBuf;
+    ASSERT(FSP_FILE_SYSTEM_TRACE_SIGNATURE == Header->Signature);
+    ASSERT(sizeof *Header == Header->Version);
+    ASSERT(0 != Header->Frequency);
+
+    CreateRequestCount = CreateResponseCount = 0;
+    TraceBufEnd = TraceBuf + FileSize;
+    for (PUINT8 P = TraceBuf + sizeof *Header; TraceBufEnd > P; P += Record->Size)
+    {
+        Record = (PVOID)P;
+        ASSERT(sizeof *Record < Record->Size);
+        ASSERT(0 == Record->Size % 8);
+        ASSERT(TraceBufEnd >= P + Record->Size);
+        ASSERT(Header->StartTime <= Record->Time);
+        switch (Record->Type)
+        {
+        case FspFileSystemTraceRequest:
+            Request = (PVOID)(Record + 1);
+            ASSERT(sizeof *Record + Request->Size <= Record->Size);
+            if (FspFsctlTransactCreateKind == Request->Kind)
+                CreateRequestCount++;
+            break;
+        case FspFileSystemTraceResponse:
+            Response = (PVOID)(Record + 1);
+            ASSERT(sizeof *Record + Response->Size <= Record->Size);
+            if (FspFsctlTransactCreateKind == Response->Kind)
+                CreateResponseCount++;
+            break;
+        default:
+            ASSERT(0);
+            break;
+        }
+    }
+    ASSERT(100 <= CreateRequestCount);
+    ASSERT(100 <= CreateResponseCount);
+
+    free(TraceBuf);
+
+    memfs_stop(memfs);
+}
+
+void memfs_trace_test(void)
+{
+    if (WinFspDiskTests)
+        memfs_trace_dotest(MemfsDisk);
+}
+
+void memfs_replay_dotest(ULONG Flags, ULONG ThreadCount)
+{
+    void *memfs = memfs_start(Flags);
+    FSP_FILE_SYSTEM *FileSystem = MemfsFileSystem(memfs);
+    FSP_FILE_SYSTEM_REPLAY_PARAMS ReplayParams;
+    FSP_FILE_SYSTEM_REPLAY_RESULT ReplayResult;
+    FSP_FILE_SYSTEM_STATISTICS *Statistics;
+    MEMFS *Replayfs;
+    NTSTATUS Result;
+
+    WCHAR Prefix[MAX_PATH];
+    WCHAR TempPath[MAX_PATH], TraceFile[MAX_PATH];
+
+    StringCbPrintfW(Prefix, sizeof Prefix, L"\\\\?\\GLOBALROOT%s", memfs_volumename(memfs));
+
+    ASSERT(0 != GetTempPathW(MAX_PATH, TempPath));
+    ASSERT(0 != GetTempFileNameW(TempPath, L"fsp", 0, TraceFile));
+
+    Result = FspFileSystemStartTrace(FileSystem, TraceFile);
+    ASSERT(STATUS_SUCCESS == Result);
+
+    ASSERT(0 == memfs_batch_dotest_thread(Prefix));
+
+    FspFileSystemStopTrace(FileSystem, 0);
+
+    memfs_stop(memfs);
+
+    Result = MemfsCreateFunnel(
+        MemfsDetached |
+            (OptCaseInsensitive ? MemfsCaseInsensitive : 0),
+        1000,
+        1024,
+        1024 * 1024,
+        0,
+        0,
+        0,
+        0,
+        0,
+        0,
+        &Replayfs);
+    ASSERT(NT_SUCCESS(Result));
+    FileSystem = MemfsFileSystem(Replayfs);
+    ASSERT(INVALID_HANDLE_VALUE == FileSystem->VolumeHandle);
+
+    Result = FspFileSystemSetMountPoint(FileSystem, 0);
+    ASSERT(STATUS_INVALID_PARAMETER == Result);
+
+    FspFileSystemResetStatistics(FileSystem);
+
+    memset(&ReplayParams, 0, sizeof ReplayParams);
+    ReplayParams.Version = sizeof ReplayParams;
+    ReplayParams.ThreadCount = ThreadCount;
+    Result = FspFileSystemReplayTrace(FileSystem, TraceFile, &ReplayParams, &ReplayResult);
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(0 < ReplayResult.RequestCount);
+    if (1 == ThreadCount)
+        ASSERT(0 == ReplayResult.MismatchCount);
+
+    Statistics = malloc(sizeof *Statistics);
+    ASSERT(0 != Statistics);
+    Statistics->Version = sizeof *Statistics;
+    Result = FspFileSystemGetStatistics(FileSystem, Statistics, FALSE);
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(ReplayResult.RequestCount == Statistics->RequestCount);
+    ASSERT(100 <= Statistics->CreateDisposition[FILE_CREATE].Count);
+
+    FspDebugLog(__FUNCTION__ "(Flags=%lx, ThreadCount=%lu): requests=%lld mismatches=%lld "
+        "elapsed=%lld (freq=%lld)\n",
+        Flags, ThreadCount, ReplayResult.RequestCount, ReplayResult.MismatchCount,
+        ReplayResult.ElapsedTime, Statistics->Frequency);
+
+    free(Statistics);
+
+    MemfsDelete(Replayfs);
+
+    ASSERT(DeleteFileW(TraceFile));
+}
+
+void memfs_replay_test(void)
+{
+    if (WinFspDiskTests)
+    {
+        memfs_replay_dotest(MemfsDisk, 1);
+        memfs_replay_dotest(MemfsDisk, 4);
+    }
+}
+
+void memfs_transferbuffers_dotest(ULONG Flags)
+{
+    void *memfs = memfs_start(Flags);
+    FSP_FILE_SYSTEM *FileSystem = MemfsFileSystem(memfs);
+    HANDLE Handle;
+    BOOL Success;
+    DWORD BytesTransferred;
+    PUINT8 WriteAlloc, ReadAlloc, WriteBuffer, ReadBuffer;
+    ULONG BufferSize = 512 * 1024;
+    NTSTATUS Result;
+
+    WCHAR FilePath[MAX_PATH];
+
+    ASSERT(0 != FileSystem->TransferBuffers);
+
+    /* transfer buffers can only be registered once */
+    Result = FspFileSystemRegisterTransferBuffers(FileSystem, 1024 * 1024, 1);
+    ASSERT(STATUS_INVALID_PARAMETER == Result);
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"\\\\?\\GLOBALROOT%s\\file0",
+        memfs_volumename(memfs));
+
+    WriteAlloc = VirtualAlloc(0, BufferSize + 4096, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    ASSERT(0 != WriteAlloc);
+    ReadAlloc = VirtualAlloc(0, BufferSize + 4096, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    ASSERT(0 != ReadAlloc);
+
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ | GENERIC_WRITE, 0, 0, CREATE_NEW,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_DELETE_ON_CLOSE, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+
+    /*
+     * Page aligned buffers are mapped directly; sector aligned buffers that are not page
+     * aligned use transfer buffers. Repeat so that transfer buffers get reused.
+     */
+    for (ULONG J = 0; 10 > J; J++)
+    {
+        WriteBuffer = WriteAlloc + (J & 1) * 512;
+        ReadBuffer = ReadAlloc + (J & 1) * 512;
+        for (ULONG I = 0; BufferSize > I; I++)
+            WriteBuffer[I] = (UINT8)((I + J) % 251);
+
+        ASSERT(0 == SetFilePointer(Handle, 0, 0, FILE_BEGIN));
+        Success = WriteFile(Handle, WriteBuffer, BufferSize, &BytesTransferred, 0);
+        ASSERT(Success);
+        ASSERT(BufferSize == BytesTransferred);
+
+        memset(ReadBuffer, 0, BufferSize);
+        ASSERT(0 == SetFilePointer(Handle, 0, 0, FILE_BEGIN));
+        Success = ReadFile(Handle, ReadBuffer, BufferSize, &BytesTransferred, 0);
+        ASSERT(Success);
+        ASSERT(BufferSize == BytesTransferred);
+        ASSERT(0 == memcmp(WriteBuffer, ReadBuffer, BufferSize));
+    }
+
+    Success = CloseHandle(Handle);
+    ASSERT(Success);
+
+    VirtualFree(ReadAlloc, 0, MEM_RELEASE);
+    VirtualFree(WriteAlloc, 0, MEM_RELEASE);
+
+    memfs_stop(memfs);
+}
+
+void memfs_transferbuffers_test(void)
+{
+    if (WinFspDiskTests)
+        memfs_transferbuffers_dotest(MemfsDisk | MemfsTransferBuffers);
+    if (WinFspNetTests)
+        memfs_transferbuffers_dotest(MemfsNet | MemfsTransferBuffers);
+}
+
+void memfs_priority_dotest(ULONG Flags)
+{
+    void *memfs = memfs_start(Flags);
+    FSP_FILE_SYSTEM *FileSystem = MemfsFileSystem(memfs);
+    FSP_FSCTL_QUEUE_INFO QueueInfo;
+    HANDLE Handle;
+    BOOL Success;
+    DWORD BytesTransferred;
+    PUINT8 Buffer;
+    ULONG BufferSize = 512 * 1024;
+    NTSTATUS Result;
+
+    WCHAR FilePath[MAX_PATH];
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"\\\\?\\GLOBALROOT%s\\file0",
+        memfs_volumename(memfs));
+
+    Buffer = VirtualAlloc(0, BufferSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    ASSERT(0 != Buffer);
+    memset(Buffer, 'B', BufferSize);
+
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ | GENERIC_WRITE, 0, 0, CREATE_NEW,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_DELETE_ON_CLOSE, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+
+    /* small I/O */
+    Success = WriteFile(Handle, Buffer, 4096, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(4096 == BytesTransferred);
+
+    /* bulk I/O */
+    ASSERT(0 == SetFilePointer(Handle, 0, 0, FILE_BEGIN));
+    Success = WriteFile(Handle, Buffer, BufferSize, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(BufferSize == BytesTransferred);
+
+    /* background */
+    Success = FlushFileBuffers(Handle);
+    ASSERT(Success);
+
+    Result = FspFsctlQueueInfo(FileSystem->VolumeHandle, 0, &QueueInfo);
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(0 != QueueInfo.DeliveredIrpClassCount[FspFsctlTransactMetadataClass]);
+    ASSERT(0 != QueueInfo.DeliveredIrpClassCount[FspFsctlTransactSmallIoClass]);
+    ASSERT(0 != QueueInfo.DeliveredIrpClassCount[FspFsctlTransactBulkIoClass]);
+    ASSERT(0 != QueueInfo.DeliveredIrpClassCount[FspFsctlTransactBackgroundClass]);
+
+    Success = CloseHandle(Handle);
+    ASSERT(Success);
+
+    VirtualFree(Buffer, 0, MEM_RELEASE);
+
+    memfs_stop(memfs);
+}
+
+static FSP_FILE_SYSTEM_OPERATION_GUARD *memfs_priority_EnterOp;
+static HANDLE memfs_priority_Gate;
+static volatile LONG memfs_priority_Held, memfs_priority_Index;
+static UINT8 memfs_priority_Order[256];
+static PUINT8 memfs_priority_Buffer;
+static ULONG memfs_priority_BufferSize;
+
+static NTSTATUS memfs_priority_Enter(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    LONG Index;
+
+    if (WAIT_TIMEOUT == WaitForSingleObject(memfs_priority_Gate, 0))
+    {
+        /* requests held by the dispatcher threads are not queued in priority order */
+        InterlockedIncrement(&memfs_priority_Held);
+        WaitForSingleObject(memfs_priority_Gate, INFINITE);
+    }
+    else if (0 <= memfs_priority_Index &&
+        (FspFsctlTransactCreateKind == Request->Kind ||
+        (FspFsctlTransactWriteKind == Request->Kind &&
+            memfs_priority_BufferSize == Request->Req.Write.Length)))
+    {
+        Index = InterlockedIncrement(&memfs_priority_Index) - 1;
+        if ((LONG)sizeof memfs_priority_Order > Index)
+            memfs_priority_Order[Index] = (UINT8)FspFsctlTransactRequestClass(Request);
+    }
+
+    return memfs_priority_EnterOp(FileSystem, Request, Response);
+}
+
+static unsigned __stdcall memfs_priority_bulk_thread(void *Handle)
+{
+    BOOL Success;
+    DWORD BytesTransferred;
+
+    SetFilePointer(Handle, 0, 0, FILE_BEGIN);
+    Success = WriteFile(Handle, memfs_priority_Buffer, memfs_priority_BufferSize,
+        &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(memfs_priority_BufferSize == BytesTransferred);
+
+    return 0;
+}
+
+static unsigned __stdcall memfs_priority_metadata_thread(void *FilePath)
+{
+    ASSERT(INVALID_FILE_ATTRIBUTES == GetFileAttributesW(FilePath));
+    ASSERT(ERROR_FILE_NOT_FOUND == GetLastError());
+
+    return 0;
+}
+
+void memfs_priority_contention_dotest(ULONG Flags)
+{
+    void *memfs = memfs_start(Flags);
+    FSP_FILE_SYSTEM *FileSystem = MemfsFileSystem(memfs);
+    FSP_FSCTL_QUEUE_INFO QueueInfo;
+    HANDLE Handle[32], BulkThread[32], MetadataThread[4];
+    ULONG WriteCount, OrderCount, MetadataCount, BulkCount;
+    ULONG64 MetadataSum, BulkSum;
+    BOOL Success;
+    DWORD BytesTransferred;
+    NTSTATUS Result;
+
+    WCHAR FilePath[MAX_PATH], MetadataPath[4][MAX_PATH];
+
+    memfs_priority_BufferSize = 512 * 1024;
+    memfs_priority_Buffer = VirtualAlloc(0, memfs_priority_BufferSize,
+        MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    ASSERT(0 != memfs_priority_Buffer);
+    memset(memfs_priority_Buffer, 'B', memfs_priority_BufferSize);
+
+    /* enough bulk writes to occupy every dispatcher thread and queue 4 more */
+    WriteCount = FileSystem->DispatcherThreadCount + 4;
+    ASSERT(sizeof Handle / sizeof Handle[0] >= WriteCount);
+
+    for (ULONG I = 0; WriteCount > I; I++)
+    {
+        StringCbPrintfW(FilePath, sizeof FilePath, L"\\\\?\\GLOBALROOT%s\\file%lu",
+            memfs_volumename(memfs), I);
+        Handle[I] = CreateFileW(FilePath,
+            GENERIC_READ | GENERIC_WRITE, 0, 0, CREATE_NEW,
+            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_DELETE_ON_CLOSE, 0);
+        ASSERT(INVALID_HANDLE_VALUE != Handle[I]);
+
+        /* allocate the file now, so that the contended writes do not extend it */
+        Success = WriteFile(Handle[I], memfs_priority_Buffer, memfs_priority_BufferSize,
+            &BytesTransferred, 0);
+        ASSERT(Success);
+        ASSERT(memfs_priority_BufferSize == BytesTransferred);
+    }
+    for (ULONG I = 0; sizeof MetadataPath / sizeof MetadataPath[0] > I; I++)
+        StringCbPrintfW(MetadataPath[I], sizeof MetadataPath[I],
+            L"\\\\?\\GLOBALROOT%s\\meta%lu", memfs_volumename(memfs), I);
+
+    memfs_priority_Gate = CreateEventW(0, TRUE, FALSE, 0);
+    ASSERT(0 != memfs_priority_Gate);
+    memfs_priority_Held = 0;
+    memfs_priority_Index = -1;
+    memfs_priority_EnterOp = FileSystem->EnterOperation;
+    FileSystem->EnterOperation = memfs_priority_Enter;
+
+    /* queue the bulk writes first; a FIFO queue would deliver them first */
+    for (ULONG I = 0; WriteCount > I; I++)
+    {
+        BulkThread[I] = (HANDLE)_beginthreadex(0, 0, memfs_priority_bulk_thread, Handle[I], 0, 0);
+        ASSERT(0 != BulkThread[I]);
+    }
+    for (ULONG I = 0;; I++)
+    {
+        ASSERT(500 > I);
+        Result = FspFsctlQueueInfo(FileSystem->VolumeHandle, 0, &QueueInfo);
+        ASSERT(STATUS_SUCCESS == Result);
+        if (4 <= QueueInfo.PendingIrpClassCount[FspFsctlTransactBulkIoClass])
+            break;
+        Sleep(10);
+    }
+
+    for (ULONG I = 0; sizeof MetadataThread / sizeof MetadataThread[0] > I; I++)
+    {
+        MetadataThread[I] = (HANDLE)_beginthreadex(0, 0, memfs_priority_metadata_thread,
+            MetadataPath[I], 0, 0);
+        ASSERT(0 != MetadataThread[I]);
+    }
+    for (ULONG I = 0;; I++)
+    {
+        ASSERT(500 > I);
+        Result = FspFsctlQueueInfo(FileSystem->VolumeHandle, 0, &QueueInfo);
+        ASSERT(STATUS_SUCCESS == Result);
+        if (sizeof MetadataThread / sizeof MetadataThread[0] <=
+            QueueInfo.PendingIrpClassCount[FspFsctlTransactMetadataClass])
+            break;
+        Sleep(10);
+    }
+
+    ASSERT(0 != memfs_priority_Held);
+    memfs_priority_Index = 0;
+    Success = SetEvent(memfs_priority_Gate);
+    ASSERT(Success);
+
+    for (ULONG I = 0; sizeof MetadataThread / sizeof MetadataThread[0] > I; I++)
+    {
+        WaitForSingleObject(MetadataThread[I], INFINITE);
+        CloseHandle(MetadataThread[I]);
+    }
+    for (ULONG I = 0; WriteCount > I; I++)
+    {
+        WaitForSingleObject(BulkThread[I], INFINITE);
+        CloseHandle(BulkThread[I]);
+    }
+
+    FileSystem->EnterOperation = memfs_priority_EnterOp;
+    CloseHandle(memfs_priority_Gate);
+
+    /* queued metadata requests must on average be delivered ahead of queued bulk ones */
+    OrderCount = sizeof memfs_priority_Order < (ULONG)memfs_priority_Index ?
+        sizeof memfs_priority_Order : (ULONG)memfs_priority_Index;
+    MetadataCount = BulkCount = 0;
+    MetadataSum = BulkSum = 0;
+    for (ULONG I = 0; OrderCount > I; I++)
+        if (FspFsctlTransactMetadataClass == memfs_priority_Order[I])
+        {
+            MetadataCount++;
+            MetadataSum += I;
+        }
+        else if (FspFsctlTransactBulkIoClass == memfs_priority_Order[I])
+        {
+            BulkCount++;
+            BulkSum += I;
+        }
+    ASSERT(0 != MetadataCount);
+    ASSERT(0 != BulkCount);
+    ASSERT(MetadataSum * BulkCount < BulkSum * MetadataCount);
+
+    for (ULONG I = 0; WriteCount > I; I++)
+    {
+        Success = CloseHandle(Handle[I]);
+        ASSERT(Success);
+    }
+
+    VirtualFree(memfs_priority_Buffer, 0, MEM_RELEASE);
+
+    memfs_stop(memfs);
+}
+
+void memfs_priority_test(void)
+{
+    if (WinFspDiskTests)
+    {
+        memfs_priority_dotest(MemfsDisk);
+        memfs_priority_dotest(MemfsDisk | MemfsTransactBatch);
+        memfs_priority_dotest(MemfsDisk | MemfsWorkStealing);
+        memfs_priority_contention_dotest(MemfsDisk);
+    }
+    if (WinFspNetTests)
+    {
+        memfs_priority_dotest(MemfsNet);
+        memfs_priority_contention_dotest(MemfsNet);
+    }
+}
+
+void memfs_async_dotest(ULONG Flags)
+{
+    void *memfs = memfs_start(Flags);
+    FSP_FILE_SYSTEM *FileSystem = MemfsFileSystem(memfs);
+    FSP_FILE_SYSTEM_ASYNC_CONTEXT *AsyncContext;
+    HANDLE Handle;
+    BOOL Success;
+    DWORD BytesTransferred;
+    UINT8 WriteBuffer[4096], ReadBuffer[4096];
+    NTSTATUS Result;
+
+    WCHAR FilePath[MAX_PATH];
+
+    /* memfs enables the async API for its delayed I/O */
+    ASSERT(0 != FileSystem->Async);
+
+    /* not servicing an operation */
+    Result = FspFileSystemAsyncBegin(FileSystem, 0, &AsyncContext);
+    ASSERT(STATUS_INVALID_DEVICE_STATE == Result);
+    ASSERT(0 == AsyncContext);
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"\\\\?\\GLOBALROOT%s\\file0",
+        memfs_volumename(memfs));
+
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ | GENERIC_WRITE, 0, 0, CREATE_NEW,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_DELETE_ON_CLOSE, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+
+    /* enough I/O that a good number of requests are completed asynchronously */
+    for (ULONG J = 0; 100 > J; J++)
+    {
+        memset(WriteBuffer, (int)J, sizeof WriteBuffer);
+
+        ASSERT(0 == SetFilePointer(Handle, 0, 0, FILE_BEGIN));
+        Success = WriteFile(Handle, WriteBuffer, sizeof WriteBuffer, &BytesTransferred, 0);
+        ASSERT(Success);
+        ASSERT(sizeof WriteBuffer == BytesTransferred);
+
+        memset(ReadBuffer, 0, sizeof ReadBuffer);
+        ASSERT(0 == SetFilePointer(Handle, 0, 0, FILE_BEGIN));
+        Success = ReadFile(Handle, ReadBuffer, sizeof ReadBuffer, &BytesTransferred, 0);
+        ASSERT(Success);
+        ASSERT(sizeof ReadBuffer == BytesTransferred);
+        ASSERT(0 == memcmp(WriteBuffer, ReadBuffer, sizeof ReadBuffer));
+    }
+
+    Success = CloseHandle(Handle);
+    ASSERT(Success);
+
+    ASSERT(0 == FspFileSystemAsyncOutstandingCount(FileSystem));
+
+    memfs_stop(memfs);
+}
+
+void memfs_async_test(void)
+{
+    if (WinFspDiskTests)
+    {
+        memfs_async_dotest(MemfsDisk);
+        memfs_async_dotest(MemfsDisk | MemfsTransactBatch);
+        memfs_async_dotest(MemfsDisk | MemfsWorkStealing);
+    }
+    if (WinFspNetTests)
+        memfs_async_dotest(MemfsNet);
+}
+
+static NTSTATUS memfs_interface_create(FSP_FILE_SYSTEM *FileSystem,
+    PWSTR FileName, BOOLEAN Directory, PSECURITY_DESCRIPTOR SecurityDescriptor)
+{
+    union
+    {
+        FSP_FSCTL_OPEN_FILE_INFO V;
+        UINT8 B[sizeof(FSP_FSCTL_OPEN_FILE_INFO) + 1024 * sizeof(WCHAR)];
+    } OpenFileInfoBuf;
+    FSP_FSCTL_OPEN_FILE_INFO *OpenFileInfo = &OpenFileInfoBuf.V;
+    UINT32 CreateOptions = Directory ? FILE_DIRECTORY_FILE : 0;
+    UINT32 FileAttributes = Directory ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_NORMAL;
+    PVOID FileContext;
+    NTSTATUS Result;
+
+    OpenFileInfo->NormalizedName = (PWSTR)(OpenFileInfo + 1);
+    OpenFileInfo->NormalizedNameSize = 1024 * sizeof(WCHAR);
+    if (0 != FileSystem->Interface->CreateEx)
+        Result = FileSystem->Interface->CreateEx(FileSystem, FileName, CreateOptions, FILE_ALL_ACCESS,
+            FileAttributes, SecurityDescriptor, 0, 0, 0, FALSE, &FileContext, &OpenFileInfo->FileInfo);
+    else
+        Result = FileSystem->Interface->Create(FileSystem, FileName, CreateOptions, FILE_ALL_ACCESS,
+            FileAttributes, SecurityDescriptor, 0, &FileContext, &OpenFileInfo->FileInfo);
+    if (NT_SUCCESS(Result))
+    {
+        FileSystem->Interface->Cleanup(FileSystem, FileContext, FileName, 0);
+        FileSystem->Interface->Close(FileSystem, FileContext);
+    }
+
+    return Result;
+}
+
+static NTSTATUS memfs_interface_open(FSP_FILE_SYSTEM *FileSystem,
+    PWSTR FileName, PVOID *PFileContext)
+{
+    union
+    {
+        FSP_FSCTL_OPEN_FILE_INFO V;
+        UINT8 B[sizeof(FSP_FSCTL_OPEN_FILE_INFO) + 1024 * sizeof(WCHAR)];
+    } OpenFileInfoBuf;
+    FSP_FSCTL_OPEN_FILE_INFO *OpenFileInfo = &OpenFileInfoBuf.V;
+
+    OpenFileInfo->NormalizedName = (PWSTR)(OpenFileInfo + 1);
+    OpenFileInfo->NormalizedNameSize = 1024 * sizeof(WCHAR);
+    return FileSystem->Interface->Open(FileSystem, FileName, 0, FILE_ALL_ACCESS,
+        PFileContext, &OpenFileInfo->FileInfo);
+}
+
+static void memfs_namespace_bench_dotest(ULONG DirCount, ULONG FileCount)
+{
+    MEMFS *Memfs;
+    FSP_FILE_SYSTEM *FileSystem;
+    PVOID FileContext;
+    PUINT8 Buffer;
+    ULONG BufferLength = 64 * 1024, BytesTransferred, EntryCount;
+    WCHAR FileName[MAX_PATH], NewFileName[MAX_PATH];
+    DWORD Time[5];
+    NTSTATUS Result;
+
+    Result = MemfsCreateFunnel(
+        MemfsDetached |
+            (OptCaseInsensitive ? MemfsCaseInsensitive : 0),
+        1000,
+        1 + DirCount + DirCount * FileCount,
+        0,
+        0,
+        0,
+        0,
+        0,
+        0,
+        0,
+        &Memfs);
+    ASSERT(NT_SUCCESS(Result));
+    FileSystem = MemfsFileSystem(Memfs);
+
+    Buffer = malloc(BufferLength);
+    ASSERT(0 != Buffer);
+
+    Time[0] = GetTickCount();
+
+    /* populate: DirCount directories with FileCount files each */
+    for (ULONG I = 0; DirCount > I; I++)
+    {
+        StringCbPrintfW(FileName, sizeof FileName, L"\\dir%05lu", I);
+        Result = memfs_interface_create(FileSystem, FileName, TRUE, 0);
+        ASSERT(NT_SUCCESS(Result));
+        for (ULONG J = 0; FileCount > J; J++)
+        {
+            StringCbPrintfW(FileName, sizeof FileName, L"\\dir%05lu\\file%05lu.dat", I, J);
+            Result = memfs_interface_create(FileSystem, FileName, FALSE, 0);
+            ASSERT(NT_SUCCESS(Result));
+        }
+    }
+
+    Time[1] = GetTickCount();
+
+    /* lookup every file by full path */
+    for (ULONG I = 0; DirCount > I; I++)
+        for (ULONG J = 0; FileCount > J; J++)
+        {
+            StringCbPrintfW(FileName, sizeof FileName, L"\\dir%05lu\\file%05lu.dat",
+                (I * 7919) % DirCount, J);
+            Result = memfs_interface_open(FileSystem, FileName, &FileContext);
+            ASSERT(NT_SUCCESS(Result));
+            FileSystem->Interface->Cleanup(FileSystem, FileContext, FileName, 0);
+            FileSystem->Interface->Close(FileSystem, FileContext);
+        }
+
+    Time[2] = GetTickCount();
+
+    /* enumerate one large directory page by page using the last name as marker */
+    StringCbPrintfW(FileName, sizeof FileName, L"\\dir%05lu", DirCount / 2);
+    Result = memfs_interface_open(FileSystem, FileName, &FileContext);
+    ASSERT(NT_SUCCESS(Result));
+    {
+        WCHAR Marker[MAX_PATH];
+        PWSTR PMarker = 0;
+        EntryCount = 0;
+        for (;;)
+        {
+            FSP_FSCTL_DIR_INFO *DirInfo, *LastDirInfo = 0;
+            PUINT8 BufferEnd;
+            BytesTransferred = 0;
+            Result = FileSystem->Interface->ReadDirectory(FileSystem, FileContext, 0, PMarker,
+                Buffer, BufferLength, &BytesTransferred);
+            ASSERT(NT_SUCCESS(Result));
+            BufferEnd = Buffer + BytesTransferred;
+            for (DirInfo = (FSP_FSCTL_DIR_INFO *)Buffer;
+                (PUINT8)DirInfo + sizeof(UINT16) <= BufferEnd && 0 != DirInfo->Size;
+                DirInfo = (FSP_FSCTL_DIR_INFO *)((PUINT8)DirInfo + FSP_FSCTL_DEFAULT_ALIGN_UP(DirInfo->Size)))
+            {
+                LastDirInfo = DirInfo;
+                EntryCount++;
+            }
+            if (0 == LastDirInfo || (PUINT8)DirInfo + sizeof(UINT16) <= BufferEnd)
+                break;
+            memcpy(Marker, LastDirInfo->FileNameBuf, LastDirInfo->Size - sizeof(FSP_FSCTL_DIR_INFO));
+            Marker[(LastDirInfo->Size - sizeof(FSP_FSCTL_DIR_INFO)) / sizeof(WCHAR)] = L'\0';
+            PMarker = Marker;
+        }
+        ASSERT(2 + FileCount == EntryCount);
+    }
+    FileSystem->Interface->Cleanup(FileSystem, FileContext, FileName, 0);
+    FileSystem->Interface->Close(FileSystem, FileContext);
+
+    Time[3] = GetTickCount();
+
+    /* rename every directory; the cost must not depend on the number of descendants */
+    for (ULONG I = 0; DirCount > I; I++)
+    {
+        StringCbPrintfW(FileName, sizeof FileName, L"\\dir%05lu", I);
+        StringCbPrintfW(NewFileName, sizeof NewFileName, L"\\DIR%05lu.renamed", I);
+        Result = memfs_interface_open(FileSystem, FileName, &FileContext);
+        ASSERT(NT_SUCCESS(Result));
+        Result = FileSystem->Interface->Rename(FileSystem, FileContext, FileName, NewFileName, FALSE);
+        ASSERT(NT_SUCCESS(Result));
+        FileSystem->Interface->Cleanup(FileSystem, FileContext, NewFileName, 0);
+        FileSystem->Interface->Close(FileSystem, FileContext);
+    }
+
+    Time[4] = GetTickCount();
+
+    StringCbPrintfW(FileName, sizeof FileName, L"\\DIR%05lu.renamed\\file%05lu.dat",
+        DirCount - 1, FileCount - 1);
+    Result = memfs_interface_open(FileSystem, FileName, &FileContext);
+    ASSERT(NT_SUCCESS(Result));
+    FileSystem->Interface->Cleanup(FileSystem, FileContext, FileName, 0);
+    FileSystem->Interface->Close(FileSystem, FileContext);
+
+    FspDebugLog(__FUNCTION__ "(DirCount=%lu, FileCount=%lu): "
+        "create=%lums lookup=%lums readdir=%lums rename=%lums\n",
+        DirCount, FileCount,
+        Time[1] - Time[0], Time[2] - Time[1], Time[3] - Time[2], Time[4] - Time[3]);
+
+    free(Buffer);
+
+    MemfsDelete(Memfs);
+}
+
+void memfs_namespace_bench_test(void)
+{
+    memfs_namespace_bench_dotest(100, 100);
+    memfs_namespace_bench_dotest(1000, 1000);
+}
+
+static ULONG memfs_dirsnapshot_list(FSP_FILE_SYSTEM *FileSystem,
+    PWSTR DirName, PWSTR FileName, PUINT64 PFileSize)
+{
+    PVOID FileContext;
+    UINT8 Buffer[1024];
+    ULONG BytesTransferred, EntryCount = 0;
+    WCHAR Marker[MAX_PATH];
+    PWSTR PMarker = 0;
+    NTSTATUS Result;
+
+    Result = memfs_interface_open(FileSystem, DirName, &FileContext);
+    ASSERT(NT_SUCCESS(Result));
+
+    /* a small buffer, so that the listing takes several pages */
+    for (;;)
+    {
+        FSP_FSCTL_DIR_INFO *DirInfo, *LastDirInfo = 0;
+        PUINT8 BufferEnd;
+        ULONG Length;
+        BytesTransferred = 0;
+        Result = FileSystem->Interface->ReadDirectory(FileSystem, FileContext, 0, PMarker,
+            Buffer, sizeof Buffer, &BytesTransferred);
+        ASSERT(NT_SUCCESS(Result));
+        BufferEnd = Buffer + BytesTransferred;
+        for (DirInfo = (FSP_FSCTL_DIR_INFO *)Buffer;
+            (PUINT8)DirInfo + sizeof(UINT16) <= BufferEnd && 0 != DirInfo->Size;
+            DirInfo = (FSP_FSCTL_DIR_INFO *)((PUINT8)DirInfo + FSP_FSCTL_DEFAULT_ALIGN_UP(DirInfo->Size)))
+        {
+            LastDirInfo = DirInfo;
+            Length = (DirInfo->Size - sizeof(FSP_FSCTL_DIR_INFO)) / sizeof(WCHAR);
+            if ((1 == Length && L'.' == DirInfo->FileNameBuf[0]) ||
+                (2 == Length && L'.' == DirInfo->FileNameBuf[0] && L'.' == DirInfo->FileNameBuf[1]))
+                continue;
+            EntryCount++;
+            if (0 != FileName && wcslen(FileName) == Length &&
+                0 == memcmp(FileName, DirInfo->FileNameBuf, Length * sizeof(WCHAR)))
+                *PFileSize = DirInfo->FileInfo.FileSize;
+        }
+        if (0 == LastDirInfo || (PUINT8)DirInfo + sizeof(UINT16) <= BufferEnd)
+            break;
+        memcpy(Marker, LastDirInfo->FileNameBuf, LastDirInfo->Size - sizeof(FSP_FSCTL_DIR_INFO));
+        Marker[(LastDirInfo->Size - sizeof(FSP_FSCTL_DIR_INFO)) / sizeof(WCHAR)] = L'\0';
+        PMarker = Marker;
+    }
+
+    FileSystem->Interface->Cleanup(FileSystem, FileContext, DirName, 0);
+    FileSystem->Interface->Close(FileSystem, FileContext);
+
+    return EntryCount;
+}
+
+void memfs_dirsnapshot_test(void)
+{
+    MEMFS *Memfs;
+    FSP_FILE_SYSTEM *FileSystem;
+    MEMFS_MEMORY_STATISTICS Statistics;
+    FSP_FSCTL_FILE_INFO FileInfo;
+    PVOID FileContext;
+    WCHAR FileName[MAX_PATH];
+    ULONG FileCount = 32;
+    UINT64 BuildCount, FileSize;
+    NTSTATUS Result;
+
+    Result = MemfsCreateFunnel(
+        MemfsDetached |
+            (OptCaseInsensitive ? MemfsCaseInsensitive : 0),
+        1000,
+        1024,
+        1024 * 1024,
+        0,
+        0,
+        0,
+        0,
+        0,
+        0,
+        &Memfs);
+    ASSERT(NT_SUCCESS(Result));
+    FileSystem = MemfsFileSystem(Memfs);
+
+    Result = memfs_interface_create(FileSystem, L"\\dir", TRUE, 0);
+    ASSERT(NT_SUCCESS(Result));
+    for (ULONG I = 0; FileCount > I; I++)
+    {
+        StringCbPrintfW(FileName, sizeof FileName, L"\\dir\\file%02lu", I);
+        Result = memfs_interface_create(FileSystem, FileName, FALSE, 0);
+        ASSERT(NT_SUCCESS(Result));
+    }
+
+    /* the first listing builds the snapshot */
+    MemfsGetMemoryStatistics(Memfs, &Statistics);
+    BuildCount = Statistics.DirectorySnapshotBuildCount;
+    ASSERT(FileCount == memfs_dirsnapshot_list(FileSystem, L"\\dir", 0, 0));
+    MemfsGetMemoryStatistics(Memfs, &Statistics);
+    ASSERT(BuildCount + 1 == Statistics.DirectorySnapshotBuildCount);
+    BuildCount = Statistics.DirectorySnapshotBuildCount;
+
+    /* other handles share it while the directory does not change */
+    ASSERT(FileCount == memfs_dirsnapshot_list(FileSystem, L"\\dir", 0, 0));
+    ASSERT(FileCount == memfs_dirsnapshot_list(FileSystem, L"\\dir", 0, 0));
+    MemfsGetMemoryStatistics(Memfs, &Statistics);
+    ASSERT(BuildCount == Statistics.DirectorySnapshotBuildCount);
+
+    /* a change to the FileInfo of a child is listed */
+    Result = memfs_interface_open(FileSystem, L"\\dir\\file00", &FileContext);
+    ASSERT(NT_SUCCESS(Result));
+    Result = FileSystem->Interface->SetFileSize(FileSystem, FileContext, 4096, FALSE, &FileInfo);
+    ASSERT(NT_SUCCESS(Result));
+    FileSystem->Interface->Cleanup(FileSystem, FileContext, L"\\dir\\file00", 0);
+    FileSystem->Interface->Close(FileSystem, FileContext);
+    FileSize = 0;
+    ASSERT(FileCount == memfs_dirsnapshot_list(FileSystem, L"\\dir", L"file00", &FileSize));
+    ASSERT(4096 == FileSize);
+    MemfsGetMemoryStatistics(Memfs, &Statistics);
+    ASSERT(BuildCount + 1 == Statistics.DirectorySnapshotBuildCount);
+
+    /* so are created and deleted children */
+    Result = memfs_interface_create(FileSystem, L"\\dir\\new", FALSE, 0);
+    ASSERT(NT_SUCCESS(Result));
+    ASSERT(FileCount + 1 == memfs_dirsnapshot_list(FileSystem, L"\\dir", 0, 0));
+    Result = memfs_interface_open(FileSystem, L"\\dir\\file01", &FileContext);
+    ASSERT(NT_SUCCESS(Result));
+    FileSystem->Interface->Cleanup(FileSystem, FileContext, L"\\dir\\file01", FspCleanupDelete);
+    FileSystem->Interface->Close(FileSystem, FileContext);
+    ASSERT(FileCount == memfs_dirsnapshot_list(FileSystem, L"\\dir", 0, 0));
+
+    /* changes in other directories do not affect the snapshot */
+    MemfsGetMemoryStatistics(Memfs, &Statistics);
+    BuildCount = Statistics.DirectorySnapshotBuildCount;
+    Result = memfs_interface_create(FileSystem, L"\\other", TRUE, 0);
+    ASSERT(NT_SUCCESS(Result));
+    Result = memfs_interface_create(FileSystem, L"\\other\\file", FALSE, 0);
+    ASSERT(NT_SUCCESS(Result));
+    ASSERT(FileCount == memfs_dirsnapshot_list(FileSystem, L"\\dir", 0, 0));
+    MemfsGetMemoryStatistics(Memfs, &Statistics);
+    ASSERT(BuildCount == Statistics.DirectorySnapshotBuildCount);
+
+    /* a rename changes both directories */
+    Result = memfs_interface_open(FileSystem, L"\\other\\file", &FileContext);
+    ASSERT(NT_SUCCESS(Result));
+    Result = FileSystem->Interface->Rename(FileSystem, FileContext,
+        L"\\other\\file", L"\\dir\\moved", FALSE);
+    ASSERT(NT_SUCCESS(Result));
+    FileSystem->Interface->Cleanup(FileSystem, FileContext, L"\\dir\\moved", 0);
+    FileSystem->Interface->Close(FileSystem, FileContext);
+    ASSERT(FileCount + 1 == memfs_dirsnapshot_list(FileSystem, L"\\dir", 0, 0));
+    ASSERT(0 == memfs_dirsnapshot_list(FileSystem, L"\\other", 0, 0));
+    MemfsGetMemoryStatistics(Memfs, &Statistics);
+    ASSERT(BuildCount + 2 == Statistics.DirectorySnapshotBuildCount);
+
+    MemfsDelete(Memfs);
+}
+
+static BOOLEAN memfs_filedata_iszero(PUINT8 Buffer, ULONG Length)
+{
+    for (ULONG I = 0; Length > I; I++)
+        if (0 != Buffer[I])
+            return FALSE;
+    return TRUE;
+}
+
+void memfs_filedata_test(void)
+{
+    MEMFS *Memfs;
+    FSP_FILE_SYSTEM *FileSystem;
+    MEMFS_MEMORY_STATISTICS Statistics;
+    FSP_FSCTL_FILE_INFO FileInfo;
+    PVOID FileContext;
+    PUINT8 Buffer;
+    ULONG PageSize = 64 * 1024, BufferLength = 4 * PageSize, BytesTransferred;
+    UINT64 PageCount, Offset;
+    NTSTATUS Result;
+
+    Result = MemfsCreateFunnel(
+        MemfsDetached |
+            (OptCaseInsensitive ? MemfsCaseInsensitive : 0),
+        1000,
+        1024,
+        256 * 1024 * 1024,
+        0,
+        0,
+        0,
+        0,
+        0,
+        0,
+        &Memfs);
+    ASSERT(NT_SUCCESS(Result));
+    FileSystem = MemfsFileSystem(Memfs);
+
+    Buffer = malloc(BufferLength);
+    ASSERT(0 != Buffer);
+
+    Result = memfs_interface_create(FileSystem, L"\\file", FALSE, 0);
+    ASSERT(NT_SUCCESS(Result));
+    Result = memfs_interface_open(FileSystem, L"\\file", &FileContext);
+    ASSERT(NT_SUCCESS(Result));
+
+    MemfsGetMemoryStatistics(Memfs, &Statistics);
+    PageCount = Statistics.FileDataPageCount;
+
+    /* a write far past the end of file allocates only the page it touches */
+    Offset = 1024 * PageSize + 100;
+    memset(Buffer, 'A', 4096);
+    Result = FileSystem->Interface->Write(FileSystem, FileContext,
+        Buffer, Offset, 4096, FALSE, FALSE, &BytesTransferred, &FileInfo);
+    ASSERT(NT_SUCCESS(Result));
+    ASSERT(4096 == BytesTransferred);
+    ASSERT(Offset + 4096 == FileInfo.FileSize);
+    MemfsGetMemoryStatistics(Memfs, &Statistics);
+    ASSERT(PageCount + 1 == Statistics.FileDataPageCount);
+
+    /* ... and the hole reads as zeros */
+    memset(Buffer, 'X', BufferLength);
+    Result = FileSystem->Interface->Read(FileSystem, FileContext,
+        Buffer, 0, BufferLength, &BytesTransferred);
+    ASSERT(NT_SUCCESS(Result));
+    ASSERT(BufferLength == BytesTransferred);
+    ASSERT(memfs_filedata_iszero(Buffer, BufferLength));
+    memset(Buffer, 'X', BufferLength);
+    Result = FileSystem->Interface->Read(FileSystem, FileContext,
+        Buffer, 512 * PageSize - 1000, 2000, &BytesTransferred);
+    ASSERT(NT_SUCCESS(Result));
+    ASSERT(2000 == BytesTransferred);
+    ASSERT(memfs_filedata_iszero(Buffer, 2000));
+    memset(Buffer, 'X', BufferLength);
+    Result = FileSystem->Interface->Read(FileSystem, FileContext,
+        Buffer, Offset - 100, 4196, &BytesTransferred);
+    ASSERT(NT_SUCCESS(Result));
+    ASSERT(4196 == BytesTransferred);
+    ASSERT(memfs_filedata_iszero(Buffer, 100));
+    for (ULONG I = 100; 4196 > I; I++)
+        ASSERT('A' == Buffer[I]);
+
+    /* I/O that crosses page boundaries */
+    for (ULONG I = 0; 2 * PageSize + 3000 > I; I++)
+        Buffer[I] = (UINT8)(I % 251 + 1);
+    Result = FileSystem->Interface->Write(FileSystem, FileContext,
+        Buffer, PageSize - 1000, 2 * PageSize + 3000, FALSE, FALSE, &BytesTransferred, &FileInfo);
+    ASSERT(NT_SUCCESS(Result));
+    ASSERT(2 * PageSize + 3000 == BytesTransferred);
+    MemfsGetMemoryStatistics(Memfs, &Statistics);
+    ASSERT(PageCount + 1 + 4 == Statistics.FileDataPageCount);
+    memset(Buffer, 'X', BufferLength);
+    Result = FileSystem->Interface->Read(FileSystem, FileContext,
+        Buffer, 0, BufferLength, &BytesTransferred);
+    ASSERT(NT_SUCCESS(Result));
+    ASSERT(BufferLength == BytesTransferred);
+    ASSERT(memfs_filedata_iszero(Buffer, PageSize - 1000));
+    for (ULONG I = 0; 2 * PageSize + 3000 > I; I++)
+        ASSERT((UINT8)(I % 251 + 1) == Buffer[PageSize - 1000 + I]);
+    ASSERT(memfs_filedata_iszero(Buffer + 3 * PageSize + 2000, PageSize - 2000));
+
+    /* truncating in the middle of a page and extending again reads zeros past the cut */
+    memset(Buffer, 'B', PageSize);
+    Result = FileSystem->Interface->Write(FileSystem, FileContext,
+        Buffer, 0, PageSize, FALSE, FALSE, &BytesTransferred, &FileInfo);
+    ASSERT(NT_SUCCESS(Result));
+    Result = FileSystem->Interface->SetFileSize(FileSystem, FileContext, 1000, FALSE, &FileInfo);
+    ASSERT(NT_SUCCESS(Result));
+    ASSERT(1000 == FileInfo.FileSize);
+    MemfsGetMemoryStatistics(Memfs, &Statistics);
+    ASSERT(PageCount + 1 == Statistics.FileDataPageCount);
+    Result = FileSystem->Interface->SetFileSize(FileSystem, FileContext, 2 * PageSize, FALSE, &FileInfo);
+    ASSERT(NT_SUCCESS(Result));
+    ASSERT(2 * PageSize == FileInfo.FileSize);
+    MemfsGetMemoryStatistics(Memfs, &Statistics);
+    ASSERT(PageCount + 1 == Statistics.FileDataPageCount);
+    memset(Buffer, 'X', BufferLength);
+    Result = FileSystem->Interface->Read(FileSystem, FileContext,
+        Buffer, 0, BufferLength, &BytesTransferred);
+    ASSERT(NT_SUCCESS(Result));
+    ASSERT(2 * PageSize == BytesTransferred);
+    for (ULONG I = 0; 1000 > I; I++)
+        ASSERT('B' == Buffer[I]);
+    ASSERT(memfs_filedata_iszero(Buffer + 1000, 2 * PageSize - 1000));
+
+    /* truncating to zero releases every page */
+    Result = FileSystem->Interface->SetFileSize(FileSystem, FileContext, 0, FALSE, &FileInfo);
+    ASSERT(NT_SUCCESS(Result));
+    MemfsGetMemoryStatistics(Memfs, &Statistics);
+    ASSERT(PageCount == Statistics.FileDataPageCount);
+
+    FileSystem->Interface->Cleanup(FileSystem, FileContext, L"\\file", 0);
+    FileSystem->Interface->Close(FileSystem, FileContext);
+
+    free(Buffer);
+
+    MemfsDelete(Memfs);
+}
+
+void memfs_memory_test(void)
+{
+    MEMFS *Memfs;
+    FSP_FILE_SYSTEM *FileSystem;
+    MEMFS_MEMORY_STATISTICS Statistics;
+    PSECURITY_DESCRIPTOR SecurityDescriptor;
+    WCHAR FileName[MAX_PATH];
+    ULONG FileCount = 1000;
+    NTSTATUS Result;
+    BOOL Success;
+
+    Result = MemfsCreateFunnel(
+        MemfsDetached |
+            (OptCaseInsensitive ? MemfsCaseInsensitive : 0),
+        1000,
+        1 + FileCount,
+        0,
+        0,
+        0,
+        0,
+        0,
+        0,
+        L"O:BAG:BAD:P(A;;FA;;;SY)(A;;FA;;;BA)(A;;FA;;;WD)",
+        &Memfs);
+    ASSERT(NT_SUCCESS(Result));
+    FileSystem = MemfsFileSystem(Memfs);
+
+    Success = ConvertStringSecurityDescriptorToSecurityDescriptorW(
+        L"O:BAG:BAD:P(A;;FA;;;SY)(A;;FA;;;BA)(A;;FA;;;WD)", SDDL_REVISION_1, &SecurityDescriptor, 0);
+    ASSERT(Success);
+
+    MemfsGetMemoryStatistics(Memfs, &Statistics);
+    ASSERT(1 == Statistics.FileNodeCount);
+    ASSERT(1 == Statistics.SecurityCount);
+    ASSERT(1 == Statistics.SecurityReferences);
+
+    for (ULONG I = 0; FileCount > I; I++)
+    {
+        StringCbPrintfW(FileName, sizeof FileName, L"\\file%lu", I);
+        Result = memfs_interface_create(FileSystem, FileName, FALSE, SecurityDescriptor);
+        ASSERT(NT_SUCCESS(Result));
+    }
+
+    MemfsGetMemoryStatistics(Memfs, &Statistics);
+    ASSERT(1 + FileCount == Statistics.FileNodeCount);
+    ASSERT(1 == Statistics.SecurityCount);
+    ASSERT(1 + FileCount == Statistics.SecurityReferences);
+    ASSERT(Statistics.NameArenaUsedSize <= (1 + FileCount) * 16 * sizeof(WCHAR));
+    ASSERT(Statistics.BytesPerFileNode < MAX_PATH * sizeof(WCHAR));
+
+    FspDebugLog(__FUNCTION__ ": nodes=%llu bytes/node=%llu (records=%llu index=%llu names=%llu/%llu "
+        "security=%llu/%llu)\n",
+        Statistics.FileNodeCount, Statistics.BytesPerFileNode,
+        Statistics.FileNodeSize, Statistics.IndexSize,
+        Statistics.NameArenaUsedSize, Statistics.NameArenaSize,
+        Statistics.SecuritySize, Statistics.SecurityCount);
+
+    LocalFree(SecurityDescriptor);
+
+    MemfsDelete(Memfs);
+}
+
+typedef struct
+{
+    FSP_FILE_SYSTEM *FileSystem;
+    ULONG Index;
+    ULONG Iterations;
+} MEMFS_CONCURRENCY_CONTEXT;
+
+static ULONG memfs_concurrency_count(FSP_FILE_SYSTEM *FileSystem, PWSTR FileName)
+{
+    PVOID FileContext;
+    UINT8 Buffer[4096];
+    ULONG BytesTransferred, EntryCount = 0;
+    FSP_FSCTL_DIR_INFO *DirInfo;
+    NTSTATUS Result;
+
+    Result = memfs_interface_open(FileSystem, FileName, &FileContext);
+    ASSERT(NT_SUCCESS(Result));
+    BytesTransferred = 0;
+    Result = FileSystem->Interface->ReadDirectory(FileSystem, FileContext, 0, 0,
+        Buffer, sizeof Buffer, &BytesTransferred);
+    ASSERT(NT_SUCCESS(Result));
+    for (DirInfo = (FSP_FSCTL_DIR_INFO *)Buffer;
+        (PUINT8)DirInfo + sizeof(UINT16) <= Buffer + BytesTransferred && 0 != DirInfo->Size;
+        DirInfo = (FSP_FSCTL_DIR_INFO *)((PUINT8)DirInfo + FSP_FSCTL_DEFAULT_ALIGN_UP(DirInfo->Size)))
+        EntryCount++;
+    FileSystem->Interface->Cleanup(FileSystem, FileContext, FileName, 0);
+    FileSystem->Interface->Close(FileSystem, FileContext);
+
+    return EntryCount;
+}
+
+static unsigned __stdcall memfs_concurrency_dotest_thread(void *Context0)
+{
+    MEMFS_CONCURRENCY_CONTEXT *Context = Context0;
+    FSP_FILE_SYSTEM *FileSystem = Context->FileSystem;
+    FSP_FSCTL_FILE_INFO FileInfo;
+    PVOID FileContext;
+    WCHAR DirName[MAX_PATH], NewDirName[MAX_PATH], FileName[MAX_PATH], NewFileName[MAX_PATH];
+    UINT8 WriteBuffer[8192], ReadBuffer[8192];
+    ULONG BytesTransferred, Shard = 0;
+    NTSTATUS Result;
+
+    StringCbPrintfW(DirName, sizeof DirName, L"\\shared%lu\\d%lu", Shard, Context->Index);
+    Result = memfs_interface_create(FileSystem, DirName, TRUE, 0);
+    ASSERT(NT_SUCCESS(Result));
+
+    for (ULONG I = 0; Context->Iterations > I; I++)
+    {
+        /* private file: create, write, read back, resize */
+        StringCbPrintfW(FileName, sizeof FileName, L"%s\\f%lu", DirName, I);
+        Result = memfs_interface_create(FileSystem, FileName, FALSE, 0);
+        ASSERT(NT_SUCCESS(Result));
+        Result = memfs_interface_open(FileSystem, FileName, &FileContext);
+        ASSERT(NT_SUCCESS(Result));
+
+        memset(WriteBuffer, (UINT8)(Context->Index + I), sizeof WriteBuffer);
+        Result = FileSystem->Interface->Write(FileSystem, FileContext,
+            WriteBuffer, (I % 64) * 512, sizeof WriteBuffer, FALSE, FALSE, &BytesTransferred, &FileInfo);
+        ASSERT(NT_SUCCESS(Result));
+        ASSERT(sizeof WriteBuffer == BytesTransferred);
+        Result = FileSystem->Interface->Read(FileSystem, FileContext,
+            ReadBuffer, (I % 64) * 512, sizeof ReadBuffer, &BytesTransferred);
+        ASSERT(NT_SUCCESS(Result));
+        ASSERT(sizeof ReadBuffer == BytesTransferred);
+        ASSERT(0 == memcmp(WriteBuffer, ReadBuffer, sizeof ReadBuffer));
+
+        Result = FileSystem->Interface->SetFileSize(FileSystem, FileContext,
+            4096, FALSE, &FileInfo);
+        ASSERT(NT_SUCCESS(Result));
+        Result = FileSystem->Interface->GetFileInfo(FileSystem, FileContext, &FileInfo);
+        ASSERT(NT_SUCCESS(Result));
+        ASSERT(4096 == FileInfo.FileSize);
+
+        /* move the file into the shared directory (child to parent) and delete it there */
+        StringCbPrintfW(NewFileName, sizeof NewFileName, L"\\shared%lu\\f%lu.%lu",
+            Shard, Context->Index, I);
+        Result = FileSystem->Interface->Rename(FileSystem, FileContext,
+            FileName, NewFileName, FALSE);
+        ASSERT(NT_SUCCESS(Result));
+        Result = FileSystem->Interface->CanDelete(FileSystem, FileContext, NewFileName);
+        ASSERT(NT_SUCCESS(Result));
+        FileSystem->Interface->Cleanup(FileSystem, FileContext, NewFileName, FspCleanupDelete);
+        FileSystem->Interface->Close(FileSystem, FileContext);
+
+        /* move the private directory to the other shared directory */
+        StringCbPrintfW(NewDirName, sizeof NewDirName, L"\\shared%lu\\d%lu",
+            1 - Shard, Context->Index);
+        Result = memfs_interface_open(FileSystem, DirName, &FileContext);
+        ASSERT(NT_SUCCESS(Result));
+        Result = FileSystem->Interface->Rename(FileSystem, FileContext,
+            DirName, NewDirName, FALSE);
+        ASSERT(NT_SUCCESS(Result));
+        FileSystem->Interface->Cleanup(FileSystem, FileContext, NewDirName, 0);
+        FileSystem->Interface->Close(FileSystem, FileContext);
+        Shard = 1 - Shard;
+        memcpy(DirName, NewDirName, sizeof DirName);
+
+        /* readers of the shared file and the shared directories */
+        if (0 == I % 8)
+        {
+            ASSERT(2 <= memfs_concurrency_count(FileSystem, L"\\shared0"));
+            ASSERT(2 == memfs_concurrency_count(FileSystem, DirName));
+
+            Result = memfs_interface_open(FileSystem, L"\\common", &FileContext);
+            ASSERT(NT_SUCCESS(Result));
+            Result = FileSystem->Interface->Read(FileSystem, FileContext,
+                ReadBuffer, 0, sizeof ReadBuffer, &BytesTransferred);
+            ASSERT(NT_SUCCESS(Result));
+            ASSERT(sizeof ReadBuffer == BytesTransferred);
+            for (ULONG J = 0; sizeof ReadBuffer > J; J++)
+                ASSERT((UINT8)J == ReadBuffer[J]);
+            FileSystem->Interface->Cleanup(FileSystem, FileContext, L"\\common", 0);
+            FileSystem->Interface->Close(FileSystem, FileContext);
+        }
+    }
+
+    Result = memfs_interface_open(FileSystem, DirName, &FileContext);
+    ASSERT(NT_SUCCESS(Result));
+    Result = FileSystem->Interface->CanDelete(FileSystem, FileContext, DirName);
+    ASSERT(NT_SUCCESS(Result));
+    FileSystem->Interface->Cleanup(FileSystem, FileContext, DirName, FspCleanupDelete);
+    FileSystem->Interface->Close(FileSystem, FileContext);
+
+    return 0;
+}
+
+/*
+ * The I/O threads share the file \io, which consists of MEMFS_CONCURRENCY_IO_BLOCK_COUNT blocks.
+ * Writers fill a whole block with its number plus one, resizers truncate or extend the file
+ * and readers read single blocks. Writes and truncations are atomic, so a block must always
+ * read as its value up to the point where it was last truncated and as zeros after that.
+ */
+#define MEMFS_CONCURRENCY_IO_BLOCK_SIZE 4096
+#define MEMFS_CONCURRENCY_IO_BLOCK_COUNT 16
+#define MEMFS_CONCURRENCY_IO_THREAD_COUNT 6
+
+static BOOLEAN memfs_concurrency_io_check(PUINT8 Buffer, ULONG Length, ULONG Block)
+{
+    ULONG J = 0;
+
+    for (; Length > J && (UINT8)(Block + 1) == Buffer[J]; J++)
+        ;
+    for (; Length > J && 0 == Buffer[J]; J++)
+        ;
+
+    return Length == J;
+}
+
+static unsigned __stdcall memfs_concurrency_io_thread(void *Context0)
+{
+    MEMFS_CONCURRENCY_CONTEXT *Context = Context0;
+    FSP_FILE_SYSTEM *FileSystem = Context->FileSystem;
+    FSP_FSCTL_FILE_INFO FileInfo;
+    PVOID FileContext;
+    UINT8 Buffer[MEMFS_CONCURRENCY_IO_BLOCK_SIZE];
+    ULONG Block, BytesTransferred;
+    UINT64 NewSize;
+    NTSTATUS Result;
+
+    Result = memfs_interface_open(FileSystem, L"\\io", &FileContext);
+    ASSERT(NT_SUCCESS(Result));
+
+    for (ULONG I = 0; Context->Iterations > I; I++)
+    {
+        Block = (Context->Index * 7 + I * 5) % MEMFS_CONCURRENCY_IO_BLOCK_COUNT;
+        switch (Context->Index % 3)
+        {
+        case 0:
+            memset(Buffer, (UINT8)(Block + 1), sizeof Buffer);
+            Result = FileSystem->Interface->Write(FileSystem, FileContext,
+                Buffer, Block * sizeof Buffer, sizeof Buffer, FALSE, FALSE, &BytesTransferred, &FileInfo);
+            ASSERT(NT_SUCCESS(Result));
+            ASSERT(sizeof Buffer == BytesTransferred);
+            ASSERT((Block + 1) * sizeof Buffer <= FileInfo.FileSize);
+            break;
+        case 1:
+            /* sizes that cut blocks in the middle, both shrinking and extending the file */
+            NewSize = (Context->Index * 7919 + I * 3001) %
+                (MEMFS_CONCURRENCY_IO_BLOCK_COUNT * MEMFS_CONCURRENCY_IO_BLOCK_SIZE);
+            Result = FileSystem->Interface->SetFileSize(FileSystem, FileContext,
+                NewSize, FALSE, &FileInfo);
+            ASSERT(NT_SUCCESS(Result));
+            ASSERT(NewSize == FileInfo.FileSize);
+            break;
+        case 2:
+            memset(Buffer, 0xff, sizeof Buffer);
+            Result = FileSystem->Interface->Read(FileSystem, FileContext,
+                Buffer, Block * sizeof Buffer, sizeof Buffer, &BytesTransferred);
+            if (STATUS_END_OF_FILE == Result)
+                break;
+            ASSERT(NT_SUCCESS(Result));
+            ASSERT(sizeof Buffer >= BytesTransferred);
+            ASSERT(memfs_concurrency_io_check(Buffer, BytesTransferred, Block));
+            break;
+        }
+    }
+
+    FileSystem->Interface->Cleanup(FileSystem, FileContext, L"\\io", 0);
+    FileSystem->Interface->Close(FileSystem, FileContext);
+
+    return 0;
+}
+
+static void memfs_concurrency_dotest(ULONG ThreadCount, ULONG Iterations)
+{
+    MEMFS *Memfs;
+    FSP_FILE_SYSTEM *FileSystem;
+    MEMFS_MEMORY_STATISTICS Statistics;
+    MEMFS_CONCURRENCY_CONTEXT Context[64], IoContext[MEMFS_CONCURRENCY_IO_THREAD_COUNT];
+    HANDLE Thread[64], IoThread[MEMFS_CONCURRENCY_IO_THREAD_COUNT];
+    FSP_FSCTL_FILE_INFO FileInfo;
+    PVOID FileContext;
+    UINT8 Buffer[8192];
+    ULONG BytesTransferred, Length;
+    DWORD ExitCode;
+    DWORD Time[2];
+    NTSTATUS Result;
+
+    ASSERT(sizeof Thread / sizeof Thread[0] >= ThreadCount);
+
+    Result = MemfsCreateFunnel(
+        MemfsDetached |
+            (OptCaseInsensitive ? MemfsCaseInsensitive : 0),
+        1000,
+        5 + ThreadCount * 3,
+        1024 * 1024,
+        0,
+        0,
+        0,
+        0,
+        0,
+        0,
+        &Memfs);
+    ASSERT(NT_SUCCESS(Result));
+    FileSystem = MemfsFileSystem(Memfs);
+
+    Result = memfs_interface_create(FileSystem, L"\\shared0", TRUE, 0);
+    ASSERT(NT_SUCCESS(Result));
+    Result = memfs_interface_create(FileSystem, L"\\shared1", TRUE, 0);
+    ASSERT(NT_SUCCESS(Result));
+    Result = memfs_interface_create(FileSystem, L"\\common", FALSE, 0);
+    ASSERT(NT_SUCCESS(Result));
+    Result = memfs_interface_open(FileSystem, L"\\common", &FileContext);
+    ASSERT(NT_SUCCESS(Result));
+    for (ULONG J = 0; sizeof Buffer > J; J++)
+        Buffer[J] = (UINT8)J;
+    Result = FileSystem->Interface->Write(FileSystem, FileContext,
+        Buffer, 0, sizeof Buffer, FALSE, FALSE, &BytesTransferred, &FileInfo);
+    ASSERT(NT_SUCCESS(Result));
+    FileSystem->Interface->Cleanup(FileSystem, FileContext, L"\\common", 0);
+    FileSystem->Interface->Close(FileSystem, FileContext);
+    Result = memfs_interface_create(FileSystem, L"\\io", FALSE, 0);
+    ASSERT(NT_SUCCESS(Result));
+
+    Time[0] = GetTickCount();
+
+    for (ULONG I = 0; MEMFS_CONCURRENCY_IO_THREAD_COUNT > I; I++)
+    {
+        IoContext[I].FileSystem = FileSystem;
+        IoContext[I].Index = I;
+        IoContext[I].Iterations = Iterations * 8;
+        IoThread[I] = (HANDLE)_beginthreadex(0, 0, memfs_concurrency_io_thread, &IoContext[I], 0, 0);
+        ASSERT(0 != IoThread[I]);
+    }
+
+    for (ULONG I = 0; ThreadCount > I; I++)
+    {
+        Context[I].FileSystem = FileSystem;
+        Context[I].Index = I;
+        Context[I].Iterations = Iterations;
+        Thread[I] = (HANDLE)_beginthreadex(0, 0, memfs_concurrency_dotest_thread, &Context[I], 0, 0);
+        ASSERT(0 != Thread[I]);
+    }
+
+    for (ULONG I = 0; ThreadCount > I; I++)
+    {
+        WaitForSingleObject(Thread[I], INFINITE);
+        GetExitCodeThread(Thread[I], &ExitCode);
+        CloseHandle(Thread[I]);
+
+        ASSERT(0 == ExitCode);
+    }
+
+    for (ULONG I = 0; MEMFS_CONCURRENCY_IO_THREAD_COUNT > I; I++)
+    {
+        WaitForSingleObject(IoThread[I], INFINITE);
+        GetExitCodeThread(IoThread[I], &ExitCode);
+        CloseHandle(IoThread[I]);
+
+        ASSERT(0 == ExitCode);
+    }
+
+    Time[1] = GetTickCount();
+
+    ASSERT(2 == memfs_concurrency_count(FileSystem, L"\\shared0"));
+    ASSERT(2 == memfs_concurrency_count(FileSystem, L"\\shared1"));
+
+    /* the shared I/O file reads consistently with its final size */
+    Result = memfs_interface_open(FileSystem, L"\\io", &FileContext);
+    ASSERT(NT_SUCCESS(Result));
+    Result = FileSystem->Interface->GetFileInfo(FileSystem, FileContext, &FileInfo);
+    ASSERT(NT_SUCCESS(Result));
+    ASSERT(MEMFS_CONCURRENCY_IO_BLOCK_COUNT * MEMFS_CONCURRENCY_IO_BLOCK_SIZE >= FileInfo.FileSize);
+    ASSERT(FileInfo.AllocationSize >= FileInfo.FileSize);
+    for (ULONG Block = 0; MEMFS_CONCURRENCY_IO_BLOCK_COUNT > Block; Block++)
+    {
+        UINT64 Offset = Block * MEMFS_CONCURRENCY_IO_BLOCK_SIZE;
+
+        Result = FileSystem->Interface->Read(FileSystem, FileContext,
+            Buffer, Offset, MEMFS_CONCURRENCY_IO_BLOCK_SIZE, &BytesTransferred);
+        if (Offset >= FileInfo.FileSize)
+        {
+            ASSERT(STATUS_END_OF_FILE == Result);
+            continue;
+        }
+        Length = FileInfo.FileSize - Offset < MEMFS_CONCURRENCY_IO_BLOCK_SIZE ?
+            (ULONG)(FileInfo.FileSize - Offset) : MEMFS_CONCURRENCY_IO_BLOCK_SIZE;
+        ASSERT(NT_SUCCESS(Result));
+        ASSERT(Length == BytesTransferred);
+        ASSERT(memfs_concurrency_io_check(Buffer, BytesTransferred, Block));
+    }
+    FileSystem->Interface->Cleanup(FileSystem, FileContext, L"\\io", 0);
+    FileSystem->Interface->Close(FileSystem, FileContext);
+
+    MemfsGetMemoryStatistics(Memfs, &Statistics);
+    ASSERT(5 == Statistics.FileNodeCount);
+
+    FspDebugLog(__FUNCTION__ "(ThreadCount=%lu, Iterations=%lu): %lums\n",
+        ThreadCount, Iterations, Time[1] - Time[0]);
+
+    MemfsDelete(Memfs);
+}
+
+void memfs_concurrency_test(void)
+{
+    memfs_concurrency_dotest(8, 100);
+}
+
+void memfs_concurrency_stress_test(void)
+{
+    memfs_concurrency_dotest(64, 10000);
+}
+
+typedef union
+{
+    FSP_FSCTL_TRANSACT_REQ V;
+    UINT8 B[sizeof(FSP_FSCTL_TRANSACT_REQ) + 1024 * sizeof(WCHAR)];
+} MEMFS_OPGUARD_REQUEST;
+
+static void memfs_opguard_request(MEMFS_OPGUARD_REQUEST *RequestBuf, UINT32 Kind,
+    PWSTR FileName, PWSTR NewFileName)
+{
+    FSP_FSCTL_TRANSACT_REQ *Request = &RequestBuf->V;
+    UINT16 Size;
+
+    memset(RequestBuf, 0, sizeof *RequestBuf);
+    Request->Kind = Kind;
+    if (FspFsctlTransactCreateKind == Kind)
+        Request->Req.Create.CreateOptions = FILE_CREATE << 24;
+    if (0 != FileName)
+    {
+        Size = (UINT16)((wcslen(FileName) + 1) * sizeof(WCHAR));
+        Request->FileName.Offset = 0;
+        Request->FileName.Size = Size;
+        memcpy(Request->Buffer, FileName, Size);
+    }
+    if (0 != NewFileName)
+    {
+        Request->Req.SetInformation.FileInformationClass = 10/*FileRenameInformation*/;
+        Request->Req.SetInformation.Info.Rename.NewFileName.Offset = Request->FileName.Size;
+        Request->Req.SetInformation.Info.Rename.NewFileName.Size =
+            (UINT16)((wcslen(NewFileName) + 1) * sizeof(WCHAR));
+        memcpy(Request->Buffer + Request->FileName.Size, NewFileName,
+            Request->Req.SetInformation.Info.Rename.NewFileName.Size);
+    }
+}
+
+typedef struct
+{
+    FSP_FILE_SYSTEM *FileSystem;
+    MEMFS_OPGUARD_REQUEST Request;
+} MEMFS_OPGUARD_CONTEXT;
+
+static unsigned __stdcall memfs_opguard_thread(void *Context0)
+{
+    MEMFS_OPGUARD_CONTEXT *Context = Context0;
+
+    FspFileSystemOpEnter(Context->FileSystem, &Context->Request.V, 0);
+    FspFileSystemOpLeave(Context->FileSystem, &Context->Request.V, 0);
+
+    return 0;
+}
+
+static HANDLE memfs_opguard_start(MEMFS_OPGUARD_CONTEXT *Context, FSP_FILE_SYSTEM *FileSystem,
+    UINT32 Kind, PWSTR FileName, PWSTR NewFileName)
+{
+    HANDLE Thread;
+
+    Context->FileSystem = FileSystem;
+    memfs_opguard_request(&Context->Request, Kind, FileName, NewFileName);
+    Thread = (HANDLE)_beginthreadex(0, 0, memfs_opguard_thread, Context, 0, 0);
+    ASSERT(0 != Thread);
+
+    return Thread;
+}
+
+static void memfs_opguard_finish(HANDLE Thread)
+{
+    DWORD ExitCode;
+
+    WaitForSingleObject(Thread, INFINITE);
+    GetExitCodeThread(Thread, &ExitCode);
+    CloseHandle(Thread);
+
+    ASSERT(0 == ExitCode);
+}
+
+void memfs_opguard_sharded_test(void)
+{
+    MEMFS *Memfs;
+    FSP_FILE_SYSTEM *FileSystem;
+    MEMFS_OPGUARD_REQUEST Request;
+    static MEMFS_OPGUARD_CONTEXT Context[4];
+    HANDLE Thread[4];
+    WCHAR FileName[MAX_PATH];
+    BOOLEAN Parallel;
+    NTSTATUS Result;
+
+    Result = MemfsCreateFunnel(
+        MemfsDetached |
+            (OptCaseInsensitive ? MemfsCaseInsensitive : 0),
+        1000,
+        1024,
+        0,
+        0,
+        0,
+        0,
+        0,
+        0,
+        0,
+        &Memfs);
+    ASSERT(NT_SUCCESS(Result));
+    FileSystem = MemfsFileSystem(Memfs);
+    FspFileSystemSetOperationGuardStrategy(FileSystem,
+        FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_PATH_SHARDED);
+
+    /* creates in the same directory (in any case) are serialized */
+    memfs_opguard_request(&Request, FspFsctlTransactCreateKind, L"\\dir0\\file", 0);
+    FspFileSystemOpEnter(FileSystem, &Request.V, 0);
+    Thread[0] = memfs_opguard_start(&Context[0], FileSystem,
+        FspFsctlTransactCreateKind, L"\\DIR0\\other", 0);
+    Thread[1] = memfs_opguard_start(&Context[1], FileSystem,
+        FspFsctlTransactQueryDirectoryKind, 0, 0);
+    ASSERT(WAIT_TIMEOUT == WaitForSingleObject(Thread[0], 100));
+    ASSERT(WAIT_TIMEOUT == WaitForSingleObject(Thread[1], 100));
+    FspFileSystemOpLeave(FileSystem, &Request.V, 0);
+    memfs_opguard_finish(Thread[0]);
+    memfs_opguard_finish(Thread[1]);
+
+    /* creates in (most) other directories are not */
+    FspFileSystemOpEnter(FileSystem, &Request.V, 0);
+    Parallel = FALSE;
+    for (ULONG I = 1; 16 >= I && !Parallel; I++)
+    {
+        StringCbPrintfW(FileName, sizeof FileName, L"\\dir%lu\\file", I);
+        Thread[2] = memfs_opguard_start(&Context[2], FileSystem,
+            FspFsctlTransactCreateKind, FileName, 0);
+        Parallel = WAIT_OBJECT_0 == WaitForSingleObject(Thread[2], 1000);
+        if (!Parallel)
+        {
+            FspFileSystemOpLeave(FileSystem, &Request.V, 0);
+            memfs_opguard_finish(Thread[2]);
+            FspFileSystemOpEnter(FileSystem, &Request.V, 0);
+        }
+        else
+            memfs_opguard_finish(Thread[2]);
+    }
+    ASSERT(Parallel);
+    FspFileSystemOpLeave(FileSystem, &Request.V, 0);
+
+    /* a rename locks both the source and the target directory */
+    memfs_opguard_request(&Request, FspFsctlTransactSetInformationKind,
+        L"\\src\\file", L"\\dst\\file");
+    FspFileSystemOpEnter(FileSystem, &Request.V, 0);
+    Thread[0] = memfs_opguard_start(&Context[0], FileSystem,
+        FspFsctlTransactCreateKind, L"\\src\\other", 0);
+    Thread[1] = memfs_opguard_start(&Context[1], FileSystem,
+        FspFsctlTransactCreateKind, L"\\dst\\other", 0);
+    ASSERT(WAIT_TIMEOUT == WaitForSingleObject(Thread[0], 100));
+    ASSERT(WAIT_TIMEOUT == WaitForSingleObject(Thread[1], 100));
+    FspFileSystemOpLeave(FileSystem, &Request.V, 0);
+    memfs_opguard_finish(Thread[0]);
+    memfs_opguard_finish(Thread[1]);
+
+    /* a listing excludes creates and renames of its own entries, but not other listings */
+    memfs_opguard_request(&Request, FspFsctlTransactQueryDirectoryKind, L"\\dir0", 0);
+    FspFileSystemOpEnter(FileSystem, &Request.V, 0);
+    Thread[0] = memfs_opguard_start(&Context[0], FileSystem,
+        FspFsctlTransactCreateKind, L"\\dir0\\file", 0);
+    Thread[1] = memfs_opguard_start(&Context[1], FileSystem,
+        FspFsctlTransactSetInformationKind, L"\\dir0\\file", L"\\dir0\\other");
+    Thread[2] = memfs_opguard_start(&Context[2], FileSystem,
+        FspFsctlTransactQueryDirectoryKind, L"\\DIR0", 0);
+    memfs_opguard_finish(Thread[2]);
+    ASSERT(WAIT_TIMEOUT == WaitForSingleObject(Thread[0], 100));
+    ASSERT(WAIT_TIMEOUT == WaitForSingleObject(Thread[1], 100));
+    FspFileSystemOpLeave(FileSystem, &Request.V, 0);
+    memfs_opguard_finish(Thread[0]);
+    memfs_opguard_finish(Thread[1]);
+
+    /* and a create holds off a listing of its directory (root included) */
+    memfs_opguard_request(&Request, FspFsctlTransactCreateKind, L"\\dir0\\file", 0);
+    FspFileSystemOpEnter(FileSystem, &Request.V, 0);
+    Thread[0] = memfs_opguard_start(&Context[0], FileSystem,
+        FspFsctlTransactQueryDirectoryKind, L"\\dir0\\", 0);
+    ASSERT(WAIT_TIMEOUT == WaitForSingleObject(Thread[0], 100));
+    FspFileSystemOpLeave(FileSystem, &Request.V, 0);
+    memfs_opguard_finish(Thread[0]);
+    memfs_opguard_request(&Request, FspFsctlTransactCreateKind, L"\\file", 0);
+    FspFileSystemOpEnter(FileSystem, &Request.V, 0);
+    Thread[0] = memfs_opguard_start(&Context[0], FileSystem,
+        FspFsctlTransactQueryDirectoryKind, L"\\", 0);
+    ASSERT(WAIT_TIMEOUT == WaitForSingleObject(Thread[0], 100));
+    FspFileSystemOpLeave(FileSystem, &Request.V, 0);
+    memfs_opguard_finish(Thread[0]);
+
+    /* the volume lock is separate from the shards */
+    memfs_opguard_request(&Request, FspFsctlTransactSetVolumeInformationKind, 0, 0);
+    FspFileSystemOpEnter(FileSystem, &Request.V, 0);
+    Thread[0] = memfs_opguard_start(&Context[0], FileSystem,
+        FspFsctlTransactCreateKind, L"\\dir0\\file", 0);
+    Thread[1] = memfs_opguard_start(&Context[1], FileSystem,
+        FspFsctlTransactQueryVolumeInformationKind, 0, 0);
+    memfs_opguard_finish(Thread[0]);
+    ASSERT(WAIT_TIMEOUT == WaitForSingleObject(Thread[1], 100));
+    FspFileSystemOpLeave(FileSystem, &Request.V, 0);
+    memfs_opguard_finish(Thread[1]);
+
+    MemfsDelete(Memfs);
+}
+
 void memfs_tests(void)
 {
     if (OptExternal)
         return;
 
     TEST(memfs_test);
+    TEST(memfs_batch_test);
+    TEST(memfs_workstealing_test);
+    TEST(memfs_adaptive_test);
+    TEST(memfs_statistics_test);
+    TEST(memfs_numa_test);
+    TEST(memfs_trace_test);
+    TEST(memfs_replay_test);
+    TEST(memfs_transferbuffers_test);
+    TEST(memfs_priority_test);
+    TEST(memfs_async_test);
+    TEST(memfs_memory_test);
+    TEST(memfs_dirsnapshot_test);
+    TEST(memfs_filedata_test);
+    TEST(memfs_concurrency_test);
+    TEST(memfs_opguard_sharded_test);
+    TEST_OPT(memfs_namespace_bench_test);
+    TEST_OPT(memfs_concurrency_stress_test);
 }
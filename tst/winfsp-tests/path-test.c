@@ -21,6 +21,7 @@
 
 #include <winfsp/winfsp.h>
 #include <tlib/testsuite.h>
+#include <time.h>
 
 #include "winfsp-tests.h"
 
@@ -128,6 +129,247 @@ void path_suffix_test(void)
     }
 }
 
+void path_split_test(void)
+{
+    /* same inputs and expected results as path_suffix_test; root is a single backslash */
+    PWSTR ipaths[] =
+    {
+        L"",
+        L"\\",
+        L"\\\\",
+        L"\\a",
+        L"\\\\a",
+        L"\\\\a\\",
+        L"\\\\a\\\\",
+        L"a\\",
+        L"a\\\\",
+        L"a\\b",
+        L"a\\\\b",
+        L"foo\\\\\\bar\\\\baz",
+        L"foo\\\\\\bar\\\\baz\\",
+        L"foo\\\\\\bar\\\\baz\\\\",
+        L"foo",
+    };
+    PWSTR opaths[] =
+    {
+        L"", L"",
+        L"\\", L"",
+        L"\\", L"",
+        L"\\", L"a",
+        L"\\", L"a",
+        L"\\\\a", L"",
+        L"\\\\a", L"",
+        L"a", L"",
+        L"a", L"",
+        L"a", L"b",
+        L"a", L"b",
+        L"foo\\\\\\bar", L"baz",
+        L"foo\\\\\\bar\\\\baz", L"",
+        L"foo\\\\\\bar\\\\baz", L"",
+        L"foo", L"",
+    };
+
+    for (size_t i = 0; sizeof ipaths / sizeof ipaths[0] > i; i++)
+    {
+        PWSTR Leaf;
+        ULONG ParentLength, LeafLength;
+        ULONG Length = (ULONG)wcslen(ipaths[i]);
+        FspPathSplit(ipaths[i], Length, &ParentLength, &Leaf, &LeafLength);
+        ASSERT(wcslen(opaths[2 * i + 0]) == ParentLength);
+        ASSERT(0 == wcsncmp(opaths[2 * i + 0], ipaths[i], ParentLength));
+        ASSERT(wcslen(opaths[2 * i + 1]) == LeafLength);
+        ASSERT(0 == wcsncmp(opaths[2 * i + 1], Leaf, LeafLength));
+        ASSERT(ipaths[i] + Length == Leaf + LeafLength);
+    }
+}
+
+void path_component_test(void)
+{
+    PWSTR Path = L"\\\\foo\\bar\\\\baz:stream\\";
+    PWSTR Components[] = { L"foo", L"bar", L"baz:stream" };
+    PWSTR Component;
+    ULONG Length = (ULONG)wcslen(Path), Index = 0, ComponentLength, I = 0;
+
+    while (FspPathNextComponent(Path, Length, &Index, &Component, &ComponentLength))
+    {
+        ASSERT(sizeof Components / sizeof Components[0] > I);
+        ASSERT(wcslen(Components[I]) == ComponentLength);
+        ASSERT(0 == wcsncmp(Components[I], Component, ComponentLength));
+        I++;
+    }
+    ASSERT(sizeof Components / sizeof Components[0] == I);
+    ASSERT(Length == Index);
+
+    /* the length bounds the view; the path need not be NUL-terminated */
+    Index = 0;
+    ASSERT(FspPathNextComponent(Path, 4, &Index, &Component, &ComponentLength));
+    ASSERT(2 == ComponentLength && 0 == wcsncmp(L"fo", Component, 2));
+    ASSERT(!FspPathNextComponent(Path, 4, &Index, &Component, &ComponentLength));
+    ASSERT(4 == Index && 0 == ComponentLength);
+}
+
+void path_scan_test(void)
+{
+    WCHAR buf[64];
+
+    /* exercise both the vector and scalar parts of the scan */
+    for (ULONG Length = 0; sizeof buf / sizeof buf[0] >= Length; Length++)
+    {
+        for (ULONG I = 0; Length > I; I++)
+            buf[I] = L'a' + (WCHAR)(I % 26);
+        ASSERT(Length == FspPathScan(buf, Length, L'\\', L':'));
+        for (ULONG J = 0; Length > J; J++)
+        {
+            buf[J] = 0 == J % 2 ? L'\\' : L':';
+            ASSERT(J == FspPathScan(buf, Length, L'\\', L':'));
+            ASSERT(J == FspPathScan(buf, J + 1, L'\\', L':'));
+            ASSERT(J == FspPathScan(buf, J, L'\\', L':'));
+            buf[J] = L'a' + (WCHAR)(J % 26);
+        }
+    }
+}
+
+void path_hash_test(void)
+{
+    PWSTR Path = L"\\Foo\\B\u00e4r";
+
+    ASSERT(FspPathHash(L"\\foo\\b\u00c4r", 8, TRUE) == FspPathHash(Path, 8, TRUE));
+    ASSERT(FspPathHash(L"\\foo\\b\u00c4r", 8, FALSE) != FspPathHash(Path, 8, FALSE));
+    ASSERT(FspPathHash(Path, 4, TRUE) == FspPathHash(L"\\FOO", 4, FALSE));
+    ASSERT(FspPathHash(Path, 4, TRUE) != FspPathHash(Path, 5, TRUE));
+}
+
+static void path_compare_randname(PWSTR Name, ULONG Length)
+{
+    static WCHAR Chars[] =
+        L"abcxyzABCXYZ019_[`~."
+        L"\u00e4\u00c4\u00ff\u0178\u0131\u03c3\u03a3\u0444\u0424\u212a";
+
+    for (ULONG I = 0; Length > I; I++)
+        Name[I] = Chars[rand() % (sizeof Chars / sizeof Chars[0] - 1)];
+}
+
+static int path_compare_sign(int Result)
+{
+    return (0 < Result) - (0 > Result);
+}
+
+void path_compare_test(void)
+{
+    WCHAR Name0[64], Name1[64];
+    ULONG Length0, Length1;
+
+    srand((unsigned)time(0));
+
+    for (ULONG I = 0; 100000 > I; I++)
+    {
+        Length0 = rand() % 40;
+        path_compare_randname(Name0, Length0);
+
+        /* mostly names that differ only in case or in a single late character */
+        Length1 = Length0;
+        memcpy(Name1, Name0, Length0 * sizeof(WCHAR));
+        switch (rand() % 4)
+        {
+        case 0:
+            path_compare_randname(Name1, Length1 = rand() % 40);
+            break;
+        case 1:
+            if (0 < Length1)
+                path_compare_randname(Name1 + Length1 - 1, 1);
+            break;
+        case 2:
+            Length1 = Length0 / 2 + rand() % (Length0 / 2 + 1);
+            break;
+        default:
+            for (ULONG J = 0; Length1 > J; J++)
+                Name1[J] = (WCHAR)(UINT_PTR)(rand() % 2 ?
+                    CharUpperW((PWSTR)(UINT_PTR)Name1[J]) : CharLowerW((PWSTR)(UINT_PTR)Name1[J]));
+            break;
+        }
+
+        ASSERT(path_compare_sign(FspNameCompare(Name0, Length0, Name1, Length1, FALSE)) ==
+            CompareStringOrdinal(Name0, Length0, Name1, Length1, FALSE) - 2);
+        ASSERT(path_compare_sign(FspNameCompare(Name0, Length0, Name1, Length1, TRUE)) ==
+            CompareStringOrdinal(Name0, Length0, Name1, Length1, TRUE) - 2);
+        if (0 == FspNameCompare(Name0, Length0, Name1, Length1, TRUE))
+            ASSERT(FspPathHash(Name0, Length0, TRUE) == FspPathHash(Name1, Length1, TRUE));
+    }
+}
+
+static int path_compare_bench_memfs(PWSTR a, int alen, PWSTR b, int blen)
+{
+    /* the case-insensitive component comparison that memfs used previously */
+    int len = alen < blen ? alen : blen, res;
+
+    res = CompareStringW(LOCALE_INVARIANT, NORM_IGNORECASE, a, alen, b, blen);
+    if (0 != res)
+        res -= 2;
+    else
+        res = _wcsnicmp(a, b, len);
+    if (0 == res)
+        res = alen - blen;
+
+    return res;
+}
+
+static void path_compare_bench_dotest(ULONG Count, BOOLEAN Ascii)
+{
+    PWSTR Names;
+    PULONG Lengths;
+    ULONG N;
+    int Sum[3] = { 0 };
+    DWORD times[4];
+
+    Names = malloc(Count * 64 * sizeof(WCHAR));
+    Lengths = malloc(Count * sizeof(ULONG));
+    ASSERT(0 != Names && 0 != Lengths);
+
+    /* names share a prefix (as they do in a typical directory) and differ late */
+    for (ULONG I = 0; Count > I; I++)
+    {
+        PWSTR Name = Names + I * 64;
+        N = 16 + rand() % 32;
+        for (ULONG J = 0; N > J; J++)
+            Name[J] = 24 > J ? (Ascii ? L"Document-" : L"Dokum\u00e4nt-")[J % 9] :
+                (Ascii ? L'a' + rand() % 26 : L"a\u00e4\u00f6\u00fc"[rand() % 4]);
+        Name[N] = L'\0';
+        Lengths[I] = N;
+    }
+
+    times[0] = GetTickCount();
+    for (ULONG I = 1; Count > I; I++)
+        Sum[0] += path_compare_sign(FspNameCompare(
+            Names + (I - 1) * 64, Lengths[I - 1], Names + I * 64, Lengths[I], TRUE));
+    times[1] = GetTickCount();
+    for (ULONG I = 1; Count > I; I++)
+        Sum[1] += path_compare_sign(path_compare_bench_memfs(
+            Names + (I - 1) * 64, Lengths[I - 1], Names + I * 64, Lengths[I]));
+    times[2] = GetTickCount();
+    for (ULONG I = 1; Count > I; I++)
+        Sum[2] += path_compare_sign(_wcsicmp(Names + (I - 1) * 64, Names + I * 64));
+    times[3] = GetTickCount();
+
+    FspDebugLog(__FUNCTION__ "(Count=%lu, Ascii=%d): FspNameCompare %ldms, "
+        "CompareStringW %ldms, _wcsicmp %ldms (%d/%d/%d)\n",
+        Count, Ascii, times[1] - times[0], times[2] - times[1], times[3] - times[2],
+        Sum[0], Sum[1], Sum[2]);
+
+    free(Lengths);
+    free(Names);
+}
+
+void path_compare_bench_test(void)
+{
+    srand((unsigned)time(0));
+
+    for (ULONG Count = 10000; 1000000 >= Count; Count *= 10)
+    {
+        path_compare_bench_dotest(Count, TRUE);
+        path_compare_bench_dotest(Count, FALSE);
+    }
+}
+
 void path_tests(void)
 {
     if (OptExternal)
@@ -135,4 +377,10 @@ void path_tests(void)
 
     TEST(path_prefix_test);
     TEST(path_suffix_test);
+    TEST(path_split_test);
+    TEST(path_component_test);
+    TEST(path_scan_test);
+    TEST(path_hash_test);
+    TEST(path_compare_test);
+    TEST_OPT(path_compare_bench_test);
 }
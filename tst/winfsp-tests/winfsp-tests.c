@@ -220,6 +220,7 @@ int main(int argc, char *argv[])
 {
     TESTSUITE(fuse_opt_tests);
     TESTSUITE(fuse_tests);
+    TESTSUITE(fuse3_buf_tests);
     TESTSUITE(posix_tests);
     TESTSUITE(uuid5_tests);
     TESTSUITE(eventlog_tests);